@@ -27,6 +27,7 @@
 #include "AlloyCamera.h"
 #include "AlloyAny.h"
 #include "AlloyFileUtil.h"
+#include "AlloyAllocator.h"
 #include "AlloyImage.h"
 #include "AlloyMath.h"
 #include "AlloyNumber.h"
@@ -0,0 +1,172 @@
+/*
+ * Copyright(C) 2015, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef INCLUDE_CORE_ALLOYALLOCATOR_H_
+#define INCLUDE_CORE_ALLOYALLOCATOR_H_
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <utility>
+#include <vector>
+namespace aly {
+bool SANITY_CHECK_ALLOCATOR();
+static const size_t BUFFER_ALIGNMENT = 64;
+static const size_t DEFAULT_POOL_CAPACITY = size_t(256) << 20;
+struct MemoryStatistics {
+	size_t bytesLive;
+	size_t bytesPeak;
+	size_t bytesCached;
+	size_t allocations;
+	size_t poolHits;
+	MemoryStatistics() :
+			bytesLive(0), bytesPeak(0), bytesCached(0), allocations(0), poolHits(
+					0) {
+	}
+	double hitRate() const {
+		return (allocations > 0) ? poolHits / (double) allocations : 0.0;
+	}
+};
+template<class L, class R> std::basic_ostream<L, R>& operator <<(
+		std::basic_ostream<L, R> & ss, const MemoryStatistics& stats) {
+	return ss << "Live: " << stats.bytesLive << " bytes Peak: "
+			<< stats.bytesPeak << " bytes Cached: " << stats.bytesCached
+			<< " bytes Allocations: " << stats.allocations << " Hit Rate: "
+			<< 100.0 * stats.hitRate() << "%";
+}
+/*
+ * Backend that hands out BUFFER_ALIGNMENT-aligned blocks for Image, Volume
+ * and Vector storage. The base class goes straight to the system heap;
+ * subclasses may cache blocks. Every backend tracks its own statistics,
+ * which are kept in atomics so threads allocating at once do not serialize.
+ */
+class BufferAllocator {
+protected:
+	std::atomic<size_t> bytesLive;
+	std::atomic<size_t> bytesPeak;
+	std::atomic<size_t> bytesCached;
+	std::atomic<size_t> allocations;
+	std::atomic<size_t> poolHits;
+	void* allocateAligned(size_t bytes);
+	void freeAligned(void* ptr);
+	void recordAllocation(size_t bytes);
+public:
+	BufferAllocator();
+	virtual void* allocate(size_t bytes);
+	virtual void deallocate(void* ptr, size_t bytes);
+	virtual void trim() {
+	}
+	MemoryStatistics getStatistics();
+	void resetStatistics();
+	virtual ~BufferAllocator() {
+	}
+};
+/*
+ * Recycles freed buffers in size classes (four per power of two, so at most
+ * 25% slack), which keeps pyramids, solver temporaries and other repeated
+ * resize() calls off the global allocator. At most maxCachedBytes are held
+ * in the free lists; trim() returns them all to the system. Size classes are
+ * spread over POOL_SHARDS independently locked free lists, so threads
+ * allocating different sizes do not contend.
+ */
+class PooledBufferAllocator: public BufferAllocator {
+protected:
+	static const int POOL_SHARDS = 32;
+	struct FreeListShard {
+		std::mutex lock;
+		std::map<size_t, std::vector<void*>> freeLists;
+	};
+	FreeListShard shards[POOL_SHARDS];
+	size_t maxCachedBytes;
+	FreeListShard& getShard(size_t sizeClass);
+public:
+	static size_t getSizeClass(size_t bytes);
+	PooledBufferAllocator(size_t maxCachedBytes = DEFAULT_POOL_CAPACITY);
+	virtual void* allocate(size_t bytes) override;
+	virtual void deallocate(void* ptr, size_t bytes) override;
+	virtual void trim() override;
+	virtual ~PooledBufferAllocator();
+};
+/*
+ * The active backend, a PooledBufferAllocator holding up to
+ * DEFAULT_POOL_CAPACITY bytes unless replaced. Install a plain
+ * BufferAllocator to disable pooling. Replacing the backend is safe at any
+ * time: each buffer records the backend that allocated it and is returned
+ * there, and replaced backends are kept alive for that purpose. Returns the
+ * backend that was active before the call so it can be restored.
+ */
+std::shared_ptr<BufferAllocator> SetBufferAllocator(
+		const std::shared_ptr<BufferAllocator>& allocator);
+BufferAllocator* GetBufferAllocator();
+void* AllocateBuffer(size_t bytes);
+void FreeBuffer(void* ptr, size_t bytes);
+/*
+ * Standard library allocator that routes through the active BufferAllocator.
+ * It is stateless, so containers using it compare, swap and move freely.
+ */
+template<class T> struct AlignedAllocator {
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+	template<class U> struct rebind {
+		typedef AlignedAllocator<U> other;
+	};
+	AlignedAllocator() {
+	}
+	template<class U> AlignedAllocator(const AlignedAllocator<U>&) {
+	}
+	T* allocate(size_t n) {
+		if (n == 0)
+			return nullptr;
+		return static_cast<T*>(AllocateBuffer(n * sizeof(T)));
+	}
+	void deallocate(T* ptr, size_t n) {
+		if (ptr != nullptr)
+			FreeBuffer(ptr, n * sizeof(T));
+	}
+	size_t max_size() const {
+		return size_t(-1) / sizeof(T);
+	}
+	template<class U, class... Args> void construct(U* ptr, Args&&... args) {
+		::new ((void*) ptr) U(std::forward<Args>(args)...);
+	}
+	template<class U> void destroy(U* ptr) {
+		ptr->~U();
+	}
+};
+template<class T, class U> bool operator==(const AlignedAllocator<T>&,
+		const AlignedAllocator<U>&) {
+	return true;
+}
+template<class T, class U> bool operator!=(const AlignedAllocator<T>&,
+		const AlignedAllocator<U>&) {
+	return false;
+}
+template<class T> using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+}
+#endif /* INCLUDE_CORE_ALLOYALLOCATOR_H_ */
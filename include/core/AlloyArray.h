@@ -165,6 +165,81 @@ template<class T, int C> void Transform(Array<T, C>& im1, Array<T, C>& im2,
 		func(offset, im1[offset], im2[offset]);
 	}
 }
+/*
+ * Functor versions of Transform. The functor type is a template parameter so
+ * the per-element call is inlined into the loop instead of going through
+ * std::function. Work is split into blocks of grainSize elements.
+ */
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, T&>::value>::type Transform(Array<T, C>& im1, F func,
+		size_t grainSize = 0) {
+	T* out = im1.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, T&, T&>::value>::type Transform(Array<T, C>& im1,
+		Array<T, C>& im2, F func, size_t grainSize = 0) {
+	T* out = im1.data();
+	T* in1 = im2.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, T&, const T&>::value>::type Transform(Array<T, C>& im1,
+		const Array<T, C>& im2, F func, size_t grainSize = 0) {
+	T* out = im1.data();
+	const T* in1 = im2.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, T&, const T&, const T&>::value>::type Transform(
+		Array<T, C>& im1, const Array<T, C>& im2, const Array<T, C>& im3,
+		F func, size_t grainSize = 0) {
+	T* out = im1.data();
+	const T* in1 = im2.data();
+	const T* in2 = im3.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset], in2[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, T&, const T&, const T&, const T&>::value>::type Transform(
+		Array<T, C>& im1, const Array<T, C>& im2, const Array<T, C>& im3,
+		const Array<T, C>& im4, F func, size_t grainSize = 0) {
+	T* out = im1.data();
+	const T* in1 = im2.data();
+	const T* in2 = im3.data();
+	const T* in3 = im4.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset], in2[offset], in3[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, size_t, T&, T&>::value>::type Transform(Array<T, C>& im1,
+		Array<T, C>& im2, F func, size_t grainSize = 0) {
+	T* out = im1.data();
+	T* in1 = im2.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(offset, out[offset], in1[offset]);
+		}
+	}, grainSize);
+}
 template<class T, class L, class R, int C> std::basic_ostream<L, R> & operator <<(
 		std::basic_ostream<L, R> & ss, const Array<T, C> & A) {
 	size_t index = 0;
@@ -29,6 +29,8 @@
 #include <ios>
 #include <locale>
 #include <memory>
+#include <utility>
+#include <type_traits>
 
 
 namespace aly {
@@ -71,6 +73,41 @@ namespace aly {
 		}
 		return ss.str();
 	}
+	/*
+	 * True if F can be invoked with arguments of types Args. Used to pick
+	 * between functor overloads that take the same containers.
+	 */
+	template<class F, class... Args> struct IsCallable {
+	private:
+		template<class U> static auto test(int)
+			-> decltype(std::declval<U&>()(std::declval<Args>()...), std::true_type());
+		template<class U> static std::false_type test(...);
+	public:
+		static const bool value = decltype(test<F>(0))::value;
+	};
+	static const size_t DEFAULT_GRAIN_SIZE = 4096;
+	/*
+	 * Calls func(begin, end) on contiguous blocks of [0, sz) in parallel.
+	 * Each block holds grainSize elements (DEFAULT_GRAIN_SIZE if zero), so
+	 * the per-element loop inside func stays serial and can be inlined and
+	 * vectorized. Ranges that fit in one block run on the calling thread.
+	 */
+	template<class F> void ParallelFor(size_t sz, F func, size_t grainSize = 0) {
+		if (grainSize == 0) {
+			grainSize = DEFAULT_GRAIN_SIZE;
+		}
+		int blocks = (int) ((sz + grainSize - 1) / grainSize);
+		if (blocks <= 1) {
+			func((size_t) 0, sz);
+			return;
+		}
+#pragma omp parallel for
+		for (int b = 0; b < blocks; b++) {
+			size_t begin = b * grainSize;
+			size_t end = (begin + grainSize < sz) ? begin + grainSize : sz;
+			func(begin, end);
+		}
+	}
 	inline bool ContainsIgnoreCase(const std::string& str, const std::string& pattern) {
 		std::string strl = ToLower(str);
 		std::string patternl = ToLower(pattern);
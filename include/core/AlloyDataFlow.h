@@ -23,11 +23,15 @@
 #include "AlloyAny.h"
 #include "AlloyUI.h"
 #include "AvoidanceRouting.h"
+#include "AlloyWorker.h"
 #include <string>
 #include <vector>
 #include <memory>
 #include <chrono>
+#include <map>
+#include <atomic>
 namespace aly {
+bool SANITY_CHECK_DATAFLOW();
 namespace dataflow {
 class Node;
 class Data;
@@ -178,6 +182,9 @@ public:
 	virtual void setValue(const std::shared_ptr<Packet>& packet) {
 	}
 	;
+	virtual std::shared_ptr<Packet> getValue() const {
+		return std::shared_ptr<Packet>();
+	}
 	virtual ~Port() {
 	}
 };
@@ -219,6 +226,9 @@ public:
 	virtual void setValue(const std::shared_ptr<Packet>& packet) override {
 		this->value = packet;
 	}
+	virtual std::shared_ptr<Packet> getValue() const override {
+		return value;
+	}
 
 	virtual ~InputPort() {
 	}
@@ -246,6 +256,9 @@ public:
 	virtual void setValue(const std::shared_ptr<Packet>& packet) override {
 		this->value = packet;
 	}
+	virtual std::shared_ptr<Packet> getValue() const override {
+		return value;
+	}
 	virtual ~OutputPort() {
 	}
 	virtual void draw(AlloyContext* context) override;
@@ -271,6 +284,9 @@ public:
 	virtual void setValue(const std::shared_ptr<Packet>& packet) override {
 		this->value = packet;
 	}
+	virtual std::shared_ptr<Packet> getValue() const override {
+		return value;
+	}
 
 	virtual ~ParentPort() {
 	}
@@ -363,6 +379,9 @@ public:
 	virtual void setValue(const std::shared_ptr<Packet>& packet) override {
 		this->value = packet;
 	}
+	virtual std::shared_ptr<Packet> getValue() const override {
+		return value;
+	}
 
 	virtual ~ChildPort() {
 	}
@@ -610,6 +629,15 @@ protected:
 	virtual void setup() override;
 public:
 	static const Color COLOR;
+	/*
+	 * Called by Executor once every upstream node has run and the packets on
+	 * this node's input ports are current. Results go to the output ports.
+	 */
+	std::function<void(Compute* node)> onCompute;
+	virtual void compute() {
+		if (onCompute)
+			onCompute(this);
+	}
 	virtual NodeType getType() const override {
 		return NodeType::Compute;
 	}
@@ -722,6 +750,9 @@ public:
 		return selectedConnection;
 	}
 	void setGroup(const std::shared_ptr<Group>& g);
+	const std::shared_ptr<Group>& getGroup() const {
+		return data;
+	}
 	void setSelected(Connection* item) {
 		selectedConnection = item;
 	}
@@ -809,6 +840,76 @@ template<class C, class R> std::basic_ostream<C, R> & operator <<(
 	return ss;
 }
 
+struct NodeTiming {
+	double lastMilliseconds = 0.0;
+	double totalMilliseconds = 0.0;
+	uint64_t executions = 0;
+};
+template<class C, class R> std::basic_ostream<C, R> & operator <<(
+		std::basic_ostream<C, R> & ss, const NodeTiming& timing) {
+	return ss << "Last: " << timing.lastMilliseconds << " ms Total: "
+			<< timing.totalMilliseconds << " ms Runs: " << timing.executions;
+}
+/*
+ * Evaluates a graph. Nodes inside groups are flattened and group ports are
+ * resolved through their proxies, so every connection becomes an edge
+ * between two leaf nodes. execute() runs every dirty node and everything
+ * downstream of it on a work-stealing pool: a node starts as soon as all of
+ * its dirty predecessors have finished, so independent branches run
+ * concurrently. After a node runs, the packets on its output, child and
+ * parent ports are copied to the connected ports. Only Compute nodes do
+ * work; other node types just forward their current packets.
+ *
+ * Call update() after adding or removing nodes or connections. Changing a
+ * port value through setValue() marks only that node's downstream subgraph
+ * for the next execute().
+ */
+class Executor {
+protected:
+	struct Link {
+		Port* source;
+		Port* destination;
+	};
+	struct Vertex {
+		Node* node;
+		std::vector<size_t> successors;
+		std::vector<Link> links;
+		std::atomic<int> remaining;
+		bool dirty;
+		NodeTiming timing;
+		Vertex(Node* node) :
+				node(node), remaining(0), dirty(true) {
+		}
+	};
+	std::weak_ptr<DataFlow> graph;
+	std::vector<std::unique_ptr<Vertex>> vertexes;
+	std::map<const Node*, size_t> vertexIndex;
+	std::vector<size_t> order;
+	std::shared_ptr<WorkerPool> pool;
+	std::mutex packetLock;
+	std::mutex errorLock;
+	std::string errorMessage;
+	void addVertexes(const std::shared_ptr<Group>& group);
+	void run(size_t index);
+public:
+	Executor(const std::shared_ptr<DataFlow>& graph, size_t threadCount = 0);
+	void update();
+	void execute();
+	void markDirty(const Node* node);
+	void markDirty(const std::shared_ptr<Node>& node) {
+		markDirty(node.get());
+	}
+	void markAllDirty();
+	bool isDirty(const Node* node) const;
+	void setValue(const std::shared_ptr<Port>& port, const std::shared_ptr<Packet>& packet);
+	NodeTiming getTiming(const Node* node) const;
+	NodeTiming getTiming(const std::shared_ptr<Node>& node) const {
+		return getTiming(node.get());
+	}
+	std::vector<std::pair<Node*, NodeTiming>> getTimings() const;
+	std::vector<Node*> getExecutionOrder() const;
+	void resetTimings();
+};
 std::shared_ptr<Connection> MakeConnection(const std::shared_ptr<Port>& source,
 		const std::shared_ptr<Port>& destination);
 std::shared_ptr<Relationship> MakeRelationship(
@@ -891,6 +992,7 @@ typedef std::shared_ptr<Packet> PacketPtr;
 typedef std::shared_ptr<NodeIcon> NodeIconPtr;
 typedef std::shared_ptr<ParentPort> ParentPortPtr;
 typedef std::shared_ptr<ChildPort> ChildPortPtr;
+typedef std::shared_ptr<Executor> ExecutorPtr;
 }
 }
 #endif /* INCLUDE_CORE_ALLOYUALGRAPH_H_ */
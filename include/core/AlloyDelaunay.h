@@ -28,10 +28,12 @@ namespace aly {
 	bool CircumCircle(float, float, float, float, float, float, float, float, float&, float&, float&);
 	void MakeDelaunay(const std::vector<float2>& vertexes, std::vector<uint3>& output);
 	inline void MakeDelaunay(const Vector2f& vertexes, std::vector<uint3>& output) {
-		MakeDelaunay(vertexes.data, output);
+		MakeDelaunay(std::vector<float2>(vertexes.data.begin(), vertexes.data.end()), output);
 	}
 	inline void MakeDelaunay(const Vector2f& vertexes, Vector3ui& output) {
-		MakeDelaunay(vertexes.data, output.data);
+		std::vector<uint3> triangles;
+		MakeDelaunay(vertexes, triangles);
+		output.set(triangles);
 	}
 }
 #endif
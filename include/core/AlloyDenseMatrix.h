@@ -29,173 +29,238 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <algorithm>
+#include <iterator>
 namespace aly {
 bool SANITY_CHECK_DENSE_MATRIX();
+/*
+ * Row-major matrix backed by one contiguous, BUFFER_ALIGNMENT-aligned buffer.
+ * Element (i,j) starts at ptr()[(i*cols+j)*C], and operator[](i) returns a
+ * pointer to the first element of row i, so A[i][j][c] indexes as before.
+ */
 template<class T, int C> struct DenseMatrix {
 private:
-	std::vector<std::vector<vec<T, C>>>data;
+	aligned_vector<vec<T, C>> data;
 public:
 	int rows, cols;
 	typedef vec<T, C> ValueType;
-	typedef typename std::vector<ValueType>::iterator iterator;
-	typedef typename std::vector<ValueType>::const_iterator const_iterator;
-	typedef typename std::vector<ValueType>::reverse_iterator reverse_iterator;
-	iterator begin(int i) const {
-		return data[i].begin();
+	typedef ValueType* iterator;
+	typedef const ValueType* const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+	const_iterator begin(int i) const {
+		return data.data() + (size_t) i * cols;
 	}
-	iterator end(int i) const {
-		return data[i].end();
+	const_iterator end(int i) const {
+		return data.data() + (size_t) (i + 1) * cols;
 	}
 	iterator begin(int i) {
-		return data[i].begin();
+		return data.data() + (size_t) i * cols;
 	}
 	iterator end(int i) {
-		return data[i].end();
+		return data.data() + (size_t) (i + 1) * cols;
 	}
 	const_iterator cbegin(int i) const {
-		return data[i].cbegin();
+		return begin(i);
 	}
 	const_iterator cend(int i) const {
-		return data[i].cend();
+		return end(i);
 	}
 	reverse_iterator rbegin(int i) {
-		return data[i].rbegin();
+		return reverse_iterator(end(i));
 	}
 	reverse_iterator rend(int i) {
-		return data[i].rend();
+		return reverse_iterator(begin(i));
 	}
-	reverse_iterator rbegin(int i) const {
-		return data[i].rbegin();
+	const_reverse_iterator rbegin(int i) const {
+		return const_reverse_iterator(end(i));
 	}
-	reverse_iterator rend(int i) const {
-		return data[i].rend();
+	const_reverse_iterator rend(int i) const {
+		return const_reverse_iterator(begin(i));
 	}
-	template<class Archive> void serialize(Archive & archive) {
+	//Archives keep the original one-vector-per-row layout so older files still load.
+	template<class Archive> void save(Archive & archive) const {
+		std::vector<std::vector<ValueType>> rowData(rows);
+		for (int i = 0; i < rows; i++) {
+			rowData[i].assign(begin(i), end(i));
+		}
 		archive(CEREAL_NVP(rows), CEREAL_NVP(cols),
 				cereal::make_nvp(
 						MakeString() << "matrix"<<C,
-						data));
+						rowData));
+	}
+	template<class Archive> void load(Archive & archive) {
+		std::vector<std::vector<ValueType>> rowData;
+		int r = 0, c = 0;
+		archive(cereal::make_nvp("rows", r), cereal::make_nvp("cols", c),
+				cereal::make_nvp(
+						MakeString() << "matrix"<<C,
+						rowData));
+		if (rowData.size() != (size_t)r)
+		throw std::runtime_error(
+				MakeString() << "Archived matrix has " << rowData.size()
+				<< " rows, expected " << r);
+		resize(r, c);
+		for (int i = 0; i < r; i++) {
+			setRow(i, rowData[i]);
+		}
+	}
+	T* ptr() {
+		if (data.size() == 0)
+			return nullptr;
+		return &(data.front()[0]);
+	}
+	const T* ptr() const {
+		if (data.size() == 0)
+			return nullptr;
+		return &(data.front()[0]);
+	}
+	size_t size() const {
+		return data.size();
 	}
-	std::vector<vec<T, C>>& operator[](size_t i) {
-		if (i >= rows || i < 0)
+	ValueType* operator[](size_t i) {
+		if (i >= (size_t)rows)
 		throw std::runtime_error(
 				MakeString() << "Index (" << i
 				<< ",*) exceeds matrix bounds [" << rows << ","
 				<< cols << "]");
-		return data[i];
+		return data.data() + i * cols;
 	}
-	const std::vector<vec<T, C>>& operator[](size_t i) const {
-		if (i >= rows || i < 0)
+	const ValueType* operator[](size_t i) const {
+		if (i >= (size_t)rows)
 		throw std::runtime_error(
 				MakeString() << "Index (" << i
 				<< ",*) exceeds matrix bounds [" << rows << ","
 				<< cols << "]");
-		return data[i];
+		return data.data() + i * cols;
 	}
 	DenseMatrix(): rows(0),cols(0) {
 	}
 	DenseMatrix(int rows, int cols) :
-	data(rows,std::vector<vec<T,C>>(cols)),rows(rows), cols(cols) {
+	data((size_t)rows*cols),rows(rows), cols(cols) {
 	}
 	void resize(int rows,int cols) {
 		if(this->rows!=rows||this->cols!=cols) {
-			data=std::vector<std::vector<vec<T,C>>>(rows,std::vector<vec<T,C>>(cols));
+			data.assign((size_t)rows*cols,vec<T,C>());
 			this->rows=rows;
 			this->cols=cols;
 		}
 	}
+	void setRow(size_t i, const ValueType* row) {
+		std::copy(row, row + cols, (*this)[i]);
+	}
+	void setRow(size_t i, const std::vector<ValueType>& row) {
+		if (row.size() != (size_t)cols)
+		throw std::runtime_error(
+				MakeString() << "Row length " << row.size()
+				<< " does not match matrix columns " << cols);
+		setRow(i, row.data());
+	}
+	void setRow(size_t i, const Vector<T, C>& row) {
+		if (row.size() != (size_t)cols)
+		throw std::runtime_error(
+				MakeString() << "Row length " << row.size()
+				<< " does not match matrix columns " << cols);
+		setRow(i, row.data.data());
+	}
 	void set(size_t i, size_t j, const vec<T, C>& value) {
-		if (i >= rows || j >= cols || i < 0 || j < 0)
+		if (i >= (size_t)rows || j >= (size_t)cols)
 		throw std::runtime_error(
 				MakeString() << "Index (" << i << "," << j
 				<< ") exceeds matrix bounds [" << rows << ","
 				<< cols << "]");
-		data[i][j] = value;
+		data[i*cols+j] = value;
 	}
 	void set(size_t i, size_t j, const T& value) {
-		if (i >= rows || j >= cols || i < 0 || j < 0)
+		if (i >= (size_t)rows || j >= (size_t)cols)
 		throw std::runtime_error(
 				MakeString() << "Index (" << i << "," << j
 				<< ") exceeds matrix bounds [" << rows << ","
 				<< cols << "]");
-		data[i][j] = vec<T, C>(value);
+		data[i*cols+j] = vec<T, C>(value);
+	}
+	void set(const vec<T, C>& value) {
+		data.assign(data.size(), value);
 	}
 	vec<T, C>& operator()(size_t i, size_t j) {
-		if (i >= rows || j >= cols || i < 0 || j < 0)
+		if (i >= (size_t)rows || j >= (size_t)cols)
 		throw std::runtime_error(
 				MakeString() << "Index (" << i << "," << j
 				<< ") exceeds matrix bounds [" << rows << ","
 				<< cols << "]");
-		return data[i][j];
+		return data[i*cols+j];
 	}
 
 	vec<T, C> get(size_t i, size_t j) const {
-		if (i >= rows || j >= cols || i < 0 || j < 0)
+		if (i >= (size_t)rows || j >= (size_t)cols)
 		throw std::runtime_error(
 				MakeString() << "Index (" << i << "," << j
 				<< ") exceeds matrix bounds [" << rows << ","
 				<< cols << "]");
-		return data[i][j];
+		return data[i*cols+j];
 	}
 	const vec<T, C>& operator()(size_t i, size_t j) const {
-		return data[i][j];
+		return data[i*cols+j];
 	}
 	inline DenseMatrix<T, C> transpose() const {
+		static const int TILE = 32;
 		DenseMatrix<T, C> M(cols, rows);
-		for (int i = 0; i < rows; i++) {
-			for (int j=0;j < cols;j++) {
-				M[j][i]=data[i][j];
+		const ValueType* src = data.data();
+		ValueType* dst = M.data.data();
+		int tiles = (rows + TILE - 1) / TILE;
+#pragma omp parallel for
+		for (int t = 0; t < tiles; t++) {
+			int i0 = t * TILE;
+			int i1 = std::min(i0 + TILE, rows);
+			for (int j0 = 0; j0 < cols; j0 += TILE) {
+				int j1 = std::min(j0 + TILE, cols);
+				for (int i = i0; i < i1; i++) {
+					for (int j = j0; j < j1; j++) {
+						dst[(size_t)j * rows + i] = src[(size_t)i * cols + j];
+					}
+				}
 			}
 		}
 		return M;
 	}
 	inline static DenseMatrix<T, C> identity(size_t M, size_t N) {
-		DenseMatrix<T, C> A(M, N);
-		for (int i = 0; i < M; i++) {
-			for (int j=0;j < N;j++) {
-				A[i][j]=vec<T, C>(T((i==j)?1:0));
-			}
+		DenseMatrix<T, C> A((int)M, (int)N);
+		for (int i = 0; i < (int)std::min(M, N); i++) {
+			A[i][i] = vec<T, C>(T(1));
 		}
 		return A;
 	}
 	inline static DenseMatrix<T, C> zero(size_t M, size_t N) {
-		DenseMatrix<T, C> A(M, N);
-		for (int i = 0; i < M; i++) {
-			for (int j=0;j < N;j++) {
-				A[i][j]=vec<T, C>(T(0));
-			}
-		}
+		DenseMatrix<T, C> A((int)M, (int)N);
+		A.set(vec<T, C>(T(0)));
 		return A;
 	}
 	inline static DenseMatrix<T, C> diagonal(const Vector<T, C>& v) {
 		DenseMatrix<T, C> A((int)v.size(), (int)v.size());
 		for (int i = 0; i < A.rows; i++) {
-			for (int j=0;j < A.cols;j++) {
-				A[i][j]=vec<T, C>(T((i==j)?v[i]:0));
-			}
+			A[i][i] = v[i];
 		}
 		return A;
 	}
 	inline static DenseMatrix<T, C> columnVector(const Vector<T, C>& v) {
 		DenseMatrix<T, C> A((int)v.size(),1);
-		for (int i = 0; i < A.rows; i++) {
-			A[i][0] = v[i];
-		}
+		std::copy(v.data.begin(), v.data.end(), A.data.begin());
 		return A;
 	}
 	inline static DenseMatrix<T, C> rowVector(const Vector<T, C>& v) {
 		DenseMatrix<T, C> A(1, (int)v.size());
-		A.data[0] = v.data;
+		std::copy(v.data.begin(), v.data.end(), A.data.begin());
 		return A;
 	}
 	inline Vector<T, C> getRow(int i) const {
-		Vector<T, C> v(data[i].data);
+		Vector<T, C> v(cols);
+		std::copy(begin(i), end(i), v.data.begin());
 		return v;
 	}
 	inline Vector<T, C> getColumn(int j) const {
 		Vector<T, C> v(rows);
 		for (int i = 0; i < rows; i++) {
-			v[i]=data[i][j];
+			v[i]=data[(size_t)i*cols+j];
 		}
 		return v;
 	}
@@ -222,43 +287,259 @@ template<class A, class B, class T, int C> std::basic_ostream<A, B> & operator <
 	return ss;
 }
 
-template<class T, int C> Vector<T, C> operator*(const DenseMatrix<T, C>& A,
-		const Vector<T, C>& v) {
-	Vector<T, C> out(A.rows);
-	for (int i = 0; i < A.rows; i++) {
-		vec<T, C> sum(0.0);
-		for (int j = 0; j < A.cols; j++) {
-			sum += A[i][j] * v[j];
+namespace detail {
+/*
+ * Tile sizes for the dense kernels, in matrix elements. A GEMM panel of
+ * DENSE_INNER_TILE x DENSE_COLUMN_TILE elements of B stays in L2 while a
+ * DENSE_ROW_TILE band of A streams over it.
+ */
+static const int DENSE_ROW_TILE = 32;
+static const int DENSE_INNER_TILE = 128;
+static const int DENSE_COLUMN_TILE = 256;
+//Work (multiply-adds) below which kernels stay on the calling thread.
+static const double DENSE_PARALLEL_WORK = 32768.0;
+//y[0..n) += a*x[0..n) over n elements of C channels. Unit stride so it vectorizes.
+template<class T, int C> inline void DenseAxpy(T* __restrict y,
+		const T* __restrict x, const vec<T, C>& a, int n) {
+	if (C == 1) {
+		const T s = a[0];
+		for (int k = 0; k < n; k++) {
+			y[k] += s * x[k];
+		}
+	} else {
+		for (int k = 0; k < n; k++) {
+			for (int c = 0; c < C; c++) {
+				y[k * C + c] += a[c] * x[k * C + c];
+			}
 		}
-		out[i] = sum;
 	}
-	return out;
 }
-template<class T, int C> DenseMatrix<T, C> operator*(const DenseMatrix<T, C>& A,
-		const DenseMatrix<T, C>& B) {
+//Per channel dot product of n elements, with four independent accumulators.
+template<class T, int C> inline vec<T, C> DenseDot(const T* __restrict x,
+		const T* __restrict y, int n) {
+	T acc[4][C];
+	for (int c = 0; c < C; c++) {
+		acc[0][c] = acc[1][c] = acc[2][c] = acc[3][c] = T(0);
+	}
+	int k = 0;
+	for (; k + 4 <= n; k += 4) {
+		for (int u = 0; u < 4; u++) {
+			for (int c = 0; c < C; c++) {
+				acc[u][c] += x[(k + u) * C + c] * y[(k + u) * C + c];
+			}
+		}
+	}
+	for (; k < n; k++) {
+		for (int c = 0; c < C; c++) {
+			acc[0][c] += x[k * C + c] * y[k * C + c];
+		}
+	}
+	vec<T, C> sum;
+	for (int c = 0; c < C; c++) {
+		sum[c] = (acc[0][c] + acc[1][c]) + (acc[2][c] + acc[3][c]);
+	}
+	return sum;
+}
+}
+/*
+ * out = A*B. Tiled i-k-j product: each row of out accumulates scaled rows of
+ * B, one L2-resident panel of B at a time. Row bands run in parallel.
+ */
+template<class T, int C> void Multiply(DenseMatrix<T, C>& out,
+		const DenseMatrix<T, C>& A, const DenseMatrix<T, C>& B) {
 	if (A.cols != B.rows)
 		throw std::runtime_error(
 				MakeString()
 						<< "Cannot multiply matrices. Inner dimensions do not match. "
 						<< "[" << A.rows << "," << A.cols << "] * [" << B.rows
 						<< "," << B.cols << "]");
-	DenseMatrix<T, C> out(A.rows, B.cols);
-	for (int i = 0; i < out.rows; i++) {
-		for (int j = 0; j < out.cols; j++) {
-			vec<T, C> sum(0.0);
-			for (int k = 0; k < A.cols; k++) {
-				sum += A[i][k] * B[k][j];
+	if (&out == &A || &out == &B) {
+		DenseMatrix<T, C> tmp;
+		Multiply(tmp, A, B);
+		out = std::move(tmp);
+		return;
+	}
+	using namespace detail;
+	const int M = A.rows, K = A.cols, N = B.cols;
+	out.resize(M, N);
+	out.set(vec<T, C>(T(0)));
+	if (M == 0 || N == 0 || K == 0)
+		return;
+	const vec<T, C>* a = A[0];
+	const T* b = B.ptr();
+	T* o = out.ptr();
+	const int bands = (M + DENSE_ROW_TILE - 1) / DENSE_ROW_TILE;
+#pragma omp parallel for schedule(dynamic) if ((double)M * N * K * C > DENSE_PARALLEL_WORK)
+	for (int t = 0; t < bands; t++) {
+		const int i0 = t * DENSE_ROW_TILE;
+		const int i1 = std::min(i0 + DENSE_ROW_TILE, M);
+		for (int j0 = 0; j0 < N; j0 += DENSE_COLUMN_TILE) {
+			const int nj = std::min(DENSE_COLUMN_TILE, N - j0);
+			for (int k0 = 0; k0 < K; k0 += DENSE_INNER_TILE) {
+				const int k1 = std::min(k0 + DENSE_INNER_TILE, K);
+				for (int i = i0; i < i1; i++) {
+					T* orow = o + ((size_t) i * N + j0) * C;
+					const vec<T, C>* arow = a + (size_t) i * K;
+					for (int k = k0; k < k1; k++) {
+						DenseAxpy<T, C>(orow, b + ((size_t) k * N + j0) * C,
+								arow[k], nj);
+					}
+				}
+			}
+		}
+	}
+}
+//out = A*v, one dot product per row.
+template<class T, int C> void Multiply(Vector<T, C>& out,
+		const DenseMatrix<T, C>& A, const ExpressionInput<Vector<T, C>>& v) {
+	if (A.cols != (int) v.size())
+		throw std::runtime_error(
+				MakeString()
+						<< "Cannot multiply matrix and vector. Dimensions do not match. "
+						<< "[" << A.rows << "," << A.cols << "] * [" << v.size()
+						<< "]");
+	if (&out == &v) {
+		Vector<T, C> tmp;
+		Multiply(tmp, A, v);
+		out = std::move(tmp);
+		return;
+	}
+	const int M = A.rows, K = A.cols;
+	out.resize(M);
+	if (K == 0) {
+		out.set(vec<T, C>(T(0)));
+		return;
+	}
+	const T* a = A.ptr();
+	const T* x = v.ptr();
+#pragma omp parallel for if ((double)M * K * C > detail::DENSE_PARALLEL_WORK)
+	for (int i = 0; i < M; i++) {
+		out[i] = detail::DenseDot<T, C>(a + (size_t) i * K * C, x, K);
+	}
+}
+/*
+ * out = transpose(A)*B without forming the transpose. Row i of A scatters
+ * into out as a sum of scaled rows of B, so every pass is unit stride. When B
+ * is A the product is symmetric and only the upper triangle is accumulated.
+ */
+template<class T, int C> void MultiplyTranspose(DenseMatrix<T, C>& out,
+		const DenseMatrix<T, C>& A, const DenseMatrix<T, C>& B) {
+	if (A.rows != B.rows)
+		throw std::runtime_error(
+				MakeString()
+						<< "Cannot multiply matrices. Row dimensions do not match. "
+						<< "[" << A.rows << "," << A.cols << "]' * [" << B.rows
+						<< "," << B.cols << "]");
+	if (&out == &A || &out == &B) {
+		DenseMatrix<T, C> tmp;
+		MultiplyTranspose(tmp, A, B);
+		out = std::move(tmp);
+		return;
+	}
+	using namespace detail;
+	const bool symmetric = (&A == &B);
+	const int M = A.rows, K = A.cols, N = B.cols;
+	out.resize(K, N);
+	out.set(vec<T, C>(T(0)));
+	if (M == 0 || N == 0 || K == 0)
+		return;
+	const vec<T, C>* a = A[0];
+	const T* b = B.ptr();
+	T* o = out.ptr();
+	const int bands = (K + DENSE_ROW_TILE - 1) / DENSE_ROW_TILE;
+#pragma omp parallel for schedule(dynamic) if ((double)M * N * K * C > DENSE_PARALLEL_WORK)
+	for (int t = 0; t < bands; t++) {
+		const int p0 = t * DENSE_ROW_TILE;
+		const int p1 = std::min(p0 + DENSE_ROW_TILE, K);
+		for (int q0 = (symmetric) ? p0 : 0; q0 < N; q0 += DENSE_COLUMN_TILE) {
+			const int q1 = std::min(q0 + DENSE_COLUMN_TILE, N);
+			for (int i0 = 0; i0 < M; i0 += DENSE_INNER_TILE) {
+				const int i1 = std::min(i0 + DENSE_INNER_TILE, M);
+				for (int p = p0; p < p1; p++) {
+					const int qs = (symmetric) ? std::max(q0, p) : q0;
+					if (qs >= q1)
+						continue;
+					T* orow = o + ((size_t) p * N + qs) * C;
+					for (int i = i0; i < i1; i++) {
+						DenseAxpy<T, C>(orow, b + ((size_t) i * N + qs) * C,
+								a[(size_t) i * K + p], q1 - qs);
+					}
+				}
+			}
+		}
+	}
+	if (symmetric) {
+		vec<T, C>* r = out[0];
+#pragma omp parallel for if ((double)K * K > DENSE_PARALLEL_WORK)
+		for (int p = 1; p < K; p++) {
+			for (int q = 0; q < p; q++) {
+				r[(size_t) p * K + q] = r[(size_t) q * K + p];
 			}
-			out[i][j] = sum;
 		}
 	}
+}
+//out = transpose(A)*A, the normal matrix of a least squares system.
+template<class T, int C> void MultiplyTranspose(DenseMatrix<T, C>& out,
+		const DenseMatrix<T, C>& A) {
+	MultiplyTranspose(out, A, A);
+}
+//out = transpose(A)*v, accumulated row by row over bands of out.
+template<class T, int C> void MultiplyTranspose(Vector<T, C>& out,
+		const DenseMatrix<T, C>& A, const ExpressionInput<Vector<T, C>>& v) {
+	if (A.rows != (int) v.size())
+		throw std::runtime_error(
+				MakeString()
+						<< "Cannot multiply transposed matrix and vector. Dimensions do not match. "
+						<< "[" << A.rows << "," << A.cols << "]' * [" << v.size()
+						<< "]");
+	if (&out == &v) {
+		Vector<T, C> tmp;
+		MultiplyTranspose(tmp, A, v);
+		out = std::move(tmp);
+		return;
+	}
+	using namespace detail;
+	const int M = A.rows, K = A.cols;
+	out.resize(K);
+	out.set(vec<T, C>(T(0)));
+	if (M == 0 || K == 0)
+		return;
+	const T* a = A.ptr();
+	T* o = out.ptr();
+	const int bands = (K + DENSE_COLUMN_TILE - 1) / DENSE_COLUMN_TILE;
+#pragma omp parallel for if ((double)M * K * C > DENSE_PARALLEL_WORK)
+	for (int t = 0; t < bands; t++) {
+		const int p0 = t * DENSE_COLUMN_TILE;
+		const int np = std::min(DENSE_COLUMN_TILE, K - p0);
+		for (int i = 0; i < M; i++) {
+			DenseAxpy<T, C>(o + (size_t) p0 * C, a + ((size_t) i * K + p0) * C,
+					v[i], np);
+		}
+	}
+}
+template<class T, int C> Vector<T, C> operator*(const DenseMatrix<T, C>& A,
+		const Vector<T, C>& v) {
+	Vector<T, C> out;
+	Multiply(out, A, v);
+	return out;
+}
+template<class E, class T, int C> Vector<T, C> operator*(
+		const DenseMatrix<T, C>& A, const Expression<E, Vector<T, C>>& v) {
+	Vector<T, C> out;
+	Multiply(out, A, v.eval());
+	return out;
+}
+template<class T, int C> DenseMatrix<T, C> operator*(const DenseMatrix<T, C>& A,
+		const DenseMatrix<T, C>& B) {
+	DenseMatrix<T, C> out;
+	Multiply(out, A, B);
 	return out;
 }
 //Slight abuse of mathematics here. Vectors are always interpreted as column vectors as a convention,
 //so this multiplcation is equivalent to multiplying "A" with a diagonal matrix constructed from "W".
 //To multiply a matrix with a column vector to get a row vector, convert "W" to a dense matrix.
 template<class T, int C> DenseMatrix<T, C> operator*(const Vector<T,C>& W,const DenseMatrix<T, C>& A) {
-	if (A.rows != W.size())
+	if (A.rows != (int)W.size())
 		throw std::runtime_error(
 			MakeString()
 			<< "Cannot scale matrix by vector. Rows must match. "
@@ -271,6 +552,10 @@ template<class T, int C> DenseMatrix<T, C> operator*(const Vector<T,C>& W,const
 	}
 	return out;
 }
+template<class E, class T, int C> DenseMatrix<T, C> operator*(
+		const Expression<E, Vector<T, C>>& W, const DenseMatrix<T, C>& A) {
+	return W.eval() * A;
+}
 template<class T, int C> DenseMatrix<T, C>& operator*=(DenseMatrix<T, C>& A,const Vector<T, C>& W) {
 	if (A.rows != W.size())
 		throw std::runtime_error(
@@ -284,6 +569,10 @@ template<class T, int C> DenseMatrix<T, C>& operator*=(DenseMatrix<T, C>& A,cons
 	}
 	return A;
 }
+template<class E, class T, int C> DenseMatrix<T, C>& operator*=(
+		DenseMatrix<T, C>& A, const Expression<E, Vector<T, C>>& W) {
+	return A *= W.eval();
+}
 template<class T, int C> DenseMatrix<T, C> operator-(
 		const DenseMatrix<T, C>& A) {
 	DenseMatrix<T, C> out(A.rows, A.cols);
@@ -401,7 +690,7 @@ template<class T, int C> DenseMatrix<T, C> operator-(const vec<T, C>& v,
 	return out;
 }
 template<class T, int C> DenseMatrix<T, C>& operator*=(
-		const DenseMatrix<T, C>& A, const vec<T, C>& v) {
+		DenseMatrix<T, C>& A, const vec<T, C>& v) {
 	for (int i = 0; i < A.rows; i++) {
 		for (int j = 0; j < A.cols; j++) {
 			A[i][j] = A[i][j] * v;
@@ -410,7 +699,7 @@ template<class T, int C> DenseMatrix<T, C>& operator*=(
 	return A;
 }
 template<class T, int C> DenseMatrix<T, C>& operator/=(
-		const DenseMatrix<T, C>& A, const vec<T, C>& v) {
+		DenseMatrix<T, C>& A, const vec<T, C>& v) {
 	for (int i = 0; i < A.rows; i++) {
 		for (int j = 0; j < A.cols; j++) {
 			A[i][j] = A[i][j] / v;
@@ -26,6 +26,441 @@
 namespace aly {
 	bool SANITY_CHECK_DENSE_SOLVE();
 	bool SANITY_CHECK_ROBUST_SOLVE();
+	enum class MultigridCycle {
+		V = 0, W = 1, Full = 2
+	};
+	template<class C, class R> std::basic_ostream<C, R> & operator <<(
+		std::basic_ostream<C, R> & ss, const MultigridCycle& type) {
+		switch (type) {
+		case MultigridCycle::V:
+			return ss << "V-Cycle";
+		case MultigridCycle::W:
+			return ss << "W-Cycle";
+		case MultigridCycle::Full:
+			return ss << "Full Multigrid";
+		}
+		return ss;
+	}
+	/*
+	 * Solver for the masked 2D Poisson problem behind PoissonBlend,
+	 * PoissonInpaint and LaplaceFill: x - 0.25*(sum of 4 neighbors of x) = b on
+	 * pixels where mask is non-zero. All other pixels of x, including the image
+	 * border, are held fixed. Runs conjugate gradient preconditioned with one
+	 * multigrid cycle per iteration, which keeps the convergence rate
+	 * independent of image size even when the mask boundary does not line up
+	 * with the coarse grids. Coarse grids take every other pixel, full
+	 * weighting restriction and bilinear prolongation, and stop at a few
+	 * pixels across. Smoothing is damped red-black Gauss-Seidel done in one
+	 * pass per band of rows. Full runs one full multigrid cycle for the
+	 * initial guess and V-cycles after that. Buffers are kept between solves.
+	 */
+	template<int C> class PoissonMultigrid {
+	public:
+		typedef vec<float, C> ValueType;
+	protected:
+		struct Level {
+			int width = 0, height = 0, stride = 0;
+			aligned_vector<ValueType> x, b;
+			std::vector<uint8_t> mask;
+			size_t index(int i, int j) const {
+				return (size_t)(j + 1) * stride + (i + 1);
+			}
+			bool parallel() const {
+				return (double)width * height > 65536.0;
+			}
+			int bands() const {
+				return (height + BAND_ROWS - 1) / BAND_ROWS;
+			}
+		};
+		static const int BAND_ROWS = 32;
+		std::vector<Level> levels;
+		aligned_vector<ValueType> direction;
+		MultigridCycle cycleType;
+		int preSmooth, postSmooth, maxLevels;
+		float relaxation;
+		void relaxRow(Level& L, int j, int color) {
+			ValueType* x = L.x.data();
+			const ValueType* b = L.b.data();
+			const uint8_t* m = L.mask.data();
+			const int stride = L.stride;
+			const size_t row = L.index(0, j);
+			for (int i = (j + color) & 1; i < L.width; i += 2) {
+				const size_t k = row + i;
+				if (m[k]) {
+					ValueType avg = 0.25f * (x[k - 1] + x[k + 1] + x[k - stride] + x[k + stride]);
+					x[k] += relaxation * (b[k] + avg - x[k]);
+				}
+			}
+		}
+		//Reversed sweeps relax black before red, so a forward then reversed pair is symmetric.
+		void smooth(Level& L, int sweeps, bool reversed) {
+			const int first = reversed ? 1 : 0;
+			const int second = 1 - first;
+			const int bands = L.bands();
+			for (int s = 0; s < sweeps; s++) {
+				//Rows j and j-1 get the first and second color in one pass. Second color rows on band edges wait for the neighboring band.
+#pragma omp parallel for if (L.parallel())
+				for (int t = 0; t < bands; t++) {
+					const int j0 = t * BAND_ROWS;
+					const int j1 = std::min(j0 + BAND_ROWS, L.height);
+					for (int j = j0; j < j1; j++) {
+						relaxRow(L, j, first);
+						if (j - 1 > j0) {
+							relaxRow(L, j - 1, second);
+						}
+					}
+				}
+#pragma omp parallel for if (L.parallel())
+				for (int t = 0; t < bands; t++) {
+					const int j0 = t * BAND_ROWS;
+					const int j1 = std::min(j0 + BAND_ROWS, L.height);
+					relaxRow(L, j0, second);
+					if (j1 - 1 > j0) {
+						relaxRow(L, j1 - 1, second);
+					}
+				}
+			}
+		}
+		void residualRow(const Level& F, int j, ValueType* r) const {
+			const ValueType* x = F.x.data();
+			const ValueType* b = F.b.data();
+			const uint8_t* m = F.mask.data();
+			const int stride = F.stride;
+			const size_t row = F.index(0, j);
+			for (int i = 0; i < F.width; i++) {
+				const size_t k = row + i;
+				r[i] = m[k] ? b[k] + 0.25f * (x[k - 1] + x[k + 1] + x[k - stride] + x[k + stride]) - x[k] : ValueType(0.0f);
+			}
+		}
+		//Full weighting of the residual on level l into the right-hand side of level l+1, which is the transpose of prolongate().
+		void restrictResidual(int l) {
+			const Level& F = levels[l];
+			Level& G = levels[l + 1];
+#pragma omp parallel if (F.parallel())
+			{
+				std::vector<ValueType> r(F.width);
+				std::vector<ValueType> acc(G.width);
+#pragma omp for
+				for (int J = 0; J < G.height; J++) {
+					std::fill(acc.begin(), acc.end(), ValueType(0.0f));
+					for (int dj = -1; dj <= 1; dj++) {
+						const int j = 2 * J + dj;
+						if (j < 0 || j >= F.height)
+							continue;
+						residualRow(F, j, r.data());
+						const float wj = (dj == 0) ? 0.5f : 0.25f;
+						for (int I = 0; I < G.width; I++) {
+							const int i = 2 * I;
+							ValueType val = 2.0f * r[i];
+							if (i > 0)
+								val += r[i - 1];
+							if (i + 1 < F.width)
+								val += r[i + 1];
+							acc[I] += wj * val;
+						}
+					}
+					const uint8_t* m = G.mask.data();
+					const size_t row = G.index(0, J);
+					for (int I = 0; I < G.width; I++) {
+						G.b[row + I] = m[row + I] ? acc[I] : ValueType(0.0f);
+					}
+				}
+			}
+		}
+		void prolongate(int l) {
+			Level& F = levels[l];
+			const Level& G = levels[l + 1];
+			ValueType* x = F.x.data();
+			const ValueType* e = G.x.data();
+			const uint8_t* m = F.mask.data();
+#pragma omp parallel for if (F.parallel())
+			for (int j = 0; j < F.height; j++) {
+				const int J = j >> 1;
+				const bool oddRow = (j & 1) != 0;
+				for (int i = 0; i < F.width; i++) {
+					const size_t k = F.index(i, j);
+					if (!m[k])
+						continue;
+					const int I = i >> 1;
+					ValueType val = e[G.index(I, J)];
+					if (i & 1)
+						val += e[G.index(I + 1, J)];
+					if (oddRow) {
+						val += e[G.index(I, J + 1)];
+						if (i & 1)
+							val += e[G.index(I + 1, J + 1)];
+					}
+					x[k] += ((i & 1) ? 0.5f : 1.0f) * (oddRow ? 0.5f : 1.0f) * val;
+				}
+			}
+		}
+		void zero(Level& L) {
+			std::fill(L.x.begin(), L.x.end(), ValueType(0.0f));
+		}
+		void coarseSolve(Level& L) {
+			int sweeps = L.width + L.height;
+			smooth(L, sweeps, false);
+			smooth(L, sweeps, true);
+		}
+		//Improves x on level l starting from its current value.
+		void cycle(int l) {
+			Level& L = levels[l];
+			if (l + 1 == (int)levels.size()) {
+				coarseSolve(L);
+				return;
+			}
+			smooth(L, preSmooth, false);
+			restrictResidual(l);
+			zero(levels[l + 1]);
+			int visits = (cycleType == MultigridCycle::W && l + 2 < (int)levels.size()) ? 2 : 1;
+			for (int v = 0; v < visits; v++) {
+				cycle(l + 1);
+			}
+			prolongate(l);
+			smooth(L, postSmooth, true);
+		}
+		//Approximates the solution of level 0 for the right-hand side in levels[0].b, starting from zero.
+		void precondition(bool full) {
+			zero(levels[0]);
+			if (full) {
+				for (int l = 0; l + 1 < (int)levels.size(); l++) {
+					zero(levels[l + 1]);
+					restrictResidual(l);
+				}
+				coarseSolve(levels.back());
+				for (int l = (int)levels.size() - 2; l >= 0; l--) {
+					prolongate(l);
+					cycle(l);
+				}
+			} else {
+				cycle(0);
+			}
+		}
+		void setup(int width, int height, const uint8_t* mask, size_t maskStride) {
+			if (levels.empty())
+				levels.resize(1);
+			size_t count = 0;
+			while (true) {
+				Level& L = levels[count];
+				if (count == 0) {
+					L.width = width;
+					L.height = height;
+				} else {
+					L.width = (levels[count - 1].width + 1) / 2;
+					L.height = (levels[count - 1].height + 1) / 2;
+				}
+				L.stride = L.width + 2;
+				L.mask.assign((size_t)L.stride * (L.height + 2), 0);
+				bool any = false;
+				for (int j = 0; j < L.height; j++) {
+					for (int i = 0; i < L.width; i++) {
+						bool active;
+						if (count == 0) {
+							active = i > 0 && j > 0 && i < width - 1 && j < height - 1 && mask[j * maskStride + i] != 0;
+						} else {
+							//Coarse unknowns need all of their fine neighbors to be unknown, so coarse corrections never spill past the mask boundary.
+							const Level& P = levels[count - 1];
+							const size_t k = P.index(2 * i, 2 * j);
+							active = P.mask[k] && P.mask[k - 1] && P.mask[k + 1] && P.mask[k - P.stride] && P.mask[k + P.stride];
+						}
+						if (active) {
+							L.mask[L.index(i, j)] = 1;
+							any = true;
+						}
+					}
+				}
+				if (!any && count > 0)
+					break;
+				L.x.resize(L.mask.size());
+				L.b.resize(L.mask.size());
+				zero(L);
+				std::fill(L.b.begin(), L.b.end(), ValueType(0.0f));
+				count++;
+				if ((maxLevels > 0 && (int)count >= maxLevels) || std::min(L.width, L.height) <= 4)
+					break;
+				if (count == levels.size())
+					levels.push_back(Level());
+			}
+			levels.resize(count);
+		}
+		//Per channel sums over bands of rows on level 0, so results do not depend on the thread count.
+		template<class F> vec<double, C> reduceRows(const F& func) {
+			const Level& L = levels[0];
+			std::vector<vec<double, C>> partial(L.bands(), vec<double, C>(0.0));
+#pragma omp parallel for if (L.parallel())
+			for (int t = 0; t < L.bands(); t++) {
+				const int j0 = t * BAND_ROWS;
+				const int j1 = std::min(j0 + BAND_ROWS, L.height);
+				for (int j = j0; j < j1; j++) {
+					func(j, partial[t]);
+				}
+			}
+			vec<double, C> sum(0.0);
+			for (const vec<double, C>& p : partial) {
+				sum += p;
+			}
+			return sum;
+		}
+		static double total(const vec<double, C>& v) {
+			double sum = 0.0;
+			for (int c = 0; c < C; c++) {
+				sum += v[c];
+			}
+			return sum;
+		}
+	public:
+		PoissonMultigrid(MultigridCycle cycle = MultigridCycle::V, int preSmooth = 2,
+			int postSmooth = 2, float relaxation = 1.0f, int maxLevels = 0) :
+			cycleType(cycle), preSmooth(preSmooth), postSmooth(postSmooth), maxLevels(maxLevels), relaxation(relaxation) {
+		}
+		void setRelaxation(float r) {
+			relaxation = r;
+		}
+		void setCycle(MultigridCycle c) {
+			cycleType = c;
+		}
+		void setMaxLevels(int l) {
+			maxLevels = l;
+		}
+		int getLevelCount() const {
+			return (int)levels.size();
+		}
+		/*
+		 * Solves in place starting from x. Stops when the residual norm drops
+		 * below tolerance times its initial value, after maxIterations, or when
+		 * monitor(iteration, relative residual) returns false. Returns the
+		 * number of iterations run.
+		 */
+		int solve(Image<float, C, ImageType::FLOAT>& x, const Image<float, C, ImageType::FLOAT>& b,
+			const Image1ub& mask, float tolerance = 1E-4f, int maxIterations = 32,
+			const std::function<bool(int, double)>& monitor = nullptr) {
+			if (x.dimensions() != b.dimensions() || x.dimensions() != mask.dimensions())
+				throw std::runtime_error(
+					MakeString() << "Cannot solve. Image dimensions do not match "
+					<< x.dimensions() << " " << b.dimensions() << " " << mask.dimensions());
+			if (x.width < 3 || x.height < 3)
+				return 0;
+			setup(x.width, x.height, &mask.data[0].x, mask.width);
+			Level& L = levels[0];
+			const int width = x.width;
+			const int stride = L.stride;
+			ValueType* r = L.b.data();
+			ValueType* z = L.x.data();
+			const uint8_t* m = L.mask.data();
+			direction.assign(L.x.size(), ValueType(0.0f));
+			ValueType* p = direction.data();
+			auto residual = [&](vec<double, C>& sum, int j) {
+				for (int i = 0; i < width; i++) {
+					const size_t k = L.index(i, j);
+					if (m[k]) {
+						const size_t n = (size_t)j * width + i;
+						ValueType res = b.data[n] + 0.25f * (x.data[n - 1] + x.data[n + 1] + x.data[n - width] + x.data[n + width]) - x.data[n];
+						r[k] = res;
+						for (int c = 0; c < C; c++) {
+							sum[c] += (double)res[c] * res[c];
+						}
+					}
+				}
+			};
+			auto update = [&](const ValueType& scale) {
+#pragma omp parallel for if (L.parallel())
+				for (int j = 0; j < L.height; j++) {
+					for (int i = 0; i < width; i++) {
+						const size_t k = L.index(i, j);
+						if (m[k]) {
+							x.data[(size_t)j * width + i] += scale * z[k];
+						}
+					}
+				}
+			};
+			double r0 = std::sqrt(total(reduceRows([&](int j, vec<double, C>& sum) {residual(sum, j);})));
+			if (r0 == 0.0)
+				return 0;
+			if (cycleType == MultigridCycle::Full) {
+				precondition(true);
+				update(ValueType(1.0f));
+				reduceRows([&](int j, vec<double, C>& sum) {residual(sum, j);});
+			}
+			precondition(false);
+			vec<double, C> rz = reduceRows([&](int j, vec<double, C>& sum) {
+				const size_t row = L.index(0, j);
+				for (int i = 0; i < width; i++) {
+					const size_t k = row + i;
+					p[k] = z[k];
+					for (int c = 0; c < C; c++) {
+						sum[c] += (double)r[k][c] * z[k][c];
+					}
+				}
+			});
+			int iter = 0;
+			while (iter < maxIterations) {
+				vec<double, C> pq = reduceRows([&](int j, vec<double, C>& sum) {
+					const size_t row = L.index(0, j);
+					for (int i = 0; i < width; i++) {
+						const size_t k = row + i;
+						if (m[k]) {
+							ValueType q = p[k] - 0.25f * (p[k - 1] + p[k + 1] + p[k - stride] + p[k + stride]);
+							for (int c = 0; c < C; c++) {
+								sum[c] += (double)p[k][c] * q[c];
+							}
+						}
+					}
+				});
+				ValueType alpha;
+				for (int c = 0; c < C; c++) {
+					alpha[c] = (pq[c] > 0.0) ? (float)(rz[c] / pq[c]) : 0.0f;
+				}
+				double res = std::sqrt(total(reduceRows([&](int j, vec<double, C>& sum) {
+					const size_t row = L.index(0, j);
+					for (int i = 0; i < width; i++) {
+						const size_t k = row + i;
+						if (m[k]) {
+							ValueType q = p[k] - 0.25f * (p[k - 1] + p[k + 1] + p[k - stride] + p[k + stride]);
+							x.data[(size_t)j * width + i] += alpha * p[k];
+							r[k] -= alpha * q;
+							for (int c = 0; c < C; c++) {
+								sum[c] += (double)r[k][c] * r[k][c];
+							}
+						}
+					}
+				}))) / r0;
+				iter++;
+				if ((monitor && !monitor(iter - 1, res)) || res < tolerance || iter == maxIterations)
+					break;
+				precondition(false);
+				vec<double, C> rzNext = reduceRows([&](int j, vec<double, C>& sum) {
+					const size_t row = L.index(0, j);
+					for (int i = 0; i < width; i++) {
+						const size_t k = row + i;
+						for (int c = 0; c < C; c++) {
+							sum[c] += (double)r[k][c] * z[k][c];
+						}
+					}
+				});
+				ValueType beta;
+				for (int c = 0; c < C; c++) {
+					beta[c] = (rz[c] > 0.0) ? (float)(rzNext[c] / rz[c]) : 0.0f;
+				}
+				rz = rzNext;
+#pragma omp parallel for if (L.parallel())
+				for (int j = 0; j < L.height; j++) {
+					const size_t row = L.index(0, j);
+					for (int i = 0; i < width; i++) {
+						const size_t k = row + i;
+						p[k] = z[k] + beta * p[k];
+					}
+				}
+			}
+			return iter;
+		}
+	};
+	typedef PoissonMultigrid<4> PoissonMultigrid4f;
+	typedef PoissonMultigrid<2> PoissonMultigrid2f;
+	/*
+	 * Overloads taking levels > 1 solve with PoissonMultigrid, running up to
+	 * iterations cycles with lambda as the smoother relaxation. The number of
+	 * grid levels is chosen from the image size.
+	 */
 	void PoissonBlend(const Image4f& in, Image4f& out, int iterations, int levels,float lambda = 0.99f, const std::function<bool(int,int)>& iterationMonitor = nullptr);
 	void PoissonBlend(const Image4f& in, Image4f& out, int iterations,float lambda = 0.99f, const std::function<bool(int)>& iterationMonitor = nullptr);
 	void PoissonBlend(const Image2f& in, Image2f& out, int iterations, int levels,float lambda = 0.99f, const std::function<bool(int,int)>& iterationMonitor = nullptr);
@@ -372,8 +807,8 @@ namespace aly {
 		return (U * D * Vt).transpose();
 	}
 	template<class T, int C> Vector<T, C> SolveSVD(const DenseMatrix<T, C>& A,
-		const Vector<T, C>& b) {
-		if (A.rows != b.size()) {
+		const ExpressionInput<Vector<T, C>>& b) {
+		if (A.rows != (int)b.size()) {
 			throw std::runtime_error(
 				MakeString()
 				<< "Matrix row dimensions and vector length must agree. A=["
@@ -381,9 +816,10 @@ namespace aly {
 				<< "]");
 		}
 		if (A.rows != A.cols) {
-			DenseMatrix<T, C> At = A.transpose();
-			DenseMatrix<T, C> AtA = At * A;
-			Vector<T, C> Atb = At * b;
+			DenseMatrix<T, C> AtA;
+			Vector<T, C> Atb;
+			MultiplyTranspose(AtA, A);
+			MultiplyTranspose(Atb, A, b);
 			return inverse(AtA) * Atb;
 		}
 		else {
@@ -490,80 +926,294 @@ namespace aly {
 		return nonSingular;
 	}
 
-	template<class T, int C> Vector<T, C> SolveLU(const DenseMatrix<T, C>& A,
-		const Vector<T, C>& b) {
-
-		if (A.rows != b.size()) {
-			throw std::runtime_error(
-				MakeString()
-				<< "Matrix row dimensions and vector length must agree. A=["
-				<< A.rows << "," << A.cols << "] b=[" << b.size()
-				<< "]");
+	namespace detail {
+		//Panel width of the blocked LU and QR factorizations.
+		static const int DENSE_FACTOR_BLOCK = 64;
+		//Upper triangular solve of an n x k row-major block in place, R stored in rows of length stride.
+		inline void DenseBackSubstitute(const double* R, int n, int stride, double* Y, int k) {
+			if (k == 1) {
+				for (int i = n - 1; i >= 0; i--) {
+					const double* row = R + (size_t)i * stride;
+					Y[i] = (Y[i] - DenseDot<double, 1>(row + i + 1, Y + i + 1, n - i - 1).x) / row[i];
+				}
+				return;
+			}
+			const int chunks = (k + DENSE_COLUMN_TILE - 1) / DENSE_COLUMN_TILE;
+#pragma omp parallel for if ((double)n * n * k > DENSE_PARALLEL_WORK)
+			for (int t = 0; t < chunks; t++) {
+				const int c0 = t * DENSE_COLUMN_TILE;
+				const int nc = std::min(DENSE_COLUMN_TILE, k - c0);
+				for (int i = n - 1; i >= 0; i--) {
+					const double* row = R + (size_t)i * stride;
+					double* yi = Y + (size_t)i * k + c0;
+					for (int p = i + 1; p < n; p++) {
+						DenseAxpy<double, 1>(yi, Y + (size_t)p * k + c0, double1(-row[p]), nc);
+					}
+					const double inv = 1.0 / row[i];
+					for (int c = 0; c < nc; c++) {
+						yi[c] *= inv;
+					}
+				}
+			}
 		}
-		if (A.rows != A.cols) {
-			DenseMatrix<T, C> At = A.transpose();
-			DenseMatrix<T, C> AtA = At * A;
-			Vector<T, C> Atb = At * b;
-			int n = AtA.cols;
-			Vector<T, C> x(A.cols);
-			Vector<T, C> y(A.cols);
-			DenseMatrix<T, 1> L, U;
-			std::vector<int> piv;
-			for (int cc = 0; cc < C; cc++) {
-				bool nonSingular = LU(AtA, L, U, piv, cc);
-				if (!nonSingular) {
-					throw std::runtime_error("Matrix is singular.");
+	}
+	/*
+	 * Factors a square matrix once as PA = LU with partial pivoting and then
+	 * solves any number of right-hand sides against it. Each channel is
+	 * factored separately in double precision. The factorization is blocked
+	 * and right-looking: a panel of DENSE_FACTOR_BLOCK columns is eliminated,
+	 * then the trailing matrix gets one rank-k update split across threads.
+	 */
+	template<class T, int C> class LUFactorization {
+	protected:
+		int n;
+		double zeroTolerance;
+		bool nonSingular;
+		//C consecutive n x n row-major blocks. Unit L below the diagonal, U on and above.
+		aligned_vector<double> factors;
+		//Row i of PA is row pivots[cc][i] of A.
+		std::vector<std::vector<int>> pivots;
+		vec<int, C> pivotSign;
+		bool factorChannel(int cc) {
+			using namespace detail;
+			pivotSign[cc] = 1;
+			pivots[cc].resize(n);
+			if (n == 0)
+				return true;
+			double* a = &factors[(size_t)cc * n * n];
+			std::vector<int>& piv = pivots[cc];
+			piv.resize(n);
+			for (int i = 0; i < n; i++) {
+				piv[i] = i;
+			}
+			int sign = 1;
+			for (int k0 = 0; k0 < n; k0 += DENSE_FACTOR_BLOCK) {
+				const int k1 = std::min(k0 + DENSE_FACTOR_BLOCK, n);
+				//Factor panel
+				for (int j = k0; j < k1; j++) {
+					int p = j;
+					double maxVal = std::abs(a[(size_t)j * n + j]);
+					for (int i = j + 1; i < n; i++) {
+						double val = std::abs(a[(size_t)i * n + j]);
+						if (val > maxVal) {
+							maxVal = val;
+							p = i;
+						}
+					}
+					if (p != j) {
+						std::swap_ranges(a + (size_t)p * n, a + (size_t)(p + 1) * n, a + (size_t)j * n);
+						std::swap(piv[p], piv[j]);
+						sign = -sign;
+					}
+					const double d = a[(size_t)j * n + j];
+					if (std::abs(d) <= zeroTolerance)
+						continue;
+					const double* prow = a + (size_t)j * n;
+#pragma omp parallel for if ((double)(n - j) * (k1 - j) > DENSE_PARALLEL_WORK)
+					for (int i = j + 1; i < n; i++) {
+						double* row = a + (size_t)i * n;
+						const double l = (row[j] /= d);
+						for (int c = j + 1; c < k1; c++) {
+							row[c] -= l * prow[c];
+						}
+					}
 				}
-				// Forward solve Ly = b
-				for (int i = 0; i < n; i++) {
-					y[i][cc] = Atb[piv[i]][cc];
-					for (int j = 0; j < i; j++) {
-						y[i][cc] -= L[i][j].x * y[j][cc];
+				if (k1 >= n)
+					continue;
+				const int nc = n - k1;
+				//U12 = inverse(L11) * A12
+				const int chunks = (nc + DENSE_COLUMN_TILE - 1) / DENSE_COLUMN_TILE;
+#pragma omp parallel for if ((double)(k1 - k0) * (k1 - k0) * nc > DENSE_PARALLEL_WORK)
+				for (int t = 0; t < chunks; t++) {
+					const int c0 = k1 + t * DENSE_COLUMN_TILE;
+					const int cn = std::min(DENSE_COLUMN_TILE, n - c0);
+					for (int i = k0 + 1; i < k1; i++) {
+						double* row = a + (size_t)i * n;
+						for (int p = k0; p < i; p++) {
+							DenseAxpy<double, 1>(row + c0, a + (size_t)p * n + c0, double1(-row[p]), cn);
+						}
 					}
-					y[i][cc] /= L[i][i].x;
 				}
-				// Backward solve Ux = y
-				for (int i = n - 1; i >= 0; i--) {
-					x[i][cc] = y[i][cc];
-					for (int j = i + 1; j < n; j++) {
-						x[i][cc] -= U[i][j].x * x[j][cc];
+				//A22 -= L21 * U12
+#pragma omp parallel for schedule(dynamic,8) if ((double)nc * nc * (k1 - k0) > DENSE_PARALLEL_WORK)
+				for (int i = k1; i < n; i++) {
+					double* row = a + (size_t)i * n;
+					for (int c0 = k1; c0 < n; c0 += DENSE_COLUMN_TILE) {
+						const int cn = std::min(DENSE_COLUMN_TILE, n - c0);
+						for (int p = k0; p < k1; p++) {
+							const double l = row[p];
+							if (l != 0.0) {
+								DenseAxpy<double, 1>(row + c0, a + (size_t)p * n + c0, double1(-l), cn);
+							}
+						}
 					}
-					x[i][cc] /= U[i][i].x;
 				}
 			}
-			return x;
+			pivotSign[cc] = sign;
+			for (int j = 0; j < n; j++) {
+				if (std::abs(a[(size_t)j * n + j]) <= zeroTolerance) {
+					return false;
+				}
+			}
+			return true;
 		}
-		else {
-			int n = A.cols;
-
-			Vector<T, C> x(A.cols);
-			Vector<T, C> y(A.cols);
-			DenseMatrix<T, 1> L, U;
-			std::vector<int> piv;
+		//Solves LUx=y for an n x k row-major block that is already permuted.
+		void solveChannel(int cc, double* Y, int k) const {
+			using namespace detail;
+			if (n == 0 || k == 0)
+				return;
+			const double* a = &factors[(size_t)cc * n * n];
+			if (k == 1) {
+				for (int i = 1; i < n; i++) {
+					Y[i] -= DenseDot<double, 1>(a + (size_t)i * n, Y, i).x;
+				}
+			}
+			else {
+				const int chunks = (k + DENSE_COLUMN_TILE - 1) / DENSE_COLUMN_TILE;
+#pragma omp parallel for if ((double)n * n * k > DENSE_PARALLEL_WORK)
+				for (int t = 0; t < chunks; t++) {
+					const int c0 = t * DENSE_COLUMN_TILE;
+					const int nc = std::min(DENSE_COLUMN_TILE, k - c0);
+					for (int i = 1; i < n; i++) {
+						const double* row = a + (size_t)i * n;
+						double* yi = Y + (size_t)i * k + c0;
+						for (int p = 0; p < i; p++) {
+							DenseAxpy<double, 1>(yi, Y + (size_t)p * k + c0, double1(-row[p]), nc);
+						}
+					}
+				}
+			}
+			DenseBackSubstitute(a, n, n, Y, k);
+		}
+	public:
+		LUFactorization() :n(0), zeroTolerance(0.0), nonSingular(false) {
+		}
+		LUFactorization(const DenseMatrix<T, C>& A, double zeroTolerance = 0.0) :n(0), zeroTolerance(0.0), nonSingular(false) {
+			factor(A, zeroTolerance);
+		}
+		bool factor(const DenseMatrix<T, C>& A, double zeroTolerance = 0.0) {
+			if (A.rows != A.cols) {
+				throw std::runtime_error(
+					MakeString() << "LU factorization requires a square matrix. A=["
+					<< A.rows << "," << A.cols << "]");
+			}
+			n = A.rows;
+			this->zeroTolerance = zeroTolerance;
+			factors.resize((size_t)C * n * n);
+			pivots.resize(C);
+			for (int cc = 0; cc < C && n > 0; cc++) {
+				const vec<T, C>* src = A[0];
+				double* a = &factors[(size_t)cc * n * n];
+				for (size_t idx = 0; idx < (size_t)n * n; idx++) {
+					a[idx] = (double)src[idx][cc];
+				}
+			}
+			nonSingular = true;
 			for (int cc = 0; cc < C; cc++) {
-				bool nonSingular = LU(A, L, U, piv, cc);
-				if (!nonSingular) {
-					throw std::runtime_error("Matrix is singular.");
+				if (!factorChannel(cc)) {
+					nonSingular = false;
 				}
-				// Forward solve Ly = b
+			}
+			return nonSingular;
+		}
+		bool isNonSingular() const {
+			return nonSingular;
+		}
+		int size() const {
+			return n;
+		}
+		vec<T, C> determinant() const {
+			vec<T, C> det;
+			for (int cc = 0; cc < C; cc++) {
+				const double* a = &factors[(size_t)cc * n * n];
+				double d = pivotSign[cc];
+				for (int j = 0; j < n; j++) {
+					d *= a[(size_t)j * n + j];
+				}
+				det[cc] = T(d);
+			}
+			return det;
+		}
+		//Solves AX=B for all columns of B at once.
+		void solve(DenseMatrix<T, C>& X, const DenseMatrix<T, C>& B) const {
+			if (B.rows != n) {
+				throw std::runtime_error(
+					MakeString() << "Matrix row dimensions must agree. A=["
+					<< n << "," << n << "] B=[" << B.rows << "," << B.cols << "]");
+			}
+			if (!nonSingular) {
+				throw std::runtime_error("Matrix is singular.");
+			}
+			const int k = B.cols;
+			DenseMatrix<T, C> out(n, k);
+			aligned_vector<double> Y((size_t)n * k);
+			for (int cc = 0; cc < C; cc++) {
+				const std::vector<int>& piv = pivots[cc];
 				for (int i = 0; i < n; i++) {
-					y[i][cc] = b[piv[i]][cc];
-					for (int j = 0; j < i; j++) {
-						y[i][cc] -= L[i][j].x * y[j][cc];
+					const vec<T, C>* brow = B[piv[i]];
+					for (int j = 0; j < k; j++) {
+						Y[(size_t)i * k + j] = (double)brow[j][cc];
 					}
-					y[i][cc] /= L[i][i].x;
 				}
-				// Backward solve Ux = y
-				for (int i = n - 1; i >= 0; i--) {
-					x[i][cc] = y[i][cc];
-					for (int j = i + 1; j < n; j++) {
-						x[i][cc] -= U[i][j].x * x[j][cc];
+				solveChannel(cc, Y.data(), k);
+				for (int i = 0; i < n; i++) {
+					vec<T, C>* xrow = out[i];
+					for (int j = 0; j < k; j++) {
+						xrow[j][cc] = T(Y[(size_t)i * k + j]);
 					}
-					x[i][cc] /= U[i][i].x;
 				}
 			}
+			X = std::move(out);
+		}
+		void solve(Vector<T, C>& x, const Vector<T, C>& b) const {
+			if ((int)b.size() != n) {
+				throw std::runtime_error(
+					MakeString() << "Matrix row dimensions and vector length must agree. A=["
+					<< n << "," << n << "] b=[" << b.size() << "]");
+			}
+			if (!nonSingular) {
+				throw std::runtime_error("Matrix is singular.");
+			}
+			std::vector<double> y(n);
+			Vector<T, C> out(n);
+			for (int cc = 0; cc < C; cc++) {
+				const std::vector<int>& piv = pivots[cc];
+				for (int i = 0; i < n; i++) {
+					y[i] = (double)b[piv[i]][cc];
+				}
+				solveChannel(cc, y.data(), 1);
+				for (int i = 0; i < n; i++) {
+					out[i][cc] = T(y[i]);
+				}
+			}
+			x = std::move(out);
+		}
+		Vector<T, C> solve(const Vector<T, C>& b) const {
+			Vector<T, C> x;
+			solve(x, b);
 			return x;
 		}
+	};
+	template<class T, int C> Vector<T, C> SolveLU(const DenseMatrix<T, C>& A,
+		const ExpressionInput<Vector<T, C>>& b) {
+
+		if (A.rows != (int)b.size()) {
+			throw std::runtime_error(
+				MakeString()
+				<< "Matrix row dimensions and vector length must agree. A=["
+				<< A.rows << "," << A.cols << "] b=[" << b.size()
+				<< "]");
+		}
+		if (A.rows != A.cols) {
+			DenseMatrix<T, C> AtA;
+			Vector<T, C> Atb;
+			MultiplyTranspose(AtA, A);
+			MultiplyTranspose(Atb, A, b);
+			return LUFactorization<T, C>(AtA).solve(Atb);
+		}
+		else {
+			return LUFactorization<T, C>(A).solve(b);
+		}
 	}
 
 	/** QR Decomposition.
@@ -661,58 +1311,293 @@ namespace aly {
 		return nonSingular;
 	}
 
-	template<class T, int C> Vector<T, C> SolveQR(const DenseMatrix<T, C>& A,
-		const Vector<T, C>& b) {
-
-		if (A.rows != b.size()) {
-			throw std::runtime_error(
-				MakeString()
-				<< "Matrix row dimensions and vector length must agree. A=["
-				<< A.rows << "," << A.cols << "] b=[" << b.size()
-				<< "]");
+	/*
+	 * Householder factorization A = QR of an m x n matrix with m >= n, kept in
+	 * compact form so that many right-hand sides can be solved in the least
+	 * squares sense without refactoring. Reflectors are accumulated a panel at
+	 * a time into the blocked form I - V*T*V' and applied to the trailing
+	 * columns in parallel, column band by column band.
+	 */
+	template<class T, int C> class QRFactorization {
+	protected:
+		int m, n;
+		double zeroTolerance;
+		bool fullRank;
+		//C consecutive m x n row-major blocks. R on and above the diagonal, reflectors below it with an implicit unit head.
+		aligned_vector<double> factors;
+		aligned_vector<double> tau;
+		bool factorChannel(int cc) {
+			using namespace detail;
+			if (n == 0)
+				return true;
+			double* a = &factors[(size_t)cc * m * n];
+			double* t = &tau[(size_t)cc * n];
+			const int NB = DENSE_FACTOR_BLOCK;
+			std::vector<double> Tm(NB * NB), w(NB), z(NB);
+			for (int k0 = 0; k0 < n; k0 += NB) {
+				const int k1 = std::min(k0 + NB, n);
+				const int nb = k1 - k0;
+				//Factor panel
+				for (int j = k0; j < k1; j++) {
+					double alpha = a[(size_t)j * n + j];
+					double sigma = 0.0;
+					for (int i = j + 1; i < m; i++) {
+						double v = a[(size_t)i * n + j];
+						sigma += v * v;
+					}
+					double beta = alpha;
+					t[j] = 0.0;
+					if (sigma > 0.0) {
+						double nrm = std::sqrt(alpha * alpha + sigma);
+						beta = (alpha <= 0.0) ? nrm : -nrm;
+						t[j] = (beta - alpha) / beta;
+						double scale = 1.0 / (alpha - beta);
+						for (int i = j + 1; i < m; i++) {
+							a[(size_t)i * n + j] *= scale;
+						}
+					}
+					a[(size_t)j * n + j] = beta;
+					const int cn = k1 - j - 1;
+					if (t[j] == 0.0 || cn == 0)
+						continue;
+					for (int c = 0; c < cn; c++) {
+						w[c] = a[(size_t)j * n + j + 1 + c];
+					}
+					for (int i = j + 1; i < m; i++) {
+						DenseAxpy<double, 1>(w.data(), a + (size_t)i * n + j + 1, double1(a[(size_t)i * n + j]), cn);
+					}
+					for (int c = 0; c < cn; c++) {
+						w[c] *= t[j];
+						a[(size_t)j * n + j + 1 + c] -= w[c];
+					}
+					for (int i = j + 1; i < m; i++) {
+						DenseAxpy<double, 1>(a + (size_t)i * n + j + 1, w.data(), double1(-a[(size_t)i * n + j]), cn);
+					}
+				}
+				if (k1 >= n)
+					continue;
+				//Triangular factor T of the panel's block reflector
+				for (int jj = 0; jj < nb; jj++) {
+					const int j = k0 + jj;
+					for (int q = 0; q < jj; q++) {
+						double s = a[(size_t)j * n + k0 + q];
+						for (int i = j + 1; i < m; i++) {
+							s += a[(size_t)i * n + k0 + q] * a[(size_t)i * n + j];
+						}
+						z[q] = s;
+					}
+					for (int q = 0; q < jj; q++) {
+						double s = 0.0;
+						for (int r = q; r < jj; r++) {
+							s += Tm[q * NB + r] * z[r];
+						}
+						Tm[q * NB + jj] = -t[j] * s;
+					}
+					Tm[jj * NB + jj] = t[j];
+				}
+				//A2 = (I - V*T'*V') * A2
+				const int nc = n - k1;
+				const int chunks = (nc + DENSE_COLUMN_TILE - 1) / DENSE_COLUMN_TILE;
+#pragma omp parallel for if ((double)(m - k0) * nb * nc > DENSE_PARALLEL_WORK)
+				for (int ch = 0; ch < chunks; ch++) {
+					const int c0 = k1 + ch * DENSE_COLUMN_TILE;
+					const int cn = std::min(DENSE_COLUMN_TILE, n - c0);
+					std::vector<double> W((size_t)nb * cn, 0.0);
+					for (int i = k0; i < m; i++) {
+						const double* row = a + (size_t)i * n;
+						const int pmax = std::min(i - k0, nb - 1);
+						for (int p = 0; p <= pmax; p++) {
+							const double v = (i == k0 + p) ? 1.0 : row[k0 + p];
+							DenseAxpy<double, 1>(&W[(size_t)p * cn], row + c0, double1(v), cn);
+						}
+					}
+					for (int p = nb - 1; p >= 0; p--) {
+						double* wp = &W[(size_t)p * cn];
+						const double tpp = Tm[p * NB + p];
+						for (int c = 0; c < cn; c++) {
+							wp[c] *= tpp;
+						}
+						for (int q = 0; q < p; q++) {
+							DenseAxpy<double, 1>(wp, &W[(size_t)q * cn], double1(Tm[q * NB + p]), cn);
+						}
+					}
+					for (int i = k0; i < m; i++) {
+						double* row = a + (size_t)i * n;
+						const int pmax = std::min(i - k0, nb - 1);
+						for (int p = 0; p <= pmax; p++) {
+							const double v = (i == k0 + p) ? 1.0 : row[k0 + p];
+							DenseAxpy<double, 1>(row + c0, &W[(size_t)p * cn], double1(-v), cn);
+						}
+					}
+				}
+			}
+			for (int j = 0; j < n; j++) {
+				if (std::abs(a[(size_t)j * n + j]) <= zeroTolerance) {
+					return false;
+				}
+			}
+			return true;
 		}
-		if (A.rows != A.cols) {
-			DenseMatrix<T, C> At = A.transpose();
-			DenseMatrix<T, C> AtA = At * A;
-			Vector<T, C> Atb = At * b;
-			int n = AtA.cols;
-			Vector<T, C> x(A.cols);
-			DenseMatrix<T, C> Q, R;
-			bool nonSingular = QR(AtA, Q, R);
-			if (!nonSingular) {
+		//Overwrites the m x k row-major block Y with Q'Y, then solves the leading n rows with R.
+		void solveChannel(int cc, double* Y, int k) const {
+			using namespace detail;
+			if (n == 0 || k == 0)
+				return;
+			const double* a = &factors[(size_t)cc * m * n];
+			const double* t = &tau[(size_t)cc * n];
+			const int chunks = (k + DENSE_COLUMN_TILE - 1) / DENSE_COLUMN_TILE;
+#pragma omp parallel for if ((double)m * n * k > DENSE_PARALLEL_WORK)
+			for (int ch = 0; ch < chunks; ch++) {
+				const int c0 = ch * DENSE_COLUMN_TILE;
+				const int cn = std::min(DENSE_COLUMN_TILE, k - c0);
+				std::vector<double> w(cn);
+				for (int j = 0; j < n; j++) {
+					if (t[j] == 0.0)
+						continue;
+					double* yj = Y + (size_t)j * k + c0;
+					std::copy(yj, yj + cn, w.begin());
+					for (int i = j + 1; i < m; i++) {
+						DenseAxpy<double, 1>(w.data(), Y + (size_t)i * k + c0, double1(a[(size_t)i * n + j]), cn);
+					}
+					for (int c = 0; c < cn; c++) {
+						w[c] *= t[j];
+						yj[c] -= w[c];
+					}
+					for (int i = j + 1; i < m; i++) {
+						DenseAxpy<double, 1>(Y + (size_t)i * k + c0, w.data(), double1(-a[(size_t)i * n + j]), cn);
+					}
+				}
+			}
+			DenseBackSubstitute(a, n, n, Y, k);
+		}
+	public:
+		QRFactorization() :m(0), n(0), zeroTolerance(0.0), fullRank(false) {
+		}
+		QRFactorization(const DenseMatrix<T, C>& A, double zeroTolerance = 0.0) :m(0), n(0), zeroTolerance(0.0), fullRank(false) {
+			factor(A, zeroTolerance);
+		}
+		bool factor(const DenseMatrix<T, C>& A, double zeroTolerance = 0.0) {
+			if (A.rows < A.cols) {
+				throw std::runtime_error(
+					MakeString() << "QR factorization requires at least as many rows as columns. A=["
+					<< A.rows << "," << A.cols << "]");
+			}
+			m = A.rows;
+			n = A.cols;
+			this->zeroTolerance = zeroTolerance;
+			factors.resize((size_t)C * m * n);
+			tau.resize((size_t)C * n);
+			for (int cc = 0; cc < C && n > 0; cc++) {
+				const vec<T, C>* src = A[0];
+				double* a = &factors[(size_t)cc * m * n];
+				for (size_t idx = 0; idx < (size_t)m * n; idx++) {
+					a[idx] = (double)src[idx][cc];
+				}
+			}
+			fullRank = true;
+			for (int cc = 0; cc < C; cc++) {
+				if (!factorChannel(cc)) {
+					fullRank = false;
+				}
+			}
+			return fullRank;
+		}
+		bool isFullRank() const {
+			return fullRank;
+		}
+		int rows() const {
+			return m;
+		}
+		int cols() const {
+			return n;
+		}
+		//Upper triangular factor R, n x n.
+		DenseMatrix<T, C> getR() const {
+			DenseMatrix<T, C> R(n, n);
+			for (int cc = 0; cc < C; cc++) {
+				const double* a = &factors[(size_t)cc * m * n];
+				for (int i = 0; i < n; i++) {
+					for (int j = i; j < n; j++) {
+						R[i][j][cc] = T(a[(size_t)i * n + j]);
+					}
+				}
+			}
+			return R;
+		}
+		//Least squares solution of AX=B for all columns of B at once.
+		void solve(DenseMatrix<T, C>& X, const DenseMatrix<T, C>& B) const {
+			if (B.rows != m) {
+				throw std::runtime_error(
+					MakeString() << "Matrix row dimensions must agree. A=["
+					<< m << "," << n << "] B=[" << B.rows << "," << B.cols << "]");
+			}
+			if (!fullRank) {
 				throw std::runtime_error("Matrix is singular.");
 			}
-			// Compute Y = transpose(Q)*B
-			x = Q.transpose() * Atb;
-			// Solve R*X = Y;
-			for (int k = n - 1; k >= 0; k--) {
-				x[k] /= R[k][k];
-				for (int i = 0; i < k; i++) {
-					x[i] -= x[k] * R[i][k];
+			const int k = B.cols;
+			DenseMatrix<T, C> out(n, k);
+			aligned_vector<double> Y((size_t)m * k);
+			for (int cc = 0; cc < C && k > 0; cc++) {
+				const vec<T, C>* src = B[0];
+				for (size_t idx = 0; idx < (size_t)m * k; idx++) {
+					Y[idx] = (double)src[idx][cc];
+				}
+				solveChannel(cc, Y.data(), k);
+				vec<T, C>* dst = (n > 0) ? out[0] : nullptr;
+				for (size_t idx = 0; idx < (size_t)n * k; idx++) {
+					dst[idx][cc] = T(Y[idx]);
 				}
 			}
-			return x;
+			X = std::move(out);
 		}
-		else {
-			int n = A.cols;
-
-			Vector<T, C> x(A.cols);
-			DenseMatrix<T, C> Q, R;
-			bool nonSingular = QR(A, Q, R);
-			if (!nonSingular) {
+		void solve(Vector<T, C>& x, const Vector<T, C>& b) const {
+			if ((int)b.size() != m) {
+				throw std::runtime_error(
+					MakeString() << "Matrix row dimensions and vector length must agree. A=["
+					<< m << "," << n << "] b=[" << b.size() << "]");
+			}
+			if (!fullRank) {
 				throw std::runtime_error("Matrix is singular.");
 			}
-			// Compute Y = transpose(Q)*B
-			x = Q.transpose() * b;
-			// Solve R*X = Y;
-			for (int k = n - 1; k >= 0; k--) {
-				x[k] /= R[k][k];
-				for (int i = 0; i < k; i++) {
-					x[i] -= x[k] * R[i][k];
+			std::vector<double> y(m);
+			Vector<T, C> out(n);
+			for (int cc = 0; cc < C; cc++) {
+				for (int i = 0; i < m; i++) {
+					y[i] = (double)b[i][cc];
+				}
+				solveChannel(cc, y.data(), 1);
+				for (int i = 0; i < n; i++) {
+					out[i][cc] = T(y[i]);
 				}
 			}
+			x = std::move(out);
+		}
+		Vector<T, C> solve(const Vector<T, C>& b) const {
+			Vector<T, C> x;
+			solve(x, b);
 			return x;
 		}
+	};
+	template<class T, int C> Vector<T, C> SolveQR(const DenseMatrix<T, C>& A,
+		const ExpressionInput<Vector<T, C>>& b) {
+
+		if (A.rows != (int)b.size()) {
+			throw std::runtime_error(
+				MakeString()
+				<< "Matrix row dimensions and vector length must agree. A=["
+				<< A.rows << "," << A.cols << "] b=[" << b.size()
+				<< "]");
+		}
+		if (A.rows < A.cols) {
+			DenseMatrix<T, C> AtA;
+			Vector<T, C> Atb;
+			MultiplyTranspose(AtA, A);
+			MultiplyTranspose(Atb, A, b);
+			return QRFactorization<T, C>(AtA).solve(Atb);
+		}
+		else {
+			return QRFactorization<T, C>(A).solve(b);
+		}
 	}
 	enum class MatrixFactorization {
 		SVD, QR, LU
@@ -730,7 +1615,7 @@ namespace aly {
 		return ss;
 	}
 	template<class T, int C> Vector<T, C> Solve(const DenseMatrix<T, C>& A,
-		const Vector<T, C>& b, MatrixFactorization factor =
+		const ExpressionInput<Vector<T, C>>& b, MatrixFactorization factor =
 		MatrixFactorization::SVD) {
 		switch (factor) {
 		case MatrixFactorization::SVD:
@@ -742,7 +1627,7 @@ namespace aly {
 		}
 		return Vector<T, C>();
 	}
-	template<class T, int C> Vector<T, C> SolveRobust(const DenseMatrix<T, C>& A, const Vector<T, C>& b,
+	template<class T, int C> Vector<T, C> SolveRobust(const DenseMatrix<T, C>& A, const ExpressionInput<Vector<T, C>>& b,
 		int p = 1, int iterations = 100, double errorTolerance = 1E-6f,
 		double zeroTolerance = 1E-16, MatrixFactorization factor = MatrixFactorization::SVD) {
 		int N = (int)b.size();
@@ -771,7 +1656,7 @@ namespace aly {
 		}
 		return X;
 	}
-	template<class T, int C> Vector<T, C> SolveRansac(const DenseMatrix<T, C>& A, const Vector<T, C>& b,
+	template<class T, int C> Vector<T, C> SolveRansac(const DenseMatrix<T, C>& A, const ExpressionInput<Vector<T, C>>& b,
 		int sampleSize, double inlierTolerance = 0.01f, int iterations = 100) {
 		int N = (int)b.size();
 		DenseMatrix<T, C> As;
@@ -799,7 +1684,7 @@ namespace aly {
 			bs.resize(sampleSize);
 			for (int i = 0;i < sampleSize;i++) {
 				int idx = order[(i + offset)%N];
-				As[i] = A[idx];
+				As.setRow(i, A[idx]);
 				bs[i] = b[idx];
 			}
 			X = SolveQR(As, bs);
@@ -831,14 +1716,14 @@ namespace aly {
 				order.push_back(n);
 			}
 		}
-		if (order.size() < sampleSize) {
+		if ((int)order.size() < sampleSize) {
 			return BestX;
 		}
 		As.resize((int)order.size(), A.cols);
 		bs.resize((int)order.size());
-		for (int i = 0;i < order.size();i++) {
+		for (int i = 0;i < (int)order.size();i++) {
 			int idx = order[i];
-			As[i] = A[idx];
+			As.setRow(i, A[idx]);
 			bs[i] = b[idx];
 		}
 		X = SolveQR(As, bs);
@@ -0,0 +1,371 @@
+/*
+ * Copyright(C) 2015, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef INCLUDE_ALLOYEXPRESSION_H_
+#define INCLUDE_ALLOYEXPRESSION_H_
+#include "AlloyCommon.h"
+#include "AlloyMath.h"
+#include <type_traits>
+#include <stdexcept>
+#include <memory>
+/*
+ * Lazy element-wise arithmetic for Image, Volume and Vector.
+ *
+ * Arithmetic operators on these containers return lightweight expression
+ * objects instead of new containers. Nothing is computed until the expression
+ * is assigned to (or used to construct) a container, at which point the whole
+ * chain is evaluated in one parallel pass with no temporaries. For example,
+ * "out = a * s + b - c" reads a, b and c once and writes out once.
+ *
+ * Named operands are held by reference, so "auto e = a - b;" reads a and b
+ * when e is finally evaluated and must not outlive them. Temporary operands,
+ * such as function results, are moved (or, if const, copied) into the
+ * expression and owned by it.
+ * Function templates that take containers also take expressions, which are
+ * evaluated into a temporary container first (see ExpressionInput). Use
+ * eval() to do the same explicitly.
+ */
+namespace aly {
+/*
+ * Marks a container type (Image, Volume, Vector) as usable in expressions.
+ * Specialized next to each container.
+ */
+template<class R> struct IsExpressionContainer: public std::false_type {
+};
+struct ExpressionBase {
+};
+template<class E, class R> struct Expression: public ExpressionBase {
+	typedef R ContainerType;
+	typedef typename R::ValueType ValueType;
+	const E& derived() const {
+		return static_cast<const E&>(*this);
+	}
+	ValueType operator[](size_t i) const {
+		return derived()[i];
+	}
+	size_t size() const {
+		return derived().shape()->size();
+	}
+	R eval() const {
+		return R(*this);
+	}
+};
+template<class L, class S, class E, class R> std::basic_ostream<L, S> & operator <<(
+		std::basic_ostream<L, S> & ss, const Expression<E, R>& expr) {
+	return ss << expr.eval();
+}
+/*
+ * Shapes of two operands must agree. Containers with more than a length
+ * overload this to compare their full dimensions.
+ */
+template<class R> void CheckExpressionShape(const R& a, const R& b) {
+	if (a.size() != b.size())
+		throw std::runtime_error(
+				MakeString() << "Expression dimensions do not match. "
+						<< a.size() << "!=" << b.size());
+}
+template<class R> struct ExpressionTerminal: public Expression<
+		ExpressionTerminal<R>, R> {
+	typedef typename R::ValueType ValueType;
+	const R& ref;
+	ExpressionTerminal(const R& ref) :
+			ref(ref) {
+	}
+	inline const ValueType& operator[](size_t i) const {
+		return ref.data[i];
+	}
+	inline const R* shape() const {
+		return &ref;
+	}
+};
+/*
+ * Owns a temporary container operand, so an expression built from a
+ * function result stays valid after the statement that built it.
+ */
+template<class R> struct ExpressionTemporary: public Expression<
+		ExpressionTemporary<R>, R> {
+	typedef typename R::ValueType ValueType;
+	std::shared_ptr<const R> ref;
+	ExpressionTemporary(R&& value) :
+			ref(std::make_shared<R>(std::move(value))) {
+	}
+	ExpressionTemporary(const R& value) :
+			ref(std::make_shared<R>(value)) {
+	}
+	inline const ValueType& operator[](size_t i) const {
+		return ref->data[i];
+	}
+	inline const R* shape() const {
+		return ref.get();
+	}
+};
+template<class R> struct ExpressionScalar: public Expression<ExpressionScalar<R>,
+		R> {
+	typedef typename R::ValueType ValueType;
+	ValueType value;
+	ExpressionScalar(const ValueType& value) :
+			value(value) {
+	}
+	inline const ValueType& operator[](size_t i) const {
+		return value;
+	}
+	inline const R* shape() const {
+		return nullptr;
+	}
+};
+template<class Op, class L, class Rt, class R> struct BinaryExpression: public Expression<
+		BinaryExpression<Op, L, Rt, R>, R> {
+	typedef typename R::ValueType ValueType;
+	L left;
+	Rt right;
+	BinaryExpression(const L& left, const Rt& right) :
+			left(left), right(right) {
+		if (left.shape() != nullptr && right.shape() != nullptr) {
+			CheckExpressionShape(*left.shape(), *right.shape());
+		}
+	}
+	inline ValueType operator[](size_t i) const {
+		return Op::apply(left[i], right[i]);
+	}
+	inline const R* shape() const {
+		return (left.shape() != nullptr) ? left.shape() : right.shape();
+	}
+};
+template<class Op, class E, class R> struct UnaryExpression: public Expression<
+		UnaryExpression<Op, E, R>, R> {
+	typedef typename R::ValueType ValueType;
+	E arg;
+	UnaryExpression(const E& arg) :
+			arg(arg) {
+	}
+	inline ValueType operator[](size_t i) const {
+		return Op::apply(arg[i]);
+	}
+	inline const R* shape() const {
+		return arg.shape();
+	}
+};
+struct ExpressionAdd {
+	template<class V> static inline V apply(const V& a, const V& b) {
+		return a + b;
+	}
+};
+struct ExpressionSubtract {
+	template<class V> static inline V apply(const V& a, const V& b) {
+		return a - b;
+	}
+};
+struct ExpressionMultiply {
+	template<class V> static inline V apply(const V& a, const V& b) {
+		return a * b;
+	}
+};
+struct ExpressionDivide {
+	template<class V> static inline V apply(const V& a, const V& b) {
+		return a / b;
+	}
+};
+struct ExpressionNegate {
+	template<class V> static inline V apply(const V& a) {
+		return -a;
+	}
+};
+template<class X> struct IsExpressionOperand: public std::integral_constant<
+		bool,
+		IsExpressionContainer<typename std::decay<X>::type>::value
+				|| std::is_base_of<ExpressionBase, typename std::decay<X>::type>::value> {
+};
+template<class V> struct ExpressionScalarType {
+};
+template<class T, int C> struct ExpressionScalarType<vec<T, C>> {
+	typedef T type;
+};
+/*
+ * Maps an operand (container or expression, as deduced by a forwarding
+ * reference) to the node stored in the expression tree and to its container
+ * type. Named containers are referenced and temporaries are moved into the
+ * tree. Empty for anything else, which removes the operators below from
+ * overload resolution.
+ */
+template<class X, class Enable = void> struct ExpressionOperand {
+};
+template<class X> struct ExpressionOperand<X,
+		typename std::enable_if<
+				IsExpressionContainer<typename std::decay<X>::type>::value
+						&& std::is_lvalue_reference<X>::value>::type> {
+	typedef typename std::decay<X>::type ContainerType;
+	typedef ExpressionTerminal<ContainerType> NodeType;
+	typedef typename ContainerType::ValueType ValueType;
+	typedef typename ExpressionScalarType<ValueType>::type ScalarType;
+	static NodeType make(const ContainerType& x) {
+		return NodeType(x);
+	}
+};
+template<class X> struct ExpressionOperand<X,
+		typename std::enable_if<
+				IsExpressionContainer<typename std::decay<X>::type>::value
+						&& !std::is_lvalue_reference<X>::value>::type> {
+	typedef typename std::decay<X>::type ContainerType;
+	typedef ExpressionTemporary<ContainerType> NodeType;
+	typedef typename ContainerType::ValueType ValueType;
+	typedef typename ExpressionScalarType<ValueType>::type ScalarType;
+	static NodeType make(X&& x) {
+		return NodeType(std::forward<X>(x));
+	}
+};
+template<class X> struct ExpressionOperand<X,
+		typename std::enable_if<
+				std::is_base_of<ExpressionBase, typename std::decay<X>::type>::value>::type> {
+	typedef typename std::decay<X>::type NodeType;
+	typedef typename NodeType::ContainerType ContainerType;
+	typedef typename NodeType::ValueType ValueType;
+	typedef typename ExpressionScalarType<ValueType>::type ScalarType;
+	static const NodeType& make(const NodeType& x) {
+		return x;
+	}
+};
+template<class Op, class A, class B, class Enable = void> struct BinaryExpressionType {
+};
+template<class Op, class A, class B> struct BinaryExpressionType<Op, A, B,
+		typename std::enable_if<
+				IsExpressionOperand<A>::value && IsExpressionOperand<B>::value
+						&& std::is_same<
+								typename ExpressionOperand<A>::ContainerType,
+								typename ExpressionOperand<B>::ContainerType>::value>::type> {
+	typedef typename ExpressionOperand<A>::ContainerType ContainerType;
+	typedef BinaryExpression<Op, typename ExpressionOperand<A>::NodeType,
+			typename ExpressionOperand<B>::NodeType, ContainerType> type;
+};
+template<class Op, class A, class Enable = void> struct ScalarExpressionType {
+};
+template<class Op, class A> struct ScalarExpressionType<Op, A,
+		typename std::enable_if<IsExpressionOperand<A>::value>::type> {
+	typedef typename ExpressionOperand<A>::ContainerType ContainerType;
+	typedef BinaryExpression<Op, typename ExpressionOperand<A>::NodeType,
+			ExpressionScalar<ContainerType>, ContainerType> Right;
+	typedef BinaryExpression<Op, ExpressionScalar<ContainerType>,
+			typename ExpressionOperand<A>::NodeType, ContainerType> Left;
+};
+template<class Op, class A, class B> typename BinaryExpressionType<Op, A, B>::type MakeBinaryExpression(
+		A&& a, B&& b) {
+	return typename BinaryExpressionType<Op, A, B>::type(
+			ExpressionOperand<A>::make(std::forward<A>(a)),
+			ExpressionOperand<B>::make(std::forward<B>(b)));
+}
+template<class Op, class A> typename ScalarExpressionType<Op, A>::Right MakeScalarExpression(
+		A&& a, const typename ExpressionOperand<A>::ValueType& s) {
+	typedef typename ScalarExpressionType<Op, A>::ContainerType R;
+	return typename ScalarExpressionType<Op, A>::Right(
+			ExpressionOperand<A>::make(std::forward<A>(a)),
+			ExpressionScalar<R>(s));
+}
+template<class Op, class A> typename ScalarExpressionType<Op, A>::Left MakeScalarExpression(
+		const typename ExpressionOperand<A>::ValueType& s, A&& a) {
+	typedef typename ScalarExpressionType<Op, A>::ContainerType R;
+	return typename ScalarExpressionType<Op, A>::Left(ExpressionScalar<R>(s),
+			ExpressionOperand<A>::make(std::forward<A>(a)));
+}
+#define ALY_EXPRESSION_OPERATOR(OP, NAME) \
+template<class A, class B> typename BinaryExpressionType<NAME, A, B>::type operator OP( \
+		A&& a, B&& b) { \
+	return MakeBinaryExpression<NAME>(std::forward<A>(a), std::forward<B>(b)); \
+} \
+template<class A> typename ScalarExpressionType<NAME, A>::Right operator OP( \
+		A&& a, const typename ExpressionOperand<A>::ValueType& s) { \
+	return MakeScalarExpression<NAME, A>(std::forward<A>(a), s); \
+} \
+template<class A> typename ScalarExpressionType<NAME, A>::Left operator OP( \
+		const typename ExpressionOperand<A>::ValueType& s, A&& a) { \
+	return MakeScalarExpression<NAME, A>(s, std::forward<A>(a)); \
+} \
+template<class A> typename ScalarExpressionType<NAME, A>::Right operator OP( \
+		A&& a, const typename ExpressionOperand<A>::ScalarType& s) { \
+	return MakeScalarExpression<NAME, A>(std::forward<A>(a), \
+			typename ExpressionOperand<A>::ValueType(s)); \
+} \
+template<class A> typename ScalarExpressionType<NAME, A>::Left operator OP( \
+		const typename ExpressionOperand<A>::ScalarType& s, A&& a) { \
+	return MakeScalarExpression<NAME, A>( \
+			typename ExpressionOperand<A>::ValueType(s), std::forward<A>(a)); \
+}
+ALY_EXPRESSION_OPERATOR(+, ExpressionAdd)
+ALY_EXPRESSION_OPERATOR(-, ExpressionSubtract)
+ALY_EXPRESSION_OPERATOR(*, ExpressionMultiply)
+ALY_EXPRESSION_OPERATOR(/, ExpressionDivide)
+#undef ALY_EXPRESSION_OPERATOR
+template<class A> UnaryExpression<ExpressionNegate,
+		typename ExpressionOperand<A>::NodeType,
+		typename ExpressionOperand<A>::ContainerType> operator-(A&& a) {
+	return UnaryExpression<ExpressionNegate,
+			typename ExpressionOperand<A>::NodeType,
+			typename ExpressionOperand<A>::ContainerType>(
+			ExpressionOperand<A>::make(std::forward<A>(a)));
+}
+/*
+ * Writes an expression into a container in one parallel pass. The output
+ * may also appear as an operand since every element only reads its own
+ * index.
+ */
+template<class R, class E> void EvaluateExpression(R& out,
+		const Expression<E, R>& expr) {
+	const E& e = expr.derived();
+	typename R::ValueType* ptr = out.data.data();
+	ParallelFor(out.data.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			ptr[i] = e[i];
+		}
+	});
+}
+#define ALY_EXPRESSION_ASSIGN_OPERATOR(OP, NAME) \
+template<class R, class B> typename std::enable_if< \
+		IsExpressionContainer<R>::value \
+				&& std::is_same<R, typename ExpressionOperand<B>::ContainerType>::value, \
+		R&>::type operator OP(R& out, const B& b) { \
+	EvaluateExpression(out, MakeBinaryExpression<NAME>(out, b)); \
+	return out; \
+} \
+template<class R> typename std::enable_if<IsExpressionContainer<R>::value, R&>::type operator OP( \
+		R& out, const typename R::ValueType& s) { \
+	EvaluateExpression(out, MakeScalarExpression<NAME, R&>(out, s)); \
+	return out; \
+} \
+template<class R> typename std::enable_if<IsExpressionContainer<R>::value, R&>::type operator OP( \
+		R& out, const typename ExpressionOperand<R>::ScalarType& s) { \
+	EvaluateExpression(out, \
+			MakeScalarExpression<NAME, R&>(out, typename R::ValueType(s))); \
+	return out; \
+}
+ALY_EXPRESSION_ASSIGN_OPERATOR(+=, ExpressionAdd)
+ALY_EXPRESSION_ASSIGN_OPERATOR(-=, ExpressionSubtract)
+ALY_EXPRESSION_ASSIGN_OPERATOR(*=, ExpressionMultiply)
+ALY_EXPRESSION_ASSIGN_OPERATOR(/=, ExpressionDivide)
+#undef ALY_EXPRESSION_ASSIGN_OPERATOR
+/*
+ * Parameter type for read-only container arguments of function templates
+ * that deduce the container type from another argument (an output container
+ * or a matrix). It takes no part in deduction, so an expression argument
+ * converts implicitly to a temporary container.
+ */
+template<class R> struct ExpressionInputType {
+	typedef R type;
+};
+template<class R> using ExpressionInput = typename ExpressionInputType<R>::type;
+}
+#endif /* INCLUDE_ALLOYEXPRESSION_H_ */
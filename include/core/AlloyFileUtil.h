@@ -32,6 +32,7 @@
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <cstdint>
 #include "sha1.h"
 #include "sha2.h"
 #ifndef _CRT_SECURE_NO_WARNINGS
@@ -54,8 +55,10 @@ namespace aly {
 	enum class FileAttribute {
 		Compressed, Hidden
 	};
+	/* FAST64 and FAST128 are non-cryptographic (XXH64 based) and intended for
+	 * cache keys; the SHA variants are cryptographic. */
 	enum class HashMethod {
-		SHA1 = 1, SHA224 = 224, SHA256 = 256, SHA384 = 384, SHA512 = 512
+		SHA1 = 1, SHA224 = 224, SHA256 = 256, SHA384 = 384, SHA512 = 512, FAST64 = 64, FAST128 = 128
 	};
 	struct FileDescription {
 		std::string fileLocation;
@@ -89,7 +92,40 @@ namespace aly {
 				fd.fileLocation.end());
 		}
 	};
+	/* Read-only mapping of a file into the address space. Pages are faulted
+	 * in by the OS on first access, so opening even a multi-GB file is cheap. */
+	class MappedFile {
+	private:
+		const uint8_t* ptr;
+		size_t length;
+		bool opened;
+#ifdef ALY_WINDOWS
+		void* fileHandle;
+		void* mapHandle;
+#else
+		int fileHandle;
+#endif
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+	public:
+		MappedFile();
+		MappedFile(const std::string& file);
+		~MappedFile();
+		void open(const std::string& file);
+		void close();
+		bool isOpen() const {
+			return opened;
+		}
+		const uint8_t* data() const {
+			return ptr;
+		}
+		size_t size() const {
+			return length;
+		}
+	};
 	FileDescription GetFileDescription(const std::string& fileLocation);
+	//Last write time in nanoseconds since the epoch, at whatever resolution the file system keeps. Returns 0 if the file cannot be read.
+	int64_t GetFileModifiedTimeNanos(const std::string& fileLocation);
 	std::string GetFileExtension(const std::string& fileName);
 	std::string GetFileWithoutExtension(const std::string& file);
 	std::string GetFileNameWithoutExtension(const std::string& file);
@@ -133,7 +169,7 @@ namespace aly {
 		return (isalnum(c) || (c == '+') || (c == '-'));
 	}
 
-	template<class T> std::string EncodeBase64(const std::vector<T>& in, bool pad =
+	template<class T, class A> std::string EncodeBase64(const std::vector<T, A>& in, bool pad =
 		true) {
 		int i = 0;
 		int j = 0;
@@ -181,40 +217,73 @@ namespace aly {
 		}
 		return bufferOut.str();
 	}
-	template<class T> std::string HashCode(std::vector<T> data, HashMethod method =
-		HashMethod::SHA256) {
-		std::string str = EncodeBase64(data);
-		std::vector<unsigned char> hashOut;
-		std::string hashCode = "";
-		switch (method) {
-		case HashMethod::SHA1:
-			hashCode = sha1(str);
-			break;
-		case HashMethod::SHA224:
-			hashOut.resize(SHA224_DIGEST_SIZE);
-			sha224((unsigned char *)str.c_str(), str.size(), hashOut.data());
-			hashCode = EncodeBase64(hashOut, false);
-			break;
-		case HashMethod::SHA256:
-			hashOut.resize(SHA256_DIGEST_SIZE);
-			sha256((unsigned char *)str.c_str(), str.size(), hashOut.data());
-			hashCode = EncodeBase64(hashOut, false);
-			break;
-		case HashMethod::SHA384:
-			hashOut.resize(SHA384_DIGEST_SIZE);
-			sha384((unsigned char *)str.c_str(), str.size(), hashOut.data());
-			hashCode = EncodeBase64(hashOut, false);
-			break;
-		case HashMethod::SHA512:
-			hashOut.resize(SHA512_DIGEST_SIZE);
-			sha512((unsigned char *)str.c_str(), str.size(), hashOut.data());
-			hashCode = EncodeBase64(hashOut, false);
-			break;
+	/*
+	 * Non-cryptographic 64-bit streaming hash (XXH64 algorithm).
+	 */
+	class FastHash64 {
+	private:
+		uint64_t seed;
+		uint64_t v[4];
+		uint64_t totalLength;
+		uint8_t buffer[32];
+		size_t bufferSize;
+	public:
+		FastHash64(uint64_t seed = 0);
+		void reset();
+		void update(const void* data, size_t bytes);
+		uint64_t digest() const;
+	};
+	uint64_t Hash64(const void* data, size_t bytes, uint64_t seed = 0);
+	/*
+	 * Incremental hash over raw bytes. Data is consumed in place, so hashing
+	 * a buffer never copies or re-encodes it. FAST128 runs two independently
+	 * seeded 64-bit streams side by side.
+	 */
+	class Hasher {
+	private:
+		HashMethod method;
+		SHA1 sha1Context;
+		sha256_ctx sha256Context; //also used for SHA224
+		sha512_ctx sha512Context; //also used for SHA384
+		FastHash64 fastContext[2];
+	public:
+		Hasher(HashMethod method = HashMethod::SHA256);
+		void reset();
+		void update(const void* data, size_t bytes);
+		template<class T, class A> void update(const std::vector<T, A>& data) {
+			update(data.data(), data.size() * sizeof(T));
+		}
+		void update(const std::string& str) {
+			update(str.data(), str.size());
 		}
-		return hashCode;
+		std::vector<uint8_t> digest();
+		/* Finalizes and formats the digest the same way HashCode() does. */
+		std::string finish();
+		HashMethod getMethod() const {
+			return method;
+		}
+	};
+	std::string HashCode(const void* data, size_t bytes, HashMethod method =
+		HashMethod::SHA256);
+	template<class T, class A> std::string HashCode(const std::vector<T, A>& data, HashMethod method =
+		HashMethod::SHA256) {
+		return HashCode(data.data(), data.size() * sizeof(T), method);
+	}
+	/*
+	 * Tree hash for large buffers. The data is cut into fixed size tiles that
+	 * are hashed in parallel, then the concatenated tile digests are hashed
+	 * again. The result depends on tileSize but not on the thread count, and
+	 * buffers that fit in one tile hash exactly like HashCode().
+	 */
+	static const size_t DEFAULT_HASH_TILE_SIZE = size_t(1) << 22;
+	std::string TreeHashCode(const void* data, size_t bytes, HashMethod method =
+		HashMethod::SHA256, size_t tileSize = DEFAULT_HASH_TILE_SIZE);
+	template<class T, class A> std::string TreeHashCode(const std::vector<T, A>& data, HashMethod method =
+		HashMethod::SHA256, size_t tileSize = DEFAULT_HASH_TILE_SIZE) {
+		return TreeHashCode(data.data(), data.size() * sizeof(T), method, tileSize);
 	}
-	template<class T> void DecodeBase64(const std::string& encoded_string,
-		std::vector<T>& out) {
+	template<class T, class A> void DecodeBase64(const std::string& encoded_string,
+		std::vector<T, A>& out) {
 		static const std::string base64_chars =
 			"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-";
 		size_t in_len = encoded_string.size();
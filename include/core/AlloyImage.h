@@ -24,11 +24,14 @@
 #include "AlloyMath.h"
 #include "sha2.h"
 #include "AlloyFileUtil.h"
+#include "AlloyExpression.h"
+#include "AlloyAllocator.h"
 #include "cereal/types/vector.hpp"
 #include <vector>
 #include <functional>
 #include <fstream>
 #include <random>
+#include <memory>
 namespace aly {
 bool SANITY_CHECK_IMAGE();
 bool SANITY_CHECK_IMAGE_IO();
@@ -65,19 +68,110 @@ template<class L, class R> std::basic_ostream<L, R>& operator <<(
 	}
 	return ss;
 }
+/* Channel ordering of raw pixel data. Planar stores each channel as one
+ * contiguous block (the MIPAV convention), Interleaved stores pixels exactly
+ * as they are laid out in memory and can therefore be memory-mapped. */
+enum class RawLayout {
+	Planar = 0, Interleaved = 1
+};
+struct RawHeader {
+	ImageType type;
+	std::vector<int> extents;
+	size_t offset;
+	bool littleEndian;
+	RawLayout layout;
+	std::string dataFile;
+	RawHeader() :
+			type(ImageType::UBYTE), offset(0), littleEndian(true), layout(
+					RawLayout::Planar) {
+	}
+};
+RawHeader ReadRawHeader(const std::string& file);
+void WriteRawHeader(const std::string& file, const RawHeader& header);
+bool IsLittleEndian();
+template<class T> void SwapRawBytes(T* data, size_t count) {
+	for (size_t n = 0; n < count; n++) {
+		uint8_t* bytes = reinterpret_cast<uint8_t*>(data + n);
+		std::reverse(bytes, bytes + sizeof(T));
+	}
+}
+/* Bulk transfer of pixel data between memory and a raw file. Planar data is
+ * staged through a bounded scratch buffer, one fwrite/fread per chunk. */
+template<class T, int C> void WriteRawData(FILE* f, const vec<T, C>* data,
+		size_t count, RawLayout layout) {
+	static_assert(sizeof(vec<T, C>) == sizeof(T) * C, "vec must be tightly packed.");
+	if (layout == RawLayout::Interleaved || C == 1) {
+		if (fwrite(data, sizeof(vec<T, C>), count, f) != count) {
+			throw std::runtime_error("Could not write raw data.");
+		}
+		return;
+	}
+	const size_t chunkSize = std::min(count, (size_t) (1 << 20));
+	std::vector<T> buffer(chunkSize);
+	for (int c = 0; c < C; c++) {
+		for (size_t start = 0; start < count; start += chunkSize) {
+			size_t len = std::min(chunkSize, count - start);
+			for (size_t n = 0; n < len; n++) {
+				buffer[n] = data[start + n][c];
+			}
+			if (fwrite(buffer.data(), sizeof(T), len, f) != len) {
+				throw std::runtime_error("Could not write raw data.");
+			}
+		}
+	}
+}
+template<class T, int C> void ReadRawData(FILE* f, vec<T, C>* data,
+		size_t count, RawLayout layout, bool swapBytes) {
+	static_assert(sizeof(vec<T, C>) == sizeof(T) * C, "vec must be tightly packed.");
+	if (layout == RawLayout::Interleaved || C == 1) {
+		if (fread(data, sizeof(vec<T, C>), count, f) != count) {
+			throw std::runtime_error("Unexpected end of raw data.");
+		}
+		if (swapBytes) {
+			SwapRawBytes(reinterpret_cast<T*>(data), count * C);
+		}
+		return;
+	}
+	const size_t chunkSize = std::min(count, (size_t) (1 << 20));
+	std::vector<T> buffer(chunkSize);
+	for (int c = 0; c < C; c++) {
+		for (size_t start = 0; start < count; start += chunkSize) {
+			size_t len = std::min(chunkSize, count - start);
+			if (fread(buffer.data(), sizeof(T), len, f) != len) {
+				throw std::runtime_error("Unexpected end of raw data.");
+			}
+			if (swapBytes) {
+				SwapRawBytes(buffer.data(), len);
+			}
+			for (size_t n = 0; n < len; n++) {
+				data[start + n][c] = buffer[n];
+			}
+		}
+	}
+}
+/* Checks that a header describes data of the requested type and that the
+ * raw file is large enough to hold count pixels of the given channel count. */
+void ValidateRawHeader(const RawHeader& header, ImageType type, int channels,
+		size_t count, size_t scalarSize);
+/* Validates the header, then opens the raw file positioned at its first sample. */
+FILE* OpenRawData(const RawHeader& header, ImageType type, int channels,
+		size_t count, size_t scalarSize);
 template<class T, int C, ImageType I> struct Image;
+template<class T, int C, ImageType I> struct ImageView;
+template<class T, int C, ImageType I> struct ConstImageView;
 template<class T, int C, ImageType I> void WriteImageToRawFile(
-		const std::string& fileName, const Image<T, C, I>& img);
+		const std::string& fileName, const Image<T, C, I>& img,
+		RawLayout layout = RawLayout::Planar);
 template<class T, int C, ImageType I> struct Image {
 protected:
 	int x, y;
 	std::string hashCode;
 public:
-	std::vector<vec<T, C>> data;
+	aligned_vector<vec<T, C>> data;
 	typedef vec<T, C> ValueType;
-	typedef typename std::vector<ValueType>::iterator iterator;
-	typedef typename std::vector<ValueType>::const_iterator const_iterator;
-	typedef typename std::vector<ValueType>::reverse_iterator reverse_iterator;
+	typedef typename aligned_vector<ValueType>::iterator iterator;
+	typedef typename aligned_vector<ValueType>::const_iterator const_iterator;
+	typedef typename aligned_vector<ValueType>::reverse_iterator reverse_iterator;
 	iterator begin() {
 		return data.begin();
 	}
@@ -140,6 +234,9 @@ public:
 		}
 	}
 	void set(const std::vector<vec<T, C>>& val) {
+		data.assign(val.begin(), val.end());
+	}
+	void set(const aligned_vector<vec<T, C>>& val) {
 		data = val;
 	}
 	void set(vec<T, C>* val) {
@@ -183,7 +280,7 @@ public:
 	}
 	Image(std::vector<vec<T, C>>& ref, int w, int h, int x = 0, int y = 0,
 		uint64_t id = 0) :
-		x(x), y(y), data(ref), width(w), height(h), id(id), channels(C), type(
+		x(x), y(y), data(ref.begin(), ref.end()), width(w), height(h), id(id), channels(C), type(
 			I) {
 	}
 	Image() :
@@ -193,6 +290,12 @@ public:
 		Image(img.width, img.height, img.x, img.y, img.id) {
 		set(img.data);
 	}
+	Image(Image<T, C, I>&& img) :
+		x(img.x), y(img.y), data(std::move(img.data)), width(img.width), height(
+			img.height), id(img.id), channels(C), type(I) {
+		img.width = 0;
+		img.height = 0;
+	}
 
 	Image<T, C, I>& operator=(const Image<T, C, I>& rhs) {
 		if (this == &rhs)
@@ -204,6 +307,34 @@ public:
 		this->set(rhs.data);
 		return *this;
 	}
+	Image<T, C, I>& operator=(Image<T, C, I>&& rhs) {
+		if (this == &rhs)
+			return *this;
+		data = std::move(rhs.data);
+		rhs.data.clear();
+		this->width = rhs.width;
+		this->height = rhs.height;
+		this->x = rhs.x;
+		this->y = rhs.y;
+		this->id = rhs.id;
+		rhs.width = 0;
+		rhs.height = 0;
+		return *this;
+	}
+	template<class E> Image(const Expression<E, Image<T, C, I>>& expr) :
+			Image() {
+		*this = expr;
+	}
+	template<class E> Image<T, C, I>& operator=(
+			const Expression<E, Image<T, C, I>>& expr) {
+		const Image<T, C, I>* shape = expr.derived().shape();
+		if (shape != this) {
+			this->resize(shape->width, shape->height);
+			this->setPosition(shape->position());
+		}
+		EvaluateExpression(*this, expr);
+		return *this;
+	}
 	int2 dimensions() const {
 		return int2(width, height);
 	}
@@ -256,6 +387,10 @@ public:
 			return nullptr;
 		return &(data.front()[0]);
 	}
+	ImageView<T, C, I> view();
+	ImageView<T, C, I> view(const int2& pos, const int2& dims);
+	ConstImageView<T, C, I> view() const;
+	ConstImageView<T, C, I> view(const int2& pos, const int2& dims) const;
 	void setZero() {
 		data.assign(data.size(), vec<T, C>((T)0));
 	}
@@ -556,7 +691,7 @@ public:
 template<class T, int C, ImageType I> std::string Image<T, C, I>::updateHashCode(
 		size_t MAX_SAMPLES, HashMethod method) {
 	if (MAX_SAMPLES == 0) {
-		hashCode = HashCode(data, method);
+		hashCode = TreeHashCode(data, method);
 	} else {
 		const size_t seed = 83128921L;
 		std::mt19937 mt(seed);
@@ -570,6 +705,179 @@ template<class T, int C, ImageType I> std::string Image<T, C, I>::updateHashCode
 	}
 	return hashCode;
 }
+/*
+ * Non-owning window onto pixel memory described by an origin, dimensions and
+ * a row stride in pixels. A view can wrap a whole Image, a sub-rectangle of
+ * one, or external memory, so regions of interest are processed in place
+ * without allocation or copies. Views have pointer semantics: copying a view
+ * never copies pixels and the viewed memory must outlive it.
+ */
+template<class T, int C, ImageType I> struct ImageView {
+	vec<T, C>* data;
+	int width;
+	int height;
+	size_t stride;
+	typedef vec<T, C> ValueType;
+	ImageView() :
+			data(nullptr), width(0), height(0), stride(0) {
+	}
+	ImageView(vec<T, C>* ptr, int w, int h, size_t rowStride = 0) :
+			data(ptr), width(w), height(h), stride(
+					(rowStride == 0) ? (size_t) w : rowStride) {
+	}
+	ImageView(T* ptr, int w, int h, size_t rowStride = 0) :
+			ImageView(reinterpret_cast<vec<T, C>*>(ptr), w, h, rowStride) {
+	}
+	ImageView(Image<T, C, I>& img) :
+			ImageView(img.vecPtr(), img.width, img.height) {
+	}
+	ImageView(Image<T, C, I>& img, const int2& pos, const int2& dims) :
+			ImageView(ImageView(img).subView(pos, dims)) {
+	}
+	ImageView subView(const int2& pos, const int2& dims) const {
+		if (pos.x < 0 || pos.y < 0 || dims.x < 0 || dims.y < 0
+				|| pos.x + dims.x > width || pos.y + dims.y > height)
+			throw std::runtime_error(
+					MakeString() << "Sub-view " << pos << " " << dims
+							<< " exceeds view dimensions " << dimensions());
+		return ImageView(data + pos.x + pos.y * stride, dims.x, dims.y,
+				stride);
+	}
+	int2 dimensions() const {
+		return int2(width, height);
+	}
+	size_t size() const {
+		return (size_t) width * height;
+	}
+	bool isContiguous() const {
+		return (stride == (size_t) width || height <= 1);
+	}
+	/* Views cannot be resized; this only checks that dimensions agree so
+	 * views can stand in for output images. */
+	void resize(int w, int h) const {
+		if (w != width || h != height)
+			throw std::runtime_error(
+					MakeString() << "Cannot resize image view "
+							<< dimensions() << " to " << int2(w, h));
+	}
+	vec<T, C>* row(int j) const {
+		return data + j * stride;
+	}
+	vec<T, C>& operator()(int i, int j) const {
+		return data[clamp(i, 0, width - 1) + clamp(j, 0, height - 1) * stride];
+	}
+	vec<T, C>& operator()(const int2& ij) const {
+		return operator()(ij.x, ij.y);
+	}
+	void set(const vec<T, C>& val) const {
+#pragma omp parallel for
+		for (int j = 0; j < height; j++) {
+			std::fill(row(j), row(j) + width, val);
+		}
+	}
+	void set(const ConstImageView<T, C, I>& other) const {
+		resize(other.width, other.height);
+#pragma omp parallel for
+		for (int j = 0; j < height; j++) {
+			std::copy(other.row(j), other.row(j) + width, row(j));
+		}
+	}
+	void copyTo(Image<T, C, I>& out) const {
+		out.resize(width, height);
+		ImageView(out).set(*this);
+	}
+};
+/*
+ * Read-only counterpart of ImageView, used for views of const images and for
+ * the input side of view-based operations. Any ImageView converts to one.
+ */
+template<class T, int C, ImageType I> struct ConstImageView {
+	const vec<T, C>* data;
+	int width;
+	int height;
+	size_t stride;
+	typedef vec<T, C> ValueType;
+	ConstImageView() :
+			data(nullptr), width(0), height(0), stride(0) {
+	}
+	ConstImageView(const vec<T, C>* ptr, int w, int h, size_t rowStride = 0) :
+			data(ptr), width(w), height(h), stride(
+					(rowStride == 0) ? (size_t) w : rowStride) {
+	}
+	ConstImageView(const T* ptr, int w, int h, size_t rowStride = 0) :
+			ConstImageView(reinterpret_cast<const vec<T, C>*>(ptr), w, h,
+					rowStride) {
+	}
+	ConstImageView(const Image<T, C, I>& img) :
+			ConstImageView(img.vecPtr(), img.width, img.height) {
+	}
+	ConstImageView(const ImageView<T, C, I>& view) :
+			ConstImageView(view.data, view.width, view.height, view.stride) {
+	}
+	ConstImageView(const Image<T, C, I>& img, const int2& pos, const int2& dims) :
+			ConstImageView(ConstImageView(img).subView(pos, dims)) {
+	}
+	ConstImageView subView(const int2& pos, const int2& dims) const {
+		if (pos.x < 0 || pos.y < 0 || dims.x < 0 || dims.y < 0
+				|| pos.x + dims.x > width || pos.y + dims.y > height)
+			throw std::runtime_error(
+					MakeString() << "Sub-view " << pos << " " << dims
+							<< " exceeds view dimensions " << dimensions());
+		return ConstImageView(data + pos.x + pos.y * stride, dims.x, dims.y,
+				stride);
+	}
+	int2 dimensions() const {
+		return int2(width, height);
+	}
+	size_t size() const {
+		return (size_t) width * height;
+	}
+	bool isContiguous() const {
+		return (stride == (size_t) width || height <= 1);
+	}
+	const vec<T, C>* row(int j) const {
+		return data + j * stride;
+	}
+	const vec<T, C>& operator()(int i, int j) const {
+		return data[clamp(i, 0, width - 1) + clamp(j, 0, height - 1) * stride];
+	}
+	const vec<T, C>& operator()(const int2& ij) const {
+		return operator()(ij.x, ij.y);
+	}
+	void copyTo(Image<T, C, I>& out) const {
+		out.resize(width, height);
+		ImageView<T, C, I>(out).set(*this);
+	}
+};
+template<class T, int C, ImageType I> ImageView<T, C, I> Image<T, C, I>::view() {
+	return ImageView<T, C, I>(*this);
+}
+template<class T, int C, ImageType I> ImageView<T, C, I> Image<T, C, I>::view(
+		const int2& pos, const int2& dims) {
+	return ImageView<T, C, I>(*this, pos, dims);
+}
+template<class T, int C, ImageType I> ConstImageView<T, C, I> Image<T, C, I>::view() const {
+	return ConstImageView<T, C, I>(*this);
+}
+template<class T, int C, ImageType I> ConstImageView<T, C, I> Image<T, C, I>::view(
+		const int2& pos, const int2& dims) const {
+	return ConstImageView<T, C, I>(*this, pos, dims);
+}
+template<class T, class L, class R, int C, ImageType I> std::basic_ostream<L, R> & operator <<(
+		std::basic_ostream<L, R> & ss, const ImageView<T, C, I> & A) {
+	ss << "Image View: Dimensions: [" << A.width << "," << A.height
+			<< "] Stride: " << A.stride;
+	return ss;
+}
+/* Splits the rows of a view into blocks of roughly grainSize pixels. */
+template<class T, int C, ImageType I, class F> void ParallelForRows(
+		const ImageView<T, C, I>& view, F func, size_t grainSize = 0) {
+	if (grainSize == 0) {
+		grainSize = DEFAULT_GRAIN_SIZE;
+	}
+	size_t rows = std::max((size_t) 1, grainSize / std::max(view.width, 1));
+	ParallelFor((size_t) view.height, func, rows);
+}
 template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
 		Image<T, C, I>& im2,
 		const std::function<void(vec<T, C>&, vec<T, C>&)>& func) {
@@ -592,7 +900,7 @@ template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
 	}
 }
 template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
-		const Image<T, C, I>& im2,
+		const ExpressionInput<Image<T, C, I>>& im2,
 		const std::function<void(vec<T, C>&, const vec<T, C>&)>& func) {
 	if (im1.dimensions() != im2.dimensions())
 		throw std::runtime_error(
@@ -605,7 +913,7 @@ template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
 	}
 }
 template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
-		const Image<T, C, I>& im2, const Image<T, C, I>& im3,
+		const ExpressionInput<Image<T, C, I>>& im2, const ExpressionInput<Image<T, C, I>>& im3,
 		const std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)>& func) {
 	if (im1.dimensions() != im2.dimensions())
 		throw std::runtime_error(
@@ -618,8 +926,8 @@ template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
 	}
 }
 template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
-		const Image<T, C, I>& im2, const Image<T, C, I>& im3,
-		const Image<T, C, I>& im4,
+		const ExpressionInput<Image<T, C, I>>& im2, const ExpressionInput<Image<T, C, I>>& im3,
+		const ExpressionInput<Image<T, C, I>>& im4,
 		const std::function<
 				void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&,
 						const vec<T, C>&)>& func) {
@@ -663,265 +971,374 @@ template<class T, int C, ImageType I> void Transform(Image<T, C, I>& im1,
 		func(offset, im1.data[offset], im2.data[offset]);
 	}
 }
-template<class T, class L, class R, int C, ImageType I> std::basic_ostream<L, R> & operator <<(
-		std::basic_ostream<L, R> & ss, const Image<T, C, I> & A) {
-	ss << "Image (" << A.getTypeName() << "): " << A.id << " Position: "
-			<< A.position() << " Dimensions: [" << A.width << "," << A.height
-			<< "]";
-	return ss;
-}
-template<class T, int C, ImageType I> Image<T, C, I> operator+(
-		const vec<T, C>& scalar, const Image<T, C, I>& img) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=scalar+val2;};
-	Transform(out, img, f);
-	return out;
-}
-
-template<class T, int C, ImageType I> Image<T, C, I> operator-(
-		const vec<T, C>& scalar, const Image<T, C, I>& img) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=scalar-val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C, ImageType I> Image<T, C, I> operator*(
-		const vec<T, C>& scalar, const Image<T, C, I>& img) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=scalar*val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C, ImageType I> Image<T, C, I> operator/(
-		const vec<T, C>& scalar, const Image<T, C, I>& img) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=scalar/val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C, ImageType I> Image<T, C, I> operator+(
-		const Image<T, C, I>& img, const vec<T, C>& scalar) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=val2+scalar;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C, ImageType I> Image<T, C, I> operator-(
-		const Image<T, C, I>& img, const vec<T, C>& scalar) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=val2-scalar;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C, ImageType I> Image<T, C, I> operator*(
-		const Image<T, C, I>& img, const vec<T, C>& scalar) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=val2*scalar;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C, ImageType I> Image<T, C, I> operator/(
-		const Image<T, C, I>& img, const vec<T, C>& scalar) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=val2/scalar;};
-	Transform(out, img, f);
-	return out;
+/*
+ * Functor versions of Transform. The functor type is a template parameter so
+ * the per-pixel call is inlined into the loop instead of going through
+ * std::function. Work is split into blocks of grainSize pixels.
+ */
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&>::value>::type Transform(Image<T, C, I>& im1,
+		F func, size_t grainSize = 0) {
+	vec<T, C>* out = im1.vecPtr();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset]);
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator-(
-		const Image<T, C, I>& img) {
-	Image<T, C, I> out(img.width, img.height, img.position());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1=-val2;};
-	Transform(out, img, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Image<T, C, I>& im1, Image<T, C, I>& im2, F func, size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions());
+	vec<T, C>* out = im1.vecPtr();
+	vec<T, C>* in1 = im2.vecPtr();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset]);
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator+=(
-		Image<T, C, I>& out, const Image<T, C, I>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1+=val2;};
-	Transform(out, img, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		Image<T, C, I>& im1, const ExpressionInput<Image<T, C, I>>& im2, F func,
+		size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions());
+	vec<T, C>* out = im1.vecPtr();
+	const vec<T, C>* in1 = im2.vecPtr();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset]);
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator-=(
-		Image<T, C, I>& out, const Image<T, C, I>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1-=val2;};
-	Transform(out, img, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		Image<T, C, I>& im1, const ExpressionInput<Image<T, C, I>>& im2,
+		const ExpressionInput<Image<T, C, I>>& im3, F func, size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions()
+			|| im1.dimensions() != im3.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions()
+						<< "!=" << im3.dimensions());
+	vec<T, C>* out = im1.vecPtr();
+	const vec<T, C>* in1 = im2.vecPtr();
+	const vec<T, C>* in2 = im3.vecPtr();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset], in2[offset]);
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator*=(
-		Image<T, C, I>& out, const Image<T, C, I>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1*=val2;};
-	Transform(out, img, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&, const vec<T, C>&,
+				const vec<T, C>&>::value>::type Transform(Image<T, C, I>& im1,
+		const ExpressionInput<Image<T, C, I>>& im2, const ExpressionInput<Image<T, C, I>>& im3,
+		const ExpressionInput<Image<T, C, I>>& im4, F func, size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions()
+			|| im1.dimensions() != im3.dimensions()
+			|| im1.dimensions() != im4.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions()
+						<< "!=" << im3.dimensions() << "!="
+						<< im4.dimensions());
+	vec<T, C>* out = im1.vecPtr();
+	const vec<T, C>* in1 = im2.vecPtr();
+	const vec<T, C>* in2 = im3.vecPtr();
+	const vec<T, C>* in3 = im4.vecPtr();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset], in2[offset], in3[offset]);
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator/=(
-		Image<T, C, I>& out, const Image<T, C, I>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2) {val1/=val2;};
-	Transform(out, img, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, int, int, vec<T, C>&>::value>::type Transform(
+		Image<T, C, I>& im1, F func, size_t grainSize = 0) {
+	vec<T, C>* out = im1.vecPtr();
+	const int width = im1.width;
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		int i = (int) (begin % width);
+		int j = (int) (begin / width);
+		for (size_t offset = begin; offset < end; offset++) {
+			func(i, j, out[offset]);
+			if (++i == width) {
+				i = 0;
+				j++;
+			}
+		}
+	}, grainSize);
 }
-
-template<class T, int C, ImageType I> Image<T, C, I> operator+=(
-		Image<T, C, I>& out, const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T,C>& val1) {val1+=scalar;};
-	Transform(out, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, int, int, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Image<T, C, I>& im1, Image<T, C, I>& im2, F func, size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions());
+	vec<T, C>* out = im1.vecPtr();
+	vec<T, C>* in1 = im2.vecPtr();
+	const int width = im1.width;
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		int i = (int) (begin % width);
+		int j = (int) (begin / width);
+		for (size_t offset = begin; offset < end; offset++) {
+			func(i, j, out[offset], in1[offset]);
+			if (++i == width) {
+				i = 0;
+				j++;
+			}
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator-=(
-		Image<T, C, I>& out, const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T,C>& val1) {val1-=scalar;};
-	Transform(out, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, size_t, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Image<T, C, I>& im1, Image<T, C, I>& im2, F func, size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions());
+	vec<T, C>* out = im1.vecPtr();
+	vec<T, C>* in1 = im2.vecPtr();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(offset, out[offset], in1[offset]);
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator*=(
-		Image<T, C, I>& out, const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T,C>& val1) {val1*=scalar;};
-	Transform(out, f);
-	return out;
+/*
+ * Transform over views. Rows are processed in blocks, so strided sub-regions
+ * are updated in place.
+ */
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&>::value>::type Transform(
+		const ImageView<T, C, I>& im1, F func, size_t grainSize = 0) {
+	ParallelForRows(im1, [&](size_t begin, size_t end) {
+		for (size_t j = begin; j < end; j++) {
+			vec<T, C>* out = im1.row((int) j);
+			for (int i = 0; i < im1.width; i++) {
+				func(out[i]);
+			}
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator/=(
-		Image<T, C, I>& out, const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T,C>& val1) {val1/=scalar;};
-	Transform(out, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		const ImageView<T, C, I>& im1,
+		const ExpressionInput<ConstImageView<T, C, I>>& im2, F func,
+		size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions());
+	ParallelForRows(im1, [&](size_t begin, size_t end) {
+		for (size_t j = begin; j < end; j++) {
+			vec<T, C>* out = im1.row((int) j);
+			const vec<T, C>* in1 = im2.row((int) j);
+			for (int i = 0; i < im1.width; i++) {
+				func(out[i], in1[i]);
+			}
+		}
+	}, grainSize);
 }
-
-template<class T, int C, ImageType I> Image<T, C, I> operator+(
-		const Image<T, C, I>& img1, const Image<T, C, I>& img2) {
-	Image<T, C, I> out(img1.width, img1.height);
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2,const vec<T,C>& val3) {val1=val2+val3;};
-	Transform(out, img1, img2, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		const ImageView<T, C, I>& im1,
+		const ExpressionInput<ConstImageView<T, C, I>>& im2,
+		const ExpressionInput<ConstImageView<T, C, I>>& im3, F func,
+		size_t grainSize = 0) {
+	if (im1.dimensions() != im2.dimensions()
+			|| im1.dimensions() != im3.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< im1.dimensions() << "!=" << im2.dimensions()
+						<< "!=" << im3.dimensions());
+	ParallelForRows(im1, [&](size_t begin, size_t end) {
+		for (size_t j = begin; j < end; j++) {
+			vec<T, C>* out = im1.row((int) j);
+			const vec<T, C>* in1 = im2.row((int) j);
+			const vec<T, C>* in2 = im3.row((int) j);
+			for (int i = 0; i < im1.width; i++) {
+				func(out[i], in1[i], in2[i]);
+			}
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator-(
-		const Image<T, C, I>& img1, const Image<T, C, I>& img2) {
-	Image<T, C, I> out(img1.width, img1.height);
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2,const vec<T,C>& val3) {val1=val2-val3;};
-	Transform(out, img1, img2, f);
-	return out;
+template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, int, int, vec<T, C>&>::value>::type Transform(
+		const ImageView<T, C, I>& im1, F func, size_t grainSize = 0) {
+	ParallelForRows(im1, [&](size_t begin, size_t end) {
+		for (size_t j = begin; j < end; j++) {
+			vec<T, C>* out = im1.row((int) j);
+			for (int i = 0; i < im1.width; i++) {
+				func(i, (int) j, out[i]);
+			}
+		}
+	}, grainSize);
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator*(
-		const Image<T, C, I>& img1, const Image<T, C, I>& img2) {
-	Image<T, C, I> out(img1.width, img1.height);
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2,const vec<T,C>& val3) {val1=val2*val3;};
-	Transform(out, img1, img2, f);
-	return out;
+template<class T, class L, class R, int C, ImageType I> std::basic_ostream<L, R> & operator <<(
+		std::basic_ostream<L, R> & ss, const Image<T, C, I> & A) {
+	ss << "Image (" << A.getTypeName() << "): " << A.id << " Position: "
+			<< A.position() << " Dimensions: [" << A.width << "," << A.height
+			<< "]";
+	return ss;
 }
-template<class T, int C, ImageType I> Image<T, C, I> operator/(
-		const Image<T, C, I>& img1, const Image<T, C, I>& img2) {
-	Image<T, C, I> out(img1.width, img1.height);
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T,C>& val1,const vec<T,C>& val2,const vec<T,C>& val3) {val1=val2/val3;};
-	Transform(out, img1, img2, f);
-	return out;
+template<class T, int C, ImageType I> struct IsExpressionContainer<
+		Image<T, C, I>> : public std::true_type {
+};
+template<class T, int C, ImageType I> void CheckExpressionShape(
+		const Image<T, C, I>& a, const Image<T, C, I>& b) {
+	if (a.dimensions() != b.dimensions())
+		throw std::runtime_error(
+				MakeString() << "Image dimensions do not match. "
+						<< a.dimensions() << "!=" << b.dimensions());
 }
 template<class T, int C, ImageType I> void WriteImageToRawFile(
-		const std::string& file, const Image<T, C, I>& img) {
-	std::ostringstream vstr;
+		const std::string& file, const Image<T, C, I>& img, RawLayout layout) {
 	std::string fileName = GetFileWithoutExtension(file);
-	vstr << fileName << ".raw";
-	FILE* f = fopen(vstr.str().c_str(), "wb");
+	RawHeader header;
+	header.type = I;
+	header.extents = {img.width, img.height, img.channels};
+	header.littleEndian = IsLittleEndian();
+	header.layout = layout;
+	header.dataFile = fileName + ".raw";
+	FILE* f = fopen(header.dataFile.c_str(), "wb");
 	if (f == NULL) {
 		throw std::runtime_error(
-				MakeString() << "Could not open " << vstr.str().c_str()
+				MakeString() << "Could not open " << header.dataFile
 						<< " for writing.");
 	}
-	for (int c = 0; c < img.channels; c++) {
-		for (int j = 0; j < img.height; j++) {
-			for (int i = 0; i < img.width; i++) {
-				T val = img(i, j)[c];
-				fwrite(&val, sizeof(T), 1, f);
-			}
-		}
+	try {
+		WriteRawData(f, img.data.data(), img.data.size(), layout);
+	} catch (...) {
+		fclose(f);
+		throw;
 	}
 	fclose(f);
-	std::string typeName = "";
-	switch (img.type) {
-	case ImageType::BYTE:
-		typeName = "Byte";
-		break;
-	case ImageType::UBYTE:
-		typeName = "Unsigned Byte";
-		break;
-	case ImageType::SHORT:
-		typeName = "Short";
-		break;
-	case ImageType::USHORT:
-		typeName = "Unsigned Short";
-		break;
-	case ImageType::INT:
-		typeName = "Integer";
-		break;
-	case ImageType::UINT:
-		typeName = "Unsigned Integer";
-		break;
-	case ImageType::FLOAT:
-		typeName = "Float";
-		break;
-	case ImageType::DOUBLE:
-		typeName = "Double";
-		break;
-	}
-//std::cout << vstr.str() << std::endl;
-	std::stringstream sstr;
-	sstr << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-	sstr << "<!-- MIPAV header file -->\n";
-	sstr
-			<< "<image xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" nDimensions=\"3\">\n";
-	sstr << "	<Dataset-attributes>\n";
-	sstr << "		<Image-offset>0</Image-offset>\n";
-	sstr << "		<Data-type>" << typeName << "</Data-type>\n";
-	sstr << "		<Endianess>Little</Endianess>\n";
-	sstr << "		<Extents>" << img.width << "</Extents>\n";
-	sstr << "		<Extents>" << img.height << "</Extents>\n";
-	sstr << "		<Extents>" << img.channels << "</Extents>\n";
-	sstr << "		<Resolutions>\n";
-	sstr << "			<Resolution>1.0</Resolution>\n";
-	sstr << "			<Resolution>1.0</Resolution>\n";
-	sstr << "			<Resolution>1.0</Resolution>\n";
-	sstr << "		</Resolutions>\n";
-	sstr << "		<Slice-spacing>1.0</Slice-spacing>\n";
-	sstr << "		<Slice-thickness>0.0</Slice-thickness>\n";
-	sstr << "		<Units>Millimeters</Units>\n";
-	sstr << "		<Units>Millimeters</Units>\n";
-	sstr << "		<Units>Millimeters</Units>\n";
-	sstr << "		<Compression>none</Compression>\n";
-	sstr << "		<Orientation>Unknown</Orientation>\n";
-	sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
-	sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
-	sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
-	sstr << "		<Origin>0.0</Origin>\n";
-	sstr << "		<Origin>0.0</Origin>\n";
-	sstr << "		<Origin>0.0</Origin>\n";
-	sstr << "		<Modality>Unknown Modality</Modality>\n";
-	sstr << "	</Dataset-attributes>\n";
-	sstr << "</image>\n";
-	std::ofstream myfile;
-	std::stringstream xmlFile;
-	xmlFile << fileName << ".xml";
-	myfile.open(xmlFile.str().c_str(), std::ios_base::out);
-	if (!myfile.is_open()) {
+	WriteRawHeader(fileName + ".xml", header);
+}
+template<class E, class T, int C, ImageType I> void WriteImageToRawFile(
+		const std::string& file, const Expression<E, Image<T, C, I>>& img,
+		RawLayout layout = RawLayout::Planar) {
+	WriteImageToRawFile(file, img.eval(), layout);
+}
+template<class T, int C, ImageType I> void ReadImageFromRawFile(
+		const std::string& file, Image<T, C, I>& img) {
+	RawHeader header = ReadRawHeader(file);
+	if (header.extents.size() < 2 || header.extents.size() > 3) {
 		throw std::runtime_error(
-				MakeString() << "Could not open " << xmlFile.str()
-						<< " for writing.");
+				MakeString() << "Raw file " << file << " is not an image.");
+	}
+	int channels = (header.extents.size() > 2) ? header.extents[2] : 1;
+	if (channels != C) {
+		throw std::runtime_error(
+				MakeString() << "Raw file " << file << " has " << channels
+						<< " channels, expected " << C << ".");
+	}
+	img.resize(header.extents[0], header.extents[1]);
+	FILE* f = OpenRawData(header, I, channels, img.size(), sizeof(T));
+	try {
+		ReadRawData(f, img.data.data(), img.size(), header.layout,
+				header.littleEndian != IsLittleEndian());
+	} catch (...) {
+		fclose(f);
+		throw;
 	}
-	myfile << sstr.str();
-	myfile.close();
+	fclose(f);
 }
+/* Read-only image backed by a memory-mapped raw file. Opening is constant
+ * time; pixels are paged in by the OS as they are touched. Only interleaved
+ * (or single channel), native-endian files can be mapped. */
+template<class T, int C, ImageType I> struct MappedImage {
+private:
+	std::shared_ptr<MappedFile> mapping;
+public:
+	const vec<T, C>* data;
+	typedef vec<T, C> ValueType;
+	int width;
+	int height;
+	const int channels = C;
+	const ImageType type = I;
+	MappedImage() :
+			data(nullptr), width(0), height(0) {
+	}
+	MappedImage(const std::string& file) :
+			MappedImage() {
+		open(file);
+	}
+	void open(const std::string& file) {
+		RawHeader header = ReadRawHeader(file);
+		if (header.extents.size() < 2 || header.extents.size() > 3) {
+			throw std::runtime_error(
+					MakeString() << "Raw file " << file << " is not an image.");
+		}
+		int chs = (header.extents.size() > 2) ? header.extents[2] : 1;
+		if (chs != C) {
+			throw std::runtime_error(
+					MakeString() << "Raw file " << file << " has " << chs
+							<< " channels, expected " << C << ".");
+		}
+		ValidateRawHeader(header, I, chs,
+				(size_t) header.extents[0] * header.extents[1], sizeof(T));
+		if (C > 1 && header.layout != RawLayout::Interleaved) {
+			throw std::runtime_error(
+					MakeString() << "Cannot map planar raw file " << file);
+		}
+		if (header.littleEndian != IsLittleEndian()
+				|| header.offset % sizeof(T) != 0) {
+			throw std::runtime_error(
+					MakeString() << "Cannot map raw file " << file
+							<< " without conversion.");
+		}
+		mapping = std::shared_ptr<MappedFile>(
+				new MappedFile(header.dataFile));
+		width = header.extents[0];
+		height = header.extents[1];
+		data = reinterpret_cast<const vec<T, C>*>(mapping->data()
+				+ header.offset);
+	}
+	void close() {
+		mapping.reset();
+		data = nullptr;
+		width = 0;
+		height = 0;
+	}
+	bool isOpen() const {
+		return (mapping.get() != nullptr);
+	}
+	size_t size() const {
+		return (size_t) width * height;
+	}
+	int2 dimensions() const {
+		return int2(width, height);
+	}
+	const vec<T, C>* begin() const {
+		return data;
+	}
+	const vec<T, C>* end() const {
+		return data + size();
+	}
+	const vec<T, C>& operator[](const size_t i) const {
+		return data[i];
+	}
+	const vec<T, C>& operator()(int i, int j) const {
+		return data[clamp(i, 0, width - 1) + clamp(j, 0, height - 1) * width];
+	}
+	const vec<T, C>& operator()(const int2 ij) const {
+		return operator()(ij.x, ij.y);
+	}
+	void copyTo(Image<T, C, I>& out) const {
+		out.resize(width, height);
+		std::copy(begin(), end(), out.data.begin());
+	}
+};
 typedef Image<uint8_t, 4, ImageType::UBYTE> ImageRGBA;
 typedef Image<int, 4, ImageType::INT> ImageRGBAi;
 typedef Image<float, 4, ImageType::FLOAT> ImageRGBAf;
@@ -992,70 +1409,79 @@ void ConvertImage(const ImageRGBAf& in, ImageRGBf& out);
 void ConvertImage(const ImageRGB& in, ImageRGBA& out);
 void ConvertImage(const ImageRGBf& in, ImageRGBAf& out);
 
-template<class T, ImageType I> void ConvertImage(const Image<T, 4, I>& in,
+template<class T, ImageType I> void ConvertImage(
+		const ExpressionInput<ConstImageView<T, 4, I>>& in,
+		const ImageView<T, 1, I>& out, bool sRGB = true) {
+	out.resize(in.width, in.height);
+	const double wr = sRGB ? 0.21 : 0.30;
+	const double wg = sRGB ? 0.72 : 0.59;
+	const double wb = sRGB ? 0.07 : 0.11;
+#pragma omp parallel for
+	for (int j = 0; j < in.height; j++) {
+		const vec<T, 4>* src = in.row(j);
+		vec<T, 1>* dst = out.row(j);
+		for (int i = 0; i < in.width; i++) {
+			vec<T, 4> c = src[i];
+			dst[i] = vec<T, 1>(T(wr * c.x + wg * c.y + wb * c.z));
+		}
+	}
+}
+template<class T, ImageType I> void ConvertImage(const ExpressionInput<Image<T, 4, I>>& in,
 		Image<T, 1, I>& out, bool sRGB = true) {
 	out.resize(in.width, in.height);
 	out.id = in.id;
 	out.setPosition(in.position());
-	int N = (int) out.size();
-
-	if (sRGB) {
-#pragma omp parallel for
-		for (int i = 0; i < N; i++) {
-			vec<T, 4> c = in[i];
-			out[i] = vec<T, 1>(T(0.21 * c.x + 0.72 * c.y + 0.07 * c.z));
-		}
-	} else {
+	ConvertImage(ConstImageView<T, 4, I>(in), ImageView<T, 1, I>(out), sRGB);
+}
+template<class T, ImageType I> void ConvertImage(
+		const ExpressionInput<ConstImageView<T, 4, I>>& in,
+		const ImageView<T, 2, I>& out, bool sRGB = true) {
+	out.resize(in.width, in.height);
+	const double wr = sRGB ? 0.21 : 0.30;
+	const double wg = sRGB ? 0.72 : 0.59;
+	const double wb = sRGB ? 0.07 : 0.11;
 #pragma omp parallel for
-		for (int i = 0; i < N; i++) {
-			vec<T, 4> c = in[i];
-			out[i] = vec<T, 1>(T(0.30 * c.x + 0.59 * c.y + 0.11 * c.z));
+	for (int j = 0; j < in.height; j++) {
+		const vec<T, 4>* src = in.row(j);
+		vec<T, 2>* dst = out.row(j);
+		for (int i = 0; i < in.width; i++) {
+			vec<T, 4> c = src[i];
+			dst[i] = vec<T, 2>(T(wr * c.x + wg * c.y + wb * c.z), c.w);
 		}
 	}
 }
-template<class T, ImageType I> void ConvertImage(const Image<T, 4, I>& in,
+template<class T, ImageType I> void ConvertImage(const ExpressionInput<Image<T, 4, I>>& in,
 		Image<T, 2, I>& out, bool sRGB = true) {
 	out.resize(in.width, in.height);
 	out.id = in.id;
 	out.setPosition(in.position());
-	int N = out.size();
-
-	if (sRGB) {
-#pragma omp parallel for
-		for (int i = 0; i < N; i++) {
-			vec<T, 4> c = in[i];
-			out[i] = vec<T, 2>(T(0.21 * c.x + 0.72 * c.y + 0.07 * c.z), c.w);
-		}
-	} else {
+	ConvertImage(ConstImageView<T, 4, I>(in), ImageView<T, 2, I>(out), sRGB);
+}
+template<class T, ImageType I> void ConvertImage(
+		const ExpressionInput<ConstImageView<T, 3, I>>& in,
+		const ImageView<T, 1, I>& out, bool sRGB = true) {
+	out.resize(in.width, in.height);
+	const double wr = sRGB ? 0.21 : 0.30;
+	const double wg = sRGB ? 0.72 : 0.59;
+	const double wb = sRGB ? 0.07 : 0.11;
 #pragma omp parallel for
-		for (int i = 0; i < N; i++) {
-			vec<T, 4> c = in[i];
-			out[i] = vec<T, 2>(T(0.30 * c.x + 0.59 * c.y + 0.11 * c.z), c.w);
+	for (int j = 0; j < in.height; j++) {
+		const vec<T, 3>* src = in.row(j);
+		vec<T, 1>* dst = out.row(j);
+		for (int i = 0; i < in.width; i++) {
+			vec<T, 3> c = src[i];
+			dst[i] = vec<T, 1>(T(wr * c.x + wg * c.y + wb * c.z));
 		}
 	}
 }
-template<class T, ImageType I> void ConvertImage(const Image<T, 3, I>& in,
+template<class T, ImageType I> void ConvertImage(const ExpressionInput<Image<T, 3, I>>& in,
 		Image<T, 1, I>& out, bool sRGB = true) {
 	out.resize(in.width, in.height);
 	out.id = in.id;
 	out.setPosition(in.position());
-	int N = (int) out.size();
-
-	if (sRGB) {
-#pragma omp parallel for
-		for (int i = 0; i < N; i++) {
-			vec<T, 3> c = in[i];
-			out[i] = vec<T, 1>(T(0.21 * c.x + 0.72 * c.y + 0.07 * c.z));
-		}
-	} else {
-#pragma omp parallel for
-		for (int i = 0; i < N; i++) {
-			vec<T, 3> c = in[i];
-			out[i] = vec<T, 1>(T(0.30 * c.x + 0.59 * c.y + 0.11 * c.z));
-		}
-	}
+	ConvertImage(ConstImageView<T, 3, I>(in), ImageView<T, 1, I>(out), sRGB);
 }
-template<class T, int C, ImageType I> void Crop(const Image<T, C, I>& in,
+template<class T, int C, ImageType I> void Crop(const ExpressionInput<Image<T, C, I>>& in,
 		Image<T, C, I>& out, int2 pos, int2 dims) {
 	out.setPosition(pos);
 	out.resize(dims.x, dims.y);
@@ -1081,7 +1507,7 @@ template<class T, int C, ImageType I> void FlipHorizontal(Image<T, C, I>& in) {
 		}
 	}
 }
-template<class T, int C, ImageType I> void DownSample(const Image<T, C, I>& in,
+template<class T, int C, ImageType I> void DownSample(const ExpressionInput<Image<T, C, I>>& in,
 		Image<T, C, I>& out) {
 	static const double Kernel[5][5] = { { 1, 4, 6, 4, 1 },
 			{ 4, 16, 24, 16, 4 }, { 6, 24, 36, 24, 6 }, { 4, 16, 24, 16, 4 }, {
@@ -1102,7 +1528,7 @@ template<class T, int C, ImageType I> void DownSample(const Image<T, C, I>& in,
 		}
 	}
 }
-template<class T, int C, ImageType I> void UpSample(const Image<T, C, I>& in,
+template<class T, int C, ImageType I> void UpSample(const ExpressionInput<Image<T, C, I>>& in,
 		Image<T, C, I>& out) {
 	static const double Kernel[5][5] = { { 1, 4, 6, 4, 1 },
 			{ 4, 16, 24, 16, 4 }, { 6, 24, 36, 24, 6 }, { 4, 16, 24, 16, 4 }, {
@@ -1127,7 +1553,7 @@ template<class T, int C, ImageType I> void UpSample(const Image<T, C, I>& in,
 		}
 	}
 }
-template<class T, int C, ImageType I> void Set(const Image<T, C, I>& in,
+template<class T, int C, ImageType I> void Set(const ExpressionInput<Image<T, C, I>>& in,
 		Image<T, C, I>& out, int2 pos) {
 	for (int i = 0; i < in.width; i++) {
 		for (int j = 0; j < in.height; j++) {
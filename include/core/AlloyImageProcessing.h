@@ -21,6 +21,7 @@
 #ifndef INCLUDE_ALLOYIMAGEPROCESSING_H_
 #define INCLUDE_ALLOYIMAGEPROCESSING_H_
 #include "AlloyImage.h"
+#include <type_traits>
 namespace aly {
 bool SANITY_CHECK_IMAGE_PROCESSING();
 template<class T, size_t M, size_t N> void GaussianKernel(T (&kernel)[M][N],
@@ -138,65 +139,269 @@ template<class T, size_t M, size_t N> struct GaussianOperators {
 		}
 	}
 };
-template<size_t M, size_t N, class T, int C, ImageType I> void Gradient(
-		const Image<T, C, I>& image, Image<T, C, I>& gX, Image<T, C, I>& gY, double sigmaX = (0.607902736 * (M - 1) * 0.5),
-	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
-
-	double filterX[M][N], filterY[M][N];
-	GaussianKernelDerivative(filterX, filterY,sigmaX,sigmaY);
-
-	gX.resize(image.width, image.height);
-	gY.resize(image.width, image.height);
-#pragma omp parallel for
-	for (int i = 0; i < image.width; i++) {
-		for (int j = 0; j < image.height; j++) {
-			vec<double, C> vsumX(0.0);
-			vec<double, C> vsumY(0.0);
-			for (int ii = 0; ii < M; ii++) {
-				for (int jj = 0; jj < N; jj++) {
-					vec<T, C> val = image(i + ii - (int)M / 2, j + jj - (int)N / 2);
-					vsumX += filterX[ii][jj] * vec<double, C>(val);
-					vsumY += filterY[ii][jj] * vec<double, C>(val);
+/*
+ * Rank-1 term of a separable kernel. The 2D kernel is the outer product
+ * kernelX[i]*kernelY[j], where i indexes columns and j indexes rows.
+ */
+struct SeparableKernel {
+	std::vector<double> kernelX;
+	std::vector<double> kernelY;
+	SeparableKernel() {
+	}
+	SeparableKernel(const std::vector<double>& kx, const std::vector<double>& ky) :
+			kernelX(kx), kernelY(ky) {
+	}
+};
+/*
+ * 1D factors of GaussianOperators. The smoothing and gradient kernels are
+ * rank-1 and the Laplacian of Gaussian (with its mean removed) is the sum of
+ * three rank-1 terms, so all of them can be applied as separable passes.
+ */
+template<class T, size_t M, size_t N> struct SeparableGaussianOperators {
+	std::vector<T> filterX, filterY;
+	std::vector<T> filterGradX, filterGradY;
+	std::vector<T> filterLaplacianX, filterLaplacianY;
+	T laplacianOffset;
+	SeparableGaussianOperators(T sigmaX = T(0.607902736 * (M - 1) * 0.5),
+			T sigmaY = T(0.607902736 * (N - 1) * 0.5)) :
+			filterX(M), filterY(N), filterGradX(M), filterGradY(N), filterLaplacianX(
+					M), filterLaplacianY(N) {
+		T sumX = 0, sumY = 0;
+		T sumLX = 0, sumLY = 0;
+		for (int i = 0; i < (int) M; i++) {
+			double xn = (i - 0.5 * (M - 1)) / sigmaX;
+			T w = T(std::exp(-0.5 * xn * xn));
+			filterX[i] = w;
+			filterGradX[i] = T(w * xn / sigmaX);
+			filterLaplacianX[i] = T(w * (xn * xn - 1.0) / (sigmaX * sigmaX));
+			sumX += w;
+			sumLX += filterLaplacianX[i];
+		}
+		for (int j = 0; j < (int) N; j++) {
+			double yn = (j - 0.5 * (N - 1)) / sigmaY;
+			T w = T(std::exp(-0.5 * yn * yn));
+			filterY[j] = w;
+			filterGradY[j] = T(w * yn / sigmaY);
+			filterLaplacianY[j] = T(w * (yn * yn - 1.0) / (sigmaY * sigmaY));
+			sumY += w;
+			sumLY += filterLaplacianY[j];
+		}
+		laplacianOffset = (sumLX * sumY + sumX * sumLY)
+				/ (T(M * N) * sumX * sumY);
+		for (int i = 0; i < (int) M; i++) {
+			filterX[i] /= sumX;
+			filterGradX[i] /= sumX;
+			filterLaplacianX[i] /= sumX;
+		}
+		for (int j = 0; j < (int) N; j++) {
+			filterY[j] /= sumY;
+			filterGradY[j] /= sumY;
+			filterLaplacianY[j] /= sumY;
+		}
+	}
+	std::vector<SeparableKernel> smooth() const {
+		return {SeparableKernel(toDouble(filterX), toDouble(filterY))};
+	}
+	std::vector<SeparableKernel> gradX() const {
+		return {SeparableKernel(toDouble(filterGradX), toDouble(filterY))};
+	}
+	std::vector<SeparableKernel> gradY() const {
+		return {SeparableKernel(toDouble(filterX), toDouble(filterGradY))};
+	}
+	std::vector<SeparableKernel> laplacian() const {
+		return {SeparableKernel(toDouble(filterLaplacianX), toDouble(filterY)),
+			SeparableKernel(toDouble(filterX), toDouble(filterLaplacianY)),
+			SeparableKernel(std::vector<double>(M, -(double)laplacianOffset),
+					std::vector<double>(N, 1.0))};
+	}
+private:
+	static std::vector<double> toDouble(const std::vector<T>& v) {
+		return std::vector<double>(v.begin(), v.end());
+	}
+};
+/*
+ * Separable convolution engine. Applies the sum of rank-1 kernels to the
+ * image in blocks of rows: a horizontal pass fills a per-thread buffer with
+ * the rows the block needs, then a vertical pass accumulates into a
+ * per-thread block of output rows, so no full-size temporaries are
+ * allocated. Both passes walk rows in memory order over interleaved channels
+ * so the inner loops vectorize. Borders replicate edge pixels like
+ * Image::operator(), but the clamp is applied once per padded row / kernel
+ * row instead of on every tap. Accumulation is in float (double for double
+ * images).
+ */
+template<class T, int C, ImageType I> void ConvolveSeparable(
+		const ExpressionInput<ConstImageView<T, C, I>>& image,
+		const ImageView<T, C, I>& out,
+		const std::vector<SeparableKernel>& kernels) {
+	typedef typename std::conditional<std::is_same<T, double>::value, double,
+			float>::type K;
+	//Output rows per block. Each block also filters the N-1 rows around it.
+	static const int BLOCK_ROWS = 64;
+	const int w = image.width;
+	const int h = image.height;
+	const int rowSize = w * C;
+	out.resize(w, h);
+	if (w == 0 || h == 0) {
+		return;
+	}
+	if (kernels.size() == 0) {
+		out.set(vec<T, C>(T(0)));
+		return;
+	}
+	//Blocks overwrite rows that neighboring blocks still read, so filter overlapping views from a copy.
+	const vec<T, C>* inBegin = image.data;
+	const vec<T, C>* inEnd = image.row(h - 1) + w;
+	const vec<T, C>* outBegin = out.data;
+	const vec<T, C>* outEnd = out.row(h - 1) + w;
+	if (std::less<const vec<T, C>*>()(inBegin, outEnd)
+			&& std::less<const vec<T, C>*>()(outBegin, inEnd)) {
+		Image<T, C, I> copy;
+		image.copyTo(copy);
+		ConvolveSeparable(ConstImageView<T, C, I>(copy), out, kernels);
+		return;
+	}
+	std::vector<std::vector<K>> kxs, kys;
+	for (const SeparableKernel& kernel : kernels) {
+		kxs.push_back(std::vector<K>(kernel.kernelX.begin(), kernel.kernelX.end()));
+		kys.push_back(std::vector<K>(kernel.kernelY.begin(), kernel.kernelY.end()));
+	}
+	const int blocks = (h + BLOCK_ROWS - 1) / BLOCK_ROWS;
+#pragma omp parallel
+	{
+		std::vector<K> pad, rows;
+		std::vector<K> accum((size_t) BLOCK_ROWS * rowSize);
+#pragma omp for schedule(dynamic)
+		for (int b = 0; b < blocks; b++) {
+			const int j0 = b * BLOCK_ROWS;
+			const int j1 = std::min(h, j0 + BLOCK_ROWS);
+			std::fill(accum.begin(), accum.begin() + (size_t) (j1 - j0) * rowSize,
+					K(0));
+			for (size_t n = 0; n < kernels.size(); n++) {
+				const std::vector<K>& kx = kxs[n];
+				const std::vector<K>& ky = kys[n];
+				const int M = (int) kx.size();
+				const int N = (int) ky.size();
+				const int offX = M / 2;
+				const int offY = N / 2;
+				//Horizontal pass over rows [r0, r1), clamped to the image.
+				const int r0 = j0 - offY;
+				const int r1 = j1 + N - 1 - offY;
+				pad.resize((size_t) (w + M - 1) * C);
+				rows.resize((size_t) (r1 - r0) * rowSize);
+				for (int r = r0; r < r1; r++) {
+					const T* srcRow = &(image.row(clamp(r, 0, h - 1))->x);
+					for (int p = 0; p < w + M - 1; p++) {
+						const T* val = srcRow + clamp(p - offX, 0, w - 1) * C;
+						for (int c = 0; c < C; c++) {
+							pad[p * C + c] = K(val[c]);
+						}
+					}
+					K* dst = &rows[(size_t) (r - r0) * rowSize];
+					for (int x = 0; x < rowSize; x++) {
+						dst[x] = K(0);
+					}
+					for (int k = 0; k < M; k++) {
+						const K wk = kx[k];
+						const K* tap = &pad[k * C];
+						for (int x = 0; x < rowSize; x++) {
+							dst[x] += wk * tap[x];
+						}
+					}
+				}
+				//Vertical pass, adding this kernel's response to the block.
+				for (int j = j0; j < j1; j++) {
+					K* dst = &accum[(size_t) (j - j0) * rowSize];
+					for (int k = 0; k < N; k++) {
+						const K wk = ky[k];
+						const K* tap = &rows[(size_t) (j + k - offY - r0) * rowSize];
+						for (int x = 0; x < rowSize; x++) {
+							dst[x] += wk * tap[x];
+						}
+					}
+				}
+			}
+			for (int j = j0; j < j1; j++) {
+				T* dst = &(out.row(j)->x);
+				const K* src = &accum[(size_t) (j - j0) * rowSize];
+				for (int x = 0; x < rowSize; x++) {
+					dst[x] = T(src[x]);
 				}
 			}
-			gX(i, j) = vec<T, C>(vsumX);
-			gY(i, j) = vec<T, C>(vsumY);
 		}
 	}
 }
-template<size_t M, size_t N, class T, int C, ImageType I> void Laplacian(
-		const Image<T, C, I>& image, Image<T, C, I>& L, double sigmaX = (0.607902736 * (M - 1) * 0.5),
-	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
-	double filter[M][N];
-	GaussianKernelLaplacian(filter,sigmaX,sigmaY);
-	L.resize(image.width, image.height);
-#pragma omp parallel for
-	for (int i = 0; i < image.width; i++) {
-		for (int j = 0; j < image.height; j++) {
-			vec<double, C> vsum(0.0);
-			for (int ii = 0; ii < M; ii++) {
-				for (int jj = 0; jj < N; jj++) {
-					vec<T, C> val = image(i + ii - (int)M / 2, j + jj - (int)N / 2);
-					vsum += filter[ii][jj] * vec<double, C>(val);
-				}
+template<class T, int C, ImageType I> void ConvolveSeparable(
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& out,
+		const std::vector<SeparableKernel>& kernels) {
+	out.resize(image.width, image.height);
+	ConvolveSeparable(ConstImageView<T, C, I>(image), ImageView<T, C, I>(out),
+			kernels);
+}
+template<class T, int C, ImageType I> void ConvolveSeparable(
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& out,
+		const std::vector<double>& kernelX,
+		const std::vector<double>& kernelY) {
+	ConvolveSeparable(image, out, std::vector<SeparableKernel> { SeparableKernel(
+			kernelX, kernelY) });
+}
+/*
+ * Tests whether an MxN kernel is the outer product of two 1D kernels and, if
+ * so, returns the factors.
+ */
+template<size_t M, size_t N> bool IsSeparable(const double (&filter)[M][N],
+		std::vector<double>& kernelX, std::vector<double>& kernelY,
+		double tolerance = 1E-7) {
+	int pi = 0, pj = 0;
+	double maxVal = 0.0;
+	for (int i = 0; i < (int) M; i++) {
+		for (int j = 0; j < (int) N; j++) {
+			if (std::abs(filter[i][j]) > maxVal) {
+				maxVal = std::abs(filter[i][j]);
+				pi = i;
+				pj = j;
+			}
+		}
+	}
+	kernelX.resize(M);
+	kernelY.resize(N);
+	if (maxVal == 0.0) {
+		kernelX.assign(M, 0.0);
+		kernelY.assign(N, 0.0);
+		return true;
+	}
+	for (int i = 0; i < (int) M; i++) {
+		kernelX[i] = filter[i][pj];
+	}
+	for (int j = 0; j < (int) N; j++) {
+		kernelY[j] = filter[pi][j] / filter[pi][pj];
+	}
+	for (int i = 0; i < (int) M; i++) {
+		for (int j = 0; j < (int) N; j++) {
+			if (std::abs(filter[i][j] - kernelX[i] * kernelY[j])
+					> tolerance * maxVal) {
+				return false;
 			}
-			L(i, j) = vec<T, C>(vsum);
 		}
 	}
+	return true;
 }
-template<size_t M, size_t N, class T, int C, ImageType I> void Smooth(
-		const Image<T, C, I>& image, Image<T, C, I>& B, double sigmaX = (0.607902736 * (M - 1) * 0.5),
-	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
-	double filter[M][N];
-	GaussianKernel(filter,sigmaX,sigmaY);
+/*
+ * Reference 2D convolution that applies every tap of the MxN kernel per
+ * pixel with clamped lookups.
+ */
+template<size_t M, size_t N, class T, int C, ImageType I> void ConvolveDirect(
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& B,
+		const double (&filter)[M][N]) {
 	B.resize(image.width, image.height);
 #pragma omp parallel for
 	for (int i = 0; i < image.width; i++) {
 		for (int j = 0; j < image.height; j++) {
 			vec<double, C> vsum(0.0);
-			for (int ii = 0; ii < M; ii++) {
-				for (int jj = 0; jj < N; jj++) {
-					vec<T, C> val = image(i + ii - (int)M / 2, j + jj - (int)N / 2);
+			for (int ii = 0; ii < (int) M; ii++) {
+				for (int jj = 0; jj < (int) N; jj++) {
+					vec<T, C> val = image(i + ii - (int) M / 2,
+							j + jj - (int) N / 2);
 					vsum += filter[ii][jj] * vec<double, C>(val);
 				}
 			}
@@ -204,54 +409,112 @@ template<size_t M, size_t N, class T, int C, ImageType I> void Smooth(
 		}
 	}
 }
+/*
+ * Convolves with an arbitrary MxN kernel, using the separable engine when
+ * the kernel factors into 1D kernels.
+ */
+template<size_t M, size_t N, class T, int C, ImageType I> void Convolve(
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& B,
+		const double (&filter)[M][N]) {
+	std::vector<double> kernelX, kernelY;
+	if (IsSeparable(filter, kernelX, kernelY)) {
+		ConvolveSeparable(image, B, kernelX, kernelY);
+	} else {
+		ConvolveDirect(image, B, filter);
+	}
+}
+template<size_t M, size_t N, class T, int C, ImageType I> void Gradient(
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& gX, Image<T, C, I>& gY, double sigmaX = (0.607902736 * (M - 1) * 0.5),
+	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
+	SeparableGaussianOperators<double, M, N> kernel(sigmaX, sigmaY);
+	ConvolveSeparable(image, gX, kernel.gradX());
+	ConvolveSeparable(image, gY, kernel.gradY());
+}
+template<size_t M, size_t N, class T, int C, ImageType I> void Laplacian(
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& L, double sigmaX = (0.607902736 * (M - 1) * 0.5),
+	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
+	SeparableGaussianOperators<double, M, N> kernel(sigmaX, sigmaY);
+	ConvolveSeparable(image, L, kernel.laplacian());
+}
+template<size_t M, size_t N, class T, int C, ImageType I> void Smooth(
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& B, double sigmaX = (0.607902736 * (M - 1) * 0.5),
+	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
+	SeparableGaussianOperators<double, M, N> kernel(sigmaX, sigmaY);
+	ConvolveSeparable(image, B, kernel.smooth());
+}
+template<size_t M, size_t N, class T, int C, ImageType I> void Gradient(
+		const ExpressionInput<ConstImageView<T, C, I>>& image,
+		const ImageView<T, C, I>& gX,
+		const ImageView<T, C, I>& gY, double sigmaX = (0.607902736 * (M - 1) * 0.5),
+	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
+	SeparableGaussianOperators<double, M, N> kernel(sigmaX, sigmaY);
+	ConvolveSeparable(image, gX, kernel.gradX());
+	ConvolveSeparable(image, gY, kernel.gradY());
+}
+template<size_t M, size_t N, class T, int C, ImageType I> void Laplacian(
+		const ExpressionInput<ConstImageView<T, C, I>>& image,
+		const ImageView<T, C, I>& L,
+		double sigmaX = (0.607902736 * (M - 1) * 0.5),
+	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
+	SeparableGaussianOperators<double, M, N> kernel(sigmaX, sigmaY);
+	ConvolveSeparable(image, L, kernel.laplacian());
+}
+template<size_t M, size_t N, class T, int C, ImageType I> void Smooth(
+		const ExpressionInput<ConstImageView<T, C, I>>& image,
+		const ImageView<T, C, I>& B,
+		double sigmaX = (0.607902736 * (M - 1) * 0.5),
+	double sigmaY = (0.607902736 * (N - 1) * 0.5)) {
+	SeparableGaussianOperators<double, M, N> kernel(sigmaX, sigmaY);
+	ConvolveSeparable(image, B, kernel.smooth());
+}
 template<class T, int C, ImageType I> void Smooth3x3(
-		const Image<T, C, I>& image, Image<T, C, I>& B) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& B) {
 	Smooth<3, 3>(image, B);
 }
 template<class T, int C, ImageType I> void Smooth5x5(
-		const Image<T, C, I>& image, Image<T, C, I>& B) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& B) {
 	Smooth<5, 5>(image, B);
 }
 template<class T, int C, ImageType I> void Smooth7x7(
-		const Image<T, C, I>& image, Image<T, C, I>& B) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& B) {
 	Smooth<7, 7>(image, B);
 }
 template<class T, int C, ImageType I> void Smooth11x11(
-		const Image<T, C, I>& image, Image<T, C, I>& B) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& B) {
 	Smooth<11, 11>(image, B);
 }
 
 template<class T, int C, ImageType I> void Laplacian3x3(
-		const Image<T, C, I>& image, Image<T, C, I>& L) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& L) {
 	Laplacian<3, 3>(image, L);
 }
 template<class T, int C, ImageType I> void Laplacian5x5(
-		const Image<T, C, I>& image, Image<T, C, I>& L) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& L) {
 	Laplacian<5, 5>(image, L);
 }
 template<class T, int C, ImageType I> void Laplacian7x7(
-		const Image<T, C, I>& image, Image<T, C, I>& L) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& L) {
 	Laplacian<7, 7>(image, L);
 }
 template<class T, int C, ImageType I> void Laplacian11x11(
-		const Image<T, C, I>& image, Image<T, C, I>& L) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& L) {
 	Laplacian<11, 11>(image, L);
 }
 
 template<class T, int C, ImageType I> void Gradient3x3(
-		const Image<T, C, I>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
 	Gradient<3, 3>(image, gX, gY);
 }
 template<class T, int C, ImageType I> void Gradient5x5(
-		const Image<T, C, I>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
 	Gradient<5, 5>(image, gX, gY);
 }
 template<class T, int C, ImageType I> void Gradient7x7(
-		const Image<T, C, I>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
 	Gradient<7, 7>(image, gX, gY);
 }
 template<class T, int C, ImageType I> void Gradient11x11(
-		const Image<T, C, I>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
+		const ExpressionInput<Image<T, C, I>>& image, Image<T, C, I>& gX, Image<T, C, I>& gY) {
 	Gradient<11, 11>(image, gX, gY);
 }
 
@@ -22,8 +22,10 @@
 #ifndef ALLOYMESHKDTREE_H_
 #define ALLOYMESHKDTREE_H_
 #include "AlloyMath.h"
+#include "AlloyAllocator.h"
 
-//Mesh intersection implemented with a KD-tree of triangles.
+//Mesh intersection implemented with a KD-tree of triangles. The tree is built top down with a binned
+//surface area heuristic into depth-first 32-byte nodes whose leaves index packed blocks of four triangles.
 //The term "Intersector" is used to disambiguate this KD-tree from the one used for points.
 
 namespace aly {
@@ -88,35 +90,6 @@ namespace aly {
 		std::basic_ostream<C, R> & ss, const KDBox& a) {
 		return ss << "[" << a.minPoint << "," << a.maxPoint << ","<<a.children.size()<<"]";
 	}
-	class KDBoxEdge {
-	protected:
-		double value;
-		bool start;
-		KDBox* box;
-	public:
-		template<class C, class R> friend std::basic_ostream<C, R> & operator <<(std::basic_ostream<C, R> & ss, const KDBoxEdge& a);
-		KDBox* getBox() {
-			return box;
-		}
-		double getValue() const {
-			return value;
-		}
-		bool isMin() const {
-			return start;
-		}
-		void set(KDBox* b, int dim, bool start);
-		KDBoxEdge() :
-			value(1E30), start(true), box(nullptr) {
-		}
-		KDBoxEdge(KDBox* b, int dim, bool start) {
-			set(b, dim, start);
-		}
-		~KDBoxEdge() {}
-	};
-	template<class C, class R> std::basic_ostream<C, R> & operator <<(
-		std::basic_ostream<C, R> & ss, const KDBoxEdge& a) {
-		return ss << "<" << *a.box << ": " << ((a.start) ? "start" : "") << ": " << a.value << ">";
-	}
 	class KDSegment {
 	public:
 		float extent;
@@ -149,6 +122,15 @@ namespace aly {
 			minPoint = aly::min(aly::min(pts[0], pts[1]), pts[2]);
 			maxPoint = aly::max(aly::max(pts[0], pts[1]), pts[2]);
 		}
+		const float3& getPoint(int i) const {
+			return pts[i];
+		}
+		void setPoints(const float3& pt1, const float3& pt2, const float3& pt3) {
+			pts[0] = pt1;
+			pts[1] = pt2;
+			pts[2] = pt3;
+			update();
+		}
 		float3 getNormal() const {
 			return normalize(cross(pts[1] - pts[0], pts[2] - pts[0]));
 		}
@@ -170,152 +152,295 @@ namespace aly {
 		double distance(const float3& p, float3& lastIntersect) const;
 	};
 
-	struct KDBoxDistance {
-		KDBox* box;
-		double dist;
-		KDBoxDistance(const float3& ref, KDBox* tri) :
-			box(tri) {
-			dist = tri->distanceToBox(ref);
-		}
-
+	/*
+	 * Build presets trading build time for traversal speed. Fast bins the
+	 * longest axis into 8 bins, Medium bins all three axes into 16 and High
+	 * into 32 with smaller leaves.
+	 */
+	enum class IntersectorQuality {
+		Fast = 0, Medium = 1, High = 2
 	};
 	template<class C, class R> std::basic_ostream<C, R> & operator <<(
-		std::basic_ostream<C, R> & ss, const KDBoxDistance& a) {
-		return ss << a.box << ": " << a.dist;
-	}
-	inline bool operator<(const KDBoxDistance& a, const KDBoxDistance& b) {
-		//Priority queue puts largest first, so we need to use a >= operator to get ascending order.
-		return (a.dist > b.dist);
+		std::basic_ostream<C, R> & ss, const IntersectorQuality& type) {
+		switch (type) {
+		case IntersectorQuality::Fast:
+			return ss << "Fast";
+		case IntersectorQuality::Medium:
+			return ss << "Medium";
+		case IntersectorQuality::High:
+			return ss << "High";
+		}
+		return ss;
 	}
-        struct CompareKDBox{
-                bool operator()(const KDBoxDistance& a, const KDBoxDistance& b){
-                    return (a.dist > b.dist);
-                }
-        };
+	static const uint32_t INTERSECTOR_INVALID_TRIANGLE = 0xFFFFFFFFU;
+	//Default tree depth, and the deepest tree the traversal stack allows.
+	static const int INTERSECTOR_DEFAULT_DEPTH = 16;
+	static const int INTERSECTOR_MAX_DEPTH = 60;
+	/*
+	 * 32 byte node of the linearized hierarchy, stored depth first. An
+	 * interior node's left child follows it in the array and offset holds the
+	 * right child. A leaf holds count triangles in the blocks starting at
+	 * offset.
+	 */
+	struct IntersectorNode {
+		float3 minPoint;
+		uint32_t offset;
+		float3 maxPoint;
+		uint32_t count;
+		bool isLeaf() const {
+			return count != 0;
+		}
+	};
+	/*
+	 * Four triangles in structure of arrays order so ray and distance tests
+	 * run across all four lanes at once. Unused lanes have an invalid id and
+	 * zero edges, which never hit.
+	 */
+	struct IntersectorBlock {
+		float v0[3][4];
+		float e1[3][4];
+		float e2[3][4];
+		uint32_t id[4];
+	};
+	/*
+	 * Result of a batched query. triangle is an index for getTriangle(), whose
+	 * id is the mesh face. A miss has INTERSECTOR_INVALID_TRIANGLE, NO_HIT_DISTANCE
+	 * and NO_HIT_POINT.
+	 */
+	struct IntersectorHit {
+		float3 point;
+		float distance;
+		uint32_t triangle;
+		bool isHit() const {
+			return triangle != INTERSECTOR_INVALID_TRIANGLE;
+		}
+	};
+	/*
+	 * Subtree built as one task, occupying nodes [node,end) and blocks
+	 * [blockBegin,blockEnd). cost is its SAH cost relative to its root area
+	 * when it was built, which refit compares against.
+	 */
+	struct IntersectorSubtree {
+		uint32_t node;
+		uint32_t end;
+		uint32_t blockBegin;
+		uint32_t blockEnd;
+		int depth;
+		double cost;
+	};
 	class Intersector {
 	protected:
-		std::shared_ptr<KDBox> root;
-		std::vector<std::shared_ptr<KDBox>> storage;
+		//Triangles are stored as indexes into a copy of the mesh vertexes. Quads are split in two.
+		std::vector<float3> vertexes;
+		std::vector<uint3> triangleIndexes;
+		uint32_t quadCount = 0;
+		aligned_vector<IntersectorNode> nodes;
+		aligned_vector<IntersectorBlock> blocks;
+		std::vector<IntersectorSubtree> subtrees;
+		int maxDepth = INTERSECTOR_DEFAULT_DEPTH;
+		IntersectorQuality quality = IntersectorQuality::Medium;
+		double treeCost = 0;
+		double degradation = 1;
+		//SAH costs. Intersection is charged per block of four triangles.
 		const double intersectCost = 80;
 		const double traversalCost = 1;
 		const double emptyBonus = 0.2;
-		int splitPosition(std::vector<KDBox*>& children,
-			std::vector<KDBoxEdge>& edges, KDBox* box);
-		void buildTree(int maxDepth);
+		double getCost(uint32_t begin, uint32_t end) const;
+		void refitSubtree(const IntersectorSubtree& subtree);
+		void refitTop(uint32_t index);
+		void rebuildSubtrees(const std::vector<int>& rebuild);
+		void intersect(const float3& org, const float3& dir, float tmax,
+			IntersectorHit& result) const;
+		void intersectPacket(const float3* org, const float3* dir,
+			IntersectorHit* result) const;
+		void closest(const float3& pt, float maxDistance, const float3* outside,
+			IntersectorHit& result) const;
+		double report(const IntersectorHit& result, float3& lastPoint,
+			uint32_t& lastTriangle) const {
+			lastPoint = result.point;
+			lastTriangle = result.triangle;
+			return result.distance;
+		}
 	public:
 		void reset() {
-			root.reset();
-			storage.clear();
-			storage.shrink_to_fit();
-		}
-		KDBox* getRoot() const {
-			return root.get();
-		}
-
-		void build(const Mesh& mesh, int maxDepth = 16);
-		Intersector(const Mesh& mesh, int maxDepth = 16) {
-			build(mesh, maxDepth);
+			vertexes.clear();
+			vertexes.shrink_to_fit();
+			triangleIndexes.clear();
+			triangleIndexes.shrink_to_fit();
+			quadCount = 0;
+			subtrees.clear();
+			nodes.clear();
+			nodes.shrink_to_fit();
+			blocks.clear();
+			blocks.shrink_to_fit();
+			treeCost = 0;
+			degradation = 1;
+		}
+		const aligned_vector<IntersectorNode>& getNodes() const {
+			return nodes;
+		}
+		size_t getTriangleCount() const {
+			return triangleIndexes.size();
+		}
+		//Mesh face the triangle was taken from.
+		uint32_t getFace(uint32_t id) const {
+			return (id < 2 * quadCount) ? id / 2 : id - quadCount;
+		}
+		//Triangle from its current vertex locations, built on demand.
+		KDTriangle getTriangle(uint32_t id) const {
+			const uint3& tri = triangleIndexes[id];
+			return KDTriangle(vertexes[tri.x], vertexes[tri.y], vertexes[tri.z],
+				getFace(id), 1);
+		}
+		void build(const Mesh& mesh, int maxDepth = INTERSECTOR_DEFAULT_DEPTH,
+			IntersectorQuality quality = IntersectorQuality::Medium);
+		Intersector(const Mesh& mesh, int maxDepth = INTERSECTOR_DEFAULT_DEPTH,
+			IntersectorQuality quality = IntersectorQuality::Medium) {
+			build(mesh, maxDepth, quality);
 		}
 		Intersector() {
 		}
+		/*
+		 * Moves the triangles to the current vertex locations of the mesh the
+		 * tree was built from and updates bounds bottom up, keeping the
+		 * hierarchy. Subtrees whose SAH cost grew more than maxDegradation
+		 * times are rebuilt, and the whole tree is rebuilt if it degrades that
+		 * much overall or the face count changed. Returns the number of
+		 * subtrees rebuilt.
+		 */
+		int refit(const Mesh& mesh, float maxDegradation = 1.5f);
+		//SAH cost of the tree relative to its cost when built.
+		double getDegradation() const {
+			return degradation;
+		}
+		/*
+		 * Batched queries, run in parallel. Rays report distance in world
+		 * units like intersectRayDistance. Set coherent when neighboring rays
+		 * are similar, as with camera rays in scanline order, to trace them in
+		 * packets of four that share one traversal.
+		 */
+		void intersectRays(const float3* origins, const float3* directions,
+			size_t count, IntersectorHit* hits, bool coherent = false) const;
+		void closestPoints(const float3* points, size_t count,
+			IntersectorHit* hits, float maxDistance = NO_HIT_DISTANCE) const;
+		template<class V1, class V2> void intersectRays(const V1& origins,
+			const V2& directions, std::vector<IntersectorHit>& hits,
+			bool coherent = false) const {
+			hits.resize(origins.size());
+			if (origins.size() > 0)
+				intersectRays(&origins[0], &directions[0], origins.size(),
+					hits.data(), coherent);
+		}
+		template<class V> void closestPoints(const V& points,
+			std::vector<IntersectorHit>& hits,
+			float maxDistance = NO_HIT_DISTANCE) const {
+			hits.resize(points.size());
+			if (points.size() > 0)
+				closestPoints(&points[0], points.size(), hits.data(),
+					maxDistance);
+		}
+		/*
+		 * lastTriangle is set to the index of the triangle found, for
+		 * getTriangle(), or INTERSECTOR_INVALID_TRIANGLE if there is none.
+		 */
 		double intersectRayDistance(const float3& p1, const float3& v,
-			float3& lastPoint, KDTriangle*& lastTriangle) const;
+			float3& lastPoint, uint32_t& lastTriangle) const;
 		double intersectSegmentDistance(const float3& p1, const float3& p2,
-			float3& lastPoint, KDTriangle*& lastTriangle) const;
+			float3& lastPoint, uint32_t& lastTriangle) const;
 		double closestPointSignedDistance(const float3& r, float3& lastPoint,
-			KDTriangle*& lastTriangle) const;
+			uint32_t& lastTriangle) const;
 		double closestPoint(const float3& pt, float3& lastPoint,
-			KDTriangle*& lastTriangle) const;
+			uint32_t& lastTriangle) const;
 		double closestPoint(const float3& pt,const float& maxDistance, float3& lastPoint,
-			KDTriangle*& lastTriangle) const;
-		double closestPointSignedDistance(const float3& r, const float& maxDistance, float3& lastPoint, KDTriangle*& lastTriangle) const;
+			uint32_t& lastTriangle) const;
+		double closestPointSignedDistance(const float3& r, const float& maxDistance, float3& lastPoint, uint32_t& lastTriangle) const;
 		double closestPointOutside(const float3& r, const float3& v,
-			float3& lastPoint, KDTriangle*& lastTriangle) const;
+			float3& lastPoint, uint32_t& lastTriangle) const;
 
 		double intersectRayDistance(const float3& p1, const float3& v,
 			float3& lastPoint) const {
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return intersectRayDistance(p1, v, lastPoint, lastTriangle);
 		}
 		double intersectSegmentDistance(const float3& p1, const float3& p2,
 			float3& lastPoint) const {
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return intersectSegmentDistance(p1, p2, lastPoint, lastTriangle);
 		}
 		double closestPointSignedDistance(const float3& r,
 			float3& lastPoint) const {
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPointSignedDistance(r, lastPoint, lastTriangle);
 		}
 		double closestPoint(const float3& pt,const float& maxDistance, float3& lastPoint) const{
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPoint(pt,maxDistance,lastPoint,lastTriangle);
 		}
 		double closestPoint(const float3& pt, float3& lastPoint) const {
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPoint(pt, lastPoint, lastTriangle);
 		}
 		double closestPointOutside(const float3& r, const float3& v,
 			float3& lastPoint) const {
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPointOutside(r, v, lastPoint, lastTriangle);
 		}
 		double intersectRayDistance(const float3& p1, const float3& v) const {
 			float3 lastPoint;
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return intersectRayDistance(p1, v, lastPoint, lastTriangle);
 		}
 		double intersectSegmentDistance(const float3& p1, const float3& p2) const {
 			float3 lastPoint;
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return intersectSegmentDistance(p1, p2, lastPoint, lastTriangle);
 		}
 		double closestPointSignedDistance(const float3& r) const {
 			float3 lastPoint;
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPointSignedDistance(r, lastPoint, lastTriangle);
 		}
 		double closestPointSignedDistance(const float3& r, const float& maxDistance) const {
 			float3 lastPoint;
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPointSignedDistance(r, maxDistance, lastPoint, lastTriangle);
 		}
 		double closestPoint(const float3& pt,const float& maxDistance) const{
 			float3 lastPoint;
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPoint(pt,maxDistance,lastPoint,lastTriangle);
 		}
 		double closestPoint(const float3& pt) const {
 			float3 lastPoint;
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPoint(pt, lastPoint, lastTriangle);
 		}
 		double closestPointOutside(const float3& r, const float3& v) const {
 			float3 lastPoint;
-			KDTriangle* lastTriangle;
+			uint32_t lastTriangle;
 			return closestPointOutside(r, v, lastPoint, lastTriangle);
 		}
 
 		double intersectRayDistance(const float3& p1, const float3& v,
-			KDTriangle*& lastTriangle) const {
+			uint32_t& lastTriangle) const {
 			float3 lastPoint;
 			return intersectRayDistance(p1, v, lastPoint, lastTriangle);
 		}
 		double intersectSegmentDistance(const float3& p1, const float3& p2,
-			KDTriangle*& lastTriangle) const {
+			uint32_t& lastTriangle) const {
 			float3 lastPoint;
 			return intersectSegmentDistance(p1, p2, lastPoint, lastTriangle);
 		}
-		double closestPointSignedDistance(const float3& r, KDTriangle*& lastTriangle) const {
+		double closestPointSignedDistance(const float3& r, uint32_t& lastTriangle) const {
 			float3 lastPoint;
 			return closestPointSignedDistance(r, lastPoint, lastTriangle);
 		}
-		double closestPoint(const float3& pt, KDTriangle*& lastTriangle) const {
+		double closestPoint(const float3& pt, uint32_t& lastTriangle) const {
 			float3 lastPoint;
 			return closestPoint(pt, lastPoint, lastTriangle);
 		}
 		double closestPointOutside(const float3& r, const float3& v,
-			KDTriangle*& lastTriangle) const {
+			uint32_t& lastTriangle) const {
 			float3 lastPoint;
 			return closestPointOutside(r, v, lastPoint, lastTriangle);
 		}
@@ -26,6 +26,8 @@
 #include "AlloyVector.h"
 #include "AlloyArray.h"
 #include "nanoflann.h"
+#include <atomic>
+#include <memory>
 
 namespace aly {
 bool SANITY_CHECK_LOCATOR();
@@ -99,7 +101,7 @@ public:
 		locator.insert(pti);
 		return pti.index;
 	}
-	void insert(const std::vector<vec<T, C>>& pts) {
+	template<class A> void insert(const std::vector<vec<T, C>, A>& pts) {
 		std::vector<xvec<T, C>> ptsi;
 		ptsi.reserve(pts.size());
 		for (vec<T, C> pt : pts) {
@@ -198,6 +200,627 @@ public:
 template<class T, int C> const xvec<T, C> Locator<T, C>::NO_POINT_FOUND = xvec<
 		T, C>(vec<T, C>(std::numeric_limits<T>::max()), -1);
 
+namespace detail {
+/*
+ * Runs query(q, matches) for q in [0, Q) in parallel and packs the matches
+ * into CSR form: results for query q are in [offsets[q], offsets[q+1]).
+ * Queries run in the given order if there is one, which lets callers visit
+ * them in spatial order for better cache use.
+ */
+template<class T, class F> void GatherMatches(int Q, const F& query,
+		std::vector<size_t>& offsets, std::vector<int>& indexes,
+		std::vector<T>& distances, const int* order = nullptr) {
+	const int CHUNK = 1024;
+	int chunks = (Q + CHUNK - 1) / CHUNK;
+	std::vector<std::vector<std::pair<int, T>>> results(chunks);
+	offsets.assign(Q + 1, 0);
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < chunks; c++) {
+		std::vector<std::pair<int, T>>& result = results[c];
+		std::vector<std::pair<int, T>> matches;
+		for (int p = c * CHUNK; p < std::min(Q, (c + 1) * CHUNK); p++) {
+			int q = (order != nullptr) ? order[p] : p;
+			query(q, matches);
+			result.insert(result.end(), matches.begin(), matches.end());
+			offsets[q + 1] = matches.size();
+		}
+	}
+	for (int q = 0; q < Q; q++) {
+		offsets[q + 1] += offsets[q];
+	}
+	indexes.resize(offsets[Q]);
+	distances.resize(offsets[Q]);
+#pragma omp parallel for
+	for (int c = 0; c < chunks; c++) {
+		size_t m = 0;
+		for (int p = c * CHUNK; p < std::min(Q, (c + 1) * CHUNK); p++) {
+			int q = (order != nullptr) ? order[p] : p;
+			for (size_t offset = offsets[q]; offset < offsets[q + 1]; offset++) {
+				indexes[offset] = results[c][m].first;
+				distances[offset] = results[c][m].second;
+				m++;
+			}
+		}
+	}
+}
+}
+/*
+ * Static kd-tree over points, bulk built by median splits. Leaves all sit
+ * at the same depth and split the points evenly, so the tree is implicit:
+ * node i has children 2i+1 and 2i+2, and only node bounds are stored. Each
+ * level is built in parallel. Batch queries run multithreaded and write
+ * into flat output buffers. Indexes refer to the order the points were
+ * given in and are -1 where no point was found.
+ */
+template<class T, int C> class PointIndex {
+protected:
+	struct Node {
+		vec<T, C> minPoint;
+		vec<T, C> maxPoint;
+	};
+	struct StackEntry {
+		uint32_t node;
+		T distance;
+	};
+	static const int MAX_DEPTH = 30;
+	std::vector<xvec<T, C>> points;
+	std::vector<Node> nodes;
+	int depth = 0;
+	size_t getBegin(int level, size_t k) const {
+		return (size_t) (((uint64_t) points.size() * k) >> level);
+	}
+	static T DistanceSqr(const Node& node, const vec<T, C>& pt) {
+		T sum = 0;
+		for (int c = 0; c < C; c++) {
+			T d = std::max(std::max(node.minPoint[c] - pt[c], T(0)),
+					pt[c] - node.maxPoint[c]);
+			sum += d * d;
+		}
+		return sum;
+	}
+	//Visits every point within the squared distance bound, which visit may shrink.
+	template<class F> void traverse(const vec<T, C>& pt, T& bound,
+			const F& visit) const {
+		if (points.size() == 0)
+			return;
+		const uint32_t firstLeaf = (1U << depth) - 1;
+		StackEntry stack[MAX_DEPTH + 2];
+		int stackSize = 0;
+		stack[stackSize++] = {0, DistanceSqr(nodes[0], pt)};
+		while (stackSize > 0) {
+			StackEntry entry = stack[--stackSize];
+			if (entry.distance > bound)
+				continue;
+			uint32_t index = entry.node;
+			while (index < firstLeaf) {
+				uint32_t left = 2 * index + 1, right = left + 1;
+				T nearLeft = DistanceSqr(nodes[left], pt);
+				T nearRight = DistanceSqr(nodes[right], pt);
+				if (nearRight < nearLeft) {
+					std::swap(left, right);
+					std::swap(nearLeft, nearRight);
+				}
+				if (nearLeft > bound)
+					break;
+				if (nearRight <= bound)
+					stack[stackSize++] = {right, nearRight};
+				index = left;
+			}
+			if (index < firstLeaf)
+				continue;
+			size_t end = getBegin(depth, index - firstLeaf + 1);
+			for (size_t i = getBegin(depth, index - firstLeaf); i < end; i++) {
+				T d = distanceSqr(pt, (const vec<T, C>&) points[i]);
+				if (d <= bound)
+					visit(points[i].index, d);
+			}
+		}
+	}
+	//Keeps the k nearest other than exclude in ascending order, returning how many were found.
+	int nearest(const vec<T, C>& pt, int k, int* indexes, T* distances,
+			T maxDistanceSqr, int exclude = -1) const {
+		int found = 0;
+		T bound = maxDistanceSqr;
+		if (k > 0) {
+			traverse(pt, bound, [&](int index, T d) {
+				if (index == exclude || (found == k && d >= distances[k - 1]))
+					return;
+				int j = (found < k) ? found++ : k - 1;
+				while (j > 0 && distances[j - 1] > d) {
+					distances[j] = distances[j - 1];
+					indexes[j] = indexes[j - 1];
+					j--;
+				}
+				distances[j] = d;
+				indexes[j] = index;
+				if (found == k)
+					bound = std::min(maxDistanceSqr, distances[k - 1]);
+			});
+		}
+		for (int j = found; j < k; j++) {
+			indexes[j] = -1;
+			distances[j] = std::numeric_limits<T>::infinity();
+		}
+		return found;
+	}
+public:
+	PointIndex() {
+	}
+	PointIndex(const Vector<T, C>& data, int leafSize = 8) {
+		build(data, leafSize);
+	}
+	PointIndex(const std::vector<vec<T, C>>& data, int leafSize = 8) {
+		build(data, leafSize);
+	}
+	size_t size() const {
+		return points.size();
+	}
+	void clear() {
+		points.clear();
+		nodes.clear();
+		depth = 0;
+	}
+	void build(const Vector<T, C>& data, int leafSize = 8) {
+		build(data.data.data(), data.size(), leafSize);
+	}
+	void build(const std::vector<vec<T, C>>& data, int leafSize = 8) {
+		build(data.data(), data.size(), leafSize);
+	}
+	void build(const vec<T, C>* data, size_t count, int leafSize = 8) {
+		if (count >= (size_t) std::numeric_limits<int>::max())
+			throw std::runtime_error(
+					MakeString() << "Point index cannot hold " << count
+							<< " points.");
+		points.resize(count);
+		int N = (int) count;
+#pragma omp parallel for
+		for (int i = 0; i < N; i++) {
+			points[i] = xvec<T, C>(data[i], i);
+		}
+		depth = 0;
+		while (depth < MAX_DEPTH
+				&& ((count + ((size_t) 1 << depth) - 1) >> depth)
+						> (size_t) std::max(leafSize, 1)) {
+			depth++;
+		}
+		nodes.resize((count > 0) ? (2U << depth) - 1 : 0);
+		if (count == 0)
+			return;
+		for (int level = 0; level <= depth; level++) {
+			int first = (1 << level) - 1;
+			int levelCount = 1 << level;
+#pragma omp parallel for schedule(dynamic, 1 + levelCount / 256)
+			for (int k = 0; k < levelCount; k++) {
+				size_t begin = getBegin(level, k), end = getBegin(level, k + 1);
+				Node& node = nodes[first + k];
+				node.minPoint = vec<T, C>(std::numeric_limits<T>::max());
+				node.maxPoint = vec<T, C>(std::numeric_limits<T>::lowest());
+				for (size_t i = begin; i < end; i++) {
+					node.minPoint = aly::min(node.minPoint, (const vec<T, C>&) points[i]);
+					node.maxPoint = aly::max(node.maxPoint, (const vec<T, C>&) points[i]);
+				}
+				if (level == depth || end - begin < 2)
+					continue;
+				int axis = 0;
+				vec<T, C> extent = node.maxPoint - node.minPoint;
+				for (int c = 1; c < C; c++) {
+					if (extent[c] > extent[axis])
+						axis = c;
+				}
+				std::nth_element(points.begin() + begin,
+						points.begin() + getBegin(level + 1, 2 * k + 1),
+						points.begin() + end,
+						[axis](const xvec<T, C>& a, const xvec<T, C>& b) {
+							return a[axis] < b[axis];
+						});
+			}
+		}
+	}
+	//Index of the closest point no farther than maxDistance, or -1.
+	int closest(const vec<T, C>& pt,
+			T maxDistance = std::numeric_limits<T>::infinity()) const {
+		int index;
+		T d;
+		nearest(pt, 1, &index, &d, maxDistance * maxDistance);
+		return index;
+	}
+	//k nearest points and their distances, nearest first.
+	void closest(const vec<T, C>& pt, int k,
+			std::vector<std::pair<int, T>>& matches,
+			T maxDistance = std::numeric_limits<T>::infinity()) const {
+		std::vector<int> indexes(k);
+		std::vector<T> distances(k);
+		int found = nearest(pt, k, indexes.data(), distances.data(),
+				maxDistance * maxDistance);
+		matches.resize(found);
+		for (int j = 0; j < found; j++) {
+			matches[j] = std::pair<int, T>(indexes[j], std::sqrt(distances[j]));
+		}
+	}
+	//Points within maxDistance and their distances, nearest first.
+	void closest(const vec<T, C>& pt, T maxDistance,
+			std::vector<std::pair<int, T>>& matches) const {
+		matches.clear();
+		T bound = maxDistance * maxDistance;
+		traverse(pt, bound, [&](int index, T d) {
+			matches.push_back(std::pair<int, T>(index, d));
+		});
+		std::sort(matches.begin(), matches.end(),
+				[](const std::pair<int, T>& a, const std::pair<int, T>& b) {
+					return a.second < b.second;
+				});
+		for (std::pair<int, T>& match : matches) {
+			match.second = std::sqrt(match.second);
+		}
+	}
+	/*
+	 * k nearest points of every query. Row q of indexes and distances, both
+	 * of size queries.size()*k, holds the results for query q nearest first.
+	 */
+	void closest(const Vector<T, C>& queries, int k, std::vector<int>& indexes,
+			std::vector<T>& distances,
+			T maxDistance = std::numeric_limits<T>::infinity()) const {
+		int Q = (int) queries.size();
+		indexes.resize((size_t) Q * k);
+		distances.resize((size_t) Q * k);
+		const T maxDistanceSqr = maxDistance * maxDistance;
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int q = 0; q < Q; q++) {
+			int* index = &indexes[(size_t) q * k];
+			T* dist = &distances[(size_t) q * k];
+			int found = nearest(queries[q], k, index, dist, maxDistanceSqr);
+			for (int j = 0; j < found; j++) {
+				dist[j] = std::sqrt(dist[j]);
+			}
+		}
+	}
+	/*
+	 * Points within maxDistance of every query, nearest first. Results for
+	 * query q are in [offsets[q], offsets[q+1]) of indexes and distances.
+	 */
+	void closest(const Vector<T, C>& queries, T maxDistance,
+			std::vector<size_t>& offsets, std::vector<int>& indexes,
+			std::vector<T>& distances) const {
+		detail::GatherMatches((int) queries.size(),
+				[&](int q, std::vector<std::pair<int, T>>& matches) {
+					closest(queries[q], maxDistance, matches);
+				}, offsets, indexes, distances);
+	}
+	/*
+	 * k nearest neighbors of every indexed point, not counting the point
+	 * itself, in the same layout as the batch kNN query. Points are visited
+	 * in tree order, which keeps neighboring queries in cache.
+	 */
+	void neighbors(int k, std::vector<int>& indexes,
+			std::vector<T>& distances) const {
+		int N = (int) points.size();
+		indexes.resize((size_t) N * k);
+		distances.resize((size_t) N * k);
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int i = 0; i < N; i++) {
+			const xvec<T, C>& pt = points[i];
+			int* index = &indexes[(size_t) pt.index * k];
+			T* dist = &distances[(size_t) pt.index * k];
+			int found = nearest(pt, k, index, dist,
+					std::numeric_limits<T>::infinity(), pt.index);
+			for (int j = 0; j < found; j++) {
+				dist[j] = std::sqrt(dist[j]);
+			}
+		}
+	}
+};
+typedef PointIndex<float, 2> PointIndex2f;
+typedef PointIndex<float, 3> PointIndex3f;
+typedef PointIndex<float, 4> PointIndex4f;
+typedef PointIndex<double, 2> PointIndex2d;
+typedef PointIndex<double, 3> PointIndex3d;
+typedef PointIndex<double, 4> PointIndex4d;
+
+/*
+ * Cell list for fixed-radius neighbor queries on particles. Particles are
+ * binned into cells of size cellSize, and cells are mapped into a table
+ * with one bucket per particle, so empty space costs nothing. The bucket
+ * interleaves the low bits of the cell coordinates, so neighboring cells
+ * land in nearby buckets. The table is filled by a parallel counting sort,
+ * which also reorders particles into bucket order.
+ *
+ * With a nonzero skin, update() only rebuilds once some particle has moved
+ * more than skin/2 since the last build. Queries then search skin/2 beyond
+ * their radius, so results stay exact. Choose cellSize = radius + skin for
+ * the interaction radius used by the simulation.
+ */
+template<class T, int C> class SpatialHash {
+	static_assert(C == 2 || C == 3, "SpatialHash supports 2D and 3D points.");
+protected:
+	static const int KEY_BITS = 21;
+	std::vector<xvec<T, C>> points;
+	std::vector<vec<T, C>> anchors;
+	std::vector<uint64_t> keys;
+	std::vector<uint32_t> bucketStart;
+	std::vector<int> order;
+	std::vector<uint64_t> particleKeys;
+	std::vector<uint32_t> spread;
+	std::unique_ptr<std::atomic<uint32_t>[]> cursors;
+	size_t cursorCount = 0;
+	int tableBits = 0;
+	int axisBits[C] = { };
+	T cellSize;
+	T skin;
+	int64_t getCell(T value) const {
+		return (int64_t) std::floor(value / cellSize);
+	}
+	uint64_t getKey(const int64_t* cell) const {
+		const uint64_t mask = (uint64_t(1) << KEY_BITS) - 1;
+		uint64_t key = 0;
+		for (int c = 0; c < C; c++) {
+			key = (key << KEY_BITS) | ((uint64_t) cell[c] & mask);
+		}
+		return key;
+	}
+	uint64_t getKey(const vec<T, C>& pt) const {
+		int64_t cell[C];
+		for (int c = 0; c < C; c++) {
+			cell[c] = getCell(pt[c]);
+		}
+		return getKey(cell);
+	}
+	uint32_t getBucket(uint64_t key) const {
+		uint32_t bucket = 0;
+		for (int c = 0; c < C; c++) {
+			uint32_t low = (uint32_t) (key >> ((C - 1 - c) * KEY_BITS))
+					& ((1U << axisBits[c]) - 1);
+			bucket |= spread[(c << axisBits[0]) + low];
+		}
+		return bucket;
+	}
+public:
+	SpatialHash(T cellSize = T(1), T skin = T(0)) :
+			cellSize(cellSize), skin(skin) {
+	}
+	SpatialHash(const Vector<T, C>& positions, T cellSize, T skin = T(0)) :
+			cellSize(cellSize), skin(skin) {
+		build(positions);
+	}
+	size_t size() const {
+		return points.size();
+	}
+	T getCellSize() const {
+		return cellSize;
+	}
+	T getSkin() const {
+		return skin;
+	}
+	void clear() {
+		points.clear();
+		anchors.clear();
+		keys.clear();
+		order.clear();
+		bucketStart.clear();
+	}
+	void build(const Vector<T, C>& positions) {
+		if (!(cellSize > T(0)))
+			throw std::runtime_error(
+					MakeString() << "Spatial hash cell size must be positive: "
+							<< cellSize);
+		size_t count = positions.size();
+		if (count >= (size_t) std::numeric_limits<int>::max())
+			throw std::runtime_error(
+					MakeString() << "Spatial hash cannot hold " << count
+							<< " particles.");
+		int N = (int) count;
+		tableBits = 0;
+		while (tableBits < 30 && ((size_t) 1 << tableBits) < count)
+			tableBits++;
+		int buckets = 1 << tableBits;
+		//Bit b of the bucket is bit b/C of axis b%C.
+		for (int c = 0; c < C; c++) {
+			axisBits[c] = (tableBits + C - 1 - c) / C;
+		}
+		spread.assign(C << axisBits[0], 0);
+		for (int c = 0; c < C; c++) {
+			for (uint32_t v = 0; v < (1U << axisBits[c]); v++) {
+				for (int j = 0; j < axisBits[c]; j++) {
+					spread[(c << axisBits[0]) + v] |= ((v >> j) & 1U) << (j * C + c);
+				}
+			}
+		}
+		if (cursorCount < (size_t) buckets) {
+			cursors.reset(new std::atomic<uint32_t>[buckets]);
+			cursorCount = buckets;
+		}
+		bucketStart.resize(buckets + 1);
+		particleKeys.resize(count);
+		order.resize(count);
+#pragma omp parallel for
+		for (int b = 0; b < buckets; b++) {
+			cursors[b].store(0, std::memory_order_relaxed);
+		}
+#pragma omp parallel for
+		for (int i = 0; i < N; i++) {
+			particleKeys[i] = getKey(positions[i]);
+			cursors[getBucket(particleKeys[i])].fetch_add(1,
+					std::memory_order_relaxed);
+		}
+		//Exclusive scan of bucket counts in parallel blocks.
+		const int BLOCK = 1 << 16;
+		int blocks = (buckets + BLOCK - 1) / BLOCK;
+		std::vector<uint32_t> blockSums(blocks + 1, 0);
+#pragma omp parallel for
+		for (int k = 0; k < blocks; k++) {
+			uint32_t sum = 0;
+			for (int b = k * BLOCK; b < std::min(buckets, (k + 1) * BLOCK); b++) {
+				sum += cursors[b].load(std::memory_order_relaxed);
+			}
+			blockSums[k + 1] = sum;
+		}
+		for (int k = 0; k < blocks; k++) {
+			blockSums[k + 1] += blockSums[k];
+		}
+#pragma omp parallel for
+		for (int k = 0; k < blocks; k++) {
+			uint32_t sum = blockSums[k];
+			for (int b = k * BLOCK; b < std::min(buckets, (k + 1) * BLOCK); b++) {
+				uint32_t bucketCount = cursors[b].load(std::memory_order_relaxed);
+				bucketStart[b] = sum;
+				cursors[b].store(sum, std::memory_order_relaxed);
+				sum += bucketCount;
+			}
+		}
+		bucketStart[buckets] = (uint32_t) count;
+#pragma omp parallel for
+		for (int i = 0; i < N; i++) {
+			order[cursors[getBucket(particleKeys[i])].fetch_add(1,
+					std::memory_order_relaxed)] = i;
+		}
+		//Scatter order depends on thread timing, so group cells and restore index order within buckets.
+#pragma omp parallel for schedule(dynamic, 4096)
+		for (int b = 0; b < buckets; b++) {
+			if (bucketStart[b + 1] - bucketStart[b] > 1) {
+				std::sort(order.begin() + bucketStart[b],
+						order.begin() + bucketStart[b + 1],
+						[this](int i, int j) {
+							return (particleKeys[i] != particleKeys[j]) ?
+									particleKeys[i] < particleKeys[j] : i < j;
+						});
+			}
+		}
+		points.resize(count);
+		anchors.resize(count);
+		keys.resize(count);
+#pragma omp parallel for
+		for (int s = 0; s < N; s++) {
+			int i = order[s];
+			points[s] = xvec<T, C>(positions[i], i);
+			anchors[s] = positions[i];
+			keys[s] = particleKeys[i];
+		}
+	}
+	/*
+	 * Moves particles to new positions, rebuilding only if some particle has
+	 * left its skin. Returns true if the hash was rebuilt.
+	 */
+	bool update(const Vector<T, C>& positions) {
+		if (positions.size() != points.size()) {
+			build(positions);
+			return true;
+		}
+		int N = (int) points.size();
+		const T limit = T(0.25) * skin * skin;
+		int moved = 0;
+#pragma omp parallel for reduction(+:moved)
+		for (int s = 0; s < N; s++) {
+			const vec<T, C>& pt = positions[points[s].index];
+			if (distanceSqr(pt, anchors[s]) > limit)
+				moved++;
+			points[s] = xvec<T, C>(pt, points[s].index);
+		}
+		if (moved > 0) {
+			build(positions);
+			return true;
+		}
+		return false;
+	}
+	//Calls visit(index, distanceSqr) for every particle within radius of pt.
+	template<class F> void forEach(const vec<T, C>& pt, T radius,
+			const F& visit) const {
+		if (points.size() == 0)
+			return;
+		const T reach = radius + T(0.5) * skin;
+		const T radiusSqr = radius * radius;
+		int64_t lo[C], hi[C], cell[C];
+		for (int c = 0; c < C; c++) {
+			lo[c] = getCell(pt[c] - reach);
+			hi[c] = getCell(pt[c] + reach);
+			cell[c] = lo[c];
+		}
+		while (true) {
+			uint64_t key = getKey(cell);
+			uint32_t bucket = getBucket(key);
+			for (uint32_t s = bucketStart[bucket]; s < bucketStart[bucket + 1];
+					s++) {
+				if (keys[s] != key)
+					continue;
+				T d = distanceSqr(pt, (const vec<T, C>&) points[s]);
+				if (d <= radiusSqr)
+					visit(points[s].index, d);
+			}
+			int c = C - 1;
+			while (c >= 0 && cell[c] == hi[c]) {
+				cell[c] = lo[c];
+				c--;
+			}
+			if (c < 0)
+				break;
+			cell[c]++;
+		}
+	}
+	//Particles within radius of pt and their distances, nearest first.
+	void closest(const vec<T, C>& pt, T radius,
+			std::vector<std::pair<int, T>>& matches, int exclude = -1) const {
+		matches.clear();
+		forEach(pt, radius, [&](int index, T d) {
+			if (index != exclude)
+				matches.push_back(std::pair<int, T>(index, d));
+		});
+		std::sort(matches.begin(), matches.end(),
+				[](const std::pair<int, T>& a, const std::pair<int, T>& b) {
+					return a.second < b.second;
+				});
+		for (std::pair<int, T>& match : matches) {
+			match.second = std::sqrt(match.second);
+		}
+	}
+	/*
+	 * Particles within radius of every query, nearest first. Results for
+	 * query q are in [offsets[q], offsets[q+1]) of indexes and distances.
+	 */
+	void closest(const Vector<T, C>& queries, T radius,
+			std::vector<size_t>& offsets, std::vector<int>& indexes,
+			std::vector<T>& distances) const {
+		detail::GatherMatches((int) queries.size(),
+				[&](int q, std::vector<std::pair<int, T>>& matches) {
+					closest(queries[q], radius, matches);
+				}, offsets, indexes, distances);
+	}
+	/*
+	 * Neighbors of every particle within radius, not counting the particle
+	 * itself, in the same layout as the batch radius query.
+	 */
+	void neighbors(T radius, std::vector<size_t>& offsets,
+			std::vector<int>& indexes, std::vector<T>& distances) const {
+		int N = (int) points.size();
+		std::vector<int> slots(N);
+#pragma omp parallel for
+		for (int s = 0; s < N; s++) {
+			slots[points[s].index] = s;
+		}
+		detail::GatherMatches(N,
+				[&](int i, std::vector<std::pair<int, T>>& matches) {
+					closest(points[slots[i]], radius, matches, i);
+				}, offsets, indexes, distances, order.data());
+	}
+	/*
+	 * Calls visit(i, j, distanceSqr) once for every pair of particles i < j
+	 * within radius. Pairs are visited in parallel, so visit must be safe to
+	 * call from several threads at once.
+	 */
+	template<class F> void forEachPair(T radius, const F& visit) const {
+		int N = (int) points.size();
+#pragma omp parallel for schedule(dynamic, 256)
+		for (int s = 0; s < N; s++) {
+			const xvec<T, C>& pt = points[s];
+			forEach(pt, radius, [&](int index, T d) {
+				if (pt.index < index)
+					visit(pt.index, index, d);
+			});
+		}
+	}
+};
+typedef SpatialHash<float, 2> SpatialHash2f;
+typedef SpatialHash<float, 3> SpatialHash3f;
+typedef SpatialHash<double, 2> SpatialHash2d;
+typedef SpatialHash<double, 3> SpatialHash3d;
+
 namespace detail {
 template<typename T = double, int C = -1, class Distance = nanoflann::metric_L2,
 		typename IndexType = size_t>
@@ -432,10 +1055,10 @@ public:
 };
 template<class T, int C> const size_t Matcher<T, C>::NO_POINT_FOUND =
 		std::numeric_limits<size_t>::max();
-//FLANN Matcher does not allow the insertion of points! All data must be provided up front.
+//Matcher does not allow the insertion of points! All data must be provided up front.
 template<class T, int C> class MatcherVec {
 protected:
-	detail::KdTreeVectorAdapter<T, C, nanoflann::metric_L2, size_t> locator;
+	PointIndex<T, C> locator;
 public:
 	static const size_t NO_POINT_FOUND;
 	MatcherVec(const Vector<T, C>& data, int maxDepth = 16) :
@@ -443,73 +1066,44 @@ public:
 	}
 	void closest(const vec<T, C>& pt, T maxDistance,
 			std::vector<size_t>& matches) const {
-		std::vector<std::pair<size_t, T> > ret_matches;
-		nanoflann::SearchParams params;
-		const size_t nMatches = locator.index->radiusSearch(&pt[0],
-				maxDistance * maxDistance, ret_matches, params);
-		matches.clear();
-		matches.reserve(nMatches);
-		for (size_t i = 0; i < nMatches; i++) {
-			matches.push_back(ret_matches[i].first);
+		std::vector<std::pair<int, T>> found;
+		locator.closest(pt, maxDistance, found);
+		matches.resize(found.size());
+		for (size_t i = 0; i < found.size(); i++) {
+			matches[i] = found[i].first;
 		}
 	}
 	void closest(const vec<T, C>& pt, T maxDistance,
 			std::vector<std::pair<size_t, T>>& matches) const {
-		matches.clear();
-		nanoflann::SearchParams params;
-		locator.index->radiusSearch(&pt[0], maxDistance * maxDistance, matches,
-				params);
-		for (std::pair<size_t, T>& pr : matches) {
-			pr.second = std::sqrt(pr.second);
-		}
+		std::vector<std::pair<int, T>> found;
+		locator.closest(pt, maxDistance, found);
+		matches.assign(found.begin(), found.end());
 	}
 	void closest(const vec<T, C>& pt, int kNN,
 			std::vector<size_t>& matches) const {
-		std::vector<size_t> ret_index(kNN, NO_POINT_FOUND);
-		std::vector<T> out_dist_sqr(kNN);
-		locator.index->knnSearch(&pt[0], kNN, ret_index.data(),
-				out_dist_sqr.data());
-		matches.clear();
-		matches.reserve(kNN);
-		for (size_t i = 0; i < kNN; i++) {
-			if (ret_index[i] != NO_POINT_FOUND) {
-				matches.push_back(ret_index[i]);
-			}
+		std::vector<std::pair<int, T>> found;
+		locator.closest(pt, kNN, found);
+		matches.resize(found.size());
+		for (size_t i = 0; i < found.size(); i++) {
+			matches[i] = found[i].first;
 		}
 	}
 	void closest(const vec<T, C>& pt, int kNN,
 			std::vector<std::pair<size_t, T>>& matches) const {
-		std::vector<size_t> ret_index(kNN, NO_POINT_FOUND);
-		std::vector<T> out_dist_sqr(kNN);
-		locator.index->knnSearch(&pt[0], kNN, ret_index.data(),
-				out_dist_sqr.data());
-		matches.clear();
-		matches.reserve(kNN);
-		for (size_t i = 0; i < kNN; i++) {
-			if (ret_index[i] != NO_POINT_FOUND) {
-				matches.push_back(
-						std::pair<size_t, T>(ret_index[i],
-								std::sqrt(out_dist_sqr[i])));
-			}
-		}
+		std::vector<std::pair<int, T>> found;
+		locator.closest(pt, kNN, found);
+		matches.assign(found.begin(), found.end());
 	}
 	size_t closest(const vec<T, C>& pt) const {
-		std::vector<size_t> ret_index(1, NO_POINT_FOUND);
-		std::vector<T> out_dist_sqr(1);
-		locator.index->knnSearch(&pt[0], 1, ret_index.data(),
-				out_dist_sqr.data());
-		return ret_index[0];
+		int index = locator.closest(pt);
+		return (index >= 0) ? (size_t) index : NO_POINT_FOUND;
 	}
 	size_t closest(const vec<T, C>& pt, T maxDistance) const {
-		std::vector<std::pair<size_t, T> > ret_matches;
-		nanoflann::SearchParams params;
-		const size_t nMatches = locator.index->radiusSearch(&pt[0],
-				maxDistance * maxDistance, ret_matches, params);
-		if (nMatches > 0) {
-			return ret_matches[0].first;
-		} else {
-			return NO_POINT_FOUND;
-		}
+		int index = locator.closest(pt, maxDistance);
+		return (index >= 0) ? (size_t) index : NO_POINT_FOUND;
+	}
+	const PointIndex<T, C>& getIndex() const {
+		return locator;
 	}
 };
 template<class T, int C> const size_t MatcherVec<T, C>::NO_POINT_FOUND =
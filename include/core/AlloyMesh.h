@@ -32,10 +32,40 @@
 #include <list>
 namespace aly {
 	bool SANITY_CHECK_SUBDIVIDE();
+	bool SANITY_CHECK_MESH_ADJACENCY();
+	bool SANITY_CHECK_VERTEX_NORMALS();
+	bool SANITY_CHECK_MESH_CACHE();
 class Mesh;
 enum class SubDivisionScheme {
 	CatmullClark,Loop
 };
+/*
+ * How face normals are weighted at a vertex: equally, by the area of the
+ * corner's triangle, or by the corner's interior angle.
+ */
+enum class NormalWeighting {
+	Uniform, Area, Angle
+};
+/*
+ * Flat (CSR) neighbor table. The neighbors of element i are
+ * indexes[offsets[i]] through indexes[offsets[i+1]-1].
+ */
+struct MeshNeighborTable {
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> indexes;
+	size_t size() const {
+		return (offsets.size() > 0) ? offsets.size() - 1 : 0;
+	}
+	uint32_t getDegree(size_t i) const {
+		return offsets[i + 1] - offsets[i];
+	}
+	const uint32_t* begin(size_t i) const {
+		return indexes.data() + offsets[i];
+	}
+	const uint32_t* end(size_t i) const {
+		return indexes.data() + offsets[i + 1];
+	}
+};
 struct GLMesh: public GLComponent {
 public:
 	enum class PrimitiveType {
@@ -75,6 +105,10 @@ private:
 	bool dirtyOffScreen = false;
 protected:
 	box3f boundingBox;
+	//Corner table from the last full normal update, reused until the faces are touched.
+	MeshNeighborTable vertexCorners;
+	bool dirtyCorners = true;
+	std::vector<uint32_t> touchedVertexes;
 public:
 	friend struct GLMesh;
 
@@ -106,10 +140,11 @@ public:
 		mesh.pose = pose;
 		mesh.dirtyOnScreen = true;
 		mesh.dirtyOffScreen = true;
-
+		mesh.touchFaces();
 	}
 
 	template<class Archive> void serialize(Archive & archive) {
+		touchFaces();
 		archive(CEREAL_NVP(pose), CEREAL_NVP(vertexLocations),
 				CEREAL_NVP(vertexNormals), CEREAL_NVP(vertexColors),
 				CEREAL_NVP(quadIndexes), CEREAL_NVP(triIndexes),
@@ -143,8 +178,33 @@ public:
 		return (onScreen)?dirtyOnScreen:dirtyOffScreen;
 	}
 	bool load(const std::string& file);
+	/*
+	 * Recomputes every normal by gathering the weighted normals of the face
+	 * corners at each vertex, then optionally smooths them by averaging
+	 * neighbors whose normals agree within DOT_TOLERANCE.
+	 */
 	void updateVertexNormals(int SMOOTH_ITERATIONS = 0, float DOT_TOLERANCE =
-			0.75f);
+			0.75f, NormalWeighting weighting = NormalWeighting::Area);
+	/*
+	 * Marks a vertex that moved since the last normal update.
+	 * updateTouchedVertexNormals() then recomputes only the normals of touched
+	 * vertices and their face neighbors, reusing the corner table from the
+	 * last full update. If the faces were touched it falls back to a full
+	 * update. The weighting should match the full update. Smoothing is not
+	 * applied. Not thread-safe; mark vertices from one thread at a time.
+	 */
+	void touchVertex(uint32_t v) {
+		touchedVertexes.push_back(v);
+	}
+	/*
+	 * Marks the faces as edited so the next incremental normal update rebuilds
+	 * the corner table. Call after changing triIndexes or quadIndexes directly.
+	 */
+	void touchFaces() {
+		dirtyCorners = true;
+	}
+	void updateTouchedVertexNormals(NormalWeighting weighting =
+			NormalWeighting::Area);
 	void convertQuadsToTriangles();
 	void mapIntoBoundingBox(float voxelSize);
 	void mapOutOfBoundingBox(float voxelSize);
@@ -173,12 +233,145 @@ void WritePlyMeshToFile(const std::string& file, const Mesh& mesh, bool binary =
 		true);
 void WriteMeshToFile(const std::string& file, const Mesh& mesh);
 void WriteObjMeshToFile(const std::string& file,const Mesh& mesh);
+/*
+ * Native binary mesh file (.amesh). A MeshFileHeader is followed by one
+ * block per MeshBlock, each BUFFER_ALIGNMENT aligned and stored in native
+ * byte order, so a file can be mapped and used without parsing. Sidecar
+ * caches also record the size and modification time of their source file.
+ */
+enum class MeshBlock {
+	VertexLocations = 0,
+	VertexNormals = 1,
+	VertexColors = 2,
+	QuadIndexes = 3,
+	TriIndexes = 4,
+	TextureMap = 5
+};
+static const int MESH_BLOCK_COUNT = 6;
+struct MeshFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t sourceSize;
+	int64_t sourceTime; //Source modification time in nanoseconds.
+	uint64_t counts[MESH_BLOCK_COUNT];
+	uint64_t offsets[MESH_BLOCK_COUNT];
+};
+void WriteBinaryMeshToFile(const std::string& file, const Mesh& mesh);
+void ReadBinaryMeshFromFile(const std::string& file, Mesh& mesh);
+/*
+ * Read-only mesh backed by a memory-mapped .amesh file. Opening only
+ * checks the header; blocks are paged in by the OS as they are touched.
+ */
+struct MappedMesh {
+private:
+	std::shared_ptr<MappedFile> mapping;
+	MeshFileHeader header;
+	template<class T> const T* getBlock(MeshBlock block) const {
+		return (header.counts[(int) block] > 0) ?
+				reinterpret_cast<const T*>(mapping->data()
+						+ header.offsets[(int) block]) :
+				nullptr;
+	}
+public:
+	const float3* vertexLocations;
+	const float3* vertexNormals;
+	const float4* vertexColors;
+	const uint4* quadIndexes;
+	const uint3* triIndexes;
+	const float2* textureMap;
+	MappedMesh();
+	MappedMesh(const std::string& file);
+	void open(const std::string& file);
+	void close();
+	bool isOpen() const {
+		return (mapping.get() != nullptr);
+	}
+	size_t size(MeshBlock block) const {
+		return (size_t) header.counts[(int) block];
+	}
+	const MeshFileHeader& getHeader() const {
+		return header;
+	}
+	void copyTo(Mesh& mesh) const;
+};
+/*
+ * When enabled, ReadMeshFromFile() keeps a <file>.amesh sidecar next to
+ * every PLY and OBJ file it parses and loads from it while the source is
+ * unchanged. Meshes with a texture image are not cached. Off by default.
+ */
+void SetMeshCacheEnabled(bool enabled);
+bool IsMeshCacheEnabled();
 typedef std::vector<std::set<uint32_t>> MeshSetNeighborTable;
 typedef std::vector<std::list<uint32_t>> MeshListNeighborTable;
 void CreateVertexNeighborTable(const Mesh& mesh, MeshSetNeighborTable& vertNbrs);
 void CreateOrderedVertexNeighborTable(const Mesh& mesh,
 	MeshListNeighborTable& vertNbrs, bool leaveTail = false);
+/*
+ * Same neighbors as the CSR face table below, in the face's own edge order
+ * (x-y, y-z, ...). Older versions listed them in edge-key order.
+ */
 void CreateFaceNeighborTable(const Mesh& mesh, MeshListNeighborTable& faceNbrs);
-void Subdivide(Mesh& mesh, SubDivisionScheme type= SubDivisionScheme::CatmullClark);
+/*
+ * Half-edge connectivity for meshes of triangles and quads. Half-edge
+ * 3f+k runs from corner k of triangle f to the next corner, and quads
+ * follow the triangles with four half-edges each. Twins are set only
+ * where exactly two faces share an edge, so boundary and non-manifold
+ * edges have no twin. vertexEdges holds one outgoing half-edge per vertex,
+ * a boundary one if there is one, so one-ring walks can start there.
+ */
+struct MeshHalfEdges {
+	static const uint32_t NONE = 0xFFFFFFFF;
+	uint32_t triangleCount = 0;
+	std::vector<uint32_t> origins;
+	std::vector<uint32_t> twins;
+	std::vector<uint32_t> vertexEdges;
+	size_t size() const {
+		return origins.size();
+	}
+	uint32_t getFace(uint32_t h) const {
+		uint32_t t = 3 * triangleCount;
+		return (h < t) ? h / 3 : triangleCount + (h - t) / 4;
+	}
+	uint32_t getNext(uint32_t h) const {
+		uint32_t t = 3 * triangleCount;
+		return (h < t) ? ((h % 3 == 2) ? h - 2 : h + 1) :
+				(((h - t) % 4 == 3) ? h - 3 : h + 1);
+	}
+	uint32_t getPrev(uint32_t h) const {
+		uint32_t t = 3 * triangleCount;
+		return (h < t) ? ((h % 3 == 0) ? h + 2 : h - 1) :
+				(((h - t) % 4 == 0) ? h + 3 : h - 1);
+	}
+	uint32_t getOrigin(uint32_t h) const {
+		return origins[h];
+	}
+	uint32_t getTarget(uint32_t h) const {
+		return origins[getNext(h)];
+	}
+	uint32_t getTwin(uint32_t h) const {
+		return twins[h];
+	}
+	bool isBoundary(uint32_t h) const {
+		return (twins[h] == NONE);
+	}
+};
+/*
+ * Parallel, sort-based builders. Vertex neighbors are sorted and unique.
+ * Face neighbors share an edge with exactly one other face and are listed
+ * in half-edge order, one entry per shared edge.
+ */
+void CreateVertexNeighborTable(const Mesh& mesh, MeshNeighborTable& vertNbrs);
+void CreateFaceNeighborTable(const Mesh& mesh, MeshNeighborTable& faceNbrs);
+void CreateHalfEdges(const Mesh& mesh, MeshHalfEdges& halfEdges);
+void CreateFaceNeighborTable(const MeshHalfEdges& halfEdges,
+		MeshNeighborTable& faceNbrs);
+//Lists the face corners (half-edges, numbered as above) at each vertex in order.
+void CreateVertexCornerTable(const Mesh& mesh, MeshNeighborTable& vertCorners);
+/*
+ * Applies the given number of subdivision levels in place. Each level
+ * replaces the mesh buffers, and normals are recomputed once at the end.
+ */
+void Subdivide(Mesh& mesh, SubDivisionScheme type= SubDivisionScheme::CatmullClark, int levels = 1);
 }
 #endif /* MESH_H_ */
@@ -35,6 +35,7 @@
 namespace aly
 {
 	bool SANITY_CHECK_MESH_IO();
+	bool SANITY_CHECK_PLY_IO();
 namespace ply
 {
 enum class FileFormat
@@ -344,6 +345,15 @@ class PLYReaderWriter
         {
             return plyFile->elemNames;
         }
+        FileFormat getFileFormat() const
+        {
+            return plyFile->file_type;
+        }
+        /* Raw access to the element data that follows the header, for bulk
+         * binary readers and writers that bypass getElement/putElement.
+         * readBytes returns fewer bytes than requested only at end of file. */
+        size_t readBytes(char* data, size_t bytes);
+        void writeBytes(const char* data, size_t bytes);
         void openForWriting(const std::string& fileName,
                             const std::vector<std::string>& elem_names,
                             const FileFormat& file_type);
@@ -29,6 +29,7 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <thread>
 namespace aly {
 
 template<class T, int C> struct SparseMatrix {
@@ -153,6 +154,10 @@ template<class T, int C> Vector<T, C> operator*(const SparseMatrix<T, 1>& A,
 	}
 	return out;
 }
+template<class E, class T, int C> Vector<T, C> operator*(
+		const SparseMatrix<T, 1>& A, const Expression<E, Vector<T, C>>& v) {
+	return A * v.eval();
+}
 template<class T, int C> SparseMatrix<T, C>& operator*=(
 		SparseMatrix<T, C>& A, const vec<T, C>& v) {
 #pragma omp parallel for
@@ -511,7 +516,7 @@ template<class T, int C> SparseMatrix<T, C>& operator-=(
 	return A;
 }
 template<class T, int C> void Multiply(Vector<T, C>& out,
-		const SparseMatrix<T, 1>& A, const Vector<T, C>& v) {
+		const SparseMatrix<T, 1>& A, const ExpressionInput<Vector<T, C>>& v) {
 	out.resize(A.rows);
 #pragma omp parallel for
 	for (int i = 0; i < (int) A.rows; i++) {
@@ -523,8 +528,8 @@ template<class T, int C> void Multiply(Vector<T, C>& out,
 	}
 }
 template<class T, int C> void AddMultiply(Vector<T, C>& out,
-		const Vector<T, C>& b, const SparseMatrix<T, 1>& A,
-		const Vector<T, C>& v) {
+		const ExpressionInput<Vector<T, C>>& b, const SparseMatrix<T, 1>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
 	out.resize(A.rows);
 #pragma omp parallel for
 	for (int i = 0; i < (int) A.rows; i++) {
@@ -536,8 +541,8 @@ template<class T, int C> void AddMultiply(Vector<T, C>& out,
 	}
 }
 template<class T, int C> void SubtractMultiply(Vector<T, C>& out,
-		const Vector<T, C>& b, const SparseMatrix<T, 1>& A,
-		const Vector<T, C>& v) {
+		const ExpressionInput<Vector<T, C>>& b, const SparseMatrix<T, 1>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
 	out.resize(A.rows);
 #pragma omp parallel for
 	for (int i = 0; i < (int) A.rows; i++) {
@@ -561,8 +566,12 @@ template<class T, int C> Vector<T, C> operator*(const SparseMatrix<T, C>& A,
 	}
 	return out;
 }
+template<class E, class T, int C> Vector<T, C> operator*(
+		const SparseMatrix<T, C>& A, const Expression<E, Vector<T, C>>& v) {
+	return A * v.eval();
+}
 template<class T, int C> void MultiplyVec(Vector<T, C>& out,
-		const SparseMatrix<T, C>& A, const Vector<T, C>& v) {
+		const SparseMatrix<T, C>& A, const ExpressionInput<Vector<T, C>>& v) {
 	out.resize(A.rows);
 #pragma omp parallel for
 	for (int i = 0; i < (int) A.rows; i++) {
@@ -575,8 +584,8 @@ template<class T, int C> void MultiplyVec(Vector<T, C>& out,
 }
 
 template<class T, int C> void AddMultiplyVec(Vector<T, C>& out,
-		const Vector<T, C>& b, const SparseMatrix<T, C>& A,
-		const Vector<T, C>& v) {
+		const ExpressionInput<Vector<T, C>>& b, const SparseMatrix<T, C>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
 	out.resize(A.rows);
 #pragma omp parallel for
 	for (int i = 0; i < A.rows; i++) {
@@ -588,8 +597,8 @@ template<class T, int C> void AddMultiplyVec(Vector<T, C>& out,
 	}
 }
 template<class T, int C> void SubtractMultiplyVec(Vector<T, C>& out,
-		const Vector<T, C>& b, const SparseMatrix<T, C>& A,
-		const Vector<T, C>& v) {
+		const ExpressionInput<Vector<T, C>>& b, const SparseMatrix<T, C>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
 	out.resize(A.rows);
 #pragma omp parallel for
 	for (int i = 0; i < (int) A.rows; i++) {
@@ -600,6 +609,459 @@ template<class T, int C> void SubtractMultiplyVec(Vector<T, C>& out,
 		out[i] = b[i] - vec<T, C>(sum);
 	}
 }
+template<class T, int C> struct SparseTriplet {
+	size_t row, col;
+	vec<T, C> value;
+	SparseTriplet() :
+			row(0), col(0), value(T(0)) {
+	}
+	SparseTriplet(size_t row, size_t col, const vec<T, C>& value) :
+			row(row), col(col), value(value) {
+	}
+	SparseTriplet(size_t row, size_t col, const T& value) :
+			row(row), col(col), value(value) {
+	}
+};
+/*
+ * Compressed sparse row (CSR) matrix. The column indices and values of row i
+ * occupy [rowOffsets[i], rowOffsets[i+1]) of two flat, aligned arrays and are
+ * sorted by column, so a product streams through memory instead of walking
+ * map nodes. The layout is fixed once built; assemble with SparseMatrix or a
+ * triplet list and convert before solving.
+ */
+template<class T, int C> struct CompressedSparseMatrix {
+protected:
+	void checkColumns() const {
+		if (cols > (size_t) std::numeric_limits<uint32_t>::max())
+			throw std::runtime_error(
+					MakeString() << "Column count " << cols
+							<< " exceeds 32 bit index range.");
+	}
+public:
+	size_t rows, cols;
+	aligned_vector<size_t> rowOffsets;
+	aligned_vector<uint32_t> columns;
+	aligned_vector<vec<T, C>> values;
+	template<class Archive> void serialize(Archive & archive) {
+		archive(CEREAL_NVP(rows), CEREAL_NVP(cols), CEREAL_NVP(rowOffsets),
+				CEREAL_NVP(columns),
+				cereal::make_nvp(MakeString() << "values" << C, values));
+	}
+	CompressedSparseMatrix() :
+			rows(0), cols(0), rowOffsets(1, 0) {
+	}
+	CompressedSparseMatrix(const SparseMatrix<T, C>& A) :
+			rows(0), cols(0) {
+		set(A);
+	}
+	CompressedSparseMatrix(size_t rows, size_t cols,
+			const std::vector<SparseTriplet<T, C>>& triplets) :
+			rows(0), cols(0) {
+		set(rows, cols, triplets);
+	}
+	size_t size() const {
+		return values.size();
+	}
+	size_t rowSize(size_t i) const {
+		return rowOffsets[i + 1] - rowOffsets[i];
+	}
+	void clear() {
+		rows = 0;
+		cols = 0;
+		rowOffsets.assign(1, 0);
+		columns.clear();
+		values.clear();
+		columns.shrink_to_fit();
+		values.shrink_to_fit();
+	}
+	void set(const SparseMatrix<T, C>& A) {
+		rows = A.rows;
+		cols = A.cols;
+		checkColumns();
+		rowOffsets.resize(rows + 1);
+		rowOffsets[0] = 0;
+#pragma omp parallel for
+		for (int i = 0; i < (int) rows; i++) {
+			rowOffsets[i + 1] = A[i].size();
+		}
+		for (size_t i = 0; i < rows; i++) {
+			rowOffsets[i + 1] += rowOffsets[i];
+		}
+		columns.resize(rowOffsets[rows]);
+		values.resize(rowOffsets[rows]);
+#pragma omp parallel for
+		for (int i = 0; i < (int) rows; i++) {
+			size_t k = rowOffsets[i];
+			for (const std::pair<size_t, vec<T, C>>& pr : A[i]) {
+				columns[k] = (uint32_t) pr.first;
+				values[k] = pr.second;
+				k++;
+			}
+		}
+	}
+	/*
+	 * Builds from (row, col, value) entries in any order. Entries are bucketed
+	 * by row, then each row is sorted and duplicate entries are summed in
+	 * parallel, the same way repeated += into a SparseMatrix would.
+	 */
+	void set(size_t rows, size_t cols,
+			const std::vector<SparseTriplet<T, C>>& triplets) {
+		this->rows = rows;
+		this->cols = cols;
+		checkColumns();
+		rowOffsets.assign(rows + 1, 0);
+		for (const SparseTriplet<T, C>& t : triplets) {
+			if (t.row >= rows || t.col >= cols)
+				throw std::runtime_error(
+						MakeString() << "Index (" << t.row << "," << t.col
+								<< ") exceeds matrix bounds [" << rows << ","
+								<< cols << "]");
+			rowOffsets[t.row + 1]++;
+		}
+		for (size_t i = 0; i < rows; i++) {
+			rowOffsets[i + 1] += rowOffsets[i];
+		}
+		aligned_vector<std::pair<uint32_t, vec<T, C>>> entries(
+				triplets.size());
+		{
+			aligned_vector<size_t> fill(rowOffsets.begin(),
+					rowOffsets.end() - 1);
+			for (const SparseTriplet<T, C>& t : triplets) {
+				entries[fill[t.row]++] = std::pair<uint32_t, vec<T, C>>(
+						(uint32_t) t.col, t.value);
+			}
+		}
+		aligned_vector<size_t> counts(rows + 1, 0);
+#pragma omp parallel for schedule(dynamic,1024)
+		for (int i = 0; i < (int) rows; i++) {
+			auto first = entries.begin() + rowOffsets[i];
+			auto last = entries.begin() + rowOffsets[i + 1];
+			if (first == last)
+				continue;
+			std::stable_sort(first, last,
+					[](const std::pair<uint32_t, vec<T, C>>& a,
+							const std::pair<uint32_t, vec<T, C>>& b) {
+						return a.first < b.first;
+					});
+			auto out = first;
+			for (auto iter = first + 1; iter != last; iter++) {
+				if (iter->first == out->first) {
+					out->second += iter->second;
+				} else {
+					*(++out) = *iter;
+				}
+			}
+			counts[i + 1] = (out - first) + 1;
+		}
+		for (size_t i = 0; i < rows; i++) {
+			counts[i + 1] += counts[i];
+		}
+		columns.resize(counts[rows]);
+		values.resize(counts[rows]);
+#pragma omp parallel for
+		for (int i = 0; i < (int) rows; i++) {
+			size_t src = rowOffsets[i];
+			for (size_t k = counts[i]; k < counts[i + 1]; k++, src++) {
+				columns[k] = entries[src].first;
+				values[k] = entries[src].second;
+			}
+		}
+		rowOffsets.swap(counts);
+	}
+	vec<T, C> get(size_t i, size_t j) const {
+		if (i >= rows || j >= cols)
+			throw std::runtime_error(
+					MakeString() << "Index (" << i << "," << j
+							<< ") exceeds matrix bounds [" << rows << ","
+							<< cols << "]");
+		auto first = columns.begin() + rowOffsets[i];
+		auto last = columns.begin() + rowOffsets[i + 1];
+		auto iter = std::lower_bound(first, last, (uint32_t) j);
+		if (iter == last || *iter != (uint32_t) j) {
+			return vec<T, C>(T(0));
+		}
+		return values[iter - columns.begin()];
+	}
+	vec<T, C> operator()(size_t i, size_t j) const {
+		return get(i, j);
+	}
+	SparseMatrix<T, C> toSparseMatrix() const {
+		SparseMatrix<T, C> A(rows, cols);
+#pragma omp parallel for
+		for (int i = 0; i < (int) rows; i++) {
+			std::map<size_t, vec<T, C>>& row = A[i];
+			for (size_t k = rowOffsets[i]; k < rowOffsets[i + 1]; k++) {
+				row.insert(row.end(),
+						std::pair<size_t, vec<T, C>>(columns[k], values[k]));
+			}
+		}
+		return A;
+	}
+	CompressedSparseMatrix<T, C> transpose() const {
+		CompressedSparseMatrix<T, C> M;
+		M.rows = cols;
+		M.cols = rows;
+		M.checkColumns();
+		M.rowOffsets.assign(cols + 1, 0);
+		for (uint32_t j : columns) {
+			M.rowOffsets[j + 1]++;
+		}
+		for (size_t j = 0; j < cols; j++) {
+			M.rowOffsets[j + 1] += M.rowOffsets[j];
+		}
+		M.columns.resize(columns.size());
+		M.values.resize(values.size());
+		aligned_vector<size_t> fill(M.rowOffsets.begin(),
+				M.rowOffsets.end() - 1);
+		for (size_t i = 0; i < rows; i++) {
+			for (size_t k = rowOffsets[i]; k < rowOffsets[i + 1]; k++) {
+				size_t dst = fill[columns[k]]++;
+				M.columns[dst] = (uint32_t) i;
+				M.values[dst] = values[k];
+			}
+		}
+		return M;
+	}
+};
+/*
+ * Products with a CompressedSparseMatrix. Rows are split into contiguous
+ * blocks across threads; each row is a dot product over raw arrays that the
+ * compiler can unroll and vectorize. Sums accumulate in double, like the
+ * SparseMatrix versions, so results match to rounding.
+ */
+template<class T, int C, int CA> inline vec<double, C> RowProduct(
+		const CompressedSparseMatrix<T, CA>& A, size_t i,
+		const vec<T, C>* __restrict v) {
+	const uint32_t* __restrict columns = A.columns.data();
+	const vec<T, CA>* __restrict values = A.values.data();
+	const size_t end = A.rowOffsets[i + 1];
+	vec<double, C> sum(0.0);
+	for (size_t k = A.rowOffsets[i]; k < end; k++) {
+		const vec<T, C>& x = v[columns[k]];
+		const vec<T, CA>& a = values[k];
+		for (int c = 0; c < C; c++) {
+			sum[c] += (double) x[c] * (double) a[(CA == 1) ? 0 : c];
+		}
+	}
+	return sum;
+}
+template<class T, int C, int CA> void CompressedMultiply(Vector<T, C>& out,
+		const CompressedSparseMatrix<T, CA>& A, const ExpressionInput<Vector<T, C>>& v) {
+	if (v.size() != A.cols)
+		throw std::runtime_error(
+				MakeString() << "Cannot multiply matrix [" << A.rows << ","
+						<< A.cols << "] by vector of length " << v.size());
+	out.resize(A.rows);
+	const vec<T, C>* in = v.data.data();
+	vec<T, C>* result = out.data.data();
+	ParallelFor(A.rows, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			result[i] = vec<T, C>(RowProduct(A, i, in));
+		}
+	}, 1024);
+}
+template<class T, int C, int CA> void CompressedAddMultiply(Vector<T, C>& out,
+		const ExpressionInput<Vector<T, C>>& b, const CompressedSparseMatrix<T, CA>& A,
+		const ExpressionInput<Vector<T, C>>& v, double sign) {
+	if (v.size() != A.cols || b.size() != A.rows)
+		throw std::runtime_error(
+				MakeString() << "Cannot multiply matrix [" << A.rows << ","
+						<< A.cols << "] by vector of length " << v.size()
+						<< " and add vector of length " << b.size());
+	out.resize(A.rows);
+	const vec<T, C>* in = v.data.data();
+	const vec<T, C>* offset = b.data.data();
+	vec<T, C>* result = out.data.data();
+	ParallelFor(A.rows, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			result[i] = vec<T, C>(vec<double, C>(offset[i]) + sign * RowProduct(A, i, in));
+		}
+	}, 1024);
+}
+/*
+ * out = A^T * v without forming A^T. Each thread scatters its block of rows
+ * into a private buffer of length A.cols and the buffers are summed, so this
+ * needs (threads * A.cols) extra elements. Build A.transpose() once instead
+ * if the transposed product is needed every iteration.
+ */
+template<class T, int C, int CA> void CompressedMultiplyTranspose(
+		Vector<T, C>& out, const CompressedSparseMatrix<T, CA>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
+	if (v.size() != A.rows)
+		throw std::runtime_error(
+				MakeString() << "Cannot multiply transpose of matrix ["
+						<< A.rows << "," << A.cols << "] by vector of length "
+						<< v.size());
+	const size_t grain = 1024;
+	int blocks = (int) std::min((size_t) std::max(1u,
+			std::thread::hardware_concurrency()), (A.rows + grain - 1) / grain);
+	blocks = std::max(blocks, 1);
+	std::vector<Vector<T, C>> partial(blocks);
+	size_t blockSize = (A.rows + blocks - 1) / blocks;
+#pragma omp parallel for
+	for (int b = 0; b < blocks; b++) {
+		Vector<T, C>& sum = partial[b];
+		sum.resize(A.cols);
+		sum.set(vec<T, C>(T(0)));
+		size_t end = std::min(A.rows, (b + 1) * blockSize);
+		for (size_t i = b * blockSize; i < end; i++) {
+			const vec<T, C> x = v[i];
+			for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+				const vec<T, CA>& a = A.values[k];
+				vec<T, C>& y = sum[A.columns[k]];
+				for (int c = 0; c < C; c++) {
+					y[c] += x[c] * a[(CA == 1) ? 0 : c];
+				}
+			}
+		}
+	}
+	out.resize(A.cols);
+	ParallelFor(A.cols, [&](size_t begin, size_t end) {
+		for (size_t j = begin; j < end; j++) {
+			vec<T, C> y = partial[0][j];
+			for (int b = 1; b < blocks; b++) {
+				y += partial[b][j];
+			}
+			out[j] = y;
+		}
+	});
+}
+template<class T, int C> void Multiply(Vector<T, C>& out,
+		const CompressedSparseMatrix<T, 1>& A, const ExpressionInput<Vector<T, C>>& v) {
+	CompressedMultiply(out, A, v);
+}
+template<class T, int C> void AddMultiply(Vector<T, C>& out,
+		const ExpressionInput<Vector<T, C>>& b, const CompressedSparseMatrix<T, 1>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
+	CompressedAddMultiply(out, b, A, v, 1.0);
+}
+template<class T, int C> void SubtractMultiply(Vector<T, C>& out,
+		const ExpressionInput<Vector<T, C>>& b, const CompressedSparseMatrix<T, 1>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
+	CompressedAddMultiply(out, b, A, v, -1.0);
+}
+template<class T, int C> void MultiplyTranspose(Vector<T, C>& out,
+		const CompressedSparseMatrix<T, 1>& A, const ExpressionInput<Vector<T, C>>& v) {
+	CompressedMultiplyTranspose(out, A, v);
+}
+template<class T, int C> Vector<T, C> operator*(
+		const CompressedSparseMatrix<T, 1>& A, const Vector<T, C>& v) {
+	Vector<T, C> out;
+	CompressedMultiply(out, A, v);
+	return out;
+}
+template<class E, class T, int C> Vector<T, C> operator*(
+		const CompressedSparseMatrix<T, 1>& A,
+		const Expression<E, Vector<T, C>>& v) {
+	return A * v.eval();
+}
+template<class T, int C> void MultiplyVec(Vector<T, C>& out,
+		const CompressedSparseMatrix<T, C>& A, const ExpressionInput<Vector<T, C>>& v) {
+	CompressedMultiply(out, A, v);
+}
+template<class T, int C> void AddMultiplyVec(Vector<T, C>& out,
+		const ExpressionInput<Vector<T, C>>& b, const CompressedSparseMatrix<T, C>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
+	CompressedAddMultiply(out, b, A, v, 1.0);
+}
+template<class T, int C> void SubtractMultiplyVec(Vector<T, C>& out,
+		const ExpressionInput<Vector<T, C>>& b, const CompressedSparseMatrix<T, C>& A,
+		const ExpressionInput<Vector<T, C>>& v) {
+	CompressedAddMultiply(out, b, A, v, -1.0);
+}
+template<class T, int C> void MultiplyTransposeVec(Vector<T, C>& out,
+		const CompressedSparseMatrix<T, C>& A, const ExpressionInput<Vector<T, C>>& v) {
+	CompressedMultiplyTranspose(out, A, v);
+}
+/*
+ * Sparse matrix product (Gustavson). Rows of A are split into one block per
+ * thread, and each block keeps a dense marker over the columns of B, so the
+ * extra memory is (threads * B.cols) indices.
+ */
+template<class T, int C> CompressedSparseMatrix<T, C> operator*(
+		const CompressedSparseMatrix<T, C>& A,
+		const CompressedSparseMatrix<T, C>& B) {
+	if (A.cols != B.rows)
+		throw std::runtime_error(
+				MakeString()
+						<< "Cannot multiply matrices. Inner dimensions do not match. "
+						<< "[" << A.rows << "," << A.cols << "] * [" << B.rows
+						<< "," << B.cols << "]");
+	CompressedSparseMatrix<T, C> out;
+	out.rows = A.rows;
+	out.cols = B.cols;
+	out.rowOffsets.assign(A.rows + 1, 0);
+	const size_t grain = 256;
+	int blocks = (int) std::min((size_t) std::max(1u,
+			std::thread::hardware_concurrency()), (A.rows + grain - 1) / grain);
+	blocks = std::max(blocks, 1);
+	size_t blockSize = (A.rows + blocks - 1) / blocks;
+#pragma omp parallel for
+	for (int b = 0; b < blocks; b++) {
+		std::vector<size_t> marker(B.cols, std::numeric_limits<size_t>::max());
+		size_t end = std::min(A.rows, (b + 1) * blockSize);
+		for (size_t i = b * blockSize; i < end; i++) {
+			size_t count = 0;
+			for (size_t ka = A.rowOffsets[i]; ka < A.rowOffsets[i + 1]; ka++) {
+				uint32_t k = A.columns[ka];
+				for (size_t kb = B.rowOffsets[k]; kb < B.rowOffsets[k + 1];
+						kb++) {
+					uint32_t j = B.columns[kb];
+					if (marker[j] != i) {
+						marker[j] = i;
+						count++;
+					}
+				}
+			}
+			out.rowOffsets[i + 1] = count;
+		}
+	}
+	for (size_t i = 0; i < A.rows; i++) {
+		out.rowOffsets[i + 1] += out.rowOffsets[i];
+	}
+	out.columns.resize(out.rowOffsets[A.rows]);
+	out.values.resize(out.rowOffsets[A.rows]);
+#pragma omp parallel for
+	for (int b = 0; b < blocks; b++) {
+		std::vector<size_t> marker(B.cols, std::numeric_limits<size_t>::max());
+		std::vector<std::pair<uint32_t, vec<T, C>>> row;
+		size_t end = std::min(A.rows, (b + 1) * blockSize);
+		for (size_t i = b * blockSize; i < end; i++) {
+			row.clear();
+			for (size_t ka = A.rowOffsets[i]; ka < A.rowOffsets[i + 1]; ka++) {
+				uint32_t k = A.columns[ka];
+				const vec<T, C>& a = A.values[ka];
+				for (size_t kb = B.rowOffsets[k]; kb < B.rowOffsets[k + 1];
+						kb++) {
+					uint32_t j = B.columns[kb];
+					if (marker[j] == std::numeric_limits<size_t>::max()) {
+						marker[j] = row.size();
+						row.push_back(
+								std::pair<uint32_t, vec<T, C>>(j,
+										a * B.values[kb]));
+					} else {
+						row[marker[j]].second += a * B.values[kb];
+					}
+				}
+			}
+			for (const std::pair<uint32_t, vec<T, C>>& pr : row) {
+				marker[pr.first] = std::numeric_limits<size_t>::max();
+			}
+			std::sort(row.begin(), row.end(),
+					[](const std::pair<uint32_t, vec<T, C>>& x,
+							const std::pair<uint32_t, vec<T, C>>& y) {
+						return x.first < y.first;
+					});
+			size_t k = out.rowOffsets[i];
+			for (const std::pair<uint32_t, vec<T, C>>& pr : row) {
+				out.columns[k] = pr.first;
+				out.values[k] = pr.second;
+				k++;
+			}
+		}
+	}
+	return out;
+}
 typedef SparseMatrix<float, 4> SparseMatrix4f;
 typedef SparseMatrix<float, 3> SparseMatrix3f;
 typedef SparseMatrix<float, 2> SparseMatrix2f;
@@ -609,6 +1071,16 @@ typedef SparseMatrix<double, 4> SparseMatrix4d;
 typedef SparseMatrix<double, 3> SparseMatrix3d;
 typedef SparseMatrix<double, 2> SparseMatrix2d;
 typedef SparseMatrix<double, 1> SparseMatrix1d;
+
+typedef CompressedSparseMatrix<float, 4> CompressedSparseMatrix4f;
+typedef CompressedSparseMatrix<float, 3> CompressedSparseMatrix3f;
+typedef CompressedSparseMatrix<float, 2> CompressedSparseMatrix2f;
+typedef CompressedSparseMatrix<float, 1> CompressedSparseMatrix1f;
+
+typedef CompressedSparseMatrix<double, 4> CompressedSparseMatrix4d;
+typedef CompressedSparseMatrix<double, 3> CompressedSparseMatrix3d;
+typedef CompressedSparseMatrix<double, 2> CompressedSparseMatrix2d;
+typedef CompressedSparseMatrix<double, 1> CompressedSparseMatrix1d;
 }
 
 #endif
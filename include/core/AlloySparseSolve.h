@@ -23,12 +23,21 @@
 #include "AlloyMath.h"
 #include "AlloyVector.h"
 #include "AlloySparseMatrix.h"
+#include <memory>
+#include <vector>
 namespace aly {
 bool SANITY_CHECK_ALGO();
 bool SANITY_CHECK_SPARSE_SOLVE();
-template<class T, int C> void SolveVecCG(const Vector<T, C>& b,
-		const SparseMatrix<T, C>& A, Vector<T, C>& x, int iters = 100,
-		T tolerance = 1E-6f,
+bool SANITY_CHECK_PRECONDITIONER();
+bool SANITY_CHECK_SPARSE_CHOLESKY();
+/*
+ * The solvers accept SparseMatrix or CompressedSparseMatrix. Convert to
+ * CompressedSparseMatrix before solving large systems; assembly is the only
+ * place the map-based SparseMatrix is cheaper.
+ */
+template<class T, int C, template<class, int> class MatrixType> void SolveVecCG(
+		const ExpressionInput<Vector<T, C>>& b, const MatrixType<T, C>& A, Vector<T, C>& x,
+		int iters = 100, T tolerance = 1E-6f,
 		const std::function<bool(int, double)>& iterationMonitor = nullptr) {
 	const double ZERO_TOLERANCE = 1E-16;
 	vec<double, C> err(0.0);
@@ -75,9 +84,9 @@ template<class T, int C> void SolveVecCG(const Vector<T, C>& b,
 		std::swap(rcurrent, rnext);
 	}
 }
-template<class T, int C> void SolveCG(const Vector<T, C>& b,
-		const SparseMatrix<T, 1>& A, Vector<T, C>& x, int iters = 100,
-		T tolerance = 1E-6f,
+template<class T, int C, template<class, int> class MatrixType> void SolveCG(
+		const ExpressionInput<Vector<T, C>>& b, const MatrixType<T, 1>& A, Vector<T, C>& x,
+		int iters = 100, T tolerance = 1E-6f,
 		const std::function<bool(int, double)>& iterationMonitor = nullptr) {
 	const double ZERO_TOLERANCE = 1E-16;
 	vec<double, C> err(0.0);
@@ -124,9 +133,9 @@ template<class T, int C> void SolveCG(const Vector<T, C>& b,
 		std::swap(rcurrent, rnext);
 	}
 }
-template<class T, int C> void SolveVecBICGStab(const Vector<T, C>& b,
-		const SparseMatrix<T, C>& A, Vector<T, C>& x, int iters = 100,
-		T tolerance = 1E-6f,
+template<class T, int C, template<class, int> class MatrixType> void SolveVecBICGStab(
+		const ExpressionInput<Vector<T, C>>& b, const MatrixType<T, C>& A, Vector<T, C>& x,
+		int iters = 100, T tolerance = 1E-6f,
 		const std::function<bool(int, double)>& iterationMonitor = nullptr) {
 	const double ZERO_TOLERANCE = 1E-16;
 	size_t N = b.size();
@@ -186,9 +195,9 @@ template<class T, int C> void SolveVecBICGStab(const Vector<T, C>& b,
 
 	}
 }
-template<class T, int C> void SolveBICGStab(const Vector<T, C>& b,
-		const SparseMatrix<T, 1>& A, Vector<T, C>& x, int iters = 100,
-		T tolerance = 1E-6f,
+template<class T, int C, template<class, int> class MatrixType> void SolveBICGStab(
+		const ExpressionInput<Vector<T, C>>& b, const MatrixType<T, 1>& A, Vector<T, C>& x,
+		int iters = 100, T tolerance = 1E-6f,
 		const std::function<bool(int, double)>& iterationMonitor = nullptr) {
 	const double ZERO_TOLERANCE = 1E-16;
 
@@ -246,5 +255,677 @@ template<class T, int C> void SolveBICGStab(const Vector<T, C>& b,
 
 	}
 }
+enum class SparseOrdering {
+	Natural = 0, ApproximateMinimumDegree = 1
+};
+template<class C, class R> std::basic_ostream<C, R> & operator <<(
+		std::basic_ostream<C, R> & ss, const SparseOrdering& type) {
+	switch (type) {
+	case SparseOrdering::Natural:
+		return ss << "Natural";
+	case SparseOrdering::ApproximateMinimumDegree:
+		return ss << "Approximate Minimum Degree";
+	}
+	return ss;
+}
+/*
+ * Fill-reducing symmetric ordering of the pattern of A (both triangles
+ * stored). Returns perm, where perm[k] is the k-th row/column to eliminate.
+ */
+std::vector<int> ApproximateMinimumDegreeOrdering(size_t N,
+		const size_t* rowOffsets, const uint32_t* columns);
+/*
+ * Direct solver for sparse symmetric matrices, factored as P*A*P' = L*D*L'
+ * in double precision. analyze() orders the unknowns and computes the
+ * pattern of L once; refactor() then only recomputes values, so a system
+ * whose coefficients change but whose pattern does not is refactored
+ * cheaply. The numeric factorization and the triangular solves process the
+ * elimination tree level by level, with the columns of each level in
+ * parallel. A must store both triangles; D may be indefinite but not
+ * singular.
+ */
+class SparseCholesky {
+protected:
+	size_t N;
+	SparseOrdering ordering;
+	//perm[k] is the original index of the k-th pivot. inversePerm is its inverse.
+	std::vector<int> perm, inversePerm;
+	std::vector<int> parent;
+	//Columns grouped by height in the elimination tree. No column depends on another in its level.
+	std::vector<size_t> levelOffsets;
+	std::vector<int> levelColumns;
+	//Strictly lower triangle of L by column, rows ascending.
+	std::vector<size_t> columnOffsets;
+	std::vector<int> rowIndices;
+	//Row j of L as (column, position in rowIndices) pairs.
+	std::vector<size_t> rowOffsets;
+	std::vector<int> rowColumns;
+	std::vector<size_t> rowPositions;
+	//Lower triangle of P*A*P' by column as (row, index into the values of A).
+	std::vector<size_t> inputOffsets;
+	std::vector<int> inputRows;
+	std::vector<size_t> inputSources;
+	//Pattern of A at analysis time, used to validate refactor().
+	std::vector<size_t> patternOffsets;
+	std::vector<uint32_t> patternColumns;
+	std::vector<double> values;
+	std::vector<double> diagonal;
+	bool factored;
+	void analyzePattern(size_t N, const size_t* rowOffsets,
+			const uint32_t* columns);
+	bool factorValues(const double* values);
+	void solvePermuted(double* x, int channels) const;
+	void checkPattern(size_t rows, const size_t* rowOffsets,
+			const uint32_t* columns) const;
+public:
+	SparseCholesky(SparseOrdering ordering =
+			SparseOrdering::ApproximateMinimumDegree);
+	template<class T> void analyze(const CompressedSparseMatrix<T, 1>& A) {
+		if (A.rows != A.cols)
+			throw std::runtime_error(
+					MakeString() << "Sparse Cholesky requires a square matrix ["
+							<< A.rows << "," << A.cols << "]");
+		analyzePattern(A.rows, A.rowOffsets.data(), A.columns.data());
+	}
+	//Recomputes L and D for a matrix with the pattern given to analyze(). Returns false on a zero pivot.
+	template<class T> bool refactor(const CompressedSparseMatrix<T, 1>& A) {
+		checkPattern(A.rows, A.rowOffsets.data(), A.columns.data());
+		std::vector<double> vals(A.values.size());
+		for (size_t k = 0; k < vals.size(); k++) {
+			vals[k] = (double) A.values[k].x;
+		}
+		return factorValues(vals.data());
+	}
+	template<class T> bool factor(const CompressedSparseMatrix<T, 1>& A) {
+		analyze(A);
+		return refactor(A);
+	}
+	template<class T> bool factor(const SparseMatrix<T, 1>& A) {
+		return factor(CompressedSparseMatrix<T, 1>(A));
+	}
+	template<class T, int C> void solve(Vector<T, C>& x,
+			const ExpressionInput<Vector<T, C>>& b) const {
+		if (!factored)
+			throw std::runtime_error("Sparse Cholesky has not been factored.");
+		if (b.size() != N)
+			throw std::runtime_error(
+					MakeString() << "Vector length " << b.size()
+							<< " does not match matrix size " << N);
+		std::vector<double> tmp(N * C);
+		for (size_t k = 0; k < N; k++) {
+			const vec<T, C>& val = b[perm[k]];
+			for (int c = 0; c < C; c++) {
+				tmp[k * C + c] = (double) val[c];
+			}
+		}
+		solvePermuted(tmp.data(), C);
+		x.resize(N);
+		for (size_t k = 0; k < N; k++) {
+			vec<T, C>& val = x[perm[k]];
+			for (int c = 0; c < C; c++) {
+				val[c] = T(tmp[k * C + c]);
+			}
+		}
+	}
+	template<class T, int C> Vector<T, C> solve(const Vector<T, C>& b) const {
+		Vector<T, C> x;
+		solve(x, b);
+		return x;
+	}
+	template<class E, class T, int C> Vector<T, C> solve(
+			const Expression<E, Vector<T, C>>& b) const {
+		return solve(b.eval());
+	}
+	size_t size() const {
+		return N;
+	}
+	bool isFactored() const {
+		return factored;
+	}
+	//Non-zeros in L, excluding the unit diagonal.
+	size_t getFactorNonZeros() const {
+		return rowIndices.size();
+	}
+	size_t getLevelCount() const {
+		return (levelOffsets.size() > 0) ? levelOffsets.size() - 1 : 0;
+	}
+	const std::vector<int>& getPermutation() const {
+		return perm;
+	}
+};
+enum class PreconditionerType {
+	Identity = 0, Jacobi = 1, IncompleteCholesky = 2, AlgebraicMultigrid = 3
+};
+template<class C, class R> std::basic_ostream<C, R> & operator <<(
+		std::basic_ostream<C, R> & ss, const PreconditionerType& type) {
+	switch (type) {
+	case PreconditionerType::Identity:
+		return ss << "Identity";
+	case PreconditionerType::Jacobi:
+		return ss << "Jacobi";
+	case PreconditionerType::IncompleteCholesky:
+		return ss << "Incomplete Cholesky";
+	case PreconditionerType::AlgebraicMultigrid:
+		return ss << "Algebraic Multigrid";
+	}
+	return ss;
+}
+/*
+ * Approximate inverse of a symmetric positive definite matrix, applied to
+ * every channel of a residual (z = M^-1 r). Preconditioners are built once
+ * per matrix, are symmetric so PCG stays valid, and may keep scratch
+ * buffers, so one instance should not be applied from two threads at once.
+ */
+template<class T, int C> class Preconditioner {
+public:
+	virtual void apply(Vector<T, C>& z, const Vector<T, C>& r) const = 0;
+	virtual ~Preconditioner() {
+	}
+};
+template<class T, int C> class JacobiPreconditioner: public Preconditioner<T,
+		C> {
+protected:
+	Vector<T, C> inverseDiagonal;
+public:
+	template<int CA> JacobiPreconditioner(
+			const CompressedSparseMatrix<T, CA>& A) :
+			inverseDiagonal(A.rows) {
+		static_assert(CA == 1 || CA == C, "Matrix must have 1 or C channels.");
+#pragma omp parallel for
+		for (int i = 0; i < (int) A.rows; i++) {
+			vec<T, CA> d = A.get(i, i);
+			for (int c = 0; c < C; c++) {
+				T val = d[(CA == 1) ? 0 : c];
+				inverseDiagonal[i][c] = (val != T(0)) ? T(1) / val : T(1);
+			}
+		}
+	}
+	virtual void apply(Vector<T, C>& z, const Vector<T, C>& r) const override {
+		z.resize(r.size());
+		ParallelFor(r.size(), [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				z[i] = inverseDiagonal[i] * r[i];
+			}
+		});
+	}
+};
+/*
+ * Zero fill-in incomplete Cholesky, A ~ L*L^T with L restricted to the
+ * lower triangle of A. The factorization runs in double precision. If a
+ * pivot turns non-positive, the diagonal is scaled by (1 + shift) and the
+ * factorization restarts with a larger shift. Triangular solves are
+ * sequential over rows; channels are solved together.
+ */
+template<class T, int C> class IncompleteCholeskyPreconditioner: public Preconditioner<
+		T, C> {
+protected:
+	CompressedSparseMatrix<double, 1> L, U;
+	double shift;
+	bool factor(const CompressedSparseMatrix<T, 1>& A, double alpha) {
+		std::vector<SparseTriplet<double, 1>> triplets;
+		triplets.reserve(A.size() / 2 + A.rows);
+		for (size_t i = 0; i < A.rows; i++) {
+			double diag = 0.0;
+			for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+				size_t j = A.columns[k];
+				if (j < i) {
+					triplets.push_back(
+							SparseTriplet<double, 1>(i, j,
+									(double) A.values[k].x));
+				} else if (j == i) {
+					diag = A.values[k].x;
+				}
+			}
+			triplets.push_back(
+					SparseTriplet<double, 1>(i, i,
+							(diag != 0.0) ? diag * (1.0 + alpha) : 1.0));
+		}
+		L.set(A.rows, A.cols, triplets);
+		if (L.rows == 0)
+			return true;
+		const size_t* offsets = L.rowOffsets.data();
+		const uint32_t* columns = L.columns.data();
+		double* values = &L.values[0].x;
+		for (size_t i = 0; i < L.rows; i++) {
+			size_t rowEnd = offsets[i + 1] - 1;
+			double diag = values[rowEnd];
+			for (size_t ki = offsets[i]; ki < rowEnd; ki++) {
+				size_t k = columns[ki];
+				double sum = values[ki];
+				size_t a = offsets[i], b = offsets[k], bEnd = offsets[k + 1]
+						- 1;
+				while (a < ki && b < bEnd) {
+					if (columns[a] == columns[b]) {
+						sum -= values[a++] * values[b++];
+					} else if (columns[a] < columns[b]) {
+						a++;
+					} else {
+						b++;
+					}
+				}
+				values[ki] = sum / values[bEnd];
+				diag -= values[ki] * values[ki];
+			}
+			if (!(diag > 0.0))
+				return false;
+			values[rowEnd] = std::sqrt(diag);
+		}
+		U = L.transpose();
+		return true;
+	}
+public:
+	IncompleteCholeskyPreconditioner(const CompressedSparseMatrix<T, 1>& A) :
+			shift(0.0) {
+		if (A.rows != A.cols)
+			throw std::runtime_error(
+					MakeString() << "Incomplete Cholesky requires a square matrix ["
+							<< A.rows << "," << A.cols << "]");
+		while (!factor(A, shift)) {
+			shift = (shift == 0.0) ? 1E-3 : 2.0 * shift;
+			if (shift > 1E3)
+				throw std::runtime_error(
+						"Incomplete Cholesky factorization failed. Matrix is not positive definite.");
+		}
+	}
+	double getShift() const {
+		return shift;
+	}
+	virtual void apply(Vector<T, C>& z, const Vector<T, C>& r) const override {
+		size_t N = r.size();
+		z.resize(N);
+		const size_t* offsets = L.rowOffsets.data();
+		const uint32_t* columns = L.columns.data();
+		const vec<double, 1>* values = L.values.data();
+		for (size_t i = 0; i < N; i++) {
+			vec<double, C> sum(r[i]);
+			size_t rowEnd = offsets[i + 1] - 1;
+			for (size_t k = offsets[i]; k < rowEnd; k++) {
+				sum -= values[k].x * vec<double, C>(z[columns[k]]);
+			}
+			z[i] = vec<T, C>(sum / values[rowEnd].x);
+		}
+		offsets = U.rowOffsets.data();
+		columns = U.columns.data();
+		values = U.values.data();
+		for (size_t i = N; i > 0; i--) {
+			size_t row = i - 1;
+			vec<double, C> sum(z[row]);
+			size_t rowStart = offsets[row];
+			for (size_t k = rowStart + 1; k < offsets[row + 1]; k++) {
+				sum -= values[k].x * vec<double, C>(z[columns[k]]);
+			}
+			z[row] = vec<T, C>(sum / values[rowStart].x);
+		}
+	}
+};
+/*
+ * Smoothed aggregation algebraic multigrid, applied as one V-cycle from a
+ * zero guess. Each level groups strongly connected nodes into aggregates,
+ * smooths the piecewise constant prolongator with one damped Jacobi step,
+ * and forms the coarse operator as P^T*A*P. Weighted Jacobi is used as the
+ * smoother, so every level runs in parallel and the cycle stays symmetric.
+ * The coarsest level is solved with a dense Cholesky factorization.
+ */
+template<class T, int C> class AlgebraicMultigridPreconditioner: public Preconditioner<
+		T, C> {
+protected:
+	struct Level {
+		CompressedSparseMatrix<T, 1> A, P, R;
+		Vector<T, 1> inverseDiagonal;
+		T omega;
+		mutable Vector<T, C> x, b, r;
+	};
+	std::vector<Level> levels;
+	std::vector<double> coarseFactor;
+	static double EstimateSpectralRadius(const CompressedSparseMatrix<T, 1>& A,
+			const Vector<T, 1>& inverseDiagonal) {
+		size_t N = A.rows;
+		Vector<T, 1> v(N), Av(N);
+		for (size_t i = 0; i < N; i++) {
+			v[i].x = T(1) + T(0.5) * (T) ((i * 7919) % 31) / T(31);
+		}
+		double rho = 1.0;
+		for (int iter = 0; iter < 15; iter++) {
+			double len = std::sqrt(lengthVecSqr(v).x);
+			if (len == 0.0)
+				break;
+			Multiply(Av, A, v);
+			ParallelFor(N, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					v[i].x = inverseDiagonal[i].x * Av[i].x / (T)len;
+				}
+			});
+			rho = std::sqrt(lengthVecSqr(v).x);
+		}
+		return rho;
+	}
+	static size_t Aggregate(const CompressedSparseMatrix<T, 1>& A,
+			double threshold, std::vector<int>& aggregates) {
+		size_t N = A.rows;
+		std::vector<T> diag(N);
+		for (size_t i = 0; i < N; i++) {
+			diag[i] = std::abs(A.get(i, i).x);
+		}
+		auto strong = [&](size_t i, size_t k) {
+			size_t j = A.columns[k];
+			return (j != i && std::abs(A.values[k].x) >= threshold * std::sqrt(diag[i] * diag[j]));
+		};
+		aggregates.assign(N, -1);
+		int count = 0;
+		for (size_t i = 0; i < N; i++) {
+			bool free = true;
+			for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+				if (strong(i, k) && aggregates[A.columns[k]] >= 0) {
+					free = false;
+					break;
+				}
+			}
+			if (free && aggregates[i] < 0) {
+				aggregates[i] = count;
+				for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+					if (strong(i, k))
+						aggregates[A.columns[k]] = count;
+				}
+				count++;
+			}
+		}
+		std::vector<int> joined = aggregates;
+		for (size_t i = 0; i < N; i++) {
+			if (aggregates[i] >= 0)
+				continue;
+			for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+				if (strong(i, k) && aggregates[A.columns[k]] >= 0) {
+					joined[i] = aggregates[A.columns[k]];
+					break;
+				}
+			}
+		}
+		aggregates = joined;
+		for (size_t i = 0; i < N; i++) {
+			if (aggregates[i] >= 0)
+				continue;
+			aggregates[i] = count;
+			for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+				if (strong(i, k) && aggregates[A.columns[k]] < 0)
+					aggregates[A.columns[k]] = count;
+			}
+			count++;
+		}
+		return (size_t) count;
+	}
+	void factorCoarse(const CompressedSparseMatrix<T, 1>& A) {
+		size_t N = A.rows;
+		coarseFactor.assign(N * N, 0.0);
+		double maxDiag = 0.0;
+		for (size_t i = 0; i < N; i++) {
+			for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+				coarseFactor[i * N + A.columns[k]] = A.values[k].x;
+			}
+			maxDiag = std::max(maxDiag, std::abs(coarseFactor[i * N + i]));
+		}
+		//Singular coarse operators (pure Neumann Laplacians) get a tiny regularization.
+		double eps = 1E-10 * std::max(maxDiag, 1E-30);
+		for (size_t j = 0; j < N; j++) {
+			double* Lj = &coarseFactor[j * N];
+			double d = Lj[j];
+			for (size_t k = 0; k < j; k++) {
+				d -= Lj[k] * Lj[k];
+			}
+			d = std::sqrt(std::max(d, eps));
+			Lj[j] = d;
+#pragma omp parallel for
+			for (int i = (int) j + 1; i < (int) N; i++) {
+				double* Li = &coarseFactor[i * N];
+				double sum = Li[j];
+				for (size_t k = 0; k < j; k++) {
+					sum -= Li[k] * Lj[k];
+				}
+				Li[j] = sum / d;
+			}
+		}
+	}
+	void solveCoarse(Vector<T, C>& x, const Vector<T, C>& b) const {
+		size_t N = b.size();
+		std::vector<vec<double, C>> y(N);
+		for (size_t i = 0; i < N; i++) {
+			vec<double, C> sum(b[i]);
+			const double* Li = &coarseFactor[i * N];
+			for (size_t k = 0; k < i; k++) {
+				sum -= Li[k] * y[k];
+			}
+			y[i] = sum / Li[i];
+		}
+		for (size_t i = N; i > 0; i--) {
+			size_t row = i - 1;
+			vec<double, C> sum = y[row];
+			for (size_t k = row + 1; k < N; k++) {
+				sum -= coarseFactor[k * N + row] * y[k];
+			}
+			y[row] = sum / coarseFactor[row * N + row];
+		}
+		x.resize(N);
+		for (size_t i = 0; i < N; i++) {
+			x[i] = vec<T, C>(y[i]);
+		}
+	}
+	void smooth(const Level& level, int sweeps) const {
+		for (int n = 0; n < sweeps; n++) {
+			SubtractMultiply(level.r, level.b, level.A, level.x);
+			ParallelFor(level.x.size(), [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) {
+					level.x[i] += (level.omega * level.inverseDiagonal[i].x) * level.r[i];
+				}
+			});
+		}
+	}
+	void cycle(size_t l) const {
+		const Level& level = levels[l];
+		if (l + 1 == levels.size()) {
+			if (coarseFactor.size() > 0) {
+				solveCoarse(level.x, level.b);
+			} else {
+				level.x.resize(level.b.size());
+				level.x.set(vec<T, C>(T(0)));
+				smooth(level, 4 * (preSmooth + postSmooth));
+			}
+			return;
+		}
+		const Level& next = levels[l + 1];
+		level.x.resize(level.b.size());
+		level.x.set(vec<T, C>(T(0)));
+		smooth(level, preSmooth);
+		SubtractMultiply(level.r, level.b, level.A, level.x);
+		Multiply(next.b, level.R, level.r);
+		cycle(l + 1);
+		Multiply(level.r, level.P, next.x);
+		Add(level.x, level.x, level.r);
+		smooth(level, postSmooth);
+	}
+public:
+	int preSmooth;
+	int postSmooth;
+	AlgebraicMultigridPreconditioner(const CompressedSparseMatrix<T, 1>& A,
+			double strengthThreshold = 0.08, size_t coarseSize = 256,
+			int maxLevels = 16) :
+			preSmooth(2), postSmooth(2) {
+		if (A.rows != A.cols)
+			throw std::runtime_error(
+					MakeString() << "Multigrid requires a square matrix ["
+							<< A.rows << "," << A.cols << "]");
+		levels.reserve(maxLevels);
+		levels.push_back(Level());
+		levels.back().A = A;
+		while (true) {
+			Level& level = levels.back();
+			size_t N = level.A.rows;
+			level.inverseDiagonal.resize(N);
+			for (size_t i = 0; i < N; i++) {
+				T d = level.A.get(i, i).x;
+				level.inverseDiagonal[i].x = (d != T(0)) ? T(1) / d : T(1);
+			}
+			level.omega = T(
+					(4.0 / 3.0)
+							/ EstimateSpectralRadius(level.A,
+									level.inverseDiagonal));
+			if (N <= coarseSize || (int) levels.size() == maxLevels)
+				break;
+			std::vector<int> aggregates;
+			size_t M = Aggregate(level.A, strengthThreshold, aggregates);
+			if (M >= N)
+				break;
+			std::vector<size_t> aggregateSize(M, 0);
+			for (int a : aggregates) {
+				aggregateSize[a]++;
+			}
+			std::vector<SparseTriplet<T, 1>> triplets(N);
+			for (size_t i = 0; i < N; i++) {
+				triplets[i] = SparseTriplet<T, 1>(i, aggregates[i],
+						T(1) / std::sqrt((T) aggregateSize[aggregates[i]]));
+			}
+			CompressedSparseMatrix<T, 1> P0(N, M, triplets);
+			CompressedSparseMatrix<T, 1> AP0 = level.A * P0;
+			triplets.reserve(N + AP0.size());
+			for (size_t i = 0; i < N; i++) {
+				T w = -level.omega * level.inverseDiagonal[i].x;
+				for (size_t k = AP0.rowOffsets[i]; k < AP0.rowOffsets[i + 1];
+						k++) {
+					triplets.push_back(
+							SparseTriplet<T, 1>(i, AP0.columns[k],
+									w * AP0.values[k].x));
+				}
+			}
+			level.P.set(N, M, triplets);
+			level.R = level.P.transpose();
+			CompressedSparseMatrix<T, 1> Ac = level.R * (level.A * level.P);
+			levels.push_back(Level());
+			levels.back().A = std::move(Ac);
+		}
+		if (levels.back().A.rows <= 4 * coarseSize)
+			factorCoarse(levels.back().A);
+	}
+	size_t getLevelCount() const {
+		return levels.size();
+	}
+	double getOperatorComplexity() const {
+		double total = 0.0;
+		for (const Level& level : levels) {
+			total += level.A.size();
+		}
+		return total / std::max((double) levels[0].A.size(), 1.0);
+	}
+	virtual void apply(Vector<T, C>& z, const Vector<T, C>& r) const override {
+		levels[0].b = r;
+		cycle(0);
+		z = levels[0].x;
+	}
+};
+template<class T, int C> std::shared_ptr<Preconditioner<T, C>> MakePreconditioner(
+		const CompressedSparseMatrix<T, 1>& A, const PreconditionerType& type) {
+	switch (type) {
+	case PreconditionerType::Jacobi:
+		return std::shared_ptr<Preconditioner<T, C>>(
+				new JacobiPreconditioner<T, C>(A));
+	case PreconditionerType::IncompleteCholesky:
+		return std::shared_ptr<Preconditioner<T, C>>(
+				new IncompleteCholeskyPreconditioner<T, C>(A));
+	case PreconditionerType::AlgebraicMultigrid:
+		return std::shared_ptr<Preconditioner<T, C>>(
+				new AlgebraicMultigridPreconditioner<T, C>(A));
+	default:
+		return std::shared_ptr<Preconditioner<T, C>>();
+	}
+}
+template<class T, int C> std::shared_ptr<Preconditioner<T, C>> MakePreconditioner(
+		const SparseMatrix<T, 1>& A, const PreconditionerType& type) {
+	return MakePreconditioner<T, C>(CompressedSparseMatrix<T, 1>(A), type);
+}
+/*
+ * Preconditioned conjugate gradient. The iteration monitor and tolerance see
+ * the same mean squared residual of A*x=b as SolveCG, so swapping solvers
+ * does not change stopping behavior.
+ */
+template<class T, int C, class F> void SolvePCGImpl(const ExpressionInput<Vector<T, C>>& b,
+		const F& multiply, Vector<T, C>& x, const Preconditioner<T, C>& M,
+		int iters, T tolerance,
+		const std::function<bool(int, double)>& iterationMonitor) {
+	const double ZERO_TOLERANCE = 1E-16;
+	size_t N = b.size();
+	x.resize(N);
+	Vector<T, C> r(N), z(N), p(N), Ap(N);
+	multiply(Ap, x);
+	Subtract(r, b, Ap);
+	double e = lengthL1(lengthVecSqr(r)) / N;
+	if (iterationMonitor) {
+		if (!iterationMonitor(0, e))
+			return;
+	}
+	if (e < tolerance)
+		return;
+	M.apply(z, r);
+	p = z;
+	vec<double, C> rz = dotVec(r, z);
+	for (int iter = 0; iter < iters; iter++) {
+		multiply(Ap, p);
+		vec<double, C> denom = dotVec(p, Ap);
+		for (int c = 0; c < C; c++) {
+			if (std::abs(denom[c]) < ZERO_TOLERANCE) {
+				denom[c] = (denom[c] < 0) ? -ZERO_TOLERANCE : ZERO_TOLERANCE;
+			}
+		}
+		vec<double, C> alpha = rz / denom;
+		ScaleAdd(x, vec<T, C>(alpha), p);
+		ScaleSubtract(r, r, vec<T, C>(alpha), Ap);
+		e = lengthL1(lengthVecSqr(r)) / N;
+		if (iterationMonitor) {
+			if (!iterationMonitor(iter + 1, e))
+				return;
+		}
+		if (e < tolerance)
+			break;
+		M.apply(z, r);
+		vec<double, C> rzNext = dotVec(r, z);
+		for (int c = 0; c < C; c++) {
+			if (std::abs(rz[c]) < ZERO_TOLERANCE) {
+				rz[c] = (rz[c] < 0) ? -ZERO_TOLERANCE : ZERO_TOLERANCE;
+			}
+		}
+		vec<double, C> beta = rzNext / rz;
+		ScaleAdd(p, z, vec<T, C>(beta), p);
+		rz = rzNext;
+	}
+}
+template<class T, int C, template<class, int> class MatrixType> void SolvePCG(
+		const ExpressionInput<Vector<T, C>>& b, const MatrixType<T, 1>& A, Vector<T, C>& x,
+		const Preconditioner<T, C>& M, int iters = 100, T tolerance = 1E-6f,
+		const std::function<bool(int, double)>& iterationMonitor = nullptr) {
+	SolvePCGImpl(b, [&](Vector<T, C>& out, const Vector<T, C>& in) {
+		Multiply(out, A, in);
+	}, x, M, iters, tolerance, iterationMonitor);
+}
+template<class T, int C, template<class, int> class MatrixType> void SolveVecPCG(
+		const ExpressionInput<Vector<T, C>>& b, const MatrixType<T, C>& A, Vector<T, C>& x,
+		const Preconditioner<T, C>& M, int iters = 100, T tolerance = 1E-6f,
+		const std::function<bool(int, double)>& iterationMonitor = nullptr) {
+	SolvePCGImpl(b, [&](Vector<T, C>& out, const Vector<T, C>& in) {
+		MultiplyVec(out, A, in);
+	}, x, M, iters, tolerance, iterationMonitor);
+}
+/*
+ * Builds the preconditioner for A, solves, and discards it. Keep a
+ * Preconditioner and call the overload above when solving with the same
+ * matrix repeatedly; AMG setup costs several solver iterations.
+ */
+template<class T, int C, template<class, int> class MatrixType> void SolvePCG(
+		const ExpressionInput<Vector<T, C>>& b, const MatrixType<T, 1>& A, Vector<T, C>& x,
+		const PreconditionerType& type, int iters = 100, T tolerance = 1E-6f,
+		const std::function<bool(int, double)>& iterationMonitor = nullptr) {
+	std::shared_ptr<Preconditioner<T, C>> M = MakePreconditioner<T, C>(A,
+			type);
+	if (M.get() == nullptr) {
+		SolveCG(b, A, x, iters, tolerance, iterationMonitor);
+	} else {
+		SolvePCG(b, A, x, *M, iters, tolerance, iterationMonitor);
+	}
+}
 }
 #endif
@@ -23,6 +23,8 @@
 #define ALLOYLINEARALGEBRA_H_
 
 #include "AlloyMath.h"
+#include "AlloyExpression.h"
+#include "AlloyAllocator.h"
 #include <vector>
 #include <functional>
 #include <iomanip>
@@ -35,12 +37,12 @@ bool SANITY_CHECK_LINALG();
 
 template<class T, int C> struct Vector {
 public:
-	std::vector<vec<T, C>> data;
+	aligned_vector<vec<T, C>> data;
 	const int channels = C;
 	typedef vec<T, C> ValueType;
-	typedef typename std::vector<ValueType>::iterator iterator;
-	typedef typename std::vector<ValueType>::const_iterator const_iterator;
-	typedef typename std::vector<ValueType>::reverse_iterator reverse_iterator;
+	typedef typename aligned_vector<ValueType>::iterator iterator;
+	typedef typename aligned_vector<ValueType>::const_iterator const_iterator;
+	typedef typename aligned_vector<ValueType>::reverse_iterator reverse_iterator;
 
 	iterator begin() {
 		return data.begin();
@@ -83,6 +85,9 @@ public:
 		data.assign(data.size(), val);
 	}
 	void set(const std::vector<vec<T, C>>& val) {
+		data.assign(val.begin(), val.end());
+	}
+	void set(const aligned_vector<vec<T, C>>& val) {
 		data = val;
 	}
 	void set(T* val) {
@@ -117,6 +122,9 @@ public:
 			Vector(img.size()) {
 		set(img.data);
 	}
+	Vector(Vector<T, C>&& img) :
+			data(std::move(img.data)) {
+	}
 	Vector<T, C>& operator=(const Vector<T, C>& rhs) {
 		if (this == &rhs)
 			return *this;
@@ -127,6 +135,25 @@ public:
 		}
 		return *this;
 	}
+	Vector<T, C>& operator=(Vector<T, C>&& rhs) {
+		if (this == &rhs)
+			return *this;
+		data = std::move(rhs.data);
+		rhs.data.clear();
+		return *this;
+	}
+	template<class E> Vector(const Expression<E, Vector<T, C>>& expr) {
+		*this = expr;
+	}
+	template<class E> Vector<T, C>& operator=(
+			const Expression<E, Vector<T, C>>& expr) {
+		const Vector<T, C>* shape = expr.derived().shape();
+		if (shape != this) {
+			this->resize(shape->size());
+		}
+		EvaluateExpression(*this, expr);
+		return *this;
+	}
 	Vector() {
 	}
 	Vector(T* ptr, size_t sz) :
@@ -138,7 +165,7 @@ public:
 		set(ptr);
 	}
 	Vector(const std::vector<vec<T, C>>& ref) :
-			data(ref) {
+			data(ref.begin(), ref.end()) {
 	}
 	size_t size() const {
 		return data.size();
@@ -327,7 +354,7 @@ template<class T, int C> void Transform(Vector<T, C>& im1,
 	}
 }
 template<class T, int C> void Transform(Vector<T, C>& im1,
-		const Vector<T, C>& im2,
+		const ExpressionInput<Vector<T, C>>& im2,
 		const std::function<void(vec<T, C>&, const vec<T, C>&)>& func) {
 	if (im1.size() != im2.size())
 		throw std::runtime_error(
@@ -340,8 +367,8 @@ template<class T, int C> void Transform(Vector<T, C>& im1,
 	}
 }
 template<class T, int C> void Transform(Vector<T, C>& im1,
-		const Vector<T, C>& im2, const Vector<T, C>& im3,
-		const Vector<T, C>& im4,
+		const ExpressionInput<Vector<T, C>>& im2, const ExpressionInput<Vector<T, C>>& im3,
+		const ExpressionInput<Vector<T, C>>& im4,
 		const std::function<
 				void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&,
 						const vec<T, C>&)>& func) {
@@ -357,7 +384,7 @@ template<class T, int C> void Transform(Vector<T, C>& im1,
 	}
 }
 template<class T, int C> void Transform(Vector<T, C>& im1,
-		const Vector<T, C>& im2, const Vector<T, C>& im3,
+		const ExpressionInput<Vector<T, C>>& im2, const ExpressionInput<Vector<T, C>>& im3,
 		const std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)>& func) {
 	if (im1.size() != im2.size())
 		throw std::runtime_error(
@@ -382,6 +409,115 @@ template<class T, int C> void Transform(Vector<T, C>& im1, Vector<T, C>& im2,
 		func(offset, im1.data[offset], im2.data[offset]);
 	}
 }
+/*
+ * Functor versions of Transform. The functor type is a template parameter so
+ * the per-element call is inlined into the loop instead of going through
+ * std::function. Work is split into blocks of grainSize elements.
+ */
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&>::value>::type Transform(Vector<T, C>& im1,
+		F func, size_t grainSize = 0) {
+	vec<T, C>* out = im1.data.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Vector<T, C>& im1, Vector<T, C>& im2, F func, size_t grainSize = 0) {
+	if (im1.size() != im2.size())
+		throw std::runtime_error(
+				MakeString() << "Vector dimensions do not match. " << im1.size()
+						<< "!=" << im2.size());
+	vec<T, C>* out = im1.data.data();
+	vec<T, C>* in1 = im2.data.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		Vector<T, C>& im1, const ExpressionInput<Vector<T, C>>& im2, F func,
+		size_t grainSize = 0) {
+	if (im1.size() != im2.size())
+		throw std::runtime_error(
+				MakeString() << "Vector dimensions do not match. " << im1.size()
+						<< "!=" << im2.size());
+	vec<T, C>* out = im1.data.data();
+	const vec<T, C>* in1 = im2.data.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		Vector<T, C>& im1, const ExpressionInput<Vector<T, C>>& im2, const ExpressionInput<Vector<T, C>>& im3,
+		F func, size_t grainSize = 0) {
+	if (im1.size() != im2.size() || im1.size() != im3.size())
+		throw std::runtime_error(
+				MakeString() << "Vector dimensions do not match. " << im1.size()
+						<< "!=" << im2.size() << "!=" << im3.size());
+	vec<T, C>* out = im1.data.data();
+	const vec<T, C>* in1 = im2.data.data();
+	const vec<T, C>* in2 = im3.data.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset], in2[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&, const vec<T, C>&,
+				const vec<T, C>&>::value>::type Transform(Vector<T, C>& im1,
+		const ExpressionInput<Vector<T, C>>& im2, const ExpressionInput<Vector<T, C>>& im3,
+		const ExpressionInput<Vector<T, C>>& im4, F func, size_t grainSize = 0) {
+	if (im1.size() != im2.size() || im1.size() != im3.size()
+			|| im1.size() != im4.size())
+		throw std::runtime_error(
+				MakeString() << "Vector dimensions do not match. " << im1.size()
+						<< "!=" << im2.size() << "!=" << im3.size() << "!="
+						<< im4.size());
+	vec<T, C>* out = im1.data.data();
+	const vec<T, C>* in1 = im2.data.data();
+	const vec<T, C>* in2 = im3.data.data();
+	const vec<T, C>* in3 = im4.data.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(out[offset], in1[offset], in2[offset], in3[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, size_t, vec<T, C>&>::value>::type Transform(
+		Vector<T, C>& im1, F func, size_t grainSize = 0) {
+	vec<T, C>* out = im1.data.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(offset, out[offset]);
+		}
+	}, grainSize);
+}
+template<class T, int C, class F> typename std::enable_if<
+		IsCallable<F, size_t, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Vector<T, C>& im1, Vector<T, C>& im2, F func, size_t grainSize = 0) {
+	if (im1.size() != im2.size())
+		throw std::runtime_error(
+				MakeString() << "Vector dimensions do not match. " << im1.size()
+						<< "!=" << im2.size());
+	vec<T, C>* out = im1.data.data();
+	vec<T, C>* in1 = im2.data.data();
+	ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+		for (size_t offset = begin; offset < end; offset++) {
+			func(offset, out[offset], in1[offset]);
+		}
+	}, grainSize);
+}
 template<class T, class L, class R, int C> std::basic_ostream<L, R> & operator <<(
 		std::basic_ostream<L, R> & ss, const Vector<T, C> & A) {
 	size_t index = 0;
@@ -390,33 +526,34 @@ template<class T, class L, class R, int C> std::basic_ostream<L, R> & operator <
 	}
 	return ss;
 }
-template<class T, int C> Vector<T, C> operator+(const vec<T, C>& scalar,
-		const Vector<T, C>& img) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar + val2;};
-	Transform(out, img, f);
-	return out;
+template<class T, int C> struct IsExpressionContainer<Vector<T, C>> : public std::true_type {
+};
+template<class T, int C> void CheckExpressionShape(const Vector<T, C>& a,
+		const Vector<T, C>& b) {
+	if (a.size() != b.size())
+		throw std::runtime_error(
+				MakeString() << "Vector dimensions do not match. " << a.size()
+						<< "!=" << b.size());
 }
 template<class T, int C> void ScaleAdd(Vector<T, C>& out,
-		const vec<T, C>& scalar, const Vector<T, C>& in) {
+		const vec<T, C>& scalar, const ExpressionInput<Vector<T, C>>& in) {
 	out.resize(in.size());
 	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
 			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 += scalar * val2;};
 	Transform(out, in, f);
 }
 template<class T, int C> void ScaleAdd(Vector<T, C>& out,
-		const Vector<T, C>& in1, const vec<T, C>& scalar,
-		const Vector<T, C>& in2) {
+		const ExpressionInput<Vector<T, C>>& in1, const vec<T, C>& scalar,
+		const ExpressionInput<Vector<T, C>>& in2) {
 	out.resize(in1.size());
 	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
 			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2+scalar * val3;};
 	Transform(out, in1, in2, f);
 }
 template<class T, int C> void ScaleAdd(Vector<T, C>& out,
-		const Vector<T, C>& in1, const vec<T, C>& scalar2,
-		const Vector<T, C>& in2, const vec<T, C>& scalar3,
-		const Vector<T, C>& in3) {
+		const ExpressionInput<Vector<T, C>>& in1, const vec<T, C>& scalar2,
+		const ExpressionInput<Vector<T, C>>& in2, const vec<T, C>& scalar3,
+		const ExpressionInput<Vector<T, C>>& in3) {
 	out.resize(in1.size());
 	std::function<
 			void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&,
@@ -428,191 +565,36 @@ template<class T, int C> void ScaleAdd(Vector<T, C>& out,
 	Transform(out, in1, in2, in3, f);
 }
 template<class T, int C> void ScaleSubtract(Vector<T, C>& out,
-		const vec<T, C>& scalar, const Vector<T, C>& in) {
+		const vec<T, C>& scalar, const ExpressionInput<Vector<T, C>>& in) {
 	out.resize(in.size());
 	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
 			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 -= scalar * val2;};
 	Transform(out, in, f);
 }
 template<class T, int C> void ScaleSubtract(Vector<T, C>& out,
-		const Vector<T, C>& in1, const vec<T, C>& scalar,
-		const Vector<T, C>& in2) {
+		const ExpressionInput<Vector<T, C>>& in1, const vec<T, C>& scalar,
+		const ExpressionInput<Vector<T, C>>& in2) {
 	out.resize(in1.size());
 	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
 			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 - scalar * val3;};
 	Transform(out, in1, in2, f);
 }
 template<class T, int C> void Subtract(Vector<T, C>& out,
-		const Vector<T, C>& v1, const Vector<T, C>& v2) {
+		const ExpressionInput<Vector<T, C>>& v1, const ExpressionInput<Vector<T, C>>& v2) {
 	out.resize(v1.size());
 	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
 			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2-val3;};
 	Transform(out, v1, v2, f);
 }
-template<class T, int C> void Add(Vector<T, C>& out, const Vector<T, C>& v1,
-		const Vector<T, C>& v2) {
+template<class T, int C> void Add(Vector<T, C>& out, const ExpressionInput<Vector<T, C>>& v1,
+		const ExpressionInput<Vector<T, C>>& v2) {
 	out.resize(v1.size());
 	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
 			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 + val3;};
 	Transform(out, v1, v2, f);
 }
-template<class T, int C> Vector<T, C> operator-(const vec<T, C>& scalar,
-		const Vector<T, C>& img) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar - val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator*(const vec<T, C>& scalar,
-		const Vector<T, C>& img) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar*val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator*(const T& scalar,
-		const Vector<T, C>& img) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar*val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator/(const vec<T, C>& scalar,
-		const Vector<T, C>& img) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar / val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator+(const Vector<T, C>& img,
-		const vec<T, C>& scalar) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2 + scalar;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator-(const Vector<T, C>& img,
-		const vec<T, C>& scalar) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2 - scalar;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator*(const Vector<T, C>& img,
-		const vec<T, C>& scalar) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2*scalar;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator/(const Vector<T, C>& img,
-		const vec<T, C>& scalar) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2 / scalar;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator-(const Vector<T, C>& img) {
-	Vector<T, C> out(img.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = -val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator+=(Vector<T, C>& out,
-		const Vector<T, C>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 += val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator-=(Vector<T, C>& out,
-		const Vector<T, C>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 -= val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator*=(Vector<T, C>& out,
-		const Vector<T, C>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 *= val2;};
-	Transform(out, img, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator/=(Vector<T, C>& out,
-		const Vector<T, C>& img) {
-	std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 /= val2;};
-	Transform(out, img, f);
-	return out;
-}
 
-template<class T, int C> Vector<T, C> operator+=(Vector<T, C>& out,
-		const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 += scalar;};
-	Transform(out, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator-=(Vector<T, C>& out,
-		const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 -= scalar;};
-	Transform(out, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator*=(Vector<T, C>& out,
-		const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 *= scalar;};
-	Transform(out, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator/=(Vector<T, C>& out,
-		const vec<T, C>& scalar) {
-	std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 /= scalar;};
-	Transform(out, f);
-	return out;
-}
 
-template<class T, int C> Vector<T, C> operator+(const Vector<T, C>& img1,
-		const Vector<T, C>& img2) {
-	Vector<T, C> out(img1.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 + val3;};
-	Transform(out, img1, img2, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator-(const Vector<T, C>& img1,
-		const Vector<T, C>& img2) {
-	Vector<T, C> out(img1.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 - val3;};
-	Transform(out, img1, img2, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator*(const Vector<T, C>& img1,
-		const Vector<T, C>& img2) {
-	Vector<T, C> out(img1.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2*val3;};
-	Transform(out, img1, img2, f);
-	return out;
-}
-template<class T, int C> Vector<T, C> operator/(const Vector<T, C>& img1,
-		const Vector<T, C>& img2) {
-	Vector<T, C> out(img1.size());
-	std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 / val3;};
-	Transform(out, img1, img2, f);
-	return out;
-}
 template<class T, int C> vec<double, C> dotVec(const Vector<T, C>& a,
 		const Vector<T, C>& b) {
 	vec<double, C> ans(0.0);
@@ -756,6 +738,66 @@ template<class T, int C> vec<double, C> lengthVecSqr(const Vector<T, C>& a) {
 template<class T, int C> vec<double, C> lengthVec(const Vector<T, C>& a) {
 	return aly::sqrt(lengthVecSqr(a));
 }
+/*
+ * Expression arguments to the reductions above are evaluated into a
+ * temporary first.
+ */
+template<class E, class T, int C> vec<double, C> dotVec(
+		const Expression<E, Vector<T, C>>& a,
+		const ExpressionInput<Vector<T, C>>& b) {
+	return dotVec(a.eval(), b);
+}
+template<class E, class T, int C> vec<double, C> dotVec(const Vector<T, C>& a,
+		const Expression<E, Vector<T, C>>& b) {
+	return dotVec(a, b.eval());
+}
+template<class E, class T, int C> double dot(
+		const Expression<E, Vector<T, C>>& a,
+		const ExpressionInput<Vector<T, C>>& b) {
+	return dot(a.eval(), b);
+}
+template<class E, class T, int C> double dot(const Vector<T, C>& a,
+		const Expression<E, Vector<T, C>>& b) {
+	return dot(a, b.eval());
+}
+template<class E, class T, int C> T lengthSqr(
+		const Expression<E, Vector<T, C>>& a) {
+	return lengthSqr(a.eval());
+}
+template<class E, class T, int C> T lengthL1(
+		const Expression<E, Vector<T, C>>& a) {
+	return lengthL1(a.eval());
+}
+template<class E, class T, int C> vec<T, C> lengthVecL1(
+		const Expression<E, Vector<T, C>>& a) {
+	return lengthVecL1(a.eval());
+}
+template<class E, class T, int C> vec<T, C> maxVec(
+		const Expression<E, Vector<T, C>>& a) {
+	return maxVec(a.eval());
+}
+template<class E, class T, int C> vec<T, C> minVec(
+		const Expression<E, Vector<T, C>>& a) {
+	return minVec(a.eval());
+}
+template<class E, class T, int C> T max(const Expression<E, Vector<T, C>>& a) {
+	return max(a.eval());
+}
+template<class E, class T, int C> T min(const Expression<E, Vector<T, C>>& a) {
+	return min(a.eval());
+}
+template<class E, class T, int C> T length(
+		const Expression<E, Vector<T, C>>& a) {
+	return length(a.eval());
+}
+template<class E, class T, int C> vec<double, C> lengthVecSqr(
+		const Expression<E, Vector<T, C>>& a) {
+	return lengthVecSqr(a.eval());
+}
+template<class E, class T, int C> vec<double, C> lengthVec(
+		const Expression<E, Vector<T, C>>& a) {
+	return lengthVec(a.eval());
+}
 typedef Vector<uint8_t, 4> VectorRGBA;
 typedef Vector<int, 4> VectorRGBAi;
 typedef Vector<float, 4> VectorRGBAf;
@@ -30,17 +30,20 @@
 #include <functional>
 #include <fstream>
 #include <random>
+#include <memory>
 namespace aly {
+	template<class T, int C, ImageType I> struct VolumeView;
+	template<class T, int C, ImageType I> struct ConstVolumeView;
 	template<class T, int C, ImageType I> struct Volume {
 	private:
 		std::string hashCode;
 		int x, y, z;
 	public:
-		std::vector<vec<T, C>> data;
+		aligned_vector<vec<T, C>> data;
 		typedef vec<T, C> ValueType;
-		typedef typename std::vector<ValueType>::iterator iterator;
-		typedef typename std::vector<ValueType>::const_iterator const_iterator;
-		typedef typename std::vector<ValueType>::reverse_iterator reverse_iterator;
+		typedef typename aligned_vector<ValueType>::iterator iterator;
+		typedef typename aligned_vector<ValueType>::const_iterator const_iterator;
+		typedef typename aligned_vector<ValueType>::reverse_iterator reverse_iterator;
 		iterator begin() {
 			return data.begin();
 		}
@@ -104,6 +107,9 @@ namespace aly {
 			data.assign(data.size(), val);
 		}
 		void set(const std::vector<vec<T, C>>& val) {
+			data.assign(val.begin(), val.end());
+		}
+		void set(const aligned_vector<vec<T, C>>& val) {
 			data = val;
 		}
 		void set(T* val) {
@@ -156,7 +162,7 @@ namespace aly {
 		}
 		Volume(std::vector<vec<T, C>>& ref, int r, int c, int s, int x = 0, int y =
 			0, int z = 0, uint64_t id = 0) :
-			x(x), y(y), z(z), data(ref) , rows(r), cols(c), slices(s), id(id){
+			x(x), y(y), z(z), data(ref.begin(), ref.end()) , rows(r), cols(c), slices(s), id(id){
 		}
 		Volume() :
 			x(0), y(0), z(0), rows(0), cols(0), slices(0), id(0) {
@@ -165,6 +171,12 @@ namespace aly {
 			Volume(img.rows, img.cols, img.slices, img.position(), img.id) {
 			set(img.data);
 		}
+		Volume(Volume<T, C, I>&& img) :
+			x(img.x), y(img.y), z(img.z), data(std::move(img.data)), rows(img.rows), cols(img.cols), slices(img.slices), id(img.id) {
+			img.rows = 0;
+			img.cols = 0;
+			img.slices = 0;
+		}
 		Volume<T, C, I>& operator=(const Volume<T, C, I>& rhs) {
 			if (this == &rhs)
 				return *this;
@@ -174,6 +186,35 @@ namespace aly {
 			this->set(rhs.data);
 			return *this;
 		}
+		Volume<T, C, I>& operator=(Volume<T, C, I>&& rhs) {
+			if (this == &rhs)
+				return *this;
+			data = std::move(rhs.data);
+			rhs.data.clear();
+			this->rows = rhs.rows;
+			this->cols = rhs.cols;
+			this->slices = rhs.slices;
+			this->setPosition(rhs.position());
+			this->id = rhs.id;
+			rhs.rows = 0;
+			rhs.cols = 0;
+			rhs.slices = 0;
+			return *this;
+		}
+		template<class E> Volume(const Expression<E, Volume<T, C, I>>& expr) :
+			Volume() {
+			*this = expr;
+		}
+		template<class E> Volume<T, C, I>& operator=(
+			const Expression<E, Volume<T, C, I>>& expr) {
+			const Volume<T, C, I>* shape = expr.derived().shape();
+			if (shape != this) {
+				this->resize(shape->rows, shape->cols, shape->slices);
+				this->setPosition(shape->position());
+			}
+			EvaluateExpression(*this, expr);
+			return *this;
+		}
 		int3 dimensions() const {
 			return int3(rows, cols, slices);
 		}
@@ -218,6 +259,10 @@ namespace aly {
 				return nullptr;
 			return &(data.front()[0]);
 		}
+		VolumeView<T, C, I> view();
+		VolumeView<T, C, I> view(const int3& pos, const int3& dims);
+		ConstVolumeView<T, C, I> view() const;
+		ConstVolumeView<T, C, I> view(const int3& pos, const int3& dims) const;
 		void setZero() {
 			data.assign(data.size(), vec<T, C>((T)0));
 		}
@@ -474,7 +519,7 @@ namespace aly {
 	template<class T, int C, ImageType I> std::string Volume<T, C, I>::updateHashCode(
 		size_t MAX_SAMPLES, HashMethod method) {
 		if (MAX_SAMPLES == 0) {
-			hashCode = HashCode(data, method);
+			hashCode = TreeHashCode(data, method);
 		}
 		else {
 			const size_t seed = 8743128921;
@@ -491,6 +536,241 @@ namespace aly {
 		}
 		return hashCode;
 	}
+	/*
+	 * Non-owning window onto voxel memory with an origin, dimensions, a row
+	 * stride (between consecutive j) and a slice stride (between consecutive
+	 * k), both in voxels. Wraps a Volume, a sub-block of one, or external
+	 * memory without copying. Views have pointer semantics.
+	 */
+	template<class T, int C, ImageType I> struct VolumeView {
+		vec<T, C>* data;
+		int rows;
+		int cols;
+		int slices;
+		size_t stride;
+		size_t sliceStride;
+		typedef vec<T, C> ValueType;
+		VolumeView() :
+			data(nullptr), rows(0), cols(0), slices(0), stride(0), sliceStride(0) {
+		}
+		VolumeView(vec<T, C>* ptr, int r, int c, int s, size_t rowStride = 0,
+			size_t planeStride = 0) :
+			data(ptr), rows(r), cols(c), slices(s), stride(
+				(rowStride == 0) ? (size_t)r : rowStride), sliceStride(
+					(planeStride == 0) ? stride * c : planeStride) {
+		}
+		VolumeView(T* ptr, int r, int c, int s, size_t rowStride = 0,
+			size_t planeStride = 0) :
+			VolumeView(reinterpret_cast<vec<T, C>*>(ptr), r, c, s, rowStride,
+				planeStride) {
+		}
+		VolumeView(Volume<T, C, I>& vol) :
+			VolumeView(vol.vecPtr(), vol.rows, vol.cols, vol.slices) {
+		}
+		VolumeView(Volume<T, C, I>& vol, const int3& pos, const int3& dims) :
+			VolumeView(VolumeView(vol).subView(pos, dims)) {
+		}
+		VolumeView subView(const int3& pos, const int3& dims) const {
+			if (pos.x < 0 || pos.y < 0 || pos.z < 0 || dims.x < 0 || dims.y < 0
+				|| dims.z < 0 || pos.x + dims.x > rows
+				|| pos.y + dims.y > cols || pos.z + dims.z > slices)
+				throw std::runtime_error(
+					MakeString() << "Sub-view " << pos << " " << dims
+					<< " exceeds view dimensions " << dimensions());
+			return VolumeView(
+				data + pos.x + pos.y * stride + pos.z * sliceStride, dims.x,
+				dims.y, dims.z, stride, sliceStride);
+		}
+		int3 dimensions() const {
+			return int3(rows, cols, slices);
+		}
+		size_t size() const {
+			return (size_t)rows * cols * slices;
+		}
+		void resize(int r, int c, int s) const {
+			if (r != rows || c != cols || s != slices)
+				throw std::runtime_error(
+					MakeString() << "Cannot resize volume view "
+					<< dimensions() << " to " << int3(r, c, s));
+		}
+		vec<T, C>* row(int j, int k) const {
+			return data + j * stride + k * sliceStride;
+		}
+		vec<T, C>& operator()(int i, int j, int k) const {
+			return data[clamp(i, 0, rows - 1) + clamp(j, 0, cols - 1) * stride
+				+ clamp(k, 0, slices - 1) * sliceStride];
+		}
+		vec<T, C>& operator()(const int3& ijk) const {
+			return operator()(ijk.x, ijk.y, ijk.z);
+		}
+		void set(const vec<T, C>& val) const {
+#pragma omp parallel for
+			for (int k = 0; k < slices; k++) {
+				for (int j = 0; j < cols; j++) {
+					std::fill(row(j, k), row(j, k) + rows, val);
+				}
+			}
+		}
+		void set(const ConstVolumeView<T, C, I>& other) const {
+			resize(other.rows, other.cols, other.slices);
+#pragma omp parallel for
+			for (int k = 0; k < slices; k++) {
+				for (int j = 0; j < cols; j++) {
+					std::copy(other.row(j, k), other.row(j, k) + rows, row(j, k));
+				}
+			}
+		}
+		void copyTo(Volume<T, C, I>& out) const {
+			out.resize(rows, cols, slices);
+			VolumeView(out).set(*this);
+		}
+	};
+	/*
+	 * Read-only counterpart of VolumeView, used for views of const volumes and
+	 * for the input side of view-based operations. Any VolumeView converts to one.
+	 */
+	template<class T, int C, ImageType I> struct ConstVolumeView {
+		const vec<T, C>* data;
+		int rows;
+		int cols;
+		int slices;
+		size_t stride;
+		size_t sliceStride;
+		typedef vec<T, C> ValueType;
+		ConstVolumeView() :
+			data(nullptr), rows(0), cols(0), slices(0), stride(0), sliceStride(0) {
+		}
+		ConstVolumeView(const vec<T, C>* ptr, int r, int c, int s,
+			size_t rowStride = 0, size_t planeStride = 0) :
+			data(ptr), rows(r), cols(c), slices(s), stride(
+				(rowStride == 0) ? (size_t)r : rowStride), sliceStride(
+					(planeStride == 0) ? stride * c : planeStride) {
+		}
+		ConstVolumeView(const T* ptr, int r, int c, int s, size_t rowStride = 0,
+			size_t planeStride = 0) :
+			ConstVolumeView(reinterpret_cast<const vec<T, C>*>(ptr), r, c, s,
+				rowStride, planeStride) {
+		}
+		ConstVolumeView(const Volume<T, C, I>& vol) :
+			ConstVolumeView(vol.vecPtr(), vol.rows, vol.cols, vol.slices) {
+		}
+		ConstVolumeView(const VolumeView<T, C, I>& view) :
+			ConstVolumeView(view.data, view.rows, view.cols, view.slices,
+				view.stride, view.sliceStride) {
+		}
+		ConstVolumeView(const Volume<T, C, I>& vol, const int3& pos,
+			const int3& dims) :
+			ConstVolumeView(ConstVolumeView(vol).subView(pos, dims)) {
+		}
+		ConstVolumeView subView(const int3& pos, const int3& dims) const {
+			if (pos.x < 0 || pos.y < 0 || pos.z < 0 || dims.x < 0 || dims.y < 0
+				|| dims.z < 0 || pos.x + dims.x > rows
+				|| pos.y + dims.y > cols || pos.z + dims.z > slices)
+				throw std::runtime_error(
+					MakeString() << "Sub-view " << pos << " " << dims
+					<< " exceeds view dimensions " << dimensions());
+			return ConstVolumeView(
+				data + pos.x + pos.y * stride + pos.z * sliceStride, dims.x,
+				dims.y, dims.z, stride, sliceStride);
+		}
+		int3 dimensions() const {
+			return int3(rows, cols, slices);
+		}
+		size_t size() const {
+			return (size_t)rows * cols * slices;
+		}
+		const vec<T, C>* row(int j, int k) const {
+			return data + j * stride + k * sliceStride;
+		}
+		const vec<T, C>& operator()(int i, int j, int k) const {
+			return data[clamp(i, 0, rows - 1) + clamp(j, 0, cols - 1) * stride
+				+ clamp(k, 0, slices - 1) * sliceStride];
+		}
+		const vec<T, C>& operator()(const int3& ijk) const {
+			return operator()(ijk.x, ijk.y, ijk.z);
+		}
+		void copyTo(Volume<T, C, I>& out) const {
+			out.resize(rows, cols, slices);
+			VolumeView<T, C, I>(out).set(*this);
+		}
+	};
+	template<class T, int C, ImageType I> VolumeView<T, C, I> Volume<T, C, I>::view() {
+		return VolumeView<T, C, I>(*this);
+	}
+	template<class T, int C, ImageType I> VolumeView<T, C, I> Volume<T, C, I>::view(
+		const int3& pos, const int3& dims) {
+		return VolumeView<T, C, I>(*this, pos, dims);
+	}
+	template<class T, int C, ImageType I> ConstVolumeView<T, C, I> Volume<T, C, I>::view() const {
+		return ConstVolumeView<T, C, I>(*this);
+	}
+	template<class T, int C, ImageType I> ConstVolumeView<T, C, I> Volume<T, C, I>::view(
+		const int3& pos, const int3& dims) const {
+		return ConstVolumeView<T, C, I>(*this, pos, dims);
+	}
+	/*
+	 * Splits the rows of a view (one per (j,k) pair, row index j + k * cols)
+	 * into blocks of roughly grainSize voxels.
+	 */
+	template<class T, int C, ImageType I, class F> void ParallelForRows(
+		const VolumeView<T, C, I>& view, F func, size_t grainSize = 0) {
+		if (grainSize == 0) {
+			grainSize = DEFAULT_GRAIN_SIZE;
+		}
+		size_t rows = std::max((size_t)1, grainSize / std::max(view.rows, 1));
+		ParallelFor((size_t)view.cols * view.slices, func, rows);
+	}
+	/*
+	 * Transform over volume views. Rows of voxels are processed in blocks, so
+	 * strided sub-blocks are updated in place.
+	 */
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&>::value>::type Transform(
+			const VolumeView<T, C, I>& im1, F func, size_t grainSize = 0) {
+		ParallelForRows(im1, [&](size_t begin, size_t end) {
+			for (size_t r = begin; r < end; r++) {
+				vec<T, C>* out = im1.row((int)(r % im1.cols), (int)(r / im1.cols));
+				for (int i = 0; i < im1.rows; i++) {
+					func(out[i]);
+				}
+			}
+		}, grainSize);
+	}
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+			const VolumeView<T, C, I>& im1,
+			const ExpressionInput<ConstVolumeView<T, C, I>>& im2, F func,
+			size_t grainSize = 0) {
+		if (im1.dimensions() != im2.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< im1.dimensions() << "!=" << im2.dimensions());
+		ParallelForRows(im1, [&](size_t begin, size_t end) {
+			for (size_t r = begin; r < end; r++) {
+				int j = (int)(r % im1.cols);
+				int k = (int)(r / im1.cols);
+				vec<T, C>* out = im1.row(j, k);
+				const vec<T, C>* in1 = im2.row(j, k);
+				for (int i = 0; i < im1.rows; i++) {
+					func(out[i], in1[i]);
+				}
+			}
+		}, grainSize);
+	}
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, int, int, int, vec<T, C>&>::value>::type Transform(
+			const VolumeView<T, C, I>& im1, F func, size_t grainSize = 0) {
+		ParallelForRows(im1, [&](size_t begin, size_t end) {
+			for (size_t r = begin; r < end; r++) {
+				int j = (int)(r % im1.cols);
+				int k = (int)(r / im1.cols);
+				vec<T, C>* out = im1.row(j, k);
+				for (int i = 0; i < im1.rows; i++) {
+					func(i, j, k, out[i]);
+				}
+			}
+		}, grainSize);
+	}
 	template<class T, int C, ImageType I> void Transform(Volume<T, C, I>& im1,
 		Volume<T, C, I>& im2,
 		const std::function<void(vec<T, C>&, vec<T, C>&)>& func) {
@@ -505,8 +785,8 @@ namespace aly {
 		}
 	}
 	template<class T, int C, ImageType I> void Transform(Volume<T, C, I>& im1,
-		const Volume<T, C, I>& im2, const Volume<T, C, I>& im3,
-		const Volume<T, C, I>& im4,
+		const ExpressionInput<Volume<T, C, I>>& im2, const ExpressionInput<Volume<T, C, I>>& im3,
+		const ExpressionInput<Volume<T, C, I>>& im4,
 		const std::function<
 		void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&,
 			const vec<T, C>&)>& func) {
@@ -530,7 +810,7 @@ namespace aly {
 		}
 	}
 	template<class T, int C, ImageType I> void Transform(Volume<T, C, I>& im1,
-		const Volume<T, C, I>& im2,
+		const ExpressionInput<Volume<T, C, I>>& im2,
 		const std::function<void(vec<T, C>&, const vec<T, C>&)>& func) {
 		if (im1.dimensions() != im2.dimensions())
 			throw std::runtime_error(
@@ -543,7 +823,7 @@ namespace aly {
 		}
 	}
 	template<class T, int C, ImageType I> void Transform(Volume<T, C, I>& im1,
-		const Volume<T, C, I>& im2, const Volume<T, C, I>& im3,
+		const ExpressionInput<Volume<T, C, I>>& im2, const ExpressionInput<Volume<T, C, I>>& im3,
 		const std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)>& func) {
 		if (im1.dimensions() != im2.dimensions())
 			throw std::runtime_error(
@@ -587,274 +867,324 @@ namespace aly {
 			func(offset, im1.data[offset], im2.data[offset]);
 		}
 	}
-	template<class T, class L, class R, int C, ImageType I> std::basic_ostream<L, R> & operator <<(
-		std::basic_ostream<L, R> & ss, const Volume<T, C, I> & A) {
-		ss << "Volume (" << A.getTypeName() << "): " << A.id << " Position: ("
-			<< A.x << "," << A.y << ") Dimensions: [" << A.rows << "," << A.cols
-			<< "]\n";
-		return ss;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator+(
-		const vec<T, C>& scalar, const Volume<T, C, I>& img) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar + val2;};
-		Transform(out, img, f);
-		return out;
-	}
-
-	template<class T, int C, ImageType I> Volume<T, C, I> operator-(
-		const vec<T, C>& scalar, const Volume<T, C, I>& img) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar - val2;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator*(
-		const vec<T, C>& scalar, const Volume<T, C, I>& img) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar*val2;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator/(
-		const vec<T, C>& scalar, const Volume<T, C, I>& img) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = scalar / val2;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator+(
-		const Volume<T, C, I>& img, const vec<T, C>& scalar) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2 + scalar;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator-(
-		const Volume<T, C, I>& img, const vec<T, C>& scalar) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2 - scalar;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator*(
-		const Volume<T, C, I>& img, const vec<T, C>& scalar) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2*scalar;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator/(
-		const Volume<T, C, I>& img, const vec<T, C>& scalar) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = val2 / scalar;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator-(
-		const Volume<T, C, I>& img) {
-		Volume<T, C, I> out(img.rows, img.cols, img.slices, img.position());
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 = -val2;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator+=(
-		Volume<T, C, I>& out, const Volume<T, C, I>& img) {
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 += val2;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator-=(
-		Volume<T, C, I>& out, const Volume<T, C, I>& img) {
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 -= val2;};
-		Transform(out, img, f);
-		return out;
-	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator*=(
-		Volume<T, C, I>& out, const Volume<T, C, I>& img) {
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 *= val2;};
-		Transform(out, img, f);
-		return out;
+	/*
+	 * Functor versions of Transform. The functor type is a template parameter so
+	 * the per-voxel call is inlined into the loop instead of going through
+	 * std::function. Work is split into blocks of grainSize voxels.
+	 */
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&>::value>::type Transform(Volume<T, C, I>& im1,
+		F func, size_t grainSize = 0) {
+		vec<T, C>* out = im1.vecPtr();
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			for (size_t offset = begin; offset < end; offset++) {
+				func(out[offset]);
+			}
+		}, grainSize);
 	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator/=(
-		Volume<T, C, I>& out, const Volume<T, C, I>& img) {
-		std::function<void(vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2) {val1 /= val2;};
-		Transform(out, img, f);
-		return out;
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Volume<T, C, I>& im1, Volume<T, C, I>& im2, F func, size_t grainSize = 0) {
+		if (im1.dimensions() != im2.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< im1.dimensions() << "!=" << im2.dimensions());
+		vec<T, C>* out = im1.vecPtr();
+		vec<T, C>* in1 = im2.vecPtr();
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			for (size_t offset = begin; offset < end; offset++) {
+				func(out[offset], in1[offset]);
+			}
+		}, grainSize);
 	}
-
-	template<class T, int C, ImageType I> Volume<T, C, I> operator+=(
-		Volume<T, C, I>& out, const vec<T, C>& scalar) {
-		std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 += scalar;};
-		Transform(out, f);
-		return out;
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		Volume<T, C, I>& im1, const ExpressionInput<Volume<T, C, I>>& im2, F func,
+		size_t grainSize = 0) {
+		if (im1.dimensions() != im2.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< im1.dimensions() << "!=" << im2.dimensions());
+		vec<T, C>* out = im1.vecPtr();
+		const vec<T, C>* in1 = im2.vecPtr();
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			for (size_t offset = begin; offset < end; offset++) {
+				func(out[offset], in1[offset]);
+			}
+		}, grainSize);
 	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator-=(
-		Volume<T, C, I>& out, const vec<T, C>& scalar) {
-		std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 -= scalar;};
-		Transform(out, f);
-		return out;
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&, const vec<T, C>&>::value>::type Transform(
+		Volume<T, C, I>& im1, const ExpressionInput<Volume<T, C, I>>& im2,
+		const ExpressionInput<Volume<T, C, I>>& im3, F func, size_t grainSize = 0) {
+		if (im1.dimensions() != im2.dimensions()
+			|| im1.dimensions() != im3.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< im1.dimensions() << "!=" << im2.dimensions() << "!="
+				<< im3.dimensions());
+		vec<T, C>* out = im1.vecPtr();
+		const vec<T, C>* in1 = im2.vecPtr();
+		const vec<T, C>* in2 = im3.vecPtr();
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			for (size_t offset = begin; offset < end; offset++) {
+				func(out[offset], in1[offset], in2[offset]);
+			}
+		}, grainSize);
 	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator*=(
-		Volume<T, C, I>& out, const vec<T, C>& scalar) {
-		std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 *= scalar;};
-		Transform(out, f);
-		return out;
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, vec<T, C>&, const vec<T, C>&, const vec<T, C>&,
+		const vec<T, C>&>::value>::type Transform(Volume<T, C, I>& im1,
+		const ExpressionInput<Volume<T, C, I>>& im2, const ExpressionInput<Volume<T, C, I>>& im3,
+		const ExpressionInput<Volume<T, C, I>>& im4, F func, size_t grainSize = 0) {
+		if (im1.dimensions() != im2.dimensions()
+			|| im1.dimensions() != im3.dimensions()
+			|| im1.dimensions() != im4.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< im1.dimensions() << "!=" << im2.dimensions() << "!="
+				<< im3.dimensions() << "!=" << im4.dimensions());
+		vec<T, C>* out = im1.vecPtr();
+		const vec<T, C>* in1 = im2.vecPtr();
+		const vec<T, C>* in2 = im3.vecPtr();
+		const vec<T, C>* in3 = im4.vecPtr();
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			for (size_t offset = begin; offset < end; offset++) {
+				func(out[offset], in1[offset], in2[offset], in3[offset]);
+			}
+		}, grainSize);
 	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator/=(
-		Volume<T, C, I>& out, const vec<T, C>& scalar) {
-		std::function<void(vec<T, C>&)> f = [=](vec<T, C>& val1) {val1 /= scalar;};
-		Transform(out, f);
-		return out;
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, int, int, int, vec<T, C>&>::value>::type Transform(
+		Volume<T, C, I>& im1, F func, size_t grainSize = 0) {
+		vec<T, C>* out = im1.vecPtr();
+		const int rows = im1.rows;
+		const int cols = im1.cols;
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			int i = (int) (begin % rows);
+			int j = (int) ((begin / rows) % cols);
+			int k = (int) (begin / ((size_t) rows * cols));
+			for (size_t offset = begin; offset < end; offset++) {
+				func(i, j, k, out[offset]);
+				if (++i == rows) {
+					i = 0;
+					if (++j == cols) {
+						j = 0;
+						k++;
+					}
+				}
+			}
+		}, grainSize);
 	}
-
-	template<class T, int C, ImageType I> Volume<T, C, I> operator+(
-		const Volume<T, C, I>& img1, const Volume<T, C, I>& img2) {
-		Volume<T, C, I> out(img1.rows, img1.cols, img1.slices);
-		std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 + val3;};
-		Transform(out, img1, img2, f);
-		return out;
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, int, int, int, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Volume<T, C, I>& im1, Volume<T, C, I>& im2, F func, size_t grainSize = 0) {
+		if (im1.dimensions() != im2.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< im1.dimensions() << "!=" << im2.dimensions());
+		vec<T, C>* out = im1.vecPtr();
+		vec<T, C>* in1 = im2.vecPtr();
+		const int rows = im1.rows;
+		const int cols = im1.cols;
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			int i = (int) (begin % rows);
+			int j = (int) ((begin / rows) % cols);
+			int k = (int) (begin / ((size_t) rows * cols));
+			for (size_t offset = begin; offset < end; offset++) {
+				func(i, j, k, out[offset], in1[offset]);
+				if (++i == rows) {
+					i = 0;
+					if (++j == cols) {
+						j = 0;
+						k++;
+					}
+				}
+			}
+		}, grainSize);
 	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator-(
-		const Volume<T, C, I>& img1, const Volume<T, C, I>& img2) {
-		Volume<T, C, I> out(img1.rows, img1.cols, img1.slices);
-		std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 - val3;};
-		Transform(out, img1, img2, f);
-		return out;
+	template<class T, int C, ImageType I, class F> typename std::enable_if<
+		IsCallable<F, size_t, vec<T, C>&, vec<T, C>&>::value>::type Transform(
+		Volume<T, C, I>& im1, Volume<T, C, I>& im2, F func, size_t grainSize = 0) {
+		if (im1.dimensions() != im2.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< im1.dimensions() << "!=" << im2.dimensions());
+		vec<T, C>* out = im1.vecPtr();
+		vec<T, C>* in1 = im2.vecPtr();
+		ParallelFor(im1.size(), [&](size_t begin, size_t end) {
+			for (size_t offset = begin; offset < end; offset++) {
+				func(offset, out[offset], in1[offset]);
+			}
+		}, grainSize);
 	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator*(
-		const Volume<T, C, I>& img1, const Volume<T, C, I>& img2) {
-		Volume<T, C, I> out(img1.rows, img1.cols, img1.slices);
-		std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2*val3;};
-		Transform(out, img1, img2, f);
-		return out;
+	template<class T, class L, class R, int C, ImageType I> std::basic_ostream<L, R> & operator <<(
+		std::basic_ostream<L, R> & ss, const Volume<T, C, I> & A) {
+		ss << "Volume (" << A.getTypeName() << "): " << A.id << " Position: ("
+			<< A.x << "," << A.y << ") Dimensions: [" << A.rows << "," << A.cols
+			<< "]\n";
+		return ss;
 	}
-	template<class T, int C, ImageType I> Volume<T, C, I> operator/(
-		const Volume<T, C, I>& img1, const Volume<T, C, I>& img2) {
-		Volume<T, C, I> out(img1.rows, img1.cols, img1.slices);
-		std::function<void(vec<T, C>&, const vec<T, C>&, const vec<T, C>&)> f =
-			[=](vec<T, C>& val1, const vec<T, C>& val2, const vec<T, C>& val3) {val1 = val2 / val3;};
-		Transform(out, img1, img2, f);
-		return out;
+	template<class T, int C, ImageType I> struct IsExpressionContainer<
+		Volume<T, C, I>> : public std::true_type {
+	};
+	template<class T, int C, ImageType I> void CheckExpressionShape(
+		const Volume<T, C, I>& a, const Volume<T, C, I>& b) {
+		if (a.dimensions() != b.dimensions())
+			throw std::runtime_error(
+				MakeString() << "Volume dimensions do not match. "
+				<< a.dimensions() << "!=" << b.dimensions());
 	}
 	template<class T, int C, ImageType I> void WriteImageToRawFile(
-		const std::string& file, const Volume<T, C, I>& img) {
-		std::ostringstream vstr;
+		const std::string& file, const Volume<T, C, I>& img,
+		RawLayout layout = RawLayout::Planar) {
 		std::string fileName = GetFileWithoutExtension(file);
-		vstr << fileName << ".raw";
-		FILE* f = fopen(vstr.str().c_str(), "wb");
+		RawHeader header;
+		header.type = I;
+		header.extents = { img.rows, img.cols, img.slices };
+		if (img.channels > 1) {
+			header.extents.push_back(img.channels);
+		}
+		header.littleEndian = IsLittleEndian();
+		header.layout = layout;
+		header.dataFile = fileName + ".raw";
+		FILE* f = fopen(header.dataFile.c_str(), "wb");
 		if (f == NULL) {
 			throw std::runtime_error(
-				MakeString() << "Could not open " << vstr.str().c_str()
+				MakeString() << "Could not open " << header.dataFile
 				<< " for writing.");
 		}
-		for (int c = 0; c < img.channels; c++) {
-			for (int k = 0; k < img.slices; k++) {
-				for (int j = 0; j < img.cols; j++) {
-					for (int i = 0; i < img.rows; i++) {
-						T val = img(i, j, k)[c];
-						fwrite(&val, sizeof(T), 1, f);
-					}
-				}
-			}
+		try {
+			WriteRawData(f, img.data.data(), img.data.size(), layout);
+		}
+		catch (...) {
+			fclose(f);
+			throw;
 		}
 		fclose(f);
-		std::string typeName = "";
-		switch (img.type) {
-		case ImageType::BYTE:
-			typeName = "Byte";
-			break;
-		case ImageType::UBYTE:
-			typeName = "Unsigned Byte";
-			break;
-		case ImageType::SHORT:
-			typeName = "Short";
-			break;
-		case ImageType::USHORT:
-			typeName = "Unsigned Short";
-			break;
-		case ImageType::INT:
-			typeName = "Integer";
-			break;
-		case ImageType::UINT:
-			typeName = "Unsigned Integer";
-			break;
-		case ImageType::FLOAT:
-			typeName = "Float";
-			break;
-		case ImageType::DOUBLE:
-			typeName = "Double";
-			break;
-		}
-		//std::cout << vstr.str() << std::endl;
-		std::stringstream sstr;
-		sstr << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
-		sstr << "<!-- MIPAV header file -->\n";
-		if (img.channels > 1) {
-			sstr << "<image xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" nDimensions=\"4\">\n";
+		WriteRawHeader(fileName + ".xml", header);
+	}
+	template<class E, class T, int C, ImageType I> void WriteImageToRawFile(
+		const std::string& file, const Expression<E, Volume<T, C, I>>& img,
+		RawLayout layout = RawLayout::Planar) {
+		WriteImageToRawFile(file, img.eval(), layout);
+	}
+	template<class T, int C, ImageType I> void ReadImageFromRawFile(
+		const std::string& file, Volume<T, C, I>& img) {
+		RawHeader header = ReadRawHeader(file);
+		if (header.extents.size() < 3 || header.extents.size() > 4) {
+			throw std::runtime_error(
+				MakeString() << "Raw file " << file << " is not a volume.");
 		}
-		else {
-			sstr << "<image xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" nDimensions=\"3\">\n";
-		}
-		sstr << "	<Dataset-attributes>\n";
-		sstr << "		<Image-offset>0</Image-offset>\n";
-		sstr << "		<Data-type>" << typeName << "</Data-type>\n";
-		sstr << "		<Endianess>Little</Endianess>\n";
-		sstr << "		<Extents>" << img.rows << "</Extents>\n";
-		sstr << "		<Extents>" << img.cols << "</Extents>\n";
-		sstr << "		<Extents>" << img.slices << "</Extents>\n";
-		if (img.channels > 1) {
-			sstr << "		<Extents>" << img.channels << "</Extents>\n";
-		}
-		sstr << "		<Resolutions>\n";
-		sstr << "			<Resolution>1.0</Resolution>\n";
-		sstr << "			<Resolution>1.0</Resolution>\n";
-		sstr << "			<Resolution>1.0</Resolution>\n";
-		sstr << "		</Resolutions>\n";
-		sstr << "		<Slice-spacing>1.0</Slice-spacing>\n";
-		sstr << "		<Slice-thickness>0.0</Slice-thickness>\n";
-		sstr << "		<Units>Millimeters</Units>\n";
-		sstr << "		<Units>Millimeters</Units>\n";
-		sstr << "		<Units>Millimeters</Units>\n";
-		sstr << "		<Compression>none</Compression>\n";
-		sstr << "		<Orientation>Unknown</Orientation>\n";
-		sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
-		sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
-		sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
-		sstr << "		<Origin>0.0</Origin>\n";
-		sstr << "		<Origin>0.0</Origin>\n";
-		sstr << "		<Origin>0.0</Origin>\n";
-		sstr << "		<Modality>Unknown Modality</Modality>\n";
-		sstr << "	</Dataset-attributes>\n";
-		sstr << "</image>\n";
-		std::ofstream myfile;
-		std::stringstream xmlFile;
-		xmlFile << fileName << ".xml";
-		myfile.open(xmlFile.str().c_str(), std::ios_base::out);
-		if (!myfile.is_open()) {
+		int channels = (header.extents.size() > 3) ? header.extents[3] : 1;
+		if (channels != C) {
 			throw std::runtime_error(
-				MakeString() << "Could not open " << xmlFile.str()
-				<< " for writing.");
+				MakeString() << "Raw file " << file << " has " << channels
+				<< " channels, expected " << C << ".");
 		}
-		myfile << sstr.str();
-		myfile.close();
+		img.resize(header.extents[0], header.extents[1], header.extents[2]);
+		FILE* f = OpenRawData(header, I, channels, img.size(), sizeof(T));
+		try {
+			ReadRawData(f, img.data.data(), img.size(), header.layout,
+				header.littleEndian != IsLittleEndian());
+		}
+		catch (...) {
+			fclose(f);
+			throw;
+		}
+		fclose(f);
 	}
+	/* Read-only volume backed by a memory-mapped raw file, so multi-GB volumes
+	 * open instantly and are paged in on demand. Requires an interleaved (or
+	 * single channel), native-endian file. */
+	template<class T, int C, ImageType I> struct MappedVolume {
+	private:
+		std::shared_ptr<MappedFile> mapping;
+	public:
+		const vec<T, C>* data;
+		typedef vec<T, C> ValueType;
+		int rows;
+		int cols;
+		int slices;
+		const int channels = C;
+		const ImageType type = I;
+		MappedVolume() :
+			data(nullptr), rows(0), cols(0), slices(0) {
+		}
+		MappedVolume(const std::string& file) :
+			MappedVolume() {
+			open(file);
+		}
+		void open(const std::string& file) {
+			RawHeader header = ReadRawHeader(file);
+			if (header.extents.size() < 3 || header.extents.size() > 4) {
+				throw std::runtime_error(
+					MakeString() << "Raw file " << file << " is not a volume.");
+			}
+			int chs = (header.extents.size() > 3) ? header.extents[3] : 1;
+			if (chs != C) {
+				throw std::runtime_error(
+					MakeString() << "Raw file " << file << " has " << chs
+					<< " channels, expected " << C << ".");
+			}
+			ValidateRawHeader(header, I, chs,
+				(size_t)header.extents[0] * header.extents[1]
+				* header.extents[2], sizeof(T));
+			if (C > 1 && header.layout != RawLayout::Interleaved) {
+				throw std::runtime_error(
+					MakeString() << "Cannot map planar raw file " << file);
+			}
+			if (header.littleEndian != IsLittleEndian()
+				|| header.offset % sizeof(T) != 0) {
+				throw std::runtime_error(
+					MakeString() << "Cannot map raw file " << file
+					<< " without conversion.");
+			}
+			mapping = std::shared_ptr<MappedFile>(
+				new MappedFile(header.dataFile));
+			rows = header.extents[0];
+			cols = header.extents[1];
+			slices = header.extents[2];
+			data = reinterpret_cast<const vec<T, C>*>(mapping->data()
+				+ header.offset);
+		}
+		void close() {
+			mapping.reset();
+			data = nullptr;
+			rows = 0;
+			cols = 0;
+			slices = 0;
+		}
+		bool isOpen() const {
+			return (mapping.get() != nullptr);
+		}
+		size_t size() const {
+			return (size_t)rows * cols * slices;
+		}
+		int3 dimensions() const {
+			return int3(rows, cols, slices);
+		}
+		const vec<T, C>* begin() const {
+			return data;
+		}
+		const vec<T, C>* end() const {
+			return data + size();
+		}
+		const vec<T, C>& operator[](const size_t i) const {
+			return data[i];
+		}
+		const vec<T, C>& operator()(const int i, const int j, const int k) const {
+			return data[clamp(i, 0, rows - 1) + clamp(j, 0, cols - 1) * rows
+				+ clamp(k, 0, slices - 1) * (size_t)rows * cols];
+		}
+		const vec<T, C>& operator()(const int3 ijk) const {
+			return operator()(ijk.x, ijk.y, ijk.z);
+		}
+		void copyTo(Volume<T, C, I>& out) const {
+			out.resize(rows, cols, slices);
+			std::copy(begin(), end(), out.data.begin());
+		}
+	};
 	typedef Volume<uint8_t, 4, ImageType::UBYTE> VolumeRGBA;
 	typedef Volume<int, 4, ImageType::INT> VolumeRGBAi;
 	typedef Volume<float, 4, ImageType::FLOAT> VolumeRGBAf;
@@ -24,6 +24,13 @@
 #include <thread>
 #include <functional>
 #include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <exception>
 namespace aly {
 class WorkerTask {
 protected:
@@ -82,8 +89,48 @@ public:
 			const std::function<void()>& failureFunc, long milliseconds,
 			long samplingTime);
 };
+/*
+ * Fixed set of worker threads with one task deque per worker. A worker takes
+ * tasks from the back of its own deque and, once that is empty, steals from
+ * the front of the others. Tasks submitted from inside a worker go to that
+ * worker's deque, so chains of dependent work stay on one thread until
+ * another thread runs out of work.
+ */
+class WorkerPool {
+protected:
+	struct TaskQueue {
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+	std::vector<std::unique_ptr<TaskQueue>> queues;
+	std::vector<std::thread> threads;
+	std::mutex waitLock;
+	std::condition_variable workAvailable;
+	std::condition_variable workDone;
+	std::atomic<size_t> queued;
+	std::atomic<size_t> pending;
+	std::atomic<size_t> nextQueue;
+	std::exception_ptr error;
+	bool shutdown;
+	bool pop(size_t index, std::function<void()>& task);
+	bool steal(size_t index, std::function<void()>& task);
+	void run(size_t index);
+public:
+	WorkerPool(size_t threadCount = 0);
+	size_t size() const {
+		return threads.size();
+	}
+	void submit(const std::function<void()>& task);
+	/*
+	 * Blocks until every submitted task, including tasks submitted by other
+	 * tasks, has finished. Rethrows the first exception a task threw.
+	 */
+	void wait();
+	~WorkerPool();
+};
 typedef std::shared_ptr<WorkerTask> WorkerTaskPtr;
 typedef std::shared_ptr<RecurrentTask> RecurrentTaskPtr;
 typedef std::shared_ptr<TimerTask> TimerTaskPtr;
+typedef std::shared_ptr<WorkerPool> WorkerPoolPtr;
 }
 #endif /* ALLOYWORKER_H_ */
@@ -27,6 +27,7 @@ public:
 	SHA1();
 	void update(const std::string &s);
 	void update(std::istream &is);
+	void update(const unsigned char* data, size_t len);
 	std::string final();
 	static std::string from_file(const std::string &filename);
 
@@ -0,0 +1,202 @@
+/*
+ * Copyright(C) 2015, Blake C. Lucas, Ph.D. (img.science@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "AlloyAllocator.h"
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+namespace aly {
+/*
+ * Every block starts with a BUFFER_ALIGNMENT sized header recording the
+ * backend that produced it, so FreeBuffer() can find the right owner even
+ * after the active backend changed.
+ */
+struct BufferHeader {
+	BufferAllocator* owner;
+};
+/*
+ * Registry state is deliberately leaked so buffers owned by static objects
+ * can still be released during program shutdown.
+ */
+static std::mutex& GetAllocatorLock() {
+	static std::mutex* lock = new std::mutex();
+	return *lock;
+}
+static std::vector<std::shared_ptr<BufferAllocator>>& GetAllocators() {
+	static std::vector<std::shared_ptr<BufferAllocator>>* allocators =
+			new std::vector<std::shared_ptr<BufferAllocator>>(1,
+					std::shared_ptr<BufferAllocator>(
+							new PooledBufferAllocator(DEFAULT_POOL_CAPACITY)));
+	return *allocators;
+}
+static std::atomic<BufferAllocator*>& GetActiveAllocator() {
+	static std::atomic<BufferAllocator*>* active = new std::atomic<
+			BufferAllocator*>(GetAllocators().back().get());
+	return *active;
+}
+std::shared_ptr<BufferAllocator> SetBufferAllocator(
+		const std::shared_ptr<BufferAllocator>& allocator) {
+	std::lock_guard<std::mutex> guard(GetAllocatorLock());
+	std::vector<std::shared_ptr<BufferAllocator>>& allocators = GetAllocators();
+	BufferAllocator* active = GetActiveAllocator().load();
+	std::shared_ptr<BufferAllocator> previous;
+	for (const std::shared_ptr<BufferAllocator>& entry : allocators) {
+		if (entry.get() == active) {
+			previous = entry;
+			break;
+		}
+	}
+	if (std::find(allocators.begin(), allocators.end(), allocator)
+			== allocators.end()) {
+		allocators.push_back(allocator);
+	}
+	GetActiveAllocator().store(allocator.get());
+	return previous;
+}
+BufferAllocator* GetBufferAllocator() {
+	return GetActiveAllocator().load();
+}
+void* AllocateBuffer(size_t bytes) {
+	BufferAllocator* allocator = GetBufferAllocator();
+	uint8_t* ptr = static_cast<uint8_t*>(allocator->allocate(
+			bytes + BUFFER_ALIGNMENT));
+	reinterpret_cast<BufferHeader*>(ptr)->owner = allocator;
+	return ptr + BUFFER_ALIGNMENT;
+}
+void FreeBuffer(void* ptr, size_t bytes) {
+	uint8_t* block = static_cast<uint8_t*>(ptr) - BUFFER_ALIGNMENT;
+	reinterpret_cast<BufferHeader*>(block)->owner->deallocate(block,
+			bytes + BUFFER_ALIGNMENT);
+}
+void* BufferAllocator::allocateAligned(size_t bytes) {
+	uint8_t* raw = static_cast<uint8_t*>(std::malloc(
+			bytes + BUFFER_ALIGNMENT + sizeof(void*)));
+	if (raw == nullptr) {
+		throw std::bad_alloc();
+	}
+	uintptr_t addr = reinterpret_cast<uintptr_t>(raw + sizeof(void*));
+	addr = (addr + BUFFER_ALIGNMENT - 1) & ~(uintptr_t) (BUFFER_ALIGNMENT - 1);
+	void** aligned = reinterpret_cast<void**>(addr);
+	aligned[-1] = raw;
+	return aligned;
+}
+void BufferAllocator::freeAligned(void* ptr) {
+	std::free(reinterpret_cast<void**>(ptr)[-1]);
+}
+BufferAllocator::BufferAllocator() :
+		bytesLive(0), bytesPeak(0), bytesCached(0), allocations(0), poolHits(
+				0) {
+}
+void BufferAllocator::recordAllocation(size_t bytes) {
+	allocations++;
+	size_t live = (bytesLive += bytes);
+	size_t peak = bytesPeak.load();
+	while (peak < live && !bytesPeak.compare_exchange_weak(peak, live)) {
+	}
+}
+void* BufferAllocator::allocate(size_t bytes) {
+	void* ptr = allocateAligned(bytes);
+	recordAllocation(bytes);
+	return ptr;
+}
+void BufferAllocator::deallocate(void* ptr, size_t bytes) {
+	freeAligned(ptr);
+	bytesLive -= bytes;
+}
+MemoryStatistics BufferAllocator::getStatistics() {
+	MemoryStatistics stats;
+	stats.bytesLive = bytesLive.load();
+	stats.bytesPeak = bytesPeak.load();
+	stats.bytesCached = bytesCached.load();
+	stats.allocations = allocations.load();
+	stats.poolHits = poolHits.load();
+	return stats;
+}
+void BufferAllocator::resetStatistics() {
+	allocations = 0;
+	poolHits = 0;
+	bytesPeak = bytesLive.load();
+}
+size_t PooledBufferAllocator::getSizeClass(size_t bytes) {
+	if (bytes <= BUFFER_ALIGNMENT)
+		return BUFFER_ALIGNMENT;
+	size_t pow2 = BUFFER_ALIGNMENT;
+	while (pow2 < bytes && pow2 < (size_t(1) << (sizeof(size_t) * 8 - 2))) {
+		pow2 <<= 1;
+	}
+	size_t step = pow2 / 8;
+	return ((bytes + step - 1) / step) * step;
+}
+PooledBufferAllocator::PooledBufferAllocator(size_t maxCachedBytes) :
+		maxCachedBytes(maxCachedBytes) {
+}
+PooledBufferAllocator::FreeListShard& PooledBufferAllocator::getShard(
+		size_t sizeClass) {
+	//Fibonacci hashing spreads the regularly spaced size classes over the shards.
+	uint64_t h = (uint64_t) (sizeClass / BUFFER_ALIGNMENT)
+			* 0x9E3779B97F4A7C15ULL;
+	return shards[(h >> 32) % POOL_SHARDS];
+}
+void* PooledBufferAllocator::allocate(size_t bytes) {
+	size_t sizeClass = getSizeClass(bytes);
+	recordAllocation(bytes);
+	FreeListShard& shard = getShard(sizeClass);
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto pos = shard.freeLists.find(sizeClass);
+		if (pos != shard.freeLists.end() && pos->second.size() > 0) {
+			void* ptr = pos->second.back();
+			pos->second.pop_back();
+			bytesCached -= sizeClass;
+			poolHits++;
+			return ptr;
+		}
+	}
+	return allocateAligned(sizeClass);
+}
+void PooledBufferAllocator::deallocate(void* ptr, size_t bytes) {
+	size_t sizeClass = getSizeClass(bytes);
+	bytesLive -= bytes;
+	//Reserve room in the cache first so concurrent frees cannot exceed maxCachedBytes.
+	if ((bytesCached += sizeClass) <= maxCachedBytes) {
+		FreeListShard& shard = getShard(sizeClass);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		shard.freeLists[sizeClass].push_back(ptr);
+		return;
+	}
+	bytesCached -= sizeClass;
+	freeAligned(ptr);
+}
+void PooledBufferAllocator::trim() {
+	for (FreeListShard& shard : shards) {
+		std::lock_guard<std::mutex> guard(shard.lock);
+		for (std::pair<const size_t, std::vector<void*>>& list : shard.freeLists) {
+			for (void* ptr : list.second) {
+				freeAligned(ptr);
+			}
+			bytesCached -= list.first * list.second.size();
+		}
+		shard.freeLists.clear();
+	}
+}
+PooledBufferAllocator::~PooledBufferAllocator() {
+	trim();
+}
+}
@@ -2555,5 +2555,219 @@ void DataFlow::pack(const pixel2& pos, const pixel2& dims, const double2& dpmm,
 	selectedConnection = c;
 	routingLock.unlock();
 }
+Executor::Executor(const std::shared_ptr<DataFlow>& graph, size_t threadCount) :
+		graph(graph), pool(new WorkerPool(threadCount)) {
+	update();
+}
+void Executor::addVertexes(const GroupPtr& group) {
+	for (NodePtr node : group->nodes) {
+		if (node->getType() == NodeType::Group) {
+			addVertexes(std::dynamic_pointer_cast<Group>(node));
+		} else if (vertexIndex.find(node.get()) == vertexIndex.end()) {
+			vertexIndex[node.get()] = vertexes.size();
+			vertexes.push_back(std::unique_ptr<Vertex>(new Vertex(node.get())));
+		}
+	}
+}
+void Executor::update() {
+	std::map<const Node*, NodeTiming> timings;
+	for (const std::unique_ptr<Vertex>& v : vertexes) {
+		timings[v->node] = v->timing;
+	}
+	vertexes.clear();
+	vertexIndex.clear();
+	order.clear();
+	std::shared_ptr<DataFlow> flow = graph.lock();
+	if (flow.get() == nullptr || flow->getGroup().get() == nullptr)
+		return;
+	addVertexes(flow->getGroup());
+	for (std::unique_ptr<Vertex>& v : vertexes) {
+		Node* node = v->node;
+		auto timing = timings.find(node);
+		if (timing != timings.end()) {
+			v->timing = timing->second;
+		}
+		std::vector<Port*> ports;
+		for (InputPortPtr port : node->getInputPorts()) {
+			ports.push_back(port.get());
+		}
+		for (OutputPortPtr port : node->getOutputPorts()) {
+			ports.push_back(port.get());
+		}
+		ports.push_back(node->getInputPort().get());
+		ports.push_back(node->getOutputPort().get());
+		ports.push_back(node->getParentPort().get());
+		ports.push_back(node->getChildPort().get());
+		for (Port* port : ports) {
+			//Connections leaving a group start at the group's proxy port.
+			for (Port* proxy = port; proxy != nullptr;
+					proxy = proxy->getProxyIn().get()) {
+				for (ConnectionPtr connection : proxy->getConnections()) {
+					if (connection->source.get() != proxy)
+						continue;
+					Port* dest = connection->destination.get();
+					while (dest->getProxyOut().get() != nullptr) {
+						dest = dest->getProxyOut().get();
+					}
+					auto iter = vertexIndex.find(dest->getNode());
+					if (iter == vertexIndex.end())
+						continue;
+					Link link;
+					link.source = port;
+					link.destination = dest;
+					v->links.push_back(link);
+					if (std::find(v->successors.begin(), v->successors.end(),
+							iter->second) == v->successors.end()) {
+						v->successors.push_back(iter->second);
+					}
+				}
+			}
+		}
+	}
+	std::vector<int> incoming(vertexes.size(), 0);
+	for (std::unique_ptr<Vertex>& v : vertexes) {
+		for (size_t s : v->successors) {
+			incoming[s]++;
+		}
+	}
+	for (size_t i = 0; i < vertexes.size(); i++) {
+		if (incoming[i] == 0)
+			order.push_back(i);
+	}
+	for (size_t n = 0; n < order.size(); n++) {
+		for (size_t s : vertexes[order[n]]->successors) {
+			if (--incoming[s] == 0)
+				order.push_back(s);
+		}
+	}
+	if (order.size() != vertexes.size()) {
+		throw std::runtime_error(
+				MakeString() << "Cannot execute data flow graph \""
+						<< flow->getName() << "\" because it contains a cycle.");
+	}
+}
+void Executor::markDirty(const Node* node) {
+	auto iter = vertexIndex.find(node);
+	if (iter != vertexIndex.end()) {
+		vertexes[iter->second]->dirty = true;
+	} else if (node != nullptr && node->getType() == NodeType::Group) {
+		for (NodePtr child : static_cast<const Group*>(node)->nodes) {
+			markDirty(child.get());
+		}
+	}
+}
+void Executor::markAllDirty() {
+	for (std::unique_ptr<Vertex>& v : vertexes) {
+		v->dirty = true;
+	}
+}
+bool Executor::isDirty(const Node* node) const {
+	auto iter = vertexIndex.find(node);
+	return (iter != vertexIndex.end() && vertexes[iter->second]->dirty);
+}
+void Executor::setValue(const PortPtr& port, const PacketPtr& packet) {
+	Port* dest = port.get();
+	while (dest->getProxyOut().get() != nullptr) {
+		dest = dest->getProxyOut().get();
+	}
+	dest->setValue(packet);
+	markDirty(dest->getNode());
+}
+void Executor::run(size_t index) {
+	Vertex& v = *vertexes[index];
+	auto startTime = std::chrono::steady_clock::now();
+	try {
+		if (v.node->getType() == NodeType::Compute) {
+			static_cast<Compute*>(v.node)->compute();
+		}
+	} catch (std::exception& e) {
+		//Downstream nodes are not scheduled and stay dirty.
+		std::lock_guard<std::mutex> lockError(errorLock);
+		if (errorMessage.size() == 0) {
+			errorMessage = MakeString() << "Node \"" << v.node->getName()
+					<< "\" failed: " << e.what();
+		}
+		return;
+	}
+	double elapsed = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - startTime).count();
+	v.timing.lastMilliseconds = elapsed;
+	v.timing.totalMilliseconds += elapsed;
+	v.timing.executions++;
+	v.dirty = false;
+	{
+		std::lock_guard<std::mutex> lockPacket(packetLock);
+		for (const Link& link : v.links) {
+			PacketPtr packet = link.source->getValue();
+			if (packet.get() != nullptr)
+				link.destination->setValue(packet);
+		}
+	}
+	for (size_t s : v.successors) {
+		Vertex& next = *vertexes[s];
+		if (next.dirty && --next.remaining == 0) {
+			pool->submit([this,s]() {
+				run(s);
+			});
+		}
+	}
+}
+void Executor::execute() {
+	//Everything downstream of a dirty node is dirty.
+	for (size_t i : order) {
+		if (vertexes[i]->dirty) {
+			for (size_t s : vertexes[i]->successors) {
+				vertexes[s]->dirty = true;
+			}
+		}
+		vertexes[i]->remaining = 0;
+	}
+	for (std::unique_ptr<Vertex>& v : vertexes) {
+		if (v->dirty) {
+			for (size_t s : v->successors) {
+				vertexes[s]->remaining++;
+			}
+		}
+	}
+	errorMessage.clear();
+	for (size_t i : order) {
+		if (vertexes[i]->dirty && vertexes[i]->remaining == 0) {
+			pool->submit([this,i]() {
+				run(i);
+			});
+		}
+	}
+	pool->wait();
+	if (errorMessage.size() > 0) {
+		throw std::runtime_error(errorMessage);
+	}
+}
+NodeTiming Executor::getTiming(const Node* node) const {
+	auto iter = vertexIndex.find(node);
+	if (iter == vertexIndex.end())
+		return NodeTiming();
+	return vertexes[iter->second]->timing;
+}
+std::vector<std::pair<Node*, NodeTiming>> Executor::getTimings() const {
+	std::vector<std::pair<Node*, NodeTiming>> timings;
+	for (size_t i : order) {
+		timings.push_back(
+				std::pair<Node*, NodeTiming>(vertexes[i]->node,
+						vertexes[i]->timing));
+	}
+	return timings;
+}
+std::vector<Node*> Executor::getExecutionOrder() const {
+	std::vector<Node*> nodes;
+	for (size_t i : order) {
+		nodes.push_back(vertexes[i]->node);
+	}
+	return nodes;
+}
+void Executor::resetTimings() {
+	for (std::unique_ptr<Vertex>& v : vertexes) {
+		v->timing = NodeTiming();
+	}
+}
 }
 }
@@ -21,6 +21,114 @@
 #include "AlloyDenseSolve.h"
 #include "AlloyFileUtil.h"
 namespace aly {
+static const float MULTIGRID_TOLERANCE = 1E-4f;
+//Guidance field of the source image where the last channel of every pixel in the stencil is positive.
+template<int C> static vec<float, C> SourceDivergence(
+		const Image<float, C, ImageType::FLOAT>& img, int i, int j) {
+	vec<float, C> val1 = img(i, j);
+	vec<float, C> val2 = img(i, j + 1);
+	vec<float, C> val3 = img(i, j - 1);
+	vec<float, C> val4 = img(i + 1, j);
+	vec<float, C> val5 = img(i - 1, j);
+	vec<float, C> div(0.0f);
+	if (val1[C - 1] > 0 && val2[C - 1] > 0 && val3[C - 1] > 0
+			&& val4[C - 1] > 0 && val5[C - 1] > 0) {
+		div = val1 - 0.25f * (val2 + val3 + val4 + val5);
+		div[C - 1] = 0.0f;
+	}
+	return div;
+}
+template<int C> static void SolvePoissonMultigrid(
+		Image<float, C, ImageType::FLOAT>& img,
+		const Image<float, C, ImageType::FLOAT>& divergence,
+		const Image1ub& mask, int iterations, float lambda,
+		const std::function<bool(int, int)>& iterationMonitor) {
+	PoissonMultigrid<C> solver(MultigridCycle::V, 2, 2, lambda);
+	solver.solve(img, divergence, mask, MULTIGRID_TOLERANCE, iterations,
+			[&](int iter, double residual) {
+				return (iterationMonitor) ? iterationMonitor(0, iter) : true;
+			});
+}
+template<int C> static void LaplaceFillMultigrid(
+		const Image<float, C, ImageType::FLOAT>& sourceImg,
+		Image<float, C, ImageType::FLOAT>& targetImg, int iterations,
+		float lambda, const std::function<bool(int, int)>& iterationMonitor) {
+	Image<float, C, ImageType::FLOAT> divergence(sourceImg.width,
+			sourceImg.height);
+	divergence.set(vec<float, C>(0.0f));
+#pragma omp parallel for
+	for (int j = 1; j < sourceImg.height - 1; j++) {
+		for (int i = 1; i < sourceImg.width - 1; i++) {
+			vec<float, C> src = sourceImg(i, j);
+			float alpha = src[C - 1];
+			src[C - 1] = 1.0f;
+			divergence(i, j) = alpha * SourceDivergence(sourceImg, i, j);
+			targetImg(i, j) = mix(targetImg(i, j), src, alpha);
+		}
+	}
+	Image1ub mask(sourceImg.width, sourceImg.height);
+	mask.set(ubyte1(1));
+	SolvePoissonMultigrid(targetImg, divergence, mask, iterations, lambda,
+			iterationMonitor);
+}
+template<int C> static void PoissonInpaintMultigrid(
+		const Image<float, C, ImageType::FLOAT>& sourceImg,
+		const Image<float, C, ImageType::FLOAT>& targetImg,
+		Image<float, C, ImageType::FLOAT>& outImg, int iterations,
+		float lambda, const std::function<bool(int, int)>& iterationMonitor) {
+	Image<float, C, ImageType::FLOAT> divergence(sourceImg.width,
+			sourceImg.height);
+	divergence.set(vec<float, C>(0.0f));
+#pragma omp parallel for
+	for (int j = 1; j < sourceImg.height - 1; j++) {
+		for (int i = 1; i < sourceImg.width - 1; i++) {
+			divergence(i, j) = mix(SourceDivergence(targetImg, i, j),
+					SourceDivergence(sourceImg, i, j), sourceImg(i, j)[C - 1]);
+		}
+	}
+	Image1ub mask(sourceImg.width, sourceImg.height);
+	mask.set(ubyte1(1));
+	SolvePoissonMultigrid(outImg, divergence, mask, iterations, lambda,
+			iterationMonitor);
+}
+template<int C> static void PoissonBlendMultigrid(
+		const Image<float, C, ImageType::FLOAT>& sourceImg,
+		Image<float, C, ImageType::FLOAT>& targetImg, int iterations,
+		float lambda, const std::function<bool(int, int)>& iterationMonitor) {
+	const float THRESHOLD = 0.5;
+	Image<float, C, ImageType::FLOAT> divergence(sourceImg.width,
+			sourceImg.height);
+	divergence.set(vec<float, C>(0.0f));
+	Image1ub mask(sourceImg.width, sourceImg.height);
+	mask.set(ubyte1((uint8_t)0));
+	Image1f alpha(sourceImg.width, sourceImg.height);
+#pragma omp parallel for
+	for (int j = 0; j < sourceImg.height; j++) {
+		for (int i = 0; i < sourceImg.width; i++) {
+			alpha(i, j).x = targetImg(i, j)[C - 1];
+			if (i == 0 || j == 0 || i == sourceImg.width - 1
+					|| j == sourceImg.height - 1)
+				continue;
+			divergence(i, j) = SourceDivergence(sourceImg, i, j);
+			if (targetImg(i, j)[C - 1] >= THRESHOLD
+					&& targetImg(i, j + 1)[C - 1] >= THRESHOLD
+					&& targetImg(i, j - 1)[C - 1] >= THRESHOLD
+					&& targetImg(i + 1, j)[C - 1] >= THRESHOLD
+					&& targetImg(i - 1, j)[C - 1] >= THRESHOLD) {
+				mask(i, j).x = 1;
+			}
+		}
+	}
+	SolvePoissonMultigrid(targetImg, divergence, mask, iterations, lambda,
+			iterationMonitor);
+	//The mask channel is not blended.
+#pragma omp parallel for
+	for (int j = 0; j < sourceImg.height; j++) {
+		for (int i = 0; i < sourceImg.width; i++) {
+			targetImg(i, j)[C - 1] = alpha(i, j).x;
+		}
+	}
+}
 void LaplaceFill(const Image4f& sourceImg, Image4f& targetImg, int iterations,
 		int levels, float lambda, const std::function<bool(int, int)>& iterationMonitor ) {
 	if (sourceImg.dimensions() != targetImg.dimensions())
@@ -38,37 +146,8 @@ void LaplaceFill(const Image4f& sourceImg, Image4f& targetImg, int iterations,
 			}
 		});
 	} else {
-		std::vector<Image4f> srcPyramid(levels);
-		std::vector<Image4f> tarPyramid(levels);
-		srcPyramid[0] = sourceImg;
-		tarPyramid[0] = targetImg;
-		for (int l = 1; l < levels; l++) {
-			srcPyramid[l - 1].downSample(srcPyramid[l]);
-			tarPyramid[l - 1].downSample(tarPyramid[l]);
-		}
-		for (int l = levels - 1; l >= 1; l--) {
-			if (iterationMonitor) {
-				if (!iterationMonitor(l, 0))return;
-			}
-			LaplaceFill(srcPyramid[l], tarPyramid[l], iterations, lambda, [=](int iter) {
-				if (iterationMonitor) {
-					return iterationMonitor(l, iter);
-				}
-				else {
-					return true;
-				}
-			});
-			tarPyramid[l].upSample(tarPyramid[l - 1]);
-		}
-		targetImg = tarPyramid[0];
-		LaplaceFill(sourceImg, targetImg, iterations, lambda, [=](int iter) {
-			if (iterationMonitor) {
-				return iterationMonitor(0, iter);
-			}
-			else {
-				return true;
-			}
-		});
+		LaplaceFillMultigrid(sourceImg, targetImg, iterations, lambda,
+				iterationMonitor);
 	}
 }
 void LaplaceFill(const Image2f& sourceImg, Image2f& targetImg, int iterations,
@@ -83,37 +162,8 @@ void LaplaceFill(const Image2f& sourceImg, Image2f& targetImg, int iterations,
 			return iterationMonitor(0, iter);
 		});
 	} else {
-		std::vector<Image2f> srcPyramid(levels);
-		std::vector<Image2f> tarPyramid(levels);
-		srcPyramid[0] = sourceImg;
-		tarPyramid[0] = targetImg;
-		for (int l = 1; l < levels; l++) {
-			srcPyramid[l - 1].downSample(srcPyramid[l]);
-			tarPyramid[l - 1].downSample(tarPyramid[l]);
-		}
-		for (int l = levels - 1; l >= 1; l--) {
-			if (iterationMonitor) {
-				if (!iterationMonitor(l, 0))return;
-			}
-			LaplaceFill(srcPyramid[l], tarPyramid[l], iterations, lambda, [=](int iter) {
-				if (iterationMonitor) {
-					return iterationMonitor(l, iter);
-				}
-				else {
-					return true;
-				}
-			});
-			tarPyramid[l].upSample(tarPyramid[l - 1]);
-		}
-		targetImg = tarPyramid[0];
-		LaplaceFill(sourceImg, targetImg, iterations, lambda, [=](int iter) {
-			if (iterationMonitor) {
-				return iterationMonitor(0, iter);
-			}
-			else {
-				return true;
-			}
-		});
+		LaplaceFillMultigrid(sourceImg, targetImg, iterations, lambda,
+				iterationMonitor);
 	}
 }
 void LaplaceFill(const Image2f& sourceImg, Image2f& targetImg, int iterations,
@@ -243,41 +293,8 @@ void PoissonInpaint(const Image4f& sourceImg, const Image4f& targetImg,
 			}
 		});
 	} else {
-		std::vector<Image4f> srcPyramid(levels);
-		std::vector<Image4f> tarPyramid(levels);
-		std::vector<Image4f> outPyramid(levels);
-		srcPyramid[0] = sourceImg;
-		tarPyramid[0] = targetImg;
-		outPyramid[0] = outImg;
-		for (int l = 1; l < levels; l++) {
-			srcPyramid[l - 1].downSample(srcPyramid[l]);
-			tarPyramid[l - 1].downSample(tarPyramid[l]);
-			outPyramid[l - 1].downSample(outPyramid[l]);
-		}
-		for (int l = levels - 1; l >= 1; l--) {
-			if (iterationMonitor) {
-				if (!iterationMonitor(l, 0))return;
-			}
-			PoissonInpaint(srcPyramid[l], tarPyramid[l], outPyramid[l],
-					iterations, lambda, [=](int iter) {
-				if (iterationMonitor) {
-					return iterationMonitor(l, iter);
-				}
-				else {
-					return true;
-				}
-			});
-			outPyramid[l].upSample(outPyramid[l - 1]);
-		}
-		outImg = outPyramid[0];
-		PoissonInpaint(sourceImg, targetImg, outImg, iterations, lambda, [=](int iter) {
-			if (iterationMonitor) {
-				return iterationMonitor(0, iter);
-			}
-			else {
-				return true;
-			}
-		});
+		PoissonInpaintMultigrid(sourceImg, targetImg, outImg, iterations,
+				lambda, iterationMonitor);
 	}
 }
 void PoissonInpaint(const Image4f& sourceImg, const Image4f& targetImg,
@@ -365,41 +382,8 @@ void PoissonInpaint(const Image2f& sourceImg, const Image2f& targetImg,
 			}
 		});
 	} else {
-		std::vector<Image2f> srcPyramid(levels);
-		std::vector<Image2f> tarPyramid(levels);
-		std::vector<Image2f> outPyramid(levels);
-		srcPyramid[0] = sourceImg;
-		tarPyramid[0] = targetImg;
-		outPyramid[0] = outImg;
-		for (int l = 1; l < levels; l++) {
-			srcPyramid[l - 1].downSample(srcPyramid[l]);
-			tarPyramid[l - 1].downSample(tarPyramid[l]);
-			outPyramid[l - 1].downSample(outPyramid[l]);
-		}
-		for (int l = levels - 1; l >= 1; l--) {
-			if (iterationMonitor) {
-				if (!iterationMonitor(l, 0))return;
-			}
-			PoissonInpaint(srcPyramid[l], tarPyramid[l], outPyramid[l],
-					iterations, lambda, [=](int iter) {
-				if (iterationMonitor) {
-					return iterationMonitor(l, iter);
-				}
-				else {
-					return true;
-				}
-			});
-			outPyramid[l].upSample(outPyramid[l - 1]);
-		}
-		outImg = outPyramid[0];
-		PoissonInpaint(sourceImg, targetImg, outImg, iterations, lambda, [=](int iter) {
-			if (iterationMonitor) {
-				return iterationMonitor(0, iter);
-			}
-			else {
-				return true;
-			}
-		});
+		PoissonInpaintMultigrid(sourceImg, targetImg, outImg, iterations,
+				lambda, iterationMonitor);
 	}
 }
 void PoissonInpaint(const Image2f& sourceImg, const Image2f& targetImg,
@@ -485,37 +469,8 @@ void PoissonBlend(const Image4f& sourceImg, Image4f& targetImg, int iterations,
 			}
 		});
 	} else {
-		std::vector<Image4f> srcPyramid(levels);
-		std::vector<Image4f> tarPyramid(levels);
-		srcPyramid[0] = sourceImg;
-		tarPyramid[0] = targetImg;
-		for (int l = 1; l < levels; l++) {
-			srcPyramid[l - 1].downSample(srcPyramid[l]);
-			tarPyramid[l - 1].downSample(tarPyramid[l]);
-		}
-		for (int l = levels - 1; l >= 1; l--) {
-			if (iterationMonitor) {
-				if (!iterationMonitor(l, 0))return;
-			}
-			PoissonBlend(srcPyramid[l], tarPyramid[l], iterations, lambda, [=](int iter) {
-				if (iterationMonitor) {
-					return iterationMonitor(l, iter);
-				}
-				else {
-					return true;
-				}
-			});
-			tarPyramid[l].upSample(tarPyramid[l - 1]);
-		}
-		targetImg = tarPyramid[0];
-		PoissonBlend(sourceImg, targetImg, iterations, lambda, [=](int iter) {
-			if (iterationMonitor) {
-				return iterationMonitor(0, iter);
-			}
-			else {
-				return true;
-			}
-		});
+		PoissonBlendMultigrid(sourceImg, targetImg, iterations, lambda,
+				iterationMonitor);
 	}
 }
 void PoissonBlend(const Image2f& sourceImg, Image2f& targetImg, int iterations,
@@ -535,37 +490,8 @@ void PoissonBlend(const Image2f& sourceImg, Image2f& targetImg, int iterations,
 			}
 		});
 	} else {
-		std::vector<Image2f> srcPyramid(levels);
-		std::vector<Image2f> tarPyramid(levels);
-		srcPyramid[0] = sourceImg;
-		tarPyramid[0] = targetImg;
-		for (int l = 1; l < levels; l++) {
-			srcPyramid[l - 1].downSample(srcPyramid[l]);
-			tarPyramid[l - 1].downSample(tarPyramid[l]);
-		}
-		for (int l = levels - 1; l >= 1; l--) {
-			if (iterationMonitor) {
-				if (!iterationMonitor(l, 0))return;
-			}
-			PoissonBlend(srcPyramid[l], tarPyramid[l], iterations, lambda, [=](int iter) {
-				if (iterationMonitor) {
-					return iterationMonitor(l, iter);
-				}
-				else {
-					return true;
-				}
-			});
-			tarPyramid[l].upSample(tarPyramid[l - 1]);
-		}
-		targetImg = tarPyramid[0];
-		PoissonBlend(sourceImg, targetImg, iterations, lambda, [=](int iter) {
-			if (iterationMonitor) {
-				return iterationMonitor(0, iter);
-			}
-			else {
-				return true;
-			}
-		});
+		PoissonBlendMultigrid(sourceImg, targetImg, iterations, lambda,
+				iterationMonitor);
 	}
 }
 void PoissonBlend(const Image4f& sourceImg, Image4f& targetImg, int iterations,
@@ -55,6 +55,9 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <pwd.h>
 #endif
 #include "AlloyFilesystem.h"
@@ -283,6 +286,357 @@ namespace aly {
 		else
 			throw runtime_error(MakeString() << "Could not write " << str);
 	}
+	static const uint64_t HASH_PRIME1 = 0x9E3779B185EBCA87ULL;
+	static const uint64_t HASH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+	static const uint64_t HASH_PRIME3 = 0x165667B19E3779F9ULL;
+	static const uint64_t HASH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+	static const uint64_t HASH_PRIME5 = 0x27D4EB2F165667C5ULL;
+	static inline uint64_t HashRotate(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+	static inline uint64_t HashRead64(const uint8_t* ptr) {
+		uint64_t val;
+		std::memcpy(&val, ptr, sizeof(uint64_t));
+		return val;
+	}
+	static inline uint32_t HashRead32(const uint8_t* ptr) {
+		uint32_t val;
+		std::memcpy(&val, ptr, sizeof(uint32_t));
+		return val;
+	}
+	static inline uint64_t HashRound(uint64_t acc, uint64_t input) {
+		acc += input * HASH_PRIME2;
+		acc = HashRotate(acc, 31);
+		return acc * HASH_PRIME1;
+	}
+	static inline uint64_t HashMergeRound(uint64_t acc, uint64_t val) {
+		acc ^= HashRound(0, val);
+		return acc * HASH_PRIME1 + HASH_PRIME4;
+	}
+	FastHash64::FastHash64(uint64_t seed) :
+			seed(seed) {
+		reset();
+	}
+	void FastHash64::reset() {
+		v[0] = seed + HASH_PRIME1 + HASH_PRIME2;
+		v[1] = seed + HASH_PRIME2;
+		v[2] = seed;
+		v[3] = seed - HASH_PRIME1;
+		totalLength = 0;
+		bufferSize = 0;
+	}
+	void FastHash64::update(const void* data, size_t bytes) {
+		const uint8_t* ptr = static_cast<const uint8_t*>(data);
+		const uint8_t* end = ptr + bytes;
+		totalLength += bytes;
+		if (bufferSize + bytes < 32) {
+			std::memcpy(buffer + bufferSize, ptr, bytes);
+			bufferSize += bytes;
+			return;
+		}
+		if (bufferSize > 0) {
+			size_t fill = 32 - bufferSize;
+			std::memcpy(buffer + bufferSize, ptr, fill);
+			for (int i = 0; i < 4; i++) {
+				v[i] = HashRound(v[i], HashRead64(buffer + 8 * i));
+			}
+			ptr += fill;
+			bufferSize = 0;
+		}
+		uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+		while (ptr + 32 <= end) {
+			v1 = HashRound(v1, HashRead64(ptr));
+			v2 = HashRound(v2, HashRead64(ptr + 8));
+			v3 = HashRound(v3, HashRead64(ptr + 16));
+			v4 = HashRound(v4, HashRead64(ptr + 24));
+			ptr += 32;
+		}
+		v[0] = v1;
+		v[1] = v2;
+		v[2] = v3;
+		v[3] = v4;
+		bufferSize = end - ptr;
+		std::memcpy(buffer, ptr, bufferSize);
+	}
+	uint64_t FastHash64::digest() const {
+		uint64_t h;
+		if (totalLength >= 32) {
+			h = HashRotate(v[0], 1) + HashRotate(v[1], 7) + HashRotate(v[2], 12)
+					+ HashRotate(v[3], 18);
+			for (int i = 0; i < 4; i++) {
+				h = HashMergeRound(h, v[i]);
+			}
+		} else {
+			h = seed + HASH_PRIME5;
+		}
+		h += totalLength;
+		const uint8_t* ptr = buffer;
+		const uint8_t* end = buffer + bufferSize;
+		while (ptr + 8 <= end) {
+			h ^= HashRound(0, HashRead64(ptr));
+			h = HashRotate(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+			ptr += 8;
+		}
+		if (ptr + 4 <= end) {
+			h ^= (uint64_t) HashRead32(ptr) * HASH_PRIME1;
+			h = HashRotate(h, 23) * HASH_PRIME2 + HASH_PRIME3;
+			ptr += 4;
+		}
+		while (ptr < end) {
+			h ^= (*ptr) * HASH_PRIME5;
+			h = HashRotate(h, 11) * HASH_PRIME1;
+			ptr++;
+		}
+		h ^= h >> 33;
+		h *= HASH_PRIME2;
+		h ^= h >> 29;
+		h *= HASH_PRIME3;
+		h ^= h >> 32;
+		return h;
+	}
+	uint64_t Hash64(const void* data, size_t bytes, uint64_t seed) {
+		FastHash64 hash(seed);
+		hash.update(data, bytes);
+		return hash.digest();
+	}
+	Hasher::Hasher(HashMethod method) :
+			method(method) {
+		fastContext[0] = FastHash64(0);
+		fastContext[1] = FastHash64(HASH_PRIME5);
+		reset();
+	}
+	void Hasher::reset() {
+		switch (method) {
+		case HashMethod::SHA1:
+			sha1Context = SHA1();
+			break;
+		case HashMethod::SHA224:
+			sha224_init(&sha256Context);
+			break;
+		case HashMethod::SHA256:
+			sha256_init(&sha256Context);
+			break;
+		case HashMethod::SHA384:
+			sha384_init(&sha512Context);
+			break;
+		case HashMethod::SHA512:
+			sha512_init(&sha512Context);
+			break;
+		case HashMethod::FAST64:
+		case HashMethod::FAST128:
+			fastContext[0].reset();
+			fastContext[1].reset();
+			break;
+		}
+	}
+	void Hasher::update(const void* data, size_t bytes) {
+		const unsigned char* ptr = static_cast<const unsigned char*>(data);
+		switch (method) {
+		case HashMethod::SHA1:
+			sha1Context.update(ptr, bytes);
+			break;
+		case HashMethod::SHA224:
+			sha224_update(&sha256Context, ptr, bytes);
+			break;
+		case HashMethod::SHA256:
+			sha256_update(&sha256Context, ptr, bytes);
+			break;
+		case HashMethod::SHA384:
+			sha384_update(&sha512Context, ptr, bytes);
+			break;
+		case HashMethod::SHA512:
+			sha512_update(&sha512Context, ptr, bytes);
+			break;
+		case HashMethod::FAST128:
+			fastContext[0].update(ptr, bytes);
+			fastContext[1].update(ptr, bytes);
+			break;
+		case HashMethod::FAST64:
+			fastContext[0].update(ptr, bytes);
+			break;
+		}
+	}
+	std::vector<uint8_t> Hasher::digest() {
+		std::vector<uint8_t> out;
+		switch (method) {
+		case HashMethod::SHA1: {
+			std::string hex = sha1Context.final();
+			for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+				out.push_back((uint8_t) std::stoi(hex.substr(i, 2), nullptr, 16));
+			}
+		}
+			break;
+		case HashMethod::SHA224:
+			out.resize(SHA224_DIGEST_SIZE);
+			sha224_final(&sha256Context, out.data());
+			break;
+		case HashMethod::SHA256:
+			out.resize(SHA256_DIGEST_SIZE);
+			sha256_final(&sha256Context, out.data());
+			break;
+		case HashMethod::SHA384:
+			out.resize(SHA384_DIGEST_SIZE);
+			sha384_final(&sha512Context, out.data());
+			break;
+		case HashMethod::SHA512:
+			out.resize(SHA512_DIGEST_SIZE);
+			sha512_final(&sha512Context, out.data());
+			break;
+		case HashMethod::FAST64:
+		case HashMethod::FAST128: {
+			int lanes = (method == HashMethod::FAST128) ? 2 : 1;
+			for (int l = 0; l < lanes; l++) {
+				uint64_t h = fastContext[l].digest();
+				for (int b = 7; b >= 0; b--) {
+					out.push_back((uint8_t) (h >> (8 * b)));
+				}
+			}
+		}
+			break;
+		}
+		reset();
+		return out;
+	}
+	std::string Hasher::finish() {
+		std::vector<uint8_t> bytes = digest();
+		if (method == HashMethod::SHA1) {
+			std::ostringstream hex;
+			for (uint8_t b : bytes) {
+				hex << std::hex << std::setfill('0') << std::setw(2) << (int) b;
+			}
+			return hex.str();
+		}
+		return EncodeBase64(bytes, false);
+	}
+	std::string HashCode(const void* data, size_t bytes, HashMethod method) {
+		Hasher hasher(method);
+		hasher.update(data, bytes);
+		return hasher.finish();
+	}
+	std::string TreeHashCode(const void* data, size_t bytes, HashMethod method,
+			size_t tileSize) {
+		if (tileSize == 0 || bytes <= tileSize) {
+			return HashCode(data, bytes, method);
+		}
+		const uint8_t* ptr = static_cast<const uint8_t*>(data);
+		int tiles = (int) ((bytes + tileSize - 1) / tileSize);
+		std::vector<std::vector<uint8_t>> digests(tiles);
+#pragma omp parallel for
+		for (int t = 0; t < tiles; t++) {
+			size_t begin = t * tileSize;
+			size_t len = std::min(tileSize, bytes - begin);
+			Hasher hasher(method);
+			hasher.update(ptr + begin, len);
+			digests[t] = hasher.digest();
+		}
+		Hasher root(method);
+		for (const std::vector<uint8_t>& digest : digests) {
+			root.update(digest);
+		}
+		return root.finish();
+	}
+#ifdef ALY_WINDOWS
+	MappedFile::MappedFile() :
+			ptr(nullptr), length(0), opened(false), fileHandle(
+					INVALID_HANDLE_VALUE), mapHandle(NULL) {
+	}
+#else
+	MappedFile::MappedFile() :
+			ptr(nullptr), length(0), opened(false), fileHandle(-1) {
+	}
+#endif
+	MappedFile::MappedFile(const std::string& file) :
+			MappedFile() {
+		open(file);
+	}
+	MappedFile::~MappedFile() {
+		close();
+	}
+#ifdef ALY_WINDOWS
+	void MappedFile::open(const std::string& file) {
+		close();
+		fileHandle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ,
+				NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			throw runtime_error(MakeString() << "Could not open " << file);
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize)) {
+			close();
+			throw runtime_error(
+					MakeString() << "Could not get size of " << file);
+		}
+		length = (size_t) fileSize.QuadPart;
+		if (length > 0) {
+			mapHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0,
+					NULL);
+			if (mapHandle == NULL) {
+				close();
+				throw runtime_error(MakeString() << "Could not map " << file);
+			}
+			ptr = (const uint8_t*) MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0,
+					0);
+			if (ptr == nullptr) {
+				close();
+				throw runtime_error(MakeString() << "Could not map " << file);
+			}
+		}
+		opened = true;
+	}
+	void MappedFile::close() {
+		if (ptr != nullptr) {
+			UnmapViewOfFile(ptr);
+			ptr = nullptr;
+		}
+		if (mapHandle != NULL) {
+			CloseHandle(mapHandle);
+			mapHandle = NULL;
+		}
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+			fileHandle = INVALID_HANDLE_VALUE;
+		}
+		length = 0;
+		opened = false;
+	}
+#else
+	void MappedFile::open(const std::string& file) {
+		close();
+		fileHandle = ::open(file.c_str(), O_RDONLY);
+		if (fileHandle < 0) {
+			throw runtime_error(MakeString() << "Could not open " << file);
+		}
+		struct stat st;
+		if (fstat(fileHandle, &st) != 0) {
+			close();
+			throw runtime_error(
+					MakeString() << "Could not get size of " << file);
+		}
+		length = (size_t) st.st_size;
+		if (length > 0) {
+			void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fileHandle,
+					0);
+			if (addr == MAP_FAILED) {
+				close();
+				throw runtime_error(MakeString() << "Could not map " << file);
+			}
+			ptr = (const uint8_t*) addr;
+		}
+		opened = true;
+	}
+	void MappedFile::close() {
+		if (ptr != nullptr) {
+			munmap((void*) ptr, length);
+			ptr = nullptr;
+		}
+		if (fileHandle >= 0) {
+			::close(fileHandle);
+			fileHandle = -1;
+		}
+		length = 0;
+		opened = false;
+	}
+#endif
 	bool FileExists(const std::string& name) {
 		try {
 			return (filesystem::internal::exists(name));
@@ -465,6 +819,16 @@ namespace aly {
 		return FileDescription(fileLocation, type, fileSize, readOnly, creationTime,
 			accessTime, modifiedTime);
 	}
+	int64_t GetFileModifiedTimeNanos(const std::string& fileLocation) {
+		struct stat attrib;
+		if (stat(fileLocation.c_str(), &attrib) != 0)
+			return 0;
+#ifdef ALY_APPLE
+		return (int64_t)attrib.st_mtimespec.tv_sec * 1000000000LL + attrib.st_mtimespec.tv_nsec;
+#else
+		return (int64_t)attrib.st_mtim.tv_sec * 1000000000LL + attrib.st_mtim.tv_nsec;
+#endif
+	}
 
 	std::vector<FileDescription> GetDirectoryDescriptionListing(
 		const std::string& dirName) {
@@ -654,6 +1018,16 @@ namespace aly {
 		FindClose(h);
 		return FileDescription(fileLocation, fileType, fileSize, fd.dwFileAttributes&&FILE_ATTRIBUTE_READONLY, creationTime, accessTime, modifiedTime);
 	}
+	int64_t GetFileModifiedTimeNanos(const std::string& fileLocation) {
+		WIN32_FILE_ATTRIBUTE_DATA fd;
+		if (!GetFileAttributesExW(ToWString(fileLocation).c_str(), GetFileExInfoStandard, &fd))
+			return 0;
+		//FILETIME counts 100ns intervals since 1601.
+		ULARGE_INTEGER ull;
+		ull.LowPart = fd.ftLastWriteTime.dwLowDateTime;
+		ull.HighPart = fd.ftLastWriteTime.dwHighDateTime;
+		return ((int64_t)ull.QuadPart - 116444736000000000LL) * 100LL;
+	}
 	std::vector<FileDescription> GetDirectoryDescriptionListing(const std::string& dirName) {
 		std::vector<FileDescription> files;
 		WIN32_FIND_DATAW fd;
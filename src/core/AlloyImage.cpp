@@ -234,6 +234,164 @@ void ConvertImage(const ImageRGBf& in, Image1ub& out, bool sRGB) {
 		}
 	}
 }
+static const char* RAW_TYPE_NAMES[] = { "Byte", "Unsigned Byte", "Short",
+		"Unsigned Short", "Integer", "Unsigned Integer", "Float", "Double" };
+static std::vector<std::string> GetXMLTagValues(const std::string& xml,
+		const std::string& tag) {
+	std::vector<std::string> values;
+	std::string openTag = "<" + tag + ">";
+	std::string closeTag = "</" + tag + ">";
+	size_t pos = 0;
+	while ((pos = xml.find(openTag, pos)) != std::string::npos) {
+		pos += openTag.size();
+		size_t end = xml.find(closeTag, pos);
+		if (end == std::string::npos)
+			break;
+		values.push_back(xml.substr(pos, end - pos));
+		pos = end + closeTag.size();
+	}
+	return values;
+}
+bool IsLittleEndian() {
+	const uint16_t val = 1;
+	return (*reinterpret_cast<const uint8_t*>(&val) == 1);
+}
+RawHeader ReadRawHeader(const std::string& file) {
+	std::string fileName = GetFileWithoutExtension(file);
+	std::string xmlFile = fileName + ".xml";
+	std::string xml = ReadTextFile(xmlFile);
+	RawHeader header;
+	header.dataFile = fileName + ".raw";
+	std::vector<std::string> vals = GetXMLTagValues(xml, "Data-type");
+	if (vals.size() == 0) {
+		throw std::runtime_error(
+				MakeString() << "No data type specified in " << xmlFile);
+	}
+	bool found = false;
+	for (int t = 0; t < 8; t++) {
+		if (vals[0] == RAW_TYPE_NAMES[t]) {
+			header.type = static_cast<ImageType>(t);
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		throw std::runtime_error(
+				MakeString() << "Unsupported data type " << vals[0] << " in "
+						<< xmlFile);
+	}
+	for (const std::string& ext : GetXMLTagValues(xml, "Extents")) {
+		header.extents.push_back(std::stoi(ext));
+	}
+	vals = GetXMLTagValues(xml, "Image-offset");
+	if (vals.size() > 0)
+		header.offset = (size_t) std::stoll(vals[0]);
+	vals = GetXMLTagValues(xml, "Endianess");
+	if (vals.size() > 0)
+		header.littleEndian = (vals[0] != "Big");
+	vals = GetXMLTagValues(xml, "Channel-layout");
+	if (vals.size() > 0)
+		header.layout = (vals[0] == "Interleaved") ?
+				RawLayout::Interleaved : RawLayout::Planar;
+	return header;
+}
+void WriteRawHeader(const std::string& file, const RawHeader& header) {
+	std::stringstream sstr;
+	sstr << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+	sstr << "<!-- MIPAV header file -->\n";
+	sstr
+			<< "<image xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" nDimensions=\""
+			<< header.extents.size() << "\">\n";
+	sstr << "	<Dataset-attributes>\n";
+	sstr << "		<Image-offset>" << header.offset << "</Image-offset>\n";
+	sstr << "		<Data-type>" << RAW_TYPE_NAMES[static_cast<int>(header.type)]
+			<< "</Data-type>\n";
+	sstr << "		<Endianess>" << (header.littleEndian ? "Little" : "Big")
+			<< "</Endianess>\n";
+	for (int ext : header.extents) {
+		sstr << "		<Extents>" << ext << "</Extents>\n";
+	}
+	sstr << "		<Resolutions>\n";
+	sstr << "			<Resolution>1.0</Resolution>\n";
+	sstr << "			<Resolution>1.0</Resolution>\n";
+	sstr << "			<Resolution>1.0</Resolution>\n";
+	sstr << "		</Resolutions>\n";
+	sstr << "		<Slice-spacing>1.0</Slice-spacing>\n";
+	sstr << "		<Slice-thickness>0.0</Slice-thickness>\n";
+	sstr << "		<Units>Millimeters</Units>\n";
+	sstr << "		<Units>Millimeters</Units>\n";
+	sstr << "		<Units>Millimeters</Units>\n";
+	sstr << "		<Compression>none</Compression>\n";
+	if (header.layout == RawLayout::Interleaved) {
+		sstr << "		<Channel-layout>Interleaved</Channel-layout>\n";
+	}
+	sstr << "		<Orientation>Unknown</Orientation>\n";
+	sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
+	sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
+	sstr << "		<Subject-axis-orientation>Unknown</Subject-axis-orientation>\n";
+	sstr << "		<Origin>0.0</Origin>\n";
+	sstr << "		<Origin>0.0</Origin>\n";
+	sstr << "		<Origin>0.0</Origin>\n";
+	sstr << "		<Modality>Unknown Modality</Modality>\n";
+	sstr << "	</Dataset-attributes>\n";
+	sstr << "</image>\n";
+	std::ofstream myfile;
+	myfile.open(file.c_str(), std::ios_base::out);
+	if (!myfile.is_open()) {
+		throw std::runtime_error(
+				MakeString() << "Could not open " << file << " for writing.");
+	}
+	myfile << sstr.str();
+	myfile.close();
+}
+void ValidateRawHeader(const RawHeader& header, ImageType type, int channels,
+		size_t count, size_t scalarSize) {
+	if (header.type != type) {
+		throw std::runtime_error(
+				MakeString() << "Raw file " << header.dataFile << " has type "
+						<< header.type << ", expected " << type << ".");
+	}
+	std::ifstream in(header.dataFile, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!in.is_open()) {
+		throw std::runtime_error(
+				MakeString() << "Could not open " << header.dataFile);
+	}
+	uint64_t fileSize = (uint64_t) in.tellg();
+	if (fileSize < header.offset + count * channels * scalarSize) {
+		throw std::runtime_error(
+				MakeString() << "Raw file " << header.dataFile
+						<< " is too small for its header.");
+	}
+}
+/* fseek() takes a long, which is 32 bits on Windows and 32-bit platforms. */
+static int SeekRawData(FILE* f, uint64_t offset) {
+#ifdef _WIN32
+	if (offset > (uint64_t) std::numeric_limits<__int64>::max())
+		return -1;
+	return _fseeki64(f, (__int64) offset, SEEK_SET);
+#else
+	if (offset > (uint64_t) std::numeric_limits<off_t>::max())
+		return -1;
+	return fseeko(f, (off_t) offset, SEEK_SET);
+#endif
+}
+FILE* OpenRawData(const RawHeader& header, ImageType type, int channels,
+		size_t count, size_t scalarSize) {
+	ValidateRawHeader(header, type, channels, count, scalarSize);
+	FILE* f = fopen(header.dataFile.c_str(), "rb");
+	if (f == NULL) {
+		throw std::runtime_error(
+				MakeString() << "Could not open " << header.dataFile);
+	}
+	if (header.offset > 0) {
+		if (SeekRawData(f, header.offset) != 0) {
+			fclose(f);
+			throw std::runtime_error(
+					MakeString() << "Unexpected end of " << header.dataFile);
+		}
+	}
+	return f;
+}
 void WriteImageToFile(const std::string& file, const ImageRGB& image) {
 	std::string ext = GetFileExtension(file);
 	if (ext == "xml") {
@@ -342,7 +500,9 @@ void ReadImageFromFile(const std::string& file, ImageRGB& image) {
 }
 void ReadImageFromFile(const std::string& file, ImageRGBAf& img) {
 	std::string ext = GetFileExtension(file);
-	if (ext == "exr") {
+	if (ext == "xml") {
+		ReadImageFromRawFile(file, img);
+	} else if (ext == "exr") {
 		const char *message = nullptr;
 		EXRImage exrImage;
 		InitEXRImage(&exrImage);
@@ -411,7 +571,9 @@ void ReadImageFromFile(const std::string& file, ImageRGBAf& img) {
 }
 void ReadImageFromFile(const std::string& file, ImageRGBf& img) {
 	std::string ext = GetFileExtension(file);
-	if (ext == "exr") {
+	if (ext == "xml") {
+		ReadImageFromRawFile(file, img);
+	} else if (ext == "exr") {
 		const char *message = nullptr;
 		EXRImage exrImage;
 		InitEXRImage(&exrImage);
@@ -477,7 +639,9 @@ void ReadImageFromFile(const std::string& file, ImageRGBf& img) {
 }
 void ReadImageFromFile(const std::string& file, Image1f& img) {
 	std::string ext = GetFileExtension(file);
-	if (ext == "exr") {
+	if (ext == "xml") {
+		ReadImageFromRawFile(file, img);
+	} else if (ext == "exr") {
 		const char *message = nullptr;
 		EXRImage exrImage;
 		InitEXRImage(&exrImage);
@@ -62,6 +62,8 @@
 #include <queue>
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <thread>
 namespace aly {
 static const double ZERO_TOLERANCE = 1E-6;
 void KDBox::update() {
@@ -161,26 +163,6 @@ bool KDBox::intersectRayBox(const float3& org, const float3& dr) const {
 	}
 	return true;
 }
-void KDBoxEdge::set(KDBox* b, int dim, bool start) {
-	box = b;
-	this->start = start;
-	if (b == nullptr)
-		return;
-	switch (dim) {
-	case 0:
-		value = (start) ? b->getMin().x : b->getMax().x;
-		break;
-	case 1:
-		value = (start) ? b->getMin().y : b->getMax().y;
-		break;
-	case 2:
-		value = (start) ? b->getMin().z : b->getMax().z;
-		break;
-	default:
-		value = 0;
-	}
-
-}
 bool KDBox::intersectSegmentBox(const float3& org, const float3& end) const {
 	if (inside(org) || inside(end))
 		return true;
@@ -890,298 +872,972 @@ double KDTriangle::distance(const float3& p, float3& lastIntersect) const {
 	lastIntersect = pts[0] + kEdge0 * (float) fS + kEdge1 * (float) fT;
 	return std::sqrt(fSqrDistance);
 }
-void Intersector::build(const Mesh& mesh, int maxDepth) {
-	root = std::shared_ptr<KDBox>(new KDBox());
-	uint64_t id = 0;
-	KDTriangle* tri;
-	for (const uint4& face : mesh.quadIndexes.data) {
-		float3 pt1 = mesh.vertexLocations[face.x];
-		float3 pt2 = mesh.vertexLocations[face.y];
-		float3 pt3 = mesh.vertexLocations[face.z];
-		float3 pt4 = mesh.vertexLocations[face.w];
-		if (distanceSqr(pt1, pt3) < distanceSqr(pt2, pt4)) {
-			storage.push_back(
-					std::shared_ptr<KDTriangle>(
-							tri = new KDTriangle(pt1, pt2, pt3, id, 1)));
-			root->getChildren().push_back(tri);
-			storage.push_back(
-					std::shared_ptr<KDTriangle>(
-							tri = new KDTriangle(pt3, pt4, pt1, id, 1)));
-			root->getChildren().push_back(tri);
-		} else {
-			storage.push_back(
-					std::shared_ptr<KDTriangle>(
-							tri = new KDTriangle(pt1, pt2, pt4, id, 1)));
-			root->getChildren().push_back(tri);
-			storage.push_back(
-					std::shared_ptr<KDTriangle>(
-							tri = new KDTriangle(pt4, pt2, pt3, id, 1)));
-			root->getChildren().push_back(tri);
-
-		}
-		id++;
-	}
-	for (const uint3& face : mesh.triIndexes.data) {
-		storage.push_back(
-				std::shared_ptr<KDTriangle>(
-						tri = new KDTriangle(mesh.vertexLocations[face.x],
-								mesh.vertexLocations[face.y],
-								mesh.vertexLocations[face.z], id, 1)));
-		root->getChildren().push_back(tri);
-		id++;
-	}
-	root->update();
-	buildTree(maxDepth);
+//Bounds of a triangle and the center of those bounds, which is what gets binned.
+struct IntersectorPrimitive {
+	float3 minPoint;
+	float3 maxPoint;
+	float3 center;
+	uint32_t id;
+};
+static inline void MakePrimitive(const std::vector<float3>& vertexes,
+		const std::vector<uint3>& triangleIndexes, uint32_t id,
+		IntersectorPrimitive& prim) {
+	const uint3& tri = triangleIndexes[id];
+	const float3& v0 = vertexes[tri.x];
+	const float3& v1 = vertexes[tri.y];
+	const float3& v2 = vertexes[tri.z];
+	prim.minPoint = aly::min(aly::min(v0, v1), v2);
+	prim.maxPoint = aly::max(aly::max(v0, v1), v2);
+	prim.center = 0.5f * (prim.minPoint + prim.maxPoint);
+	prim.id = id;
 }
-void Intersector::buildTree(int maxDepth) {
-	std::list<KDBox*> boxes;
-	boxes.push_back(root.get());
-	int sz;
-	int splitPos;
-	KDBox* leftChild;
-	KDBox* rightChild;
-	int depthCount = 0;
-	while (boxes.size() > 0) {
-		KDBox* box = boxes.front();
-		boxes.pop_front();
-		if (box->getDepth() > maxDepth)
-			continue;
-		if (box->getDepth() > depthCount) {
-			depthCount = box->getDepth();
+struct IntersectorBounds {
+	float3 minPoint;
+	float3 maxPoint;
+	IntersectorBounds() :
+			minPoint(1E30f), maxPoint(-1E30f) {
+	}
+	void add(const float3& mn, const float3& mx) {
+		minPoint = aly::min(minPoint, mn);
+		maxPoint = aly::max(maxPoint, mx);
+	}
+	float halfArea() const {
+		float3 d = aly::max(maxPoint - minPoint, float3(0.0f));
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+};
+static const int INTERSECTOR_MAX_BINS = 32;
+struct IntersectorBins {
+	IntersectorBounds bounds[3][INTERSECTOR_MAX_BINS];
+	uint32_t counts[3][INTERSECTOR_MAX_BINS];
+	IntersectorBins() {
+		std::fill(&counts[0][0], &counts[0][0] + 3 * INTERSECTOR_MAX_BINS, 0);
+	}
+};
+//Ranges larger than this are split by the calling thread and binned with OpenMP.
+static const uint32_t INTERSECTOR_SUBTREE_GRAIN = 4096;
+static const uint32_t INTERSECTOR_BIN_CHUNK = 1024;
+static const int INTERSECTOR_MAX_CHUNKS = 64;
+/*
+ * Top down binned SAH over the bounds centers. Each range is binned and
+ * partitioned in place in linear time, so the whole build is O(n log n).
+ * A leaf costs intersectCost per block of four triangles, a split costs
+ * traversalCost plus the area weighted cost of its children, and splits
+ * whose children leave empty space between them get emptyBonus off.
+ */
+class IntersectorBuilder {
+protected:
+	std::vector<IntersectorPrimitive>& primitives;
+	const std::vector<float3>& vertexes;
+	const std::vector<uint3>& triangleIndexes;
+	const double intersectCost, traversalCost, emptyBonus;
+	const int maxDepth;
+	int bins;
+	bool allAxes;
+	uint32_t maxLeafSize;
+	static uint32_t BlockCount(uint32_t n) {
+		return (n + 3) / 4;
+	}
+public:
+	struct Task {
+		uint32_t begin, end;
+		int depth;
+		aligned_vector<IntersectorNode> nodes;
+		aligned_vector<IntersectorBlock> blocks;
+	};
+	//Nodes split on the calling thread. Subtrees below them are built as tasks.
+	struct TopNode {
+		IntersectorNode node;
+		int left, right, task;
+	};
+	IntersectorBuilder(std::vector<IntersectorPrimitive>& primitives,
+			const std::vector<float3>& vertexes,
+			const std::vector<uint3>& triangleIndexes, double intersectCost,
+			double traversalCost, double emptyBonus, int maxDepth,
+			IntersectorQuality quality) :
+			primitives(primitives), vertexes(vertexes), triangleIndexes(
+					triangleIndexes), intersectCost(
+					intersectCost), traversalCost(traversalCost), emptyBonus(
+					emptyBonus), maxDepth(maxDepth) {
+		switch (quality) {
+		case IntersectorQuality::Fast:
+			bins = 8;
+			allAxes = false;
+			maxLeafSize = 16;
+			break;
+		case IntersectorQuality::High:
+			bins = 32;
+			allAxes = true;
+			maxLeafSize = 4;
+			break;
+		default:
+			bins = 16;
+			allAxes = true;
+			maxLeafSize = 8;
 		}
-		std::vector<KDBox*>& children = box->getChildren();
-		if (children.size() < 2)
-			continue;
-		sz = (int) children.size() * 2;
-		std::vector<KDBoxEdge> edges;
-		splitPos = splitPosition(children, edges, box);
-		if (splitPos <= 0 || splitPos == sz - 1) {
-			continue;
+	}
+	/*
+	 * Computes the bounds of [begin,end) and either partitions it around the
+	 * best split, returning true and the first index of the right half, or
+	 * returns false if it should be a leaf.
+	 */
+	bool split(uint32_t begin, uint32_t end, int depth, bool parallel,
+			IntersectorNode& node, uint32_t& mid) {
+		uint32_t n = end - begin;
+		int chunks =
+				(parallel) ?
+						(int) std::min<uint32_t>(INTERSECTOR_MAX_CHUNKS,
+								(n + INTERSECTOR_BIN_CHUNK - 1)
+										/ INTERSECTOR_BIN_CHUNK) :
+						1;
+		IntersectorBounds box, center;
+		std::vector<IntersectorBounds> boxes((chunks > 1) ? 2 * chunks : 0);
+		IntersectorBounds* bounds = (chunks > 1) ? boxes.data() : &box;
+#pragma omp parallel for if(chunks > 1)
+		for (int c = 0; c < chunks; c++) {
+			IntersectorBounds& chunkBox = bounds[2 * c];
+			IntersectorBounds& chunkCenter =
+					(chunks > 1) ? bounds[2 * c + 1] : center;
+			uint32_t cend = begin + (uint32_t) ((uint64_t) n * (c + 1) / chunks);
+			for (uint32_t i = begin + (uint32_t) ((uint64_t) n * c / chunks);
+					i < cend; i++) {
+				const IntersectorPrimitive& prim = primitives[i];
+				chunkBox.add(prim.minPoint, prim.maxPoint);
+				chunkCenter.add(prim.center, prim.center);
+			}
 		}
-		storage.push_back(
-				std::shared_ptr<KDBox>(
-						leftChild = new KDBox(box->getDepth() + 1)));
-		storage.push_back(
-				std::shared_ptr<KDBox>(
-						rightChild = new KDBox(box->getDepth() + 1)));
-		std::vector<KDBox*>& lchildren = leftChild->getChildren();
-		std::vector<KDBox*>& rchildren = rightChild->getChildren();
-		for (int i = 0; i < splitPos; i++) {
-			if (edges[i].isMin()) {
-				edges[i].getBox()->setDepth(leftChild->getDepth() + 1);
-				lchildren.push_back(edges[i].getBox());
-
+		for (int c = 0; c < (int) boxes.size(); c += 2) {
+			box.add(boxes[c].minPoint, boxes[c].maxPoint);
+			center.add(boxes[c + 1].minPoint, boxes[c + 1].maxPoint);
+		}
+		node.minPoint = box.minPoint;
+		node.maxPoint = box.maxPoint;
+		node.offset = 0;
+		node.count = 0;
+		if (n <= 1 || depth >= maxDepth)
+			return false;
+		float3 extent = center.maxPoint - center.minPoint;
+		int axisStart = 0, axisEnd = 3;
+		if (!allAxes) {
+			axisStart = (extent.x > extent.y && extent.x > extent.z) ?
+					0 : ((extent.y > extent.z) ? 1 : 2);
+			axisEnd = axisStart + 1;
+		}
+		float3 scale;
+		for (int a = 0; a < 3; a++) {
+			scale[a] = (extent[a] > 0.0f) ? bins * 0.9999f / extent[a] : 0.0f;
+		}
+		IntersectorBins single;
+		std::vector<IntersectorBins> local((chunks > 1) ? chunks : 0);
+		IntersectorBins* binned = (chunks > 1) ? local.data() : &single;
+#pragma omp parallel for if(chunks > 1)
+		for (int c = 0; c < chunks; c++) {
+			IntersectorBins& b = binned[c];
+			uint32_t cend = begin + (uint32_t) ((uint64_t) n * (c + 1) / chunks);
+			for (uint32_t i = begin + (uint32_t) ((uint64_t) n * c / chunks);
+					i < cend; i++) {
+				const IntersectorPrimitive& prim = primitives[i];
+				for (int a = axisStart; a < axisEnd; a++) {
+					int k = std::min(bins - 1,
+							(int) ((prim.center[a] - center.minPoint[a])
+									* scale[a]));
+					b.bounds[a][k].add(prim.minPoint, prim.maxPoint);
+					b.counts[a][k]++;
+				}
 			}
 		}
-		for (int i = splitPos + 1; i < sz; i++) {
-			if (!edges[i].isMin()) {
-				edges[i].getBox()->setDepth(rightChild->getDepth() + 1);
-				rchildren.push_back(edges[i].getBox());
+		for (int c = 1; c < chunks; c++) {
+			for (int a = axisStart; a < axisEnd; a++) {
+				for (int k = 0; k < bins; k++) {
+					binned[0].bounds[a][k].add(binned[c].bounds[a][k].minPoint,
+							binned[c].bounds[a][k].maxPoint);
+					binned[0].counts[a][k] += binned[c].counts[a][k];
+				}
 			}
 		}
-		if (lchildren.size() >= children.size()
-				|| rchildren.size() >= children.size()) {
-			continue;
+		const IntersectorBins& b = binned[0];
+		float parentArea = box.halfArea();
+		float invArea = (parentArea > 0.0f) ? 1.0f / parentArea : 0.0f;
+		double bestCost = 1E30;
+		int bestAxis = -1, bestBin = 0;
+		for (int a = axisStart; a < axisEnd; a++) {
+			if (scale[a] == 0.0f)
+				continue;
+			//Sweep from the right to get the cost of every right half.
+			float rightArea[INTERSECTOR_MAX_BINS];
+			uint32_t rightCount[INTERSECTOR_MAX_BINS];
+			float rightMin[INTERSECTOR_MAX_BINS];
+			IntersectorBounds right;
+			uint32_t count = 0;
+			for (int k = bins - 1; k > 0; k--) {
+				right.add(b.bounds[a][k].minPoint, b.bounds[a][k].maxPoint);
+				count += b.counts[a][k];
+				rightArea[k] = right.halfArea();
+				rightCount[k] = count;
+				rightMin[k] = right.minPoint[a];
+			}
+			IntersectorBounds left;
+			count = 0;
+			for (int k = 1; k < bins; k++) {
+				left.add(b.bounds[a][k - 1].minPoint,
+						b.bounds[a][k - 1].maxPoint);
+				count += b.counts[a][k - 1];
+				if (count == 0 || rightCount[k] == 0)
+					continue;
+				double area = (invArea > 0.0f) ?
+						(left.halfArea() * BlockCount(count)
+								+ rightArea[k] * BlockCount(rightCount[k]))
+								* invArea :
+						BlockCount(count) + BlockCount(rightCount[k]);
+				double cost = traversalCost
+						+ intersectCost
+								* (1
+										- ((left.maxPoint[a] < rightMin[k]) ?
+												emptyBonus : 0)) * area;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = a;
+					bestBin = k;
+				}
+			}
 		}
-		leftChild->update();
-		rightChild->update();
-		children.clear();
-		children.push_back(leftChild);
-		children.push_back(rightChild);
-		box->update();
-		//std::cout << "Left: " << *leftChild<<std::endl;
-		//std::cout << "Right: " << *rightChild << std::endl;
-		boxes.push_back(leftChild);
-		boxes.push_back(rightChild);
-
+		if (bestAxis < 0) {
+			//Every center coincides, so only an arbitrary split can bound the leaf size.
+			if (n <= maxLeafSize)
+				return false;
+			mid = begin + n / 2;
+			return true;
+		}
+		if (bestCost >= intersectCost * BlockCount(n) && n <= maxLeafSize)
+			return false;
+		const float minCenter = center.minPoint[bestAxis];
+		const float axisScale = scale[bestAxis];
+		const int binCount = bins;
+		IntersectorPrimitive* first = primitives.data() + begin;
+		mid = begin
+				+ (uint32_t) (std::partition(first, first + n,
+						[=](const IntersectorPrimitive& prim) {
+							return std::min(binCount - 1,
+									(int) ((prim.center[bestAxis] - minCenter)
+											* axisScale)) < bestBin;
+						}) - first);
+		return true;
+	}
+	uint32_t build(uint32_t begin, uint32_t end, int depth,
+			aligned_vector<IntersectorNode>& nodes,
+			aligned_vector<IntersectorBlock>& blocks) {
+		uint32_t index = (uint32_t) nodes.size();
+		IntersectorNode node;
+		uint32_t mid;
+		bool interior = split(begin, end, depth, false, node, mid);
+		nodes.push_back(node);
+		if (interior) {
+			build(begin, mid, depth + 1, nodes, blocks);
+			uint32_t right = build(mid, end, depth + 1, nodes, blocks);
+			nodes[index].offset = right;
+			return index;
+		}
+		nodes[index].offset = (uint32_t) blocks.size();
+		nodes[index].count = end - begin;
+		for (uint32_t n = begin; n < end; n += 4) {
+			IntersectorBlock block;
+			for (int k = 0; k < 4; k++) {
+				float3 v0(0.0f), e1(0.0f), e2(0.0f);
+				uint32_t id = INTERSECTOR_INVALID_TRIANGLE;
+				if (n + k < end) {
+					id = primitives[n + k].id;
+					const uint3& tri = triangleIndexes[id];
+					v0 = vertexes[tri.x];
+					e1 = vertexes[tri.y] - v0;
+					e2 = vertexes[tri.z] - v0;
+				}
+				for (int c = 0; c < 3; c++) {
+					block.v0[c][k] = v0[c];
+					block.e1[c][k] = e1[c];
+					block.e2[c][k] = e2[c];
+				}
+				block.id[k] = id;
+			}
+			blocks.push_back(block);
+		}
+		return index;
 	}
+	int buildTop(uint32_t begin, uint32_t end, int depth, uint32_t grain,
+			std::vector<TopNode>& top, std::vector<Task>& tasks) {
+		int index = (int) top.size();
+		TopNode entry;
+		entry.left = entry.right = entry.task = -1;
+		uint32_t mid;
+		if (end - begin <= grain
+				|| !split(begin, end, depth, true, entry.node, mid)) {
+			entry.task = (int) tasks.size();
+			Task task;
+			task.begin = begin;
+			task.end = end;
+			task.depth = depth;
+			tasks.push_back(std::move(task));
+			top.push_back(entry);
+			return index;
+		}
+		top.push_back(entry);
+		int left = buildTop(begin, mid, depth + 1, grain, top, tasks);
+		int right = buildTop(mid, end, depth + 1, grain, top, tasks);
+		top[index].left = left;
+		top[index].right = right;
+		return index;
+	}
+};
+/*
+ * Appends the depth first subtree in srcNodes [begin,end), whose blocks are
+ * srcBlocks [blockBegin,blockEnd), moving its offsets to the new location.
+ */
+static IntersectorSubtree AppendSubtree(aligned_vector<IntersectorNode>& nodes,
+		aligned_vector<IntersectorBlock>& blocks,
+		const aligned_vector<IntersectorNode>& srcNodes, uint32_t begin,
+		uint32_t end, const aligned_vector<IntersectorBlock>& srcBlocks,
+		uint32_t blockBegin, uint32_t blockEnd) {
+	IntersectorSubtree subtree;
+	subtree.node = (uint32_t) nodes.size();
+	subtree.blockBegin = (uint32_t) blocks.size();
+	//Unsigned arithmetic wraps, so these shifts work in either direction.
+	uint32_t nodeShift = subtree.node - begin;
+	uint32_t blockShift = subtree.blockBegin - blockBegin;
+	for (uint32_t i = begin; i < end; i++) {
+		IntersectorNode node = srcNodes[i];
+		node.offset += (node.isLeaf()) ? blockShift : nodeShift;
+		nodes.push_back(node);
+	}
+	blocks.insert(blocks.end(), srcBlocks.begin() + blockBegin,
+			srcBlocks.begin() + blockEnd);
+	subtree.end = (uint32_t) nodes.size();
+	subtree.blockEnd = (uint32_t) blocks.size();
+	subtree.depth = 0;
+	subtree.cost = 0;
+	return subtree;
 }
-int Intersector::splitPosition(std::vector<KDBox*>& children,
-		std::vector<KDBoxEdge>& edges, KDBox* box) {
-	int nAbove = 0;
-	int nBelow = 0;
-	double pAbove = 0;
-	double pBelow = 0;
-	double cost = 0;
-	int dim = 0;
-	int bestSplit = -1;
-	double sum = 0;
-	double prod = 0;
-	double voxel;
-	double val;
-	double minCost;
-	int sz;
-	//KDBoxEdge e1, e2;
-	float3 v = box->getMax() - box->getMin();
-	if (v.x > v.y && v.x > v.z)
-		dim = 0;
-	else if (v.y > v.z)
-		dim = 1;
-	else
-		dim = 2;
-	int retry = 3;
-	voxel = 1.0 / (v.x + v.y + v.z);
-	do {
-		bestSplit = -1;
-		switch (dim) {
-		case 0:
-			sum = v.y + v.z;
-			prod = v.y * v.z;
-			break;
-		case 1:
-			sum = v.x + v.z;
-			prod = v.x * v.z;
-			break;
-		case 2:
-			sum = v.x + v.y;
-			prod = v.x * v.y;
-			break;
+void Intersector::build(const Mesh& mesh, int maxDepth,
+		IntersectorQuality quality) {
+	reset();
+	this->maxDepth = aly::clamp(maxDepth, 0, INTERSECTOR_MAX_DEPTH);
+	this->quality = quality;
+	vertexes.assign(mesh.vertexLocations.data.begin(),
+			mesh.vertexLocations.data.end());
+	quadCount = (uint32_t) mesh.quadIndexes.size();
+	triangleIndexes.reserve(2 * mesh.quadIndexes.size() + mesh.triIndexes.size());
+	for (const uint4& face : mesh.quadIndexes.data) {
+		if (distanceSqr(vertexes[face.x], vertexes[face.z])
+				< distanceSqr(vertexes[face.y], vertexes[face.w])) {
+			triangleIndexes.push_back(uint3(face.x, face.y, face.z));
+			triangleIndexes.push_back(uint3(face.z, face.w, face.x));
+		} else {
+			triangleIndexes.push_back(uint3(face.x, face.y, face.w));
+			triangleIndexes.push_back(uint3(face.w, face.y, face.z));
 		}
-
-		sz = (int) children.size() * 2;
-		edges.resize(sz);
-		for (int i = 0; i < sz; i++) {
-			KDBox* child = children[i / 2];
-			edges[i] = KDBoxEdge(child, dim, (i % 2 == 1) ? true : false);
+	}
+	triangleIndexes.insert(triangleIndexes.end(), mesh.triIndexes.data.begin(),
+			mesh.triIndexes.data.end());
+	if (triangleIndexes.size() == 0)
+		return;
+	int N = (int) triangleIndexes.size();
+	std::vector<IntersectorPrimitive> primitives(N);
+#pragma omp parallel for
+	for (int i = 0; i < N; i++) {
+		MakePrimitive(vertexes, triangleIndexes, (uint32_t) i, primitives[i]);
+	}
+	IntersectorBuilder builder(primitives, vertexes, triangleIndexes,
+			intersectCost, traversalCost, emptyBonus, this->maxDepth, quality);
+	//Aim for several subtrees per thread so the dynamic schedule can balance them.
+	uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+	uint32_t grain = std::max(INTERSECTOR_SUBTREE_GRAIN,
+			(uint32_t) N / (8 * threads));
+	std::vector<IntersectorBuilder::TopNode> top;
+	std::vector<IntersectorBuilder::Task> tasks;
+	builder.buildTop(0, (uint32_t) N, 0, grain, top, tasks);
+	std::vector<int> order(tasks.size());
+	for (int i = 0; i < (int) order.size(); i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		return tasks[a].end - tasks[a].begin > tasks[b].end - tasks[b].begin;
+	});
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int) order.size(); i++) {
+		IntersectorBuilder::Task& task = tasks[order[i]];
+		builder.build(task.begin, task.end, task.depth, task.nodes,
+				task.blocks);
+	}
+	size_t nodeCount = top.size(), blockCount = 0;
+	for (const IntersectorBuilder::Task& task : tasks) {
+		nodeCount += task.nodes.size();
+		blockCount += task.blocks.size();
+	}
+	nodes.reserve(nodeCount);
+	blocks.reserve(blockCount);
+	//Splice the top nodes and subtrees together depth first.
+	std::function<uint32_t(int)> splice = [&](int t) -> uint32_t {
+		const IntersectorBuilder::TopNode& entry = top[t];
+		uint32_t index = (uint32_t) nodes.size();
+		if (entry.task >= 0) {
+			IntersectorBuilder::Task& task = tasks[entry.task];
+			subtrees.push_back(
+					AppendSubtree(nodes, blocks, task.nodes, 0,
+							(uint32_t) task.nodes.size(), task.blocks, 0,
+							(uint32_t) task.blocks.size()));
+			subtrees.back().depth = task.depth;
+			task.nodes = aligned_vector<IntersectorNode>();
+			task.blocks = aligned_vector<IntersectorBlock>();
+			return index;
 		}
-
-		std::sort(edges.begin(), edges.end(),
-				[](const KDBoxEdge& e1, const KDBoxEdge& e2) {
-					return (e1.getValue() < e2.getValue());
-				});
-		for (int i = 0; i < (int) edges.size() - 1; i++) {
-			KDBoxEdge& e1 = edges[i];
-			KDBoxEdge& e2 = edges[i + 1];
-			if (e1.getValue() == e2.getValue()) {
-				if (!e1.isMin() && e2.isMin()) {
-					std::swap(e1, e2);
+		nodes.push_back(entry.node);
+		splice(entry.left);
+		uint32_t right = splice(entry.right);
+		nodes[index].offset = right;
+		return index;
+	};
+	splice(0);
+	for (IntersectorSubtree& subtree : subtrees) {
+		subtree.cost = getCost(subtree.node, subtree.end);
+	}
+	treeCost = getCost(0, (uint32_t) nodes.size());
+}
+static inline double NodeHalfArea(const IntersectorNode& node) {
+	float3 d = aly::max(node.maxPoint - node.minPoint, float3(0.0f));
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+double Intersector::getCost(uint32_t begin, uint32_t end) const {
+	double sum = 0;
+	for (uint32_t i = begin; i < end; i++) {
+		const IntersectorNode& node = nodes[i];
+		sum += NodeHalfArea(node)
+				* ((node.isLeaf()) ?
+						intersectCost * ((node.count + 3) / 4) : traversalCost);
+	}
+	double area = NodeHalfArea(nodes[begin]);
+	return (area > 0) ? sum / area : sum;
+}
+void Intersector::refitSubtree(const IntersectorSubtree& subtree) {
+	//Children follow their parent, so a reverse sweep sees them first.
+	for (uint32_t i = subtree.end; i-- > subtree.node;) {
+		IntersectorNode& node = nodes[i];
+		if (node.isLeaf()) {
+			float3 minPoint(1E30f), maxPoint(-1E30f);
+			uint32_t end = node.offset + (node.count + 3) / 4;
+			for (uint32_t b = node.offset; b < end; b++) {
+				IntersectorBlock& block = blocks[b];
+				for (int k = 0; k < 4; k++) {
+					if (block.id[k] == INTERSECTOR_INVALID_TRIANGLE)
+						continue;
+					const uint3& tri = triangleIndexes[block.id[k]];
+					float3 v0 = vertexes[tri.x];
+					float3 v1 = vertexes[tri.y];
+					float3 v2 = vertexes[tri.z];
+					float3 e1 = v1 - v0;
+					float3 e2 = v2 - v0;
+					for (int c = 0; c < 3; c++) {
+						block.v0[c][k] = v0[c];
+						block.e1[c][k] = e1[c];
+						block.e2[c][k] = e2[c];
+					}
+					minPoint = aly::min(minPoint, aly::min(aly::min(v0, v1), v2));
+					maxPoint = aly::max(maxPoint, aly::max(aly::max(v0, v1), v2));
 				}
 			}
+			node.minPoint = minPoint;
+			node.maxPoint = maxPoint;
+		} else {
+			const IntersectorNode& left = nodes[i + 1];
+			const IntersectorNode& right = nodes[node.offset];
+			node.minPoint = aly::min(left.minPoint, right.minPoint);
+			node.maxPoint = aly::max(left.maxPoint, right.maxPoint);
 		}
-		nBelow = 0;
-		nAbove = (int) children.size();
-		// Do not assume prior minimum cost because the spherical
-		// orientation
-		// is in some sense optimal when rays are cast from outside the
-		// sphere.
-		// If minimum cost is assumed, then no branches in kd-tree will be
-		// generated
-		// minCost=intersectCost*nAbove;
-		minCost = 1E30;
-
-		KDBoxEdge e1(box, dim, true);
-		KDBoxEdge e2(box, dim, false);
-		for (int i = 0; i < sz; i++) {
-			if (!edges[i].isMin())
-				nAbove--;
-			val = edges[i].getValue();
-			if (val > e1.getValue() && e2.getValue() > val) {
-				pBelow = (sum * (val - e1.getValue()) + prod) * voxel;
-				pAbove = (sum * (e2.getValue() - val) + prod) * voxel;
-				cost = traversalCost
-						+ intersectCost
-								* (1
-										- ((nAbove == 0 || nBelow == 0) ?
-												emptyBonus : 0))
-								* (pBelow * nBelow + pAbove * nAbove);
-				if (cost < minCost) {
-					minCost = cost;
-					bestSplit = i;
+	}
+}
+void Intersector::refitTop(uint32_t index) {
+	auto pos = std::lower_bound(subtrees.begin(), subtrees.end(), index,
+			[](const IntersectorSubtree& subtree, uint32_t node) {
+				return subtree.node < node;
+			});
+	if (pos != subtrees.end() && pos->node == index)
+		return;
+	IntersectorNode& node = nodes[index];
+	refitTop(index + 1);
+	refitTop(node.offset);
+	const IntersectorNode& left = nodes[index + 1];
+	const IntersectorNode& right = nodes[node.offset];
+	node.minPoint = aly::min(left.minPoint, right.minPoint);
+	node.maxPoint = aly::max(left.maxPoint, right.maxPoint);
+}
+void Intersector::rebuildSubtrees(const std::vector<int>& rebuild) {
+	int S = (int) subtrees.size();
+	std::vector<IntersectorBuilder::Task> replacements(S);
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < S; s++) {
+		if (!rebuild[s])
+			continue;
+		const IntersectorSubtree& subtree = subtrees[s];
+		std::vector<IntersectorPrimitive> primitives;
+		for (uint32_t b = subtree.blockBegin; b < subtree.blockEnd; b++) {
+			for (int k = 0; k < 4; k++) {
+				uint32_t id = blocks[b].id[k];
+				if (id == INTERSECTOR_INVALID_TRIANGLE)
+					continue;
+				IntersectorPrimitive prim;
+				MakePrimitive(vertexes, triangleIndexes, id, prim);
+				primitives.push_back(prim);
+			}
+		}
+		IntersectorBuilder builder(primitives, vertexes, triangleIndexes,
+				intersectCost, traversalCost, emptyBonus, maxDepth, quality);
+		builder.build(0, (uint32_t) primitives.size(), subtree.depth,
+				replacements[s].nodes, replacements[s].blocks);
+	}
+	aligned_vector<IntersectorNode> newNodes;
+	aligned_vector<IntersectorBlock> newBlocks;
+	std::vector<IntersectorSubtree> newSubtrees;
+	newNodes.reserve(nodes.size());
+	newBlocks.reserve(blocks.size());
+	int next = 0;
+	//Subtrees are stored in depth first order, so they are reached in order.
+	std::function<uint32_t(uint32_t)> splice = [&](uint32_t index) -> uint32_t {
+		uint32_t copy = (uint32_t) newNodes.size();
+		if (next < S && subtrees[next].node == index) {
+			const IntersectorSubtree& subtree = subtrees[next];
+			IntersectorBuilder::Task& task = replacements[next];
+			IntersectorSubtree updated =
+					(rebuild[next]) ?
+							AppendSubtree(newNodes, newBlocks, task.nodes, 0,
+									(uint32_t) task.nodes.size(), task.blocks,
+									0, (uint32_t) task.blocks.size()) :
+							AppendSubtree(newNodes, newBlocks, nodes,
+									subtree.node, subtree.end, blocks,
+									subtree.blockBegin, subtree.blockEnd);
+			updated.depth = subtree.depth;
+			updated.cost = subtree.cost;
+			newSubtrees.push_back(updated);
+			next++;
+			return copy;
+		}
+		newNodes.push_back(nodes[index]);
+		splice(index + 1);
+		uint32_t right = splice(nodes[index].offset);
+		newNodes[copy].offset = right;
+		return copy;
+	};
+	splice(0);
+	nodes.swap(newNodes);
+	blocks.swap(newBlocks);
+	subtrees.swap(newSubtrees);
+	for (int s = 0; s < S; s++) {
+		if (rebuild[s])
+			subtrees[s].cost = getCost(subtrees[s].node, subtrees[s].end);
+	}
+}
+int Intersector::refit(const Mesh& mesh, float maxDegradation) {
+	if (nodes.size() == 0 || vertexes.size() != mesh.vertexLocations.size()
+			|| quadCount != mesh.quadIndexes.size()
+			|| triangleIndexes.size()
+					!= 2 * mesh.quadIndexes.size() + mesh.triIndexes.size()) {
+		build(mesh, maxDepth, quality);
+		return (int) subtrees.size();
+	}
+	vertexes.assign(mesh.vertexLocations.data.begin(),
+			mesh.vertexLocations.data.end());
+	int S = (int) subtrees.size();
+	std::vector<int> rebuild(S, 0);
+	std::vector<double> costs(S);
+#pragma omp parallel for schedule(dynamic)
+	for (int s = 0; s < S; s++) {
+		const IntersectorSubtree& subtree = subtrees[s];
+		refitSubtree(subtree);
+		costs[s] = getCost(subtree.node, subtree.end);
+		rebuild[s] = (costs[s] > maxDegradation * subtree.cost) ? 1 : 0;
+	}
+	//Rebuilding a subtree does not change its root bounds, so the top can be refit first.
+	refitTop(0);
+	double cost = getCost(0, (uint32_t) nodes.size());
+	double rootArea = NodeHalfArea(nodes[0]);
+	int rebuilt = 0;
+	for (int s = 0; s < S; s++) {
+		if (rebuild[s]) {
+			//Estimate the cost after the rebuild with the subtree's cost when built.
+			const IntersectorSubtree& subtree = subtrees[s];
+			if (rootArea > 0)
+				cost -= (costs[s] - subtree.cost)
+						* NodeHalfArea(nodes[subtree.node]) / rootArea;
+			rebuilt++;
+		}
+	}
+	if (treeCost > 0 && cost > maxDegradation * treeCost) {
+		build(mesh, maxDepth, quality);
+		return (int) subtrees.size();
+	}
+	if (rebuilt > 0) {
+		rebuildSubtrees(rebuild);
+		cost = getCost(0, (uint32_t) nodes.size());
+	}
+	degradation = (treeCost > 0) ? cost / treeCost : 1;
+	return rebuilt;
+}
+//Slab test against the node bounds. On a hit, near is the entry distance.
+static inline bool IntersectRayNode(const IntersectorNode& node,
+		const float3& org, const float3& invDir, float tmax, float& near) {
+	float t0 = 0.0f, t1 = tmax;
+	for (int c = 0; c < 3; c++) {
+		float ta = (node.minPoint[c] - org[c]) * invDir[c];
+		float tb = (node.maxPoint[c] - org[c]) * invDir[c];
+		t0 = std::max(t0, std::min(ta, tb));
+		t1 = std::min(t1, std::max(ta, tb));
+	}
+	near = t0;
+	return t0 <= t1;
+}
+//Moller-Trumbore on all four lanes, keeping the nearest hit in [0, tbest).
+static inline void IntersectRayBlock(const IntersectorBlock& block,
+		const float3& org, const float3& dir, float& tbest, uint32_t& hit) {
+	static const float EPS = 1E-5f;
+	float t[4];
+	for (int k = 0; k < 4; k++) {
+		const float e1x = block.e1[0][k], e1y = block.e1[1][k], e1z =
+				block.e1[2][k];
+		const float e2x = block.e2[0][k], e2y = block.e2[1][k], e2z =
+				block.e2[2][k];
+		const float px = dir.y * e2z - dir.z * e2y;
+		const float py = dir.z * e2x - dir.x * e2z;
+		const float pz = dir.x * e2y - dir.y * e2x;
+		const float det = e1x * px + e1y * py + e1z * pz;
+		const float inv = 1.0f / det;
+		const float sx = org.x - block.v0[0][k];
+		const float sy = org.y - block.v0[1][k];
+		const float sz = org.z - block.v0[2][k];
+		const float u = (sx * px + sy * py + sz * pz) * inv;
+		const float qx = sy * e1z - sz * e1y;
+		const float qy = sz * e1x - sx * e1z;
+		const float qz = sx * e1y - sy * e1x;
+		const float v = (dir.x * qx + dir.y * qy + dir.z * qz) * inv;
+		const float d = (e2x * qx + e2y * qy + e2z * qz) * inv;
+		//Zero determinants give infinite or NaN coordinates, which fail these tests.
+		const bool inside = (u >= -EPS) & (v >= -EPS) & (u + v <= 1.0f + EPS)
+				& (d >= 0.0f);
+		t[k] = inside ? d : NO_HIT_DISTANCE;
+	}
+	for (int k = 0; k < 4; k++) {
+		if (t[k] < tbest) {
+			tbest = t[k];
+			hit = block.id[k];
+		}
+	}
+}
+static inline float DistanceSqrToNode(const IntersectorNode& node,
+		const float3& pt) {
+	float sum = 0.0f;
+	for (int c = 0; c < 3; c++) {
+		float d = std::max(std::max(node.minPoint[c] - pt[c], 0.0f),
+				pt[c] - node.maxPoint[c]);
+		sum += d * d;
+	}
+	return sum;
+}
+//Closest point on triangle (a, a+ab, a+ac) from Ericson, Real-Time Collision Detection, 5.1.5.
+static inline float3 ClosestPointOnTriangle(const float3& p, const float3& a,
+		const float3& ab, const float3& ac) {
+	float3 ap = p - a;
+	float d1 = dot(ab, ap);
+	float d2 = dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f)
+		return a;
+	float3 bp = ap - ab;
+	float d3 = dot(ab, bp);
+	float d4 = dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3)
+		return a + ab;
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+		return a + (d1 / (d1 - d3)) * ab;
+	float3 cp = ap - ac;
+	float d5 = dot(ab, cp);
+	float d6 = dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6)
+		return a + ac;
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+		return a + (d2 / (d2 - d6)) * ac;
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+		return a + ab + ((d4 - d3) / ((d4 - d3) + (d5 - d6))) * (ac - ab);
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+struct IntersectorStackEntry {
+	uint32_t node;
+	float distance;
+};
+void Intersector::intersect(const float3& org, const float3& dir, float tmax,
+		IntersectorHit& result) const {
+	if (nodes.size() == 0)
+		throw std::runtime_error("KD-Tree has not been initialized.");
+	result.point = NO_HIT_POINT;
+	result.distance = NO_HIT_DISTANCE;
+	result.triangle = INTERSECTOR_INVALID_TRIANGLE;
+	float3 invDir;
+	for (int c = 0; c < 3; c++) {
+		//Keep the reciprocal finite so rays in a slab plane do not produce NaNs.
+		invDir[c] = 1.0f
+				/ ((std::abs(dir[c]) > 1E-20f) ?
+						dir[c] : std::copysign(1E-20f, dir[c]));
+	}
+	IntersectorStackEntry stack[2 * INTERSECTOR_MAX_DEPTH + 4];
+	int stackSize = 0;
+	float tbest = tmax;
+	uint32_t hit = INTERSECTOR_INVALID_TRIANGLE;
+	float near;
+	if (!IntersectRayNode(nodes[0], org, invDir, tbest, near))
+		return;
+	stack[stackSize++] = {0, near};
+	while (stackSize > 0) {
+		IntersectorStackEntry entry = stack[--stackSize];
+		if (entry.distance > tbest)
+			continue;
+		uint32_t index = entry.node;
+		while (true) {
+			const IntersectorNode& node = nodes[index];
+			if (node.isLeaf()) {
+				uint32_t end = node.offset + (node.count + 3) / 4;
+				for (uint32_t b = node.offset; b < end; b++) {
+					IntersectRayBlock(blocks[b], org, dir, tbest, hit);
 				}
+				break;
+			}
+			uint32_t left = index + 1, right = node.offset;
+			float nearLeft, nearRight;
+			bool hitLeft = IntersectRayNode(nodes[left], org, invDir, tbest,
+					nearLeft);
+			bool hitRight = IntersectRayNode(nodes[right], org, invDir, tbest,
+					nearRight);
+			if (hitLeft && hitRight) {
+				if (nearRight < nearLeft) {
+					std::swap(left, right);
+					std::swap(nearLeft, nearRight);
+				}
+				stack[stackSize++] = {right, nearRight};
+				index = left;
+			} else if (hitLeft) {
+				index = left;
+			} else if (hitRight) {
+				index = right;
+			} else {
+				break;
 			}
-			if (edges[i].isMin())
-				nBelow++;
 		}
-		dim = (dim + 1) % 3;
-		retry--;
-	} while (bestSplit == -1 && retry > 0);
-	return bestSplit;
+	}
+	if (hit == INTERSECTOR_INVALID_TRIANGLE)
+		return;
+	result.triangle = hit;
+	result.point = org + tbest * dir;
+	result.distance = tbest * length(dir);
 }
-double Intersector::intersectRayDistance(const float3& p1, const float3& v,
-		float3& lastPoint, KDTriangle*& lastTriangle) const {
-	if (root->getChildren().size() == 0)
-		throw new std::runtime_error("KD-Tree has not been initialized.");
-	std::list<KDBox*> boxes;
-	boxes.push_back(getRoot());
-	double d;
-	double mind = 1E30;
-	KDTriangle* resultTriangle = nullptr;
-	float3 resultIntersect = NO_HIT_POINT;
-	KDTriangle* tri;
-	while (boxes.size() > 0) {
-		KDBox* box = boxes.front();
-		//std::cout << *box << std::endl;
-		boxes.pop_front();
-		if (box->intersectRayBox(p1, v)) {
-			if (box->isLeaf) {
-				tri = dynamic_cast<KDTriangle*>(box);
-				float3 intersect = tri->intersectionPointRay(p1, v);
-				if (intersect != NO_HIT_POINT) {
-					d = distance(p1, intersect);
-					if (d < mind) {
-						mind = d;
-						resultTriangle = tri;
-						resultIntersect = intersect;
+struct IntersectorPacketEntry {
+	uint32_t node;
+	float distance;
+	int mask;
+};
+//Slab test of the rays in mask against the node. Returns the rays that hit and their nearest entry.
+static inline int IntersectPacketNode(const IntersectorNode& node,
+		const float (&org)[3][4], const float (&invDir)[3][4],
+		const float (&tbest)[4], int mask, float& near) {
+	const float minX = node.minPoint.x, minY = node.minPoint.y, minZ =
+			node.minPoint.z;
+	const float maxX = node.maxPoint.x, maxY = node.maxPoint.y, maxZ =
+			node.maxPoint.z;
+	float t0[4], t1[4];
+	for (int k = 0; k < 4; k++) {
+		float ax = (minX - org[0][k]) * invDir[0][k];
+		float bx = (maxX - org[0][k]) * invDir[0][k];
+		float ay = (minY - org[1][k]) * invDir[1][k];
+		float by = (maxY - org[1][k]) * invDir[1][k];
+		float az = (minZ - org[2][k]) * invDir[2][k];
+		float bz = (maxZ - org[2][k]) * invDir[2][k];
+		t0[k] = std::max(std::max(0.0f, std::min(ax, bx)),
+				std::max(std::min(ay, by), std::min(az, bz)));
+		t1[k] = std::min(std::min(tbest[k], std::max(ax, bx)),
+				std::min(std::max(ay, by), std::max(az, bz)));
+	}
+	int hits = 0;
+	near = NO_HIT_DISTANCE;
+	for (int k = 0; k < 4; k++) {
+		if (((mask >> k) & 1) && t0[k] <= t1[k]) {
+			hits |= 1 << k;
+			near = std::min(near, t0[k]);
+		}
+	}
+	return hits;
+}
+void Intersector::intersectPacket(const float3* org, const float3* dir,
+		IntersectorHit* result) const {
+	float o[3][4], invDir[3][4], tbest[4];
+	uint32_t hit[4];
+	for (int k = 0; k < 4; k++) {
+		for (int c = 0; c < 3; c++) {
+			o[c][k] = org[k][c];
+			invDir[c][k] = 1.0f
+					/ ((std::abs(dir[k][c]) > 1E-20f) ?
+							dir[k][c] : std::copysign(1E-20f, dir[k][c]));
+		}
+		tbest[k] = NO_HIT_DISTANCE;
+		hit[k] = INTERSECTOR_INVALID_TRIANGLE;
+	}
+	IntersectorPacketEntry stack[2 * INTERSECTOR_MAX_DEPTH + 4];
+	int stackSize = 0;
+	float near;
+	int mask = IntersectPacketNode(nodes[0], o, invDir, tbest, 0xF, near);
+	if (mask != 0)
+		stack[stackSize++] = {0, near, mask};
+	while (stackSize > 0) {
+		IntersectorPacketEntry entry = stack[--stackSize];
+		float farthest = 0.0f;
+		for (int k = 0; k < 4; k++) {
+			if ((entry.mask >> k) & 1)
+				farthest = std::max(farthest, tbest[k]);
+		}
+		if (entry.distance > farthest)
+			continue;
+		uint32_t index = entry.node;
+		int active = entry.mask;
+		while (true) {
+			const IntersectorNode& node = nodes[index];
+			if (node.isLeaf()) {
+				uint32_t end = node.offset + (node.count + 3) / 4;
+				for (uint32_t b = node.offset; b < end; b++) {
+					for (int k = 0; k < 4; k++) {
+						if ((active >> k) & 1)
+							IntersectRayBlock(blocks[b], org[k], dir[k],
+									tbest[k], hit[k]);
 					}
 				}
+				break;
+			}
+			uint32_t left = index + 1, right = node.offset;
+			float nearLeft, nearRight;
+			int maskLeft = IntersectPacketNode(nodes[left], o, invDir, tbest,
+					active, nearLeft);
+			int maskRight = IntersectPacketNode(nodes[right], o, invDir, tbest,
+					active, nearRight);
+			if (maskLeft != 0 && maskRight != 0) {
+				if (nearRight < nearLeft) {
+					std::swap(left, right);
+					std::swap(nearLeft, nearRight);
+					std::swap(maskLeft, maskRight);
+				}
+				stack[stackSize++] = {right, nearRight, maskRight};
+				index = left;
+				active = maskLeft;
+			} else if (maskLeft != 0) {
+				index = left;
+				active = maskLeft;
+			} else if (maskRight != 0) {
+				index = right;
+				active = maskRight;
+			} else {
+				break;
 			}
-			boxes.insert(boxes.end(), box->getChildren().begin(),
-					box->getChildren().end());
 		}
 	}
-	lastTriangle = resultTriangle;
-	lastPoint = resultIntersect;
-	if (resultTriangle == nullptr) {
-		return NO_HIT_DISTANCE;
-	} else {
-		return mind;
+	for (int k = 0; k < 4; k++) {
+		IntersectorHit& r = result[k];
+		if (hit[k] == INTERSECTOR_INVALID_TRIANGLE) {
+			r.point = NO_HIT_POINT;
+			r.distance = NO_HIT_DISTANCE;
+			r.triangle = INTERSECTOR_INVALID_TRIANGLE;
+		} else {
+			r.point = org[k] + tbest[k] * dir[k];
+			r.distance = tbest[k] * length(dir[k]);
+			r.triangle = hit[k];
+		}
 	}
 }
-double Intersector::intersectSegmentDistance(const float3& p1, const float3& p2,
-		float3& lastPoint, KDTriangle*& lastTriangle) const {
-	if (root->getChildren().size() == 0)
-		throw new std::runtime_error("KD-Tree has not been initialized.");
-	std::list<KDBox*> boxes;
-	boxes.push_back(getRoot());
-	double d;
-	double mind = 1E30;
-	KDTriangle* resultTriangle = nullptr;
-	float3 resultIntersect = NO_HIT_POINT;
-	KDTriangle* tri;
-	while (boxes.size() > 0) {
-		KDBox* box = boxes.front();
-		boxes.pop_front();
-		if (box->intersectSegmentBox(p1, p2)) {
-			if (box->isLeaf) {
-				tri = dynamic_cast<KDTriangle*>(box);
-				float3 intersect = tri->intersectionPointSegment(p1, p2);
-				if (intersect != NO_HIT_POINT) {
-					d = distance(p1, intersect);
-					if (d < mind) {
-						mind = d;
-						resultTriangle = tri;
-						resultIntersect = intersect;
+void Intersector::closest(const float3& pt, float maxDistance,
+		const float3* outside, IntersectorHit& result) const {
+	if (nodes.size() == 0)
+		throw std::runtime_error("KD-Tree has not been initialized.");
+	result.point = NO_HIT_POINT;
+	result.distance = NO_HIT_DISTANCE;
+	result.triangle = INTERSECTOR_INVALID_TRIANGLE;
+	IntersectorStackEntry stack[2 * INTERSECTOR_MAX_DEPTH + 4];
+	int stackSize = 0;
+	float best = (maxDistance < NO_HIT_DISTANCE) ?
+			maxDistance * maxDistance : NO_HIT_DISTANCE;
+	uint32_t hit = INTERSECTOR_INVALID_TRIANGLE;
+	float3 hitPoint = NO_HIT_POINT;
+	stack[stackSize++] = {0, DistanceSqrToNode(nodes[0], pt)};
+	while (stackSize > 0) {
+		IntersectorStackEntry entry = stack[--stackSize];
+		if (entry.distance > best)
+			continue;
+		uint32_t index = entry.node;
+		while (true) {
+			const IntersectorNode& node = nodes[index];
+			if (node.isLeaf()) {
+				uint32_t end = node.offset + (node.count + 3) / 4;
+				for (uint32_t b = node.offset; b < end; b++) {
+					const IntersectorBlock& block = blocks[b];
+					for (int k = 0; k < 4; k++) {
+						if (block.id[k] == INTERSECTOR_INVALID_TRIANGLE)
+							continue;
+						float3 a(block.v0[0][k], block.v0[1][k], block.v0[2][k]);
+						float3 ab(block.e1[0][k], block.e1[1][k], block.e1[2][k]);
+						float3 ac(block.e2[0][k], block.e2[1][k], block.e2[2][k]);
+						float3 q = ClosestPointOnTriangle(pt, a, ab, ac);
+						float d = distanceSqr(pt, q);
+						if (d <= best
+								&& (outside == nullptr
+										|| dot(q - pt, *outside) >= 0.0f)) {
+							best = d;
+							hit = block.id[k];
+							hitPoint = q;
+						}
 					}
 				}
+				break;
+			}
+			uint32_t left = index + 1, right = node.offset;
+			float nearLeft = DistanceSqrToNode(nodes[left], pt);
+			float nearRight = DistanceSqrToNode(nodes[right], pt);
+			if (nearRight < nearLeft) {
+				std::swap(left, right);
+				std::swap(nearLeft, nearRight);
+			}
+			if (nearLeft > best)
+				break;
+			if (nearRight <= best) {
+				stack[stackSize++] = {right, nearRight};
 			}
-			boxes.insert(boxes.end(), box->getChildren().begin(),
-					box->getChildren().end());
+			index = left;
 		}
 	}
-	lastTriangle = resultTriangle;
-	lastPoint = resultIntersect;
-	if (resultTriangle == nullptr) {
-		return NO_HIT_DISTANCE;
-	} else {
-		return mind;
-	}
+	if (hit == INTERSECTOR_INVALID_TRIANGLE)
+		return;
+	result.triangle = hit;
+	result.point = hitPoint;
+	result.distance = std::sqrt(best);
+}
+double Intersector::intersectRayDistance(const float3& p1, const float3& v,
+		float3& lastPoint, uint32_t& lastTriangle) const {
+	IntersectorHit result;
+	intersect(p1, v, NO_HIT_DISTANCE, result);
+	return report(result, lastPoint, lastTriangle);
+}
+double Intersector::intersectSegmentDistance(const float3& p1, const float3& p2,
+		float3& lastPoint, uint32_t& lastTriangle) const {
+	IntersectorHit result;
+	intersect(p1, p2 - p1, 1.0f, result);
+	return report(result, lastPoint, lastTriangle);
 }
 double Intersector::closestPointSignedDistance(const float3& r, float3& lastPoint,
-		KDTriangle*& lastTriangle) const {
+		uint32_t& lastTriangle) const {
 	double d = closestPoint(r, lastPoint, lastTriangle);
 	if (d >= 0&& d!=NO_HIT_DISTANCE) {
-		float3 norm = lastTriangle->getNormal();
-		float3 center = lastTriangle->getCentroid();
+		KDTriangle tri = getTriangle(lastTriangle);
+		float3 norm = tri.getNormal();
+		float3 center = tri.getCentroid();
 		float3 diff = r - center;
 		return sign(dot(diff, norm)) * d;
 	} else {
@@ -1189,11 +1845,12 @@ double Intersector::closestPointSignedDistance(const float3& r, float3& lastPoin
 	}
 }
 double Intersector::closestPointSignedDistance(const float3& r,const float& maxDistance, float3& lastPoint,
-	KDTriangle*& lastTriangle) const {
+	uint32_t& lastTriangle) const {
 	double d = closestPoint(r, maxDistance, lastPoint, lastTriangle);
 	if (d >= 0&&d!= NO_HIT_DISTANCE) {
-		float3 norm = lastTriangle->getNormal();
-		float3 center = lastTriangle->getCentroid();
+		KDTriangle tri = getTriangle(lastTriangle);
+		float3 norm = tri.getNormal();
+		float3 center = tri.getCentroid();
 		float3 diff = r - center;
 		return sign(dot(diff, norm)) * d;
 	}
@@ -1202,129 +1859,50 @@ double Intersector::closestPointSignedDistance(const float3& r,const float& maxD
 	}
 }
 double Intersector::closestPoint(const float3& pt, const float& maxDistance,
-		float3& lastPoint, KDTriangle*& lastTriangle) const {
-	if (root->getChildren().size() == 0)
-		throw new std::runtime_error("KD-Tree has not been initialized.");
-	double d;
-	double triangleDist = maxDistance;
-	std::priority_queue<KDBoxDistance,std::vector<KDBoxDistance>,CompareKDBox> queue;
-	queue.push(KDBoxDistance(pt, getRoot()));
-	lastTriangle = nullptr;
-	lastPoint = NO_HIT_POINT;
-	float3 lastIntersect = NO_HIT_POINT;
-	while (queue.size() > 0) {
-		KDBoxDistance boxd = queue.top();
-		queue.pop();
-		if (boxd.box->isLeaf) {
-			KDTriangle* tri = dynamic_cast<KDTriangle*>(boxd.box);
-			d = tri->distance(pt, lastIntersect);
-			if (d <= triangleDist) {
-				triangleDist = d;
-				lastTriangle = tri;
-				lastPoint = lastIntersect;
-			}
-		} else {
-			for (KDBox* child : boxd.box->getChildren()) {
-				KDBoxDistance kdb(pt, child);
-				if (kdb.dist <= maxDistance) {
-					queue.push(kdb);
-				}
-			}
-		}
-	}
-	if (lastTriangle == nullptr) {
-		return NO_HIT_DISTANCE;
-	} else {
-		return triangleDist;
-	}
+		float3& lastPoint, uint32_t& lastTriangle) const {
+	IntersectorHit result;
+	closest(pt, maxDistance, nullptr, result);
+	return report(result, lastPoint, lastTriangle);
 }
 double Intersector::closestPoint(const float3& pt, float3& lastPoint,
-		KDTriangle*& lastTriangle) const {
-	if (root->getChildren().size() == 0)
-		throw new std::runtime_error("KD-Tree has not been initialized.");
-	double d;
-	double mind = 1E30;
-	double triangleDist = 1E30;
-	std::priority_queue<KDBoxDistance,std::vector<KDBoxDistance>,CompareKDBox> queue;
-	queue.push(KDBoxDistance(pt, getRoot()));
-	lastTriangle = nullptr;
-	lastPoint = NO_HIT_POINT;
-	float3 lastIntersect = NO_HIT_POINT;
-	while (queue.size() > 0) {
-		KDBoxDistance boxd = queue.top();
-		queue.pop();
-		if (boxd.dist <= mind || boxd.box->isLeaf) {
-			if (boxd.box->isLeaf) {
-				mind = boxd.dist;
-				KDTriangle* tri = dynamic_cast<KDTriangle*>(boxd.box);
-				d = tri->distance(pt, lastIntersect);
-				if (d < triangleDist) {
-					triangleDist = d;
-					lastTriangle = tri;
-					lastPoint = lastIntersect;
-				}
-			} else {
-				for (KDBox* child : boxd.box->getChildren()) {
-					KDBoxDistance kdb(pt, child);
-					queue.push(kdb);
-				}
-			}
-		}
-	}
-	if (lastTriangle == nullptr) {
-		return NO_HIT_DISTANCE;
-	} else {
-		return triangleDist;
-	}
+		uint32_t& lastTriangle) const {
+	IntersectorHit result;
+	closest(pt, NO_HIT_DISTANCE, nullptr, result);
+	return report(result, lastPoint, lastTriangle);
 }
-
 double Intersector::closestPointOutside(const float3& r, const float3& v,
-		float3& lastPoint, KDTriangle*& lastTriangle) const {
-	if (root->getChildren().size() == 0)
-		throw new std::runtime_error("KD-Tree has not been initialized.");
-
-	double d;
-	double mind = 1E30;
-	double triangleDist = 1E30;
-	std::priority_queue<KDBoxDistance,std::vector<KDBoxDistance>,CompareKDBox> queue;
-	queue.push(KDBoxDistance(r, getRoot()));
+		float3& lastPoint, uint32_t& lastTriangle) const {
+	IntersectorHit result;
+	closest(r, NO_HIT_DISTANCE, &v, result);
+	return report(result, lastPoint, lastTriangle);
+}
 
-	lastTriangle = nullptr;
-	lastPoint = NO_HIT_POINT;
-	float3 pt;
-	float3 testv;
-	float3 lastIntersect;
-	while (queue.size() > 0) {
-		KDBoxDistance boxd = queue.top();
-		queue.pop();
-		if (boxd.dist <= mind || boxd.box->isLeaf) {
-			if (boxd.box->isLeaf) {
-				mind = boxd.dist;
-				KDTriangle* tri = dynamic_cast<KDTriangle*>(boxd.box);
-				d = tri->distance(r, lastIntersect);
-				boxd.dist = d;
-				if (d < triangleDist) {
-					pt = lastIntersect;
-					testv = pt - r;
-					// Test if point is on one side of plane
-					if (dot(testv, v) >= 0) {
-						triangleDist = d;
-						lastTriangle = tri;
-						lastPoint = pt;
-					}
-				}
-			} else {
-				for (KDBox* child : boxd.box->getChildren()) {
-					queue.push(KDBoxDistance(pt, child));
-				}
-			}
+void Intersector::intersectRays(const float3* origins,
+		const float3* directions, size_t count, IntersectorHit* hits,
+		bool coherent) const {
+	if (nodes.size() == 0)
+		throw std::runtime_error("KD-Tree has not been initialized.");
+	int start = 0;
+	if (coherent) {
+		int packets = (int) (count / 4);
+#pragma omp parallel for schedule(dynamic, 16)
+		for (int i = 0; i < packets; i++) {
+			intersectPacket(origins + 4 * i, directions + 4 * i, hits + 4 * i);
 		}
+		start = 4 * packets;
 	}
-	if (lastTriangle == nullptr) {
-		return NO_HIT_DISTANCE;
-	} else {
-		return mind;
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = start; i < (int) count; i++) {
+		intersect(origins[i], directions[i], NO_HIT_DISTANCE, hits[i]);
+	}
+}
+void Intersector::closestPoints(const float3* points, size_t count,
+		IntersectorHit* hits, float maxDistance) const {
+	if (nodes.size() == 0)
+		throw std::runtime_error("KD-Tree has not been initialized.");
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int i = 0; i < (int) count; i++) {
+		closest(points[i], maxDistance, nullptr, hits[i]);
 	}
 }
-
 }
@@ -29,6 +29,13 @@
 #include <string.h>
 #include <stddef.h>
 #include <set>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <random>
+#include <thread>
+#include <functional>
 #include "AlloyPLY.h"
 #include "tiny_obj_loader.h"
 #ifndef ALY_WINDOWS
@@ -529,6 +536,9 @@ namespace aly {
 		triIndexes.clear();
 		textureMap.clear();
 		textureImage.clear();
+		vertexCorners = MeshNeighborTable();
+		dirtyCorners = true;
+		touchedVertexes.clear();
 		setDirty(true);
 	}
 	bool Mesh::save(const std::string& file) {
@@ -548,6 +558,9 @@ namespace aly {
 		else if (ext == "obj") {
 			WriteObjMeshToFile(file, mesh);
 		}
+		else if (ext == "amesh") {
+			WriteBinaryMeshToFile(file, mesh);
+		}
 		else
 			throw std::runtime_error(
 				MakeString() << "Could not write file " << file);
@@ -683,6 +696,252 @@ namespace aly {
 		}
 		out.close();
 	}
+	static const size_t PLY_CHUNK_BYTES = size_t(16) << 20;
+	//Buffered reader over the element data of a binary PLY file.
+	class PlyChunkReader {
+	private:
+		PLYReaderWriter& ply;
+		std::vector<char> buffer;
+		size_t first;
+		size_t last;
+		bool eof;
+	public:
+		PlyChunkReader(PLYReaderWriter& ply) :
+			ply(ply), first(0), last(0), eof(false) {
+		}
+		//Tops up the buffer if fewer than the given bytes remain and returns the bytes available.
+		size_t fill(size_t bytes) {
+			if (last - first < bytes && !eof) {
+				std::memmove(buffer.data(), buffer.data() + first, last - first);
+				last -= first;
+				first = 0;
+				if (buffer.size() < bytes)
+					buffer.resize(bytes);
+				size_t read = ply.readBytes(buffer.data() + last, buffer.size() - last);
+				eof = (read < buffer.size() - last);
+				last += read;
+			}
+			return last - first;
+		}
+		const uint8_t* data() const {
+			return reinterpret_cast<const uint8_t*>(buffer.data()) + first;
+		}
+		void consume(size_t bytes) {
+			first += bytes;
+		}
+	};
+	//Decodes one face record into the mesh and returns its size, or 0 if it is not fully buffered.
+	static size_t ReadPlyFace(const uint8_t* record, size_t avail, bool texcoords,
+		Mesh& mesh) {
+		if (avail < 1)
+			return 0;
+		size_t n = record[0];
+		size_t size = 1 + 4 * n;
+		size_t m = 0;
+		if (texcoords) {
+			if (avail < size + 1)
+				return 0;
+			m = record[size];
+			size += 1 + 4 * m;
+		}
+		if (avail < size)
+			return 0;
+		uint32_t verts[4];
+		std::memcpy(verts, record + 1, 4 * std::min(n, (size_t)4));
+		if (n == 4) {
+			mesh.quadIndexes.data.push_back(uint4(verts[0], verts[1], verts[2], verts[3]));
+		}
+		else if (n == 3) {
+			mesh.triIndexes.data.push_back(uint3(verts[0], verts[1], verts[2]));
+		}
+		if (texcoords) {
+			const uint8_t* uvs = record + 2 + 4 * n;
+			for (size_t i = 0; i < n; i++) {
+				float2 uv(0.0f);
+				if (2 * i + 1 < m)
+					std::memcpy(&uv, uvs + 8 * i, sizeof(float2));
+				mesh.textureMap.data.push_back(uv);
+			}
+		}
+		return size;
+	}
+	/*
+	 * Reads the vertex and face elements of a binary little-endian PLY file
+	 * in large chunks, straight into the mesh buffers. Vertex records have a
+	 * fixed size and are decoded in parallel, as are runs of triangles.
+	 * Returns false without consuming any data if the layout is not the
+	 * usual float xyz[, nx ny nz][, uchar rgb] and uchar-count int face list.
+	 */
+	static bool ReadBinaryPlyElements(PLYReaderWriter& ply, Mesh& mesh,
+		bool hasNormals, bool hasColors, bool hasTexture) {
+		if (ply.getFileFormat() != FileFormat::BINARY_LE || !IsLittleEndian())
+			return false;
+		for (std::string name : ply.getElementNames()) {
+			if (name != "vertex" && name != "face")
+				return false;
+		}
+		PlyElement* vertexElem = ply.findElement("vertex");
+		PlyElement* faceElem = ply.findElement("face");
+		const char* vertexNames[9] = { "x", "y", "z", "nx", "ny", "nz", "red", "green", "blue" };
+		int vertexOffsets[9];
+		std::fill(vertexOffsets, vertexOffsets + 9, -1);
+		size_t vertexSize = 0;
+		for (const std::shared_ptr<PlyProperty>& prop : vertexElem->props) {
+			if (prop->is_list != SectionType::Scalar)
+				return false;
+			for (int c = 0; c < 9; c++) {
+				if (prop->name == vertexNames[c]) {
+					if (prop->external_type != ((c < 6) ? DataType::Float32 : DataType::Uint8))
+						return false;
+					vertexOffsets[c] = (int)vertexSize;
+				}
+			}
+			vertexSize += ply_type_size[(int)prop->external_type];
+		}
+		auto isList = [](const PlyProperty& prop, const std::string& name, DataType type) {
+			return prop.name == name && prop.is_list == SectionType::List
+				&& prop.count_external == DataType::Uint8
+				&& (prop.external_type == type || (type == DataType::Int32
+					&& prop.external_type == DataType::Uint32));
+		};
+		const std::vector<std::shared_ptr<PlyProperty>>& faceProps = faceElem->props;
+		if (faceProps.size() != (hasTexture ? 2 : 1)
+			|| !isList(*faceProps[0], "vertex_indices", DataType::Int32)
+			|| (hasTexture && !isList(*faceProps[1], "texcoord", DataType::Float32)))
+			return false;
+
+		PlyChunkReader reader(ply);
+		for (std::string name : ply.getElementNames()) {
+			if (name == "vertex") {
+				int count = vertexElem->num;
+				mesh.vertexLocations.resize(count);
+				if (hasNormals)
+					mesh.vertexNormals.resize(count);
+				if (hasColors)
+					mesh.vertexColors.resize(count);
+				int batch = (int)std::max((size_t)1, PLY_CHUNK_BYTES / 2 / std::max(vertexSize, (size_t)1));
+				for (int start = 0; start < count; start += batch) {
+					int n = std::min(batch, count - start);
+					if (reader.fill(n * vertexSize) < n * vertexSize)
+						throw std::runtime_error("Unexpected end of PLY vertex data.");
+					const uint8_t* records = reader.data();
+#pragma omp parallel for
+					for (int k = 0; k < n; k++) {
+						const uint8_t* record = records + k * vertexSize;
+						float v[6];
+						for (int c = 0; c < (hasNormals ? 6 : 3); c++) {
+							std::memcpy(&v[c], record + vertexOffsets[c], sizeof(float));
+						}
+						mesh.vertexLocations.data[start + k] = float3(v[0], v[1], v[2]);
+						if (hasNormals)
+							mesh.vertexNormals.data[start + k] = float3(v[3], v[4], v[5]);
+						if (hasColors)
+							mesh.vertexColors.data[start + k] = float4(record[vertexOffsets[6]] / 255.0f,
+								record[vertexOffsets[7]] / 255.0f, record[vertexOffsets[8]] / 255.0f, 1.0f);
+					}
+					reader.consume(n * vertexSize);
+				}
+			}
+			else {
+				size_t triSize = hasTexture ? 38 : 13;
+				int remaining = faceElem->num;
+				while (remaining > 0) {
+					//Small meshes get a small buffer, but always room for the largest record.
+					size_t avail = reader.fill(std::max((size_t)2048,
+						std::min(PLY_CHUNK_BYTES / 2, remaining * triSize)));
+					const uint8_t* records = reader.data();
+					int run = 0;
+					int maxRun = (int)std::min((size_t)remaining, avail / triSize);
+					while (run < maxRun && records[run * triSize] == 3
+						&& (!hasTexture || records[run * triSize + 13] == 6))
+						run++;
+					if (run >= 1024) {
+						size_t tris = mesh.triIndexes.size();
+						size_t uvs = mesh.textureMap.size();
+						mesh.triIndexes.data.resize(tris + run);
+						if (hasTexture)
+							mesh.textureMap.data.resize(uvs + 3 * (size_t)run);
+#pragma omp parallel for
+						for (int k = 0; k < run; k++) {
+							const uint8_t* record = records + k * triSize;
+							std::memcpy(&mesh.triIndexes.data[tris + k], record + 1, sizeof(uint3));
+							if (hasTexture)
+								std::memcpy(&mesh.textureMap.data[uvs + 3 * k], record + 14, 3 * sizeof(float2));
+						}
+						reader.consume(run * triSize);
+						remaining -= run;
+						continue;
+					}
+					//Mixed faces are decoded one at a time until the next run of triangles.
+					size_t pos = 0;
+					int decoded = 0;
+					while (decoded < remaining) {
+						if (decoded >= 1024 && avail - pos > 13 && records[pos] == 3)
+							break;
+						size_t size = ReadPlyFace(records + pos, avail - pos, hasTexture, mesh);
+						if (size == 0)
+							break;
+						pos += size;
+						decoded++;
+					}
+					if (decoded == 0)
+						throw std::runtime_error("Unexpected end of PLY face data.");
+					reader.consume(pos);
+					remaining -= decoded;
+				}
+			}
+		}
+		return true;
+	}
+	//Encodes fixed size records in parallel one chunk at a time and writes them out.
+	template<class F> void WritePlyRecords(PLYReaderWriter& ply, size_t count,
+		size_t recordSize, const F& encode) {
+		size_t batch = std::max((size_t)1, PLY_CHUNK_BYTES / recordSize);
+		std::vector<char> buffer(std::min(count, batch) * recordSize);
+		for (size_t start = 0; start < count; start += batch) {
+			int n = (int)std::min(batch, count - start);
+#pragma omp parallel for
+			for (int k = 0; k < n; k++) {
+				encode(start + k, &buffer[k * recordSize]);
+			}
+			ply.writeBytes(buffer.data(), n * recordSize);
+		}
+	}
+	/*
+	 * Writes the vertex and face elements of a binary little-endian PLY file
+	 * in the layout described by WritePlyMeshToFile, bypassing putElement.
+	 */
+	static void WriteBinaryPlyElements(PLYReaderWriter& ply, const Mesh& mesh,
+		const std::vector<unsigned char>& pointColors) {
+		bool hasNormals = (mesh.vertexNormals.size() > 0);
+		bool hasColors = (pointColors.size() > 0);
+		bool hasTexture = (mesh.textureMap.size() > 0);
+		size_t vertexSize = 12 + (hasNormals ? 12 : 0) + (hasColors ? 3 : 0);
+		WritePlyRecords(ply, mesh.vertexLocations.size(), vertexSize, [&](size_t i, char* record) {
+			std::memcpy(record, &mesh.vertexLocations.data[i], sizeof(float3));
+			if (hasNormals)
+				std::memcpy(record + 12, &mesh.vertexNormals.data[i], sizeof(float3));
+			if (hasColors)
+				std::memcpy(record + (hasNormals ? 24 : 12), &pointColors[3 * i], 3);
+		});
+		//Texture coordinates follow the same indexing as the element writer.
+		WritePlyRecords(ply, mesh.quadIndexes.size(), hasTexture ? 50 : 17, [&](size_t i, char* record) {
+			record[0] = 4;
+			std::memcpy(record + 1, &mesh.quadIndexes.data[i], sizeof(uint4));
+			if (hasTexture) {
+				record[17] = 8;
+				std::memcpy(record + 18, &mesh.textureMap.data[4 * i], 4 * sizeof(float2));
+			}
+		});
+		WritePlyRecords(ply, mesh.triIndexes.size(), hasTexture ? 38 : 13, [&](size_t i, char* record) {
+			record[0] = 3;
+			std::memcpy(record + 1, &mesh.triIndexes.data[i], sizeof(uint3));
+			if (hasTexture) {
+				record[13] = 6;
+				std::memcpy(record + 14, &mesh.textureMap.data[3 * i], 3 * sizeof(float2));
+			}
+		});
+	}
 	void WritePlyMeshToFile(const std::string& file, const Mesh& mesh, bool binary) {
 		std::vector<std::string> elemNames = { "vertex", "face" };
 		int i, j, idx;
@@ -755,6 +1014,10 @@ namespace aly {
 		ply.appendObjInfo("ImageSci");
 		// complete the header
 		ply.headerComplete();
+		if (binary && IsLittleEndian()) {
+			WriteBinaryPlyElements(ply, mesh, pointColors);
+			return;
+		}
 
 		// set up and write the vertex elements
 		plyVertex vert;
@@ -831,67 +1094,101 @@ namespace aly {
 			}
 		}
 	}
-	void Mesh::updateVertexNormals(int SMOOTH_ITERATIONS, float DOT_TOLERANCE) {
-		uint32_t sz = (uint32_t)triIndexes.size();
-		float3 pt;
-		vertexNormals.clear();
-		vertexNormals.resize(vertexLocations.size(), float3(0.0f));
-		for (uint32_t i = 0; i < sz; i++) {
-			uint3 verts = triIndexes[i];
-			float3 v1 = vertexLocations[verts.x];
-			float3 v2 = vertexLocations[verts.y];
-			float3 v3 = vertexLocations[verts.z];
-			float3 norm = cross((v3 - v1), (v2 - v1));
-			vertexNormals[verts.x] += norm;
-			vertexNormals[verts.y] += norm;
-			vertexNormals[verts.z] += norm;
-		}
-		sz = (uint32_t)quadIndexes.size();
-		for (uint32_t i = 0; i < sz; i++) {
-			uint4 verts = quadIndexes[i];
-			float3 v1 = vertexLocations[verts.x];
-			float3 v2 = vertexLocations[verts.y];
-			float3 v3 = vertexLocations[verts.z];
-			float3 v4 = vertexLocations[verts.w];
-
-			vertexNormals[verts.x] += cross((v4 - v1), (v2 - v1));
-			vertexNormals[verts.y] += cross((v1 - v2), (v3 - v2));
-			vertexNormals[verts.z] += cross((v2 - v3), (v4 - v3));
-			vertexNormals[verts.w] += cross((v3 - v4), (v1 - v4));
+	/*
+	 * Weights the cross product norm of corner edges e1 and e2. Every corner of
+	 * a triangle shares one cross product, so it is passed in.
+	 */
+	static inline float3 WeightCornerNormal(const float3& norm, const float3& e1,
+		const float3& e2, NormalWeighting weighting) {
+		if (weighting == NormalWeighting::Area)
+			return norm;
+		float len = length(norm);
+		if (len <= 0.0f)
+			return float3(0.0f);
+		if (weighting == NormalWeighting::Angle)
+			return norm * (std::atan2(len, dot(e1, e2)) / len);
+		return norm / len;
+	}
+	//Weighted normal of the corner at half-edge h, numbered as in MeshHalfEdges.
+	static inline float3 GetCornerNormal(const Mesh& mesh, uint32_t h,
+		NormalWeighting weighting) {
+		const Vector3f& pts = mesh.vertexLocations;
+		uint32_t T = (uint32_t)mesh.triIndexes.size();
+		if (h < 3 * T) {
+			const uint3& face = mesh.triIndexes.data[h / 3];
+			int k = h % 3;
+			float3 pt = pts.data[face[k]];
+			float3 norm = cross(pts.data[face.z] - pts.data[face.x],
+				pts.data[face.y] - pts.data[face.x]);
+			return WeightCornerNormal(norm, pts.data[face[(k + 2) % 3]] - pt,
+				pts.data[face[(k + 1) % 3]] - pt, weighting);
+		}
+		const uint4& face = mesh.quadIndexes.data[(h - 3 * T) / 4];
+		int k = (h - 3 * T) % 4;
+		float3 pt = pts.data[face[k]];
+		float3 e1 = pts.data[face[(k + 3) % 4]] - pt;
+		float3 e2 = pts.data[face[(k + 1) % 4]] - pt;
+		return WeightCornerNormal(cross(e1, e2), e1, e2, weighting);
+	}
+	void Mesh::updateVertexNormals(int SMOOTH_ITERATIONS, float DOT_TOLERANCE,
+		NormalWeighting weighting) {
+		int vertCount = (int)vertexLocations.size();
+		int T = (int)triIndexes.size();
+		int Q = (int)quadIndexes.size();
+		//Faces are public and may have been edited in place, so a full update always rebuilds the table.
+		CreateVertexCornerTable(*this, vertexCorners);
+		dirtyCorners = false;
+		touchedVertexes.clear();
+		//Corner normals are computed face by face, then gathered at each vertex.
+		Vector3f cornerNormals(3 * (size_t)T + 4 * (size_t)Q);
+		const Vector3f& pts = vertexLocations;
+#pragma omp parallel for
+		for (int f = 0; f < T; f++) {
+			const uint3& face = triIndexes.data[f];
+			float3 v1 = pts.data[face.x];
+			float3 v2 = pts.data[face.y];
+			float3 v3 = pts.data[face.z];
+			float3 norm = cross(v3 - v1, v2 - v1);
+			float3* corners = &cornerNormals.data[3 * (size_t)f];
+			corners[0] = WeightCornerNormal(norm, v3 - v1, v2 - v1, weighting);
+			corners[1] = WeightCornerNormal(norm, v1 - v2, v3 - v2, weighting);
+			corners[2] = WeightCornerNormal(norm, v2 - v3, v1 - v3, weighting);
 		}
 #pragma omp parallel for
-		for (int n = 0; n < (int)vertexNormals.size(); n++) {
-			vertexNormals[n] = normalize(vertexNormals[n]);
+		for (int f = 0; f < Q; f++) {
+			const uint4& face = quadIndexes.data[f];
+			float3* corners = &cornerNormals.data[3 * (size_t)T + 4 * (size_t)f];
+			for (int k = 0; k < 4; k++) {
+				float3 pt = pts.data[face[k]];
+				float3 e1 = pts.data[face[(k + 3) % 4]] - pt;
+				float3 e2 = pts.data[face[(k + 1) % 4]] - pt;
+				corners[k] = WeightCornerNormal(cross(e1, e2), e1, e2, weighting);
+			}
 		}
-		if (SMOOTH_ITERATIONS > 0) {
-			int vertCount = (int)vertexLocations.size();
-			std::vector<float3> tmp(vertCount);
-			std::vector<std::list<int>> vertNbrs(vertCount);
-			int indexCount = (int)quadIndexes.size();
-
-			for (int i = 0; i < indexCount; i++) {
-				uint4 verts = quadIndexes[i];
-				int v1 = verts.x;
-				int v2 = verts.y;
-				int v3 = verts.z;
-				int v4 = verts.w;
-
-				vertNbrs[v1].push_back(v2);
-				vertNbrs[v2].push_back(v3);
-				vertNbrs[v3].push_back(v1);
-
-				vertNbrs[v3].push_back(v4);
-				vertNbrs[v4].push_back(v1);
-				vertNbrs[v1].push_back(v3);
+		vertexNormals.resize(vertCount);
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int i = 0; i < vertCount; i++) {
+			float3 norm(0.0f);
+			for (const uint32_t* h = vertexCorners.begin(i); h != vertexCorners.end(i); h++) {
+				norm += cornerNormals.data[*h];
 			}
+			vertexNormals.data[i] = normalize(norm);
+		}
+		if (SMOOTH_ITERATIONS > 0) {
+			MeshNeighborTable vertNbrs;
+			CreateVertexNeighborTable(*this, vertNbrs);
+			Vector3f tmp(vertCount);
 			for (int iter = 0; iter < SMOOTH_ITERATIONS; iter++) {
-#pragma omp for
+#pragma omp parallel for
 				for (int i = 0; i < vertCount; i++) {
-					float3 norm = vertexNormals[i];
+					float3 norm = vertexNormals.data[i];
+					if (vertNbrs.getDegree(i) == 0) {
+						tmp.data[i] = norm;
+						continue;
+					}
 					float3 avg = float3(0.0f);
-					for (int nbr : vertNbrs[i]) {
-						float3 nnorm = vertexNormals[nbr];
-						;
+					for (const uint32_t* nbr = vertNbrs.begin(i); nbr != vertNbrs.end(i); nbr++) {
+						float3 nnorm = vertexNormals.data[*nbr];
 						if (dot(norm, nnorm) > DOT_TOLERANCE) {
 							avg += nnorm;
 						}
@@ -899,11 +1196,54 @@ namespace aly {
 							avg += norm;
 						}
 					}
-					tmp[i] = normalize(avg);
+					tmp.data[i] = normalize(avg);
+				}
+				vertexNormals.data.swap(tmp.data);
+			}
+		}
+		setDirty(true);
+	}
+	void Mesh::updateTouchedVertexNormals(NormalWeighting weighting) {
+		size_t V = vertexLocations.size();
+		size_t T = triIndexes.size();
+		//A full update is cheaper once a large part of the mesh moved.
+		if (dirtyCorners || vertexCorners.size() != V || vertexNormals.size() != V
+			|| vertexCorners.indexes.size() != 3 * T + 4 * quadIndexes.size()
+			|| 4 * touchedVertexes.size() > V) {
+			updateVertexNormals(0, 0.75f, weighting);
+			return;
+		}
+		//Normals change at touched vertices and at every vertex sharing a face with one.
+		std::vector<uint32_t> vertexes;
+		for (uint32_t v : touchedVertexes) {
+			if (v >= V)
+				throw std::runtime_error(
+					MakeString() << "Touched vertex " << v << " is out of range, mesh has "
+					<< V << " vertexes.");
+			for (const uint32_t* h = vertexCorners.begin(v); h != vertexCorners.end(v); h++) {
+				if (*h < 3 * T) {
+					const uint3& face = triIndexes.data[*h / 3];
+					vertexes.insert(vertexes.end(), { face.x, face.y, face.z });
+				}
+				else {
+					const uint4& face = quadIndexes.data[(*h - 3 * T) / 4];
+					vertexes.insert(vertexes.end(), { face.x, face.y, face.z, face.w });
 				}
-				vertexNormals = tmp;
 			}
 		}
+		touchedVertexes.clear();
+		std::sort(vertexes.begin(), vertexes.end());
+		vertexes.erase(std::unique(vertexes.begin(), vertexes.end()), vertexes.end());
+		int count = (int)vertexes.size();
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int i = 0; i < count; i++) {
+			uint32_t v = vertexes[i];
+			float3 norm(0.0f);
+			for (const uint32_t* h = vertexCorners.begin(v); h != vertexCorners.end(v); h++) {
+				norm += GetCornerNormal(*this, *h, weighting);
+			}
+			vertexNormals.data[v] = normalize(norm);
+		}
 		setDirty(true);
 	}
 	float Mesh::estimateVoxelSize(int stride) {
@@ -1189,8 +1529,159 @@ namespace aly {
 		}
 		mesh.updateBoundingBox();
 	}
+	static const char MESH_FILE_MAGIC[8] = { 'A', 'L', 'Y', 'M', 'E', 'S', 'H', '\0' };
+	static const uint32_t MESH_FILE_VERSION = 2;
+	static const uint32_t MESH_FILE_BYTE_ORDER = 0x01020304;
+	static const size_t MESH_BLOCK_SIZES[MESH_BLOCK_COUNT] = { sizeof(float3),
+		sizeof(float3), sizeof(float4), sizeof(uint4), sizeof(uint3), sizeof(float2) };
+	static std::atomic<bool> meshCacheEnabled(false);
+	void SetMeshCacheEnabled(bool enabled) {
+		meshCacheEnabled = enabled;
+	}
+	bool IsMeshCacheEnabled() {
+		return meshCacheEnabled;
+	}
+	//Temp file name that is unique across threads and processes, so concurrent loads of one source never share a temp file.
+	static std::string MakeMeshCacheTempFile(const std::string& cacheFile) {
+		static std::atomic<uint32_t> counter(0);
+		static const uint32_t session = std::random_device()();
+		return MakeString() << cacheFile << "." << std::hex << session << "."
+			<< std::hash<std::thread::id>()(std::this_thread::get_id()) << "." << counter++ << ".tmp";
+	}
+	static uint64_t AlignMeshBlock(uint64_t offset) {
+		return (offset + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+	}
+	static void WriteBinaryMeshToFile(const std::string& file, const Mesh& mesh,
+		uint64_t sourceSize, int64_t sourceTime) {
+		static_assert(sizeof(MeshFileHeader) == 128, "Mesh file header must be packed.");
+		MeshFileHeader header;
+		std::memset(&header, 0, sizeof(MeshFileHeader));
+		std::memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+		header.version = MESH_FILE_VERSION;
+		header.byteOrder = MESH_FILE_BYTE_ORDER;
+		header.sourceSize = sourceSize;
+		header.sourceTime = sourceTime;
+		const void* blocks[MESH_BLOCK_COUNT] = { mesh.vertexLocations.ptr(),
+			mesh.vertexNormals.ptr(), mesh.vertexColors.ptr(), mesh.quadIndexes.ptr(),
+			mesh.triIndexes.ptr(), mesh.textureMap.ptr() };
+		size_t counts[MESH_BLOCK_COUNT] = { mesh.vertexLocations.size(),
+			mesh.vertexNormals.size(), mesh.vertexColors.size(), mesh.quadIndexes.size(),
+			mesh.triIndexes.size(), mesh.textureMap.size() };
+		uint64_t offset = AlignMeshBlock(sizeof(MeshFileHeader));
+		for (int b = 0; b < MESH_BLOCK_COUNT; b++) {
+			header.counts[b] = counts[b];
+			header.offsets[b] = offset;
+			offset = AlignMeshBlock(offset + counts[b] * MESH_BLOCK_SIZES[b]);
+		}
+		FILE* f = fopen(file.c_str(), "wb");
+		if (f == nullptr)
+			throw std::runtime_error(MakeString() << "Could not open " << file << " for writing.");
+		const char padding[BUFFER_ALIGNMENT] = { 0 };
+		bool ok = (fwrite(&header, sizeof(MeshFileHeader), 1, f) == 1);
+		uint64_t position = sizeof(MeshFileHeader);
+		for (int b = 0; b < MESH_BLOCK_COUNT && ok; b++) {
+			ok = (fwrite(padding, 1, header.offsets[b] - position, f) == header.offsets[b] - position);
+			if (ok && counts[b] > 0)
+				ok = (fwrite(blocks[b], MESH_BLOCK_SIZES[b], counts[b], f) == counts[b]);
+			position = header.offsets[b] + counts[b] * MESH_BLOCK_SIZES[b];
+		}
+		ok &= (fclose(f) == 0);
+		if (!ok)
+			throw std::runtime_error(MakeString() << "Could not write " << file);
+	}
+	void WriteBinaryMeshToFile(const std::string& file, const Mesh& mesh) {
+		WriteBinaryMeshToFile(file, mesh, 0, 0);
+	}
+	MappedMesh::MappedMesh() :
+		vertexLocations(nullptr), vertexNormals(nullptr), vertexColors(nullptr),
+		quadIndexes(nullptr), triIndexes(nullptr), textureMap(nullptr) {
+		std::memset(&header, 0, sizeof(MeshFileHeader));
+	}
+	MappedMesh::MappedMesh(const std::string& file) :
+		MappedMesh() {
+		open(file);
+	}
+	void MappedMesh::open(const std::string& file) {
+		close();
+		std::shared_ptr<MappedFile> map(new MappedFile(file));
+		if (map->size() < sizeof(MeshFileHeader))
+			throw std::runtime_error(MakeString() << file << " is not a mesh file.");
+		std::memcpy(&header, map->data(), sizeof(MeshFileHeader));
+		if (std::memcmp(header.magic, MESH_FILE_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != MESH_FILE_VERSION) {
+			throw std::runtime_error(MakeString() << file << " is not a mesh file.");
+		}
+		if (header.byteOrder != MESH_FILE_BYTE_ORDER) {
+			throw std::runtime_error(MakeString() << "Cannot map mesh file " << file
+				<< " written with a different byte order.");
+		}
+		for (int b = 0; b < MESH_BLOCK_COUNT; b++) {
+			uint64_t offset = header.offsets[b];
+			if (offset % BUFFER_ALIGNMENT != 0 || offset > map->size()
+				|| header.counts[b] > (map->size() - offset) / MESH_BLOCK_SIZES[b]) {
+				throw std::runtime_error(MakeString() << "Mesh file " << file << " is truncated.");
+			}
+		}
+		mapping = map;
+		vertexLocations = getBlock<float3>(MeshBlock::VertexLocations);
+		vertexNormals = getBlock<float3>(MeshBlock::VertexNormals);
+		vertexColors = getBlock<float4>(MeshBlock::VertexColors);
+		quadIndexes = getBlock<uint4>(MeshBlock::QuadIndexes);
+		triIndexes = getBlock<uint3>(MeshBlock::TriIndexes);
+		textureMap = getBlock<float2>(MeshBlock::TextureMap);
+	}
+	void MappedMesh::close() {
+		mapping.reset();
+		std::memset(&header, 0, sizeof(MeshFileHeader));
+		vertexLocations = nullptr;
+		vertexNormals = nullptr;
+		vertexColors = nullptr;
+		quadIndexes = nullptr;
+		triIndexes = nullptr;
+		textureMap = nullptr;
+	}
+	void MappedMesh::copyTo(Mesh& mesh) const {
+		mesh.vertexLocations.data.assign(vertexLocations, vertexLocations + size(MeshBlock::VertexLocations));
+		mesh.vertexNormals.data.assign(vertexNormals, vertexNormals + size(MeshBlock::VertexNormals));
+		mesh.vertexColors.data.assign(vertexColors, vertexColors + size(MeshBlock::VertexColors));
+		mesh.quadIndexes.data.assign(quadIndexes, quadIndexes + size(MeshBlock::QuadIndexes));
+		mesh.triIndexes.data.assign(triIndexes, triIndexes + size(MeshBlock::TriIndexes));
+		mesh.textureMap.data.assign(textureMap, textureMap + size(MeshBlock::TextureMap));
+		mesh.textureImage.clear();
+		mesh.updateBoundingBox();
+		mesh.setDirty(true);
+	}
+	void ReadBinaryMeshFromFile(const std::string& file, Mesh& mesh) {
+		MappedMesh(file).copyTo(mesh);
+	}
 	void ReadMeshFromFile(const std::string& file, Mesh &mesh) {
+		mesh.touchFaces();
 		std::string ext = GetFileExtension(file);
+		if (ext == "amesh") {
+			ReadBinaryMeshFromFile(file, mesh);
+			return;
+		}
+		bool cache = IsMeshCacheEnabled() && (ext == "ply" || ext == "obj");
+		std::string cacheFile = file + ".amesh";
+		FileDescription source;
+		int64_t sourceTime = 0;
+		if (cache) {
+			source = GetFileDescription(file);
+			sourceTime = GetFileModifiedTimeNanos(file);
+			if (FileExists(cacheFile)) {
+				//A stale or unreadable cache is replaced below.
+				try {
+					MappedMesh mapped(cacheFile);
+					if (mapped.getHeader().sourceSize == source.fileSize
+						&& mapped.getHeader().sourceTime == sourceTime) {
+						mapped.copyTo(mesh);
+						return;
+					}
+				}
+				catch (const std::exception&) {
+				}
+			}
+		}
 		if (ext == "ply") {
 			ReadPlyMeshFromFile(file, mesh);
 		}
@@ -1200,6 +1691,19 @@ namespace aly {
 		else
 			throw std::runtime_error(
 				MakeString() << "Could not read file " << file);
+		if (cache && mesh.textureImage.size() == 0) {
+			//The cache is optional, so a read-only directory is not an error.
+			std::string tmpFile = MakeMeshCacheTempFile(cacheFile);
+			try {
+				WriteBinaryMeshToFile(tmpFile, mesh, source.fileSize, sourceTime);
+				std::remove(cacheFile.c_str());
+				if (std::rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+					std::remove(tmpFile.c_str());
+			}
+			catch (const std::exception&) {
+				std::remove(tmpFile.c_str());
+			}
+		}
 	}
 	void ReadPlyMeshFromFile(const std::string& file, Mesh &mesh) {
 		int i, j;
@@ -1283,8 +1787,9 @@ namespace aly {
 		std::vector<std::string> elist = ply.getElementNames();
 		std::string elemName;
 		int numElems, nprops;
-		// Okay, now we can grab the data
-		for (i = 0; i < ply.getNumberOfElements(); i++) {
+		// Common binary layouts are read in bulk, anything else element by element.
+		bool bulk = ReadBinaryPlyElements(ply, mesh, hasNormals, RGBPointsAvailable, hasTexture);
+		for (i = 0; !bulk && i < ply.getNumberOfElements(); i++) {
 			//get the description of the first element */
 			elemName = elist[i];
 			ply.getElementDescription(elemName, &numElems, &nprops);
@@ -1377,30 +1882,311 @@ namespace aly {
 		mesh.setDirty(true);
 	}
 
-	void CreateVertexNeighborTable(const Mesh& mesh,
-		std::vector<std::set<uint32_t>>& vertNbrs) {
-		vertNbrs.resize(mesh.vertexLocations.size());
-		for (const uint3& face : mesh.triIndexes.data) {
-			vertNbrs[face.x].insert(face.y);
-			vertNbrs[face.y].insert(face.z);
-			vertNbrs[face.z].insert(face.x);
-			vertNbrs[face.z].insert(face.y);
-			vertNbrs[face.y].insert(face.x);
-			vertNbrs[face.x].insert(face.z);
+	const uint32_t MeshHalfEdges::NONE;
+	/*
+	 * Parallel counting sort of value(i) for i in [0, count) into buckets
+	 * [0, bucketCount) by key(i), followed by a sort within each bucket.
+	 * Bucket b holds items[offsets[b]] through items[offsets[b+1]-1]. The
+	 * first pass scatters by the high bits of the key from fixed input
+	 * blocks, the second finishes each coarse bucket on its own thread, so
+	 * no atomics are needed and the result does not depend on scheduling.
+	 */
+	template<class T, class K, class F> void SortIntoBuckets(size_t bucketCount,
+		size_t count, const K& key, const F& value,
+		std::vector<uint32_t>& offsets, std::vector<T>& items) {
+		const int BLOCKS = 64;
+		const int COARSE = 256;
+		int B = (int)bucketCount;
+		int N = (int)count;
+		offsets.assign(bucketCount + 1, 0);
+		items.resize(count);
+		if (bucketCount == 0)
+			return;
+		int shift = 0;
+		while (((bucketCount - 1) >> shift) >= (size_t)COARSE)
+			shift++;
+		int blockSize = (N + BLOCKS - 1) / BLOCKS;
+		std::vector<uint32_t> blockOffsets(BLOCKS * COARSE + 1, 0);
+#pragma omp parallel for
+		for (int k = 0; k < BLOCKS; k++) {
+			uint32_t* counts = &blockOffsets[k * COARSE + 1];
+			for (int i = k * blockSize; i < std::min(N, (k + 1) * blockSize); i++) {
+				counts[key(i) >> shift]++;
+			}
+		}
+		//Coarse bucket major, block minor, which keeps the scatter stable.
+		std::vector<uint32_t> coarseOffsets(COARSE + 1, 0);
+		uint32_t sum = 0;
+		for (int c = 0; c < COARSE; c++) {
+			coarseOffsets[c] = sum;
+			for (int k = 0; k < BLOCKS; k++) {
+				uint32_t blockCount = blockOffsets[k * COARSE + c + 1];
+				blockOffsets[k * COARSE + c + 1] = sum;
+				sum += blockCount;
+			}
+		}
+		coarseOffsets[COARSE] = sum;
+		std::vector<uint32_t> coarseKeys(count);
+		std::vector<T> coarseValues(count);
+#pragma omp parallel for
+		for (int k = 0; k < BLOCKS; k++) {
+			uint32_t* cursors = &blockOffsets[k * COARSE + 1];
+			for (int i = k * blockSize; i < std::min(N, (k + 1) * blockSize); i++) {
+				uint32_t bucket = key(i);
+				uint32_t slot = cursors[bucket >> shift]++;
+				coarseKeys[slot] = bucket;
+				coarseValues[slot] = value(i);
+			}
+		}
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int c = 0; c < COARSE; c++) {
+			int first = c << shift;
+			int last = std::min(B, (c + 1) << shift);
+			if (first >= last)
+				continue;
+			for (uint32_t i = coarseOffsets[c]; i < coarseOffsets[c + 1]; i++) {
+				offsets[coarseKeys[i] + 1]++;
+			}
+			uint32_t start = coarseOffsets[c];
+			for (int b = first; b < last; b++) {
+				uint32_t bucketSize = offsets[b + 1];
+				offsets[b + 1] = start;
+				start += bucketSize;
+			}
+			for (uint32_t i = coarseOffsets[c]; i < coarseOffsets[c + 1]; i++) {
+				items[offsets[coarseKeys[i] + 1]++] = coarseValues[i];
+			}
+			for (int b = first; b < last; b++) {
+				std::sort(items.begin() + ((b == first) ? coarseOffsets[c] : offsets[b]),
+					items.begin() + offsets[b + 1]);
+			}
 		}
-		for (const uint4& face : mesh.quadIndexes.data) {
-			vertNbrs[face.x].insert(face.y);
-			vertNbrs[face.y].insert(face.z);
-			vertNbrs[face.z].insert(face.w);
-			vertNbrs[face.w].insert(face.x);
-			vertNbrs[face.w].insert(face.z);
-			vertNbrs[face.z].insert(face.y);
-			vertNbrs[face.y].insert(face.x);
-			vertNbrs[face.x].insert(face.w);
+	}
+	//Fills triangle count and origins, the corners of every face in order.
+	static void CreateHalfEdgeOrigins(const Mesh& mesh, MeshHalfEdges& halfEdges,
+		size_t limit) {
+		size_t T = mesh.triIndexes.size();
+		size_t Q = mesh.quadIndexes.size();
+		size_t H = 3 * T + 4 * Q;
+		if (H >= limit)
+			throw std::runtime_error(
+				MakeString() << "Mesh has too many faces for half-edges: "
+				<< T << " triangles and " << Q << " quads.");
+		halfEdges.triangleCount = (uint32_t)T;
+		halfEdges.origins.resize(H);
+#pragma omp parallel for
+		for (int f = 0; f < (int)T; f++) {
+			const uint3& face = mesh.triIndexes[f];
+			for (int k = 0; k < 3; k++) {
+				halfEdges.origins[3 * f + k] = face[k];
+			}
+		}
+#pragma omp parallel for
+		for (int f = 0; f < (int)Q; f++) {
+			const uint4& face = mesh.quadIndexes[f];
+			for (int k = 0; k < 4; k++) {
+				halfEdges.origins[3 * T + 4 * f + k] = face[k];
+			}
+		}
+	}
+	/*
+	 * Undirected edge of a mesh. Edges are numbered in (lower, upper) vertex
+	 * order. first and last are the lowest and highest half-edges on the
+	 * edge and count is the number of half-edges on it.
+	 */
+	struct MeshEdge {
+		uint32_t lower;
+		uint32_t upper;
+		uint32_t first;
+		uint32_t last;
+		uint32_t count;
+	};
+	//Groups half-edges into edges, optionally recording the edge of every half-edge.
+	static void CreateEdges(const MeshHalfEdges& halfEdges, size_t vertexCount,
+		std::vector<MeshEdge>& edges, std::vector<uint32_t>* halfEdgeEdges) {
+		size_t V = vertexCount;
+		std::vector<uint32_t> offsets;
+		std::vector<uint64_t> items;
+		SortIntoBuckets(V, halfEdges.size(), [&](int h) {
+			return std::min(halfEdges.getOrigin(h), halfEdges.getTarget(h));
+		}, [&](int h) {
+			uint64_t upper = std::max(halfEdges.getOrigin(h), halfEdges.getTarget(h));
+			return (upper << 32) | (uint64_t)h;
+		}, offsets, items);
+		std::vector<uint32_t> edgeOffsets(V + 1, 0);
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int v = 0; v < (int)V; v++) {
+			uint32_t count = 0;
+			for (uint32_t i = offsets[v]; i < offsets[v + 1]; i++) {
+				if (i == offsets[v] || (items[i] >> 32) != (items[i - 1] >> 32))
+					count++;
+			}
+			edgeOffsets[v + 1] = count;
+		}
+		for (size_t v = 0; v < V; v++) {
+			edgeOffsets[v + 1] += edgeOffsets[v];
+		}
+		edges.resize(edgeOffsets[V]);
+		if (halfEdgeEdges != nullptr)
+			halfEdgeEdges->resize(halfEdges.size());
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int v = 0; v < (int)V; v++) {
+			uint32_t e = edgeOffsets[v];
+			uint32_t end = offsets[v + 1];
+			for (uint32_t i = offsets[v]; i < end;) {
+				uint32_t j = i + 1;
+				while (j < end && (items[j] >> 32) == (items[i] >> 32)) {
+					j++;
+				}
+				MeshEdge& edge = edges[e];
+				edge.lower = v;
+				edge.upper = (uint32_t)(items[i] >> 32);
+				edge.first = (uint32_t)items[i];
+				edge.last = (uint32_t)items[j - 1];
+				edge.count = j - i;
+				if (halfEdgeEdges != nullptr) {
+					for (uint32_t k = i; k < j; k++) {
+						(*halfEdgeEdges)[(uint32_t)items[k]] = e;
+					}
+				}
+				e++;
+				i = j;
+			}
+		}
+	}
+	void CreateHalfEdges(const Mesh& mesh, MeshHalfEdges& halfEdges) {
+		const uint32_t NONE = MeshHalfEdges::NONE;
+		CreateHalfEdgeOrigins(mesh, halfEdges, std::numeric_limits<int>::max());
+		size_t V = mesh.vertexLocations.size();
+		int H = (int)halfEdges.size();
+		std::vector<MeshEdge> edges;
+		CreateEdges(halfEdges, V, edges, nullptr);
+		halfEdges.twins.assign(H, NONE);
+#pragma omp parallel for
+		for (int e = 0; e < (int)edges.size(); e++) {
+			const MeshEdge& edge = edges[e];
+			if (edge.count == 2
+				&& halfEdges.getFace(edge.first) != halfEdges.getFace(edge.last)) {
+				halfEdges.twins[edge.first] = edge.last;
+				halfEdges.twins[edge.last] = edge.first;
+			}
+		}
+		//Lowest outgoing half-edge per vertex, preferring boundary ones.
+		std::unique_ptr<std::atomic<uint64_t>[]> best(
+			new std::atomic<uint64_t>[V]);
+#pragma omp parallel for
+		for (int v = 0; v < (int)V; v++) {
+			best[v].store(std::numeric_limits<uint64_t>::max(),
+				std::memory_order_relaxed);
+		}
+#pragma omp parallel for
+		for (int h = 0; h < H; h++) {
+			uint64_t rank = ((uint64_t)(halfEdges.twins[h] != NONE) << 32) | h;
+			std::atomic<uint64_t>& current = best[halfEdges.origins[h]];
+			uint64_t value = current.load(std::memory_order_relaxed);
+			while (rank < value
+				&& !current.compare_exchange_weak(value, rank,
+					std::memory_order_relaxed)) {
+			}
+		}
+		halfEdges.vertexEdges.resize(V);
+#pragma omp parallel for
+		for (int v = 0; v < (int)V; v++) {
+			uint64_t value = best[v].load(std::memory_order_relaxed);
+			halfEdges.vertexEdges[v] = (value == std::numeric_limits<uint64_t>::max()) ?
+				NONE : (uint32_t)value;
+		}
+	}
+	void CreateVertexNeighborTable(const Mesh& mesh, MeshNeighborTable& vertNbrs) {
+		//Entry 2h lists the target of half-edge h under its origin, and 2h+1 the reverse.
+		MeshHalfEdges halfEdges;
+		CreateHalfEdgeOrigins(mesh, halfEdges, std::numeric_limits<int>::max() / 2);
+		size_t V = mesh.vertexLocations.size();
+		std::vector<uint32_t> offsets, items;
+		SortIntoBuckets(V, 2 * halfEdges.size(), [&](int e) {
+			return (e & 1) ? halfEdges.getTarget(e >> 1) : halfEdges.getOrigin(e >> 1);
+		}, [&](int e) {
+			return (e & 1) ? halfEdges.getOrigin(e >> 1) : halfEdges.getTarget(e >> 1);
+		}, offsets, items);
+		vertNbrs.offsets.resize(V + 1);
+		vertNbrs.offsets[0] = 0;
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int v = 0; v < (int)V; v++) {
+			uint32_t count = 0;
+			for (uint32_t i = offsets[v]; i < offsets[v + 1]; i++) {
+				if (i == offsets[v] || items[i] != items[i - 1])
+					count++;
+			}
+			vertNbrs.offsets[v + 1] = count;
+		}
+		for (size_t v = 0; v < V; v++) {
+			vertNbrs.offsets[v + 1] += vertNbrs.offsets[v];
+		}
+		vertNbrs.indexes.resize(vertNbrs.offsets[V]);
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int v = 0; v < (int)V; v++) {
+			uint32_t index = vertNbrs.offsets[v];
+			for (uint32_t i = offsets[v]; i < offsets[v + 1]; i++) {
+				if (i == offsets[v] || items[i] != items[i - 1])
+					vertNbrs.indexes[index++] = items[i];
+			}
+		}
+	}
+	void CreateVertexCornerTable(const Mesh& mesh, MeshNeighborTable& vertCorners) {
+		MeshHalfEdges halfEdges;
+		CreateHalfEdgeOrigins(mesh, halfEdges, std::numeric_limits<int>::max());
+		SortIntoBuckets(mesh.vertexLocations.size(), halfEdges.size(), [&](int h) {
+			return halfEdges.getOrigin(h);
+		}, [&](int h) {
+			return (uint32_t)h;
+		}, vertCorners.offsets, vertCorners.indexes);
+	}
+	void CreateFaceNeighborTable(const MeshHalfEdges& halfEdges,
+		MeshNeighborTable& faceNbrs) {
+		size_t T = halfEdges.triangleCount;
+		size_t F = (halfEdges.size() > 0) ?
+			halfEdges.getFace((uint32_t)halfEdges.size() - 1) + 1 : 0;
+		auto getBegin = [&](size_t f) {
+			return (uint32_t)((f < T) ? 3 * f : 3 * T + 4 * (f - T));
+		};
+		faceNbrs.offsets.resize(F + 1);
+		faceNbrs.offsets[0] = 0;
+#pragma omp parallel for
+		for (int f = 0; f < (int)F; f++) {
+			uint32_t count = 0;
+			for (uint32_t h = getBegin(f); h < getBegin(f + 1); h++) {
+				if (!halfEdges.isBoundary(h))
+					count++;
+			}
+			faceNbrs.offsets[f + 1] = count;
+		}
+		for (size_t f = 0; f < F; f++) {
+			faceNbrs.offsets[f + 1] += faceNbrs.offsets[f];
+		}
+		faceNbrs.indexes.resize(faceNbrs.offsets[F]);
+#pragma omp parallel for
+		for (int f = 0; f < (int)F; f++) {
+			uint32_t index = faceNbrs.offsets[f];
+			for (uint32_t h = getBegin(f); h < getBegin(f + 1); h++) {
+				if (!halfEdges.isBoundary(h))
+					faceNbrs.indexes[index++] = halfEdges.getFace(halfEdges.getTwin(h));
+			}
 		}
 	}
-	inline uint64_t faceHashCode(const uint2& val) {
-		return ((uint64_t)val.y) << 32 | ((uint64_t)val.x);
+	void CreateFaceNeighborTable(const Mesh& mesh, MeshNeighborTable& faceNbrs) {
+		MeshHalfEdges halfEdges;
+		CreateHalfEdges(mesh, halfEdges);
+		CreateFaceNeighborTable(halfEdges, faceNbrs);
+	}
+	void CreateVertexNeighborTable(const Mesh& mesh,
+		std::vector<std::set<uint32_t>>& vertNbrs) {
+		MeshNeighborTable table;
+		CreateVertexNeighborTable(mesh, table);
+		vertNbrs.resize(table.size());
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int v = 0; v < (int)table.size(); v++) {
+			vertNbrs[v] = std::set<uint32_t>(table.begin(v), table.end(v));
+		}
 	}
 	void CreateOrderedVertexNeighborTable(const Mesh& mesh,
 		std::vector<std::list<uint32_t>>& vertNbrsOut, bool leaveTail) {
@@ -1572,8 +2358,10 @@ namespace aly {
 				}
 			}
 		}
-		if (quadIndexes.size() > 0)
+		if (quadIndexes.size() > 0) {
 			setDirty(true);
+			touchFaces();
+		}
 		quadIndexes.clear();
 		if (vertexNormals.size() > 0) {
 			updateVertexNormals();
@@ -1581,442 +2369,267 @@ namespace aly {
 	}
 	void CreateFaceNeighborTable(const Mesh& mesh,
 		std::vector<std::list<uint32_t>>& faceNbrs) {
-		faceNbrs.resize(mesh.triIndexes.size() + mesh.quadIndexes.size());
-		std::map<uint64_t, std::list<uint>> edgeTable;
-		uint2 edge;
-		uint fid = 0;
-		for (const uint3& face : mesh.triIndexes.data) {
-			edge = (face.x < face.y) ?
-				uint2(face.x, face.y) : uint2(face.y, face.x);
-			edgeTable[faceHashCode(edge)].push_back(fid);
-			edge = (face.y < face.z) ?
-				uint2(face.y, face.z) : uint2(face.z, face.y);
-			edgeTable[faceHashCode(edge)].push_back(fid);
-			edge = (face.z < face.x) ?
-				uint2(face.z, face.x) : uint2(face.x, face.z);
-			edgeTable[faceHashCode(edge)].push_back(fid);
-			fid++;
-		}
-		for (const uint4& face : mesh.quadIndexes.data) {
-			edge = (face.x < face.y) ?
-				uint2(face.x, face.y) : uint2(face.y, face.x);
-			edgeTable[faceHashCode(edge)].push_back(fid);
-			edge = (face.y < face.z) ?
-				uint2(face.y, face.z) : uint2(face.z, face.y);
-			edgeTable[faceHashCode(edge)].push_back(fid);
-			edge = (face.z < face.w) ?
-				uint2(face.z, face.w) : uint2(face.w, face.z);
-			edgeTable[faceHashCode(edge)].push_back(fid);
-			edge = (face.w < face.x) ?
-				uint2(face.w, face.x) : uint2(face.x, face.w);
-			edgeTable[faceHashCode(edge)].push_back(fid);
-			fid++;
-		}
-		for (std::pair<const uint64_t, std::list<uint>>& edgeList : edgeTable) {
-			if (edgeList.second.size() == 2) {
-				uint fid1 = edgeList.second.front();
-				uint fid2 = edgeList.second.back();
-				if (fid1 != fid2) {
-					faceNbrs[fid1].push_back(fid2);
-					faceNbrs[fid2].push_back(fid1);
-				}
-			}
+		MeshNeighborTable table;
+		CreateFaceNeighborTable(mesh, table);
+		faceNbrs.resize(table.size());
+		for (size_t f = 0; f < table.size(); f++) {
+			faceNbrs[f].assign(table.begin(f), table.end(f));
 		}
 	}
-	struct FaceEdge {
-		std::list<uint> faces;
-		size_t edgePointIndex;
-	};
-	void SubdivideCatmullClark(Mesh& mesh) {
-		std::vector<std::list<uint32_t>> faceFaceNbrs;
-		faceFaceNbrs.resize(mesh.triIndexes.size() + mesh.quadIndexes.size());
-		std::map<uint64_t, FaceEdge> edgeTable;
-		std::set<uint2> edges;
+	//Incident edges of every vertex, in edge order.
+	static void CreateVertexEdgeTable(const std::vector<MeshEdge>& edges,
+		size_t vertexCount, MeshNeighborTable& table) {
+		SortIntoBuckets(vertexCount, 2 * edges.size(), [&](int i) {
+			return (i & 1) ? edges[i >> 1].upper : edges[i >> 1].lower;
+		}, [](int i) {
+			return (uint32_t)(i >> 1);
+		}, table.offsets, table.indexes);
+	}
+	/*
+	 * One level of Catmull-Clark. Face points are numbered after the old
+	 * vertexes and edge points after the face points, in edge order. Every
+	 * corner of every face becomes a quad, written at the index of the
+	 * corner's half-edge.
+	 */
+	static void SubdivideCatmullClark(Mesh& mesh) {
+		MeshHalfEdges halfEdges;
+		CreateHalfEdgeOrigins(mesh, halfEdges, std::numeric_limits<int>::max() / 2);
+		size_t V = mesh.vertexLocations.size();
+		size_t T = mesh.triIndexes.size();
+		size_t F = T + mesh.quadIndexes.size();
+		std::vector<MeshEdge> edges;
+		std::vector<uint32_t> halfEdgeEdges;
+		CreateEdges(halfEdges, V, edges, &halfEdgeEdges);
+		size_t E = edges.size();
+		if (V + F + E >= (size_t)std::numeric_limits<uint32_t>::max())
+			throw std::runtime_error(
+				MakeString() << "Subdivided mesh would have too many vertexes: "
+				<< V + F + E);
+		MeshNeighborTable vertexEdges, vertexFaces;
+		CreateVertexEdgeTable(edges, V, vertexEdges);
+		SortIntoBuckets(V, halfEdges.size(), [&](int h) {
+			return halfEdges.getOrigin(h);
+		}, [&](int h) {
+			return halfEdges.getFace(h);
+		}, vertexFaces.offsets, vertexFaces.indexes);
 		bool hasUVs = mesh.textureMap.size() > 0;
 		bool hasColor = mesh.vertexColors.size() > 0;
-		std::vector<std::pair<int, float3>> faceVerts(mesh.vertexLocations.size(), std::pair<int, float3>(0, float3(0.0f)));
-		std::vector<std::pair<int, float3>> edgeVerts(mesh.vertexLocations.size(), std::pair<int, float3>(0, float3(0.0f)));
-		uint2 edge;
-		uint fid = 0;
-		for (const uint3& face : mesh.triIndexes.data) {
-			edge = (face.x < face.y) ?
-				uint2(face.x, face.y) : uint2(face.y, face.x);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-
-			edge = (face.y < face.z) ?
-				uint2(face.y, face.z) : uint2(face.z, face.y);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-
-			edge = (face.z < face.x) ?
-				uint2(face.z, face.x) : uint2(face.x, face.z);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-			fid++;
-		}
-		for (const uint4& face : mesh.quadIndexes.data) {
-			edge = (face.x < face.y) ?
-				uint2(face.x, face.y) : uint2(face.y, face.x);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-
-			edge = (face.y < face.z) ?
-				uint2(face.y, face.z) : uint2(face.z, face.y);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-
-			edge = (face.z < face.w) ?
-				uint2(face.z, face.w) : uint2(face.w, face.z);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-
-			edge = (face.w < face.x) ?
-				uint2(face.w, face.x) : uint2(face.x, face.w);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-			fid++;
-		}
-		for (std::pair<const uint64_t, FaceEdge>& edgeList : edgeTable) {
-			if (edgeList.second.faces.size() == 2) {
-				uint fid1 = edgeList.second.faces.front();
-				uint fid2 = edgeList.second.faces.back();
-				if (fid1 != fid2) {
-					faceFaceNbrs[fid1].push_back(fid2);
-					faceFaceNbrs[fid2].push_back(fid1);
-				}
-			}
-		}
-		size_t backIndex = mesh.vertexLocations.size();
-		size_t endIndex = backIndex;
-		mesh.vertexLocations.resize(endIndex + mesh.quadIndexes.size() + mesh.triIndexes.size() + edges.size());
-		if (hasColor) {
-			mesh.vertexColors.resize(endIndex + mesh.quadIndexes.size() + mesh.triIndexes.size() + edges.size());
-		}
-		for (const uint3& face : mesh.triIndexes.data) {
-			float3 pt1 = mesh.vertexLocations[face.x];
-			float3 pt2 = mesh.vertexLocations[face.y];
-			float3 pt3 = mesh.vertexLocations[face.z];
-			float3 avg = 0.33333333f*(pt1 + pt2 + pt3);
-			for (int k = 0;k < 3;k++) {
-				std::pair<int, float3>& pr = faceVerts[face[k]];
-				pr.first++;
-				pr.second += avg;
-			}
-			if (hasColor) {
-				mesh.vertexColors[endIndex] = 0.3333333f*(mesh.vertexColors[face.x] + mesh.vertexColors[face.y] + mesh.vertexColors[face.z]);
-			}
-			mesh.vertexLocations[endIndex++] = avg;
-		}
-		for (const uint4& face : mesh.quadIndexes.data) {
-			float3 pt1 = mesh.vertexLocations[face.x];
-			float3 pt2 = mesh.vertexLocations[face.y];
-			float3 pt3 = mesh.vertexLocations[face.z];
-			float3 pt4 = mesh.vertexLocations[face.w];
-			float3 avg = 0.25f*(pt1 + pt2 + pt3 + pt4);
-			for (int k = 0;k < 4;k++) {
-				std::pair<int, float3>& pr = faceVerts[face[k]];
-				pr.first++;
-				pr.second += avg;
-			}
-			if (hasColor) {
-				mesh.vertexColors[endIndex] = 0.25f*(mesh.vertexColors[face.x] + mesh.vertexColors[face.y] + mesh.vertexColors[face.z]+mesh.vertexColors[face.w]);
-			}
-			mesh.vertexLocations[endIndex++] = avg;
-		}
-		for (uint2 edge : edges) {
-			float3 pt1 = mesh.vertexLocations[edge.x];
-			float3 pt2 = mesh.vertexLocations[edge.y];
-			FaceEdge& fe = edgeTable[faceHashCode(edge)];
-			fe.edgePointIndex = endIndex;
-			float3 avg;
-			if (fe.faces.size() < 2) {
-				avg = 0.5f*(pt1 + pt2);
-			}
-			else {
-				avg = 0.25f*(pt1 + pt2 + mesh.vertexLocations[fe.faces.front() + backIndex] + mesh.vertexLocations[fe.faces.back() + backIndex]);
-			}
-			for (int k = 0;k < 2;k++) {
-				std::pair<int, float3>& pr = edgeVerts[edge[k]];
-				pr.first++;
-				pr.second += avg;
-			}
-			if (hasColor) {
-				mesh.vertexColors[endIndex] = 0.5f*(mesh.vertexColors[edge.x] + mesh.vertexColors[edge.y]);
-			}
-			mesh.vertexLocations[endIndex++] = avg;
-
+		const Vector3f& points = mesh.vertexLocations;
+		const Vector4f& colors = mesh.vertexColors;
+		Vector3f newPoints(V + F + E);
+		Vector4f newColors(hasColor ? V + F + E : 0);
+		auto getFirstHalfEdge = [&](size_t f) {
+			return (uint32_t)((f < T) ? 3 * f : 3 * T + 4 * (f - T));
+		};
+#pragma omp parallel for
+		for (int f = 0; f < (int)F; f++) {
+			uint32_t h0 = getFirstHalfEdge(f);
+			uint32_t K = (f < (int)T) ? 3 : 4;
+			float3 sum(0.0f);
+			float4 color(0.0f);
+			for (uint32_t k = 0; k < K; k++) {
+				sum += points[halfEdges.getOrigin(h0 + k)];
+				if (hasColor)
+					color += colors[halfEdges.getOrigin(h0 + k)];
+			}
+			newPoints[V + f] = sum / (float)K;
+			if (hasColor)
+				newColors[V + f] = color / (float)K;
 		}
-		std::vector<uint4> newQuads(4 * mesh.quadIndexes.size() + 3 * mesh.triIndexes.size());
-		std::vector<float2> uvs(newQuads.size() * 4);
-		size_t faceIndex = 0;
-		size_t uvIndex = 0;
-		fid = 0;
-		endIndex = backIndex;
-		for (const uint3& face : mesh.triIndexes.data) {
-			edge = (face.x < face.y) ? uint2(face.x, face.y) : uint2(face.y, face.x);
-			size_t ept1 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			edge = (face.y < face.z) ? uint2(face.y, face.z) : uint2(face.z, face.y);
-			size_t ept2 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			edge = (face.z < face.x) ? uint2(face.z, face.x) : uint2(face.x, face.z);
-			size_t ept3 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			
+#pragma omp parallel for
+		for (int e = 0; e < (int)E; e++) {
+			const MeshEdge& edge = edges[e];
+			float3 pt1 = points[edge.lower];
+			float3 pt2 = points[edge.upper];
+			if (edge.count < 2) {
+				newPoints[V + F + e] = 0.5f * (pt1 + pt2);
+			} else {
+				newPoints[V + F + e] = 0.25f * (pt1 + pt2
+					+ newPoints[V + halfEdges.getFace(edge.first)]
+					+ newPoints[V + halfEdges.getFace(edge.last)]);
+			}
+			if (hasColor)
+				newColors[V + F + e] = 0.5f * (colors[edge.lower] + colors[edge.upper]);
+		}
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int v = 0; v < (int)V; v++) {
+			uint32_t fcount = vertexFaces.getDegree(v);
+			uint32_t ecount = vertexEdges.getDegree(v);
+			if (hasColor)
+				newColors[v] = colors[v];
+			if (fcount == 0 || ecount == 0) {
+				newPoints[v] = points[v];
+				continue;
+			}
+			float3 faceSum(0.0f), edgeSum(0.0f);
+			for (const uint32_t* f = vertexFaces.begin(v); f != vertexFaces.end(v); f++) {
+				faceSum += newPoints[V + *f];
+			}
+			for (const uint32_t* e = vertexEdges.begin(v); e != vertexEdges.end(v); e++) {
+				edgeSum += newPoints[V + F + *e];
+			}
+			float3 faceAvg = faceSum / (float)fcount;
+			float3 edgeAvg = edgeSum / (float)ecount;
+			newPoints[v] = (faceAvg + 2.0f * edgeAvg + (ecount - 3.0f) * points[v])
+				/ (float)ecount;
+		}
+		Vector4ui newQuads(halfEdges.size());
+		Vector2f newUVs(hasUVs ? 4 * halfEdges.size() : 0);
+#pragma omp parallel for
+		for (int f = 0; f < (int)F; f++) {
+			uint32_t h0 = getFirstHalfEdge(f);
+			uint32_t K = (f < (int)T) ? 3 : 4;
+			uint32_t facePoint = (uint32_t)(V + f);
+			float2 uvAvg(0.0f);
 			if (hasUVs) {
-				float2 uv1 = mesh.textureMap[fid];
-				float2 uv2 = mesh.textureMap[fid + 1];
-				float2 uv3 = mesh.textureMap[fid + 2];
-				float2 uva= 0.33333333f*(uv1 + uv2 + uv3);
-				float2  upt1 = 0.5f*(uv1 + uv2);
-				float2  upt2 = 0.5f*(uv2 + uv3);
-				float2  upt3 = 0.5f*(uv3 + uv1);
-
-				uvs[uvIndex++] = uv1;
-				uvs[uvIndex++] = upt1;
-				uvs[uvIndex++] = uva;
-				uvs[uvIndex++] = upt3;
-
-				uvs[uvIndex++] = uv2;
-				uvs[uvIndex++] = upt2;
-				uvs[uvIndex++] = uva;
-				uvs[uvIndex++] = upt1;
-
-				uvs[uvIndex++] = uv3;
-				uvs[uvIndex++] = upt3;
-				uvs[uvIndex++] = uva;
-				uvs[uvIndex++] = upt2;
-				fid += 3;
+				for (uint32_t k = 0; k < K; k++) {
+					uvAvg += mesh.textureMap[h0 + k];
+				}
+				uvAvg /= (float)K;
+			}
+			for (uint32_t k = 0; k < K; k++) {
+				uint32_t h = h0 + k;
+				uint32_t prev = h0 + (k + K - 1) % K;
+				uint32_t next = h0 + (k + 1) % K;
+				newQuads[h] = uint4(halfEdges.getOrigin(h),
+					(uint32_t)(V + F + halfEdgeEdges[h]), facePoint,
+					(uint32_t)(V + F + halfEdgeEdges[prev]));
+				if (hasUVs) {
+					float2 uv = mesh.textureMap[h];
+					newUVs[4 * h] = uv;
+					newUVs[4 * h + 1] = 0.5f * (uv + mesh.textureMap[next]);
+					newUVs[4 * h + 2] = uvAvg;
+					newUVs[4 * h + 3] = 0.5f * (mesh.textureMap[prev] + uv);
+				}
 			}
-			newQuads[faceIndex++] = uint4(face.x, (uint32_t)ept1, (uint32_t)endIndex, (uint32_t)ept3);
-			newQuads[faceIndex++] = uint4(face.y, (uint32_t)ept2, (uint32_t)endIndex, (uint32_t)ept1);
-			newQuads[faceIndex++] = uint4(face.z, (uint32_t)ept3, (uint32_t)endIndex, (uint32_t)ept2);
-			endIndex++;
-		}
-		for (const uint4& face : mesh.quadIndexes.data) {
-			edge = (face.x < face.y) ? uint2(face.x, face.y) : uint2(face.y, face.x);
-			size_t ept1 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			edge = (face.y < face.z) ? uint2(face.y, face.z) : uint2(face.z, face.y);
-			size_t ept2 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			edge = (face.z < face.w) ? uint2(face.z, face.w) : uint2(face.w, face.z);
-			size_t ept3 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			edge = (face.w < face.x) ? uint2(face.w, face.x) : uint2(face.x, face.w);
-			size_t ept4 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			if (hasUVs) {
-				float2 uv1 = mesh.textureMap[fid];
-				float2 uv2 = mesh.textureMap[fid + 1];
-				float2 uv3 = mesh.textureMap[fid + 2];
-				float2 uv4 = mesh.textureMap[fid + 3];
-				float2 uva = 0.25f*(uv1 + uv2 + uv3 + uv4);
-				float2  upt1 = 0.5f*(uv1 + uv2);
-				float2  upt2 = 0.5f*(uv2 + uv3);
-				float2  upt3 = 0.5f*(uv3 + uv4);
-				float2  upt4 = 0.5f*(uv4 + uv1);
-
-				uvs[uvIndex++] = uv1;
-				uvs[uvIndex++] = upt1;
-				uvs[uvIndex++] = uva;
-				uvs[uvIndex++] = upt4;
-
-				uvs[uvIndex++] = uv2;
-				uvs[uvIndex++] = upt2;
-				uvs[uvIndex++] = uva;
-				uvs[uvIndex++] = upt1;
-
-				uvs[uvIndex++] = uv3;
-				uvs[uvIndex++] = upt3;
-				uvs[uvIndex++] = uva;
-				uvs[uvIndex++] = upt2;
-
-				uvs[uvIndex++] = uv4;
-				uvs[uvIndex++] = upt4;
-				uvs[uvIndex++] = uva;
-				uvs[uvIndex++] = upt3;
-				fid+=4;
-			}
-			newQuads[faceIndex++] = uint4(face.x, (uint32_t)ept1, (uint32_t)endIndex, (uint32_t)ept4);
-			newQuads[faceIndex++] = uint4(face.y, (uint32_t)ept2, (uint32_t)endIndex, (uint32_t)ept1);
-			newQuads[faceIndex++] = uint4(face.z, (uint32_t)ept3, (uint32_t)endIndex, (uint32_t)ept2);
-			newQuads[faceIndex++] = uint4(face.w, (uint32_t)ept4, (uint32_t)endIndex, (uint32_t)ept3);
-			
-			endIndex++;
-		}
-		for (int n = 0;n < (int)faceVerts.size();n++) {
-			float3 P = mesh.vertexLocations[n];
-			int fcount = faceVerts[n].first;
-			int ecount = edgeVerts[n].first;
-
-			float3 F = faceVerts[n].second / (float)fcount;
-			float3 R = edgeVerts[n].second / (float)ecount;
-
-			mesh.vertexLocations[n] = (F + 2.0f*R + (ecount - 3.0f)*P) / (float)ecount;
 		}
-		if(hasUVs)mesh.textureMap = uvs;
-		mesh.quadIndexes = newQuads;
+		mesh.vertexLocations.data.swap(newPoints.data);
+		mesh.vertexColors.data.swap(newColors.data);
+		mesh.quadIndexes.data.swap(newQuads.data);
 		mesh.triIndexes.clear();
-		if(mesh.vertexNormals.size()>0)mesh.updateVertexNormals();
-		mesh.setDirty(true);
+		mesh.textureMap.data.swap(newUVs.data);
 	}
-	void SubdivideLoop(Mesh& mesh) {
-		mesh.convertQuadsToTriangles();
-		std::map<uint64_t, FaceEdge> edgeTable;
-		std::set<uint2> edges;
-		uint2 edge;
-		uint fid = 0;
+	/*
+	 * One level of Loop subdivision on triangles. Edge points are numbered
+	 * after the old vertexes, in edge order, and every triangle becomes four.
+	 */
+	static void SubdivideLoop(Mesh& mesh) {
+		if (mesh.quadIndexes.size() > 0)
+			mesh.convertQuadsToTriangles();
+		MeshHalfEdges halfEdges;
+		CreateHalfEdgeOrigins(mesh, halfEdges, std::numeric_limits<int>::max() / 2);
+		size_t V = mesh.vertexLocations.size();
+		size_t T = mesh.triIndexes.size();
+		std::vector<MeshEdge> edges;
+		std::vector<uint32_t> halfEdgeEdges;
+		CreateEdges(halfEdges, V, edges, &halfEdgeEdges);
+		size_t E = edges.size();
+		if (V + E >= (size_t)std::numeric_limits<uint32_t>::max())
+			throw std::runtime_error(
+				MakeString() << "Subdivided mesh would have too many vertexes: "
+				<< V + E);
+		MeshNeighborTable vertexEdges;
+		CreateVertexEdgeTable(edges, V, vertexEdges);
 		bool hasUVs = mesh.textureMap.size() > 0;
 		bool hasColor = mesh.vertexColors.size() > 0;
-		for (const uint3& face : mesh.triIndexes.data) {
-			edge = (face.x < face.y) ?
-				uint2(face.x, face.y) : uint2(face.y, face.x);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-
-			edge = (face.y < face.z) ?
-				uint2(face.y, face.z) : uint2(face.z, face.y);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-
-			edge = (face.z < face.x) ?
-				uint2(face.z, face.x) : uint2(face.x, face.z);
-			edges.insert(edge);
-			edgeTable[faceHashCode(edge)].faces.push_back(fid);
-			fid++;
-		}
-
-		size_t backIndex = mesh.vertexLocations.size();
-		size_t endIndex = backIndex;
-		mesh.vertexLocations.resize(endIndex + edges.size());
-		if(hasColor)mesh.vertexColors.resize(mesh.vertexLocations.size());
-		for (uint2 edge : edges) {
-			float3 pt1 = mesh.vertexLocations[edge.x];
-			float3 pt2 = mesh.vertexLocations[edge.y];
-			FaceEdge& fe = edgeTable[faceHashCode(edge)];
-			fe.edgePointIndex = endIndex;
-			float3 avg;
-			if (fe.faces.size() < 2) {
-				avg = 0.5f*(pt1 + pt2);
-			}
-			else {
-				uint3 face = mesh.triIndexes[fe.faces.front()];
-				int other1 = -1, other2 = -1;
-				if ((face.x == edge.x && face.y == edge.y) || (face.y == edge.x && face.x == edge.y)) {
-					other1 = face.z;
-				}
-				else 	if ((face.y == edge.x && face.z == edge.y) || (face.z == edge.x && face.y == edge.y)) {
-					other1 = face.x;
-				}
-				else if ((face.x == edge.x && face.z == edge.y) || (face.z == edge.x && face.x == edge.y)) {
-					other1 = face.y;
-				}
-				face = mesh.triIndexes[fe.faces.back()];
-				if ((face.x == edge.x && face.y == edge.y) || (face.y == edge.x && face.x == edge.y)) {
-					other2 = face.z;
-				}
-				else 	if ((face.y == edge.x && face.z == edge.y) || (face.z == edge.x && face.y == edge.y)) {
-					other2 = face.x;
-				}
-				else if ((face.x == edge.x && face.z == edge.y) || (face.z == edge.x && face.x == edge.y)) {
-					other2 = face.y;
-				}
-				if (other1 >= 0 && other2 >= 0) {
-					avg = 0.125f*(3.0f*pt1 + 3.0f*pt2 + mesh.vertexLocations[other1] + mesh.vertexLocations[other2]);
-				}
-				else {
-					avg = 0.5f*(pt1 + pt2);
-				}
-			}
-			if (hasColor) {
-				mesh.vertexColors[endIndex] = 0.5f*(mesh.vertexColors[edge.x] + mesh.vertexColors[edge.y]);
-			}
-			mesh.vertexLocations[endIndex++] = avg;
-		}
-		std::vector<uint3> newTris(4 * mesh.triIndexes.size());
-		size_t faceIndex = 0;
-		endIndex = backIndex;
-		fid = 0;
-		std::vector<float2> uvs(newTris.size() * 3);
-		size_t uvIndex = 0;
-		for (const uint3& face : mesh.triIndexes.data) {
-			edge = (face.x < face.y) ? uint2(face.x, face.y) : uint2(face.y, face.x);
-			size_t ept1 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			edge = (face.y < face.z) ? uint2(face.y, face.z) : uint2(face.z, face.y);
-			size_t ept2 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			edge = (face.z < face.x) ? uint2(face.z, face.x) : uint2(face.x, face.z);
-			size_t ept3 = edgeTable[faceHashCode(edge)].edgePointIndex;
-			if (hasUVs) {
-				float2 uv1 = mesh.textureMap[fid];
-				float2 uv2 = mesh.textureMap[fid + 1];
-				float2 uv3 = mesh.textureMap[fid + 2];
-				float2  upt1 = 0.5f*(uv1 + uv2);
-				float2  upt2 = 0.5f*(uv2 + uv3);
-				float2  upt3 = 0.5f*(uv3 + uv1);
-				uvs[uvIndex++] = uv1;
-				uvs[uvIndex++] = upt1;
-				uvs[uvIndex++] = upt3;
-
-				uvs[uvIndex++] = uv2;
-				uvs[uvIndex++] = upt2;
-				uvs[uvIndex++] = upt1;
-
-				uvs[uvIndex++] = uv3;
-				uvs[uvIndex++] = upt3;
-				uvs[uvIndex++] = upt2;
-
-				uvs[uvIndex++] = upt1;
-				uvs[uvIndex++] = upt2;
-				uvs[uvIndex++] = upt3;
-
-				fid += 3;
-			}
-			newTris[faceIndex++] = uint3(face.x, (uint32_t)ept1, (uint32_t)ept3);
-			newTris[faceIndex++] = uint3(face.y, (uint32_t)ept2, (uint32_t)ept1);
-			newTris[faceIndex++] = uint3(face.z, (uint32_t)ept3, (uint32_t)ept2);
-			newTris[faceIndex++] = uint3((uint32_t)ept1, (uint32_t)ept2, (uint32_t)ept3);
+		const Vector3f& points = mesh.vertexLocations;
+		const Vector4f& colors = mesh.vertexColors;
+		Vector3f newPoints(V + E);
+		Vector4f newColors(hasColor ? V + E : 0);
+#pragma omp parallel for
+		for (int e = 0; e < (int)E; e++) {
+			const MeshEdge& edge = edges[e];
+			float3 pt1 = points[edge.lower];
+			float3 pt2 = points[edge.upper];
+			if (edge.count < 2) {
+				newPoints[V + e] = 0.5f * (pt1 + pt2);
+			} else {
+				//Vertexes opposite the edge in the first and last faces.
+				float3 opposite1 = points[halfEdges.getOrigin(halfEdges.getPrev(edge.first))];
+				float3 opposite2 = points[halfEdges.getOrigin(halfEdges.getPrev(edge.last))];
+				newPoints[V + e] = 0.125f * (3.0f * pt1 + 3.0f * pt2 + opposite1 + opposite2);
+			}
+			if (hasColor)
+				newColors[V + e] = 0.5f * (colors[edge.lower] + colors[edge.upper]);
 		}
-		std::vector<std::set<uint32_t>> vertNbrs(mesh.vertexLocations.size());
-		for (const uint3& face : mesh.triIndexes.data) {
-			vertNbrs[face.x].insert(face.y);
-			vertNbrs[face.y].insert(face.z);
-			vertNbrs[face.z].insert(face.x);
-			vertNbrs[face.z].insert(face.y);
-			vertNbrs[face.y].insert(face.x);
-			vertNbrs[face.x].insert(face.z);
-		}
-		mesh.triIndexes = newTris;
 		const int MAX_VALENCE = 32;
-		static std::vector<float> valenceWeights;
-		if (valenceWeights.size() == 0) {
-			valenceWeights.resize(MAX_VALENCE);
-			for (int i = 1; i < MAX_VALENCE; i++)
-			{
-				float x = 3 / 8.0f + 0.25f * std::cos(2.0f * ALY_PI / i);
-				float beta = (5 / 8.0f - x * x) / i;
-				valenceWeights[i] = beta;
-			}
-		}
-
-		for (int n = 0;n < (int)backIndex;n++) {
-			int N = (int)vertNbrs[n].size();
-			if (N > 0 && N < MAX_VALENCE)
-			{
+		float valenceWeights[MAX_VALENCE] = { 0.0f };
+		for (int i = 1; i < MAX_VALENCE; i++) {
+			float x = 3 / 8.0f + 0.25f * std::cos(2.0f * ALY_PI / i);
+			valenceWeights[i] = (5 / 8.0f - x * x) / i;
+		}
+		//Reads only the old positions, so the result does not depend on vertex order.
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (int v = 0; v < (int)V; v++) {
+			int N = (int)vertexEdges.getDegree(v);
+			if (hasColor)
+				newColors[v] = colors[v];
+			if (N > 0 && N < MAX_VALENCE) {
 				float beta = valenceWeights[N];
 				float alpha = (1 - N * beta);
-				float3 pt = alpha * mesh.vertexLocations[n];
-				for (uint32_t nbr : vertNbrs[n])
-				{
-					pt += beta * mesh.vertexLocations[nbr];
+				float3 pt = alpha * points[v];
+				for (const uint32_t* e = vertexEdges.begin(v); e != vertexEdges.end(v); e++) {
+					const MeshEdge& edge = edges[*e];
+					pt += beta * points[(edge.lower == (uint32_t)v) ? edge.upper : edge.lower];
 				}
-				mesh.vertexLocations[n] = pt;
+				newPoints[v] = pt;
+			} else {
+				newPoints[v] = points[v];
 			}
 		}
-		if(hasUVs)mesh.textureMap = uvs;
-		if(mesh.vertexNormals.size()>0)mesh.updateVertexNormals();
-		mesh.setDirty(true);
+		Vector3ui newTris(4 * T);
+		Vector2f newUVs(hasUVs ? 12 * T : 0);
+#pragma omp parallel for
+		for (int f = 0; f < (int)T; f++) {
+			const uint3& face = mesh.triIndexes[f];
+			uint32_t ept1 = (uint32_t)(V + halfEdgeEdges[3 * f]);
+			uint32_t ept2 = (uint32_t)(V + halfEdgeEdges[3 * f + 1]);
+			uint32_t ept3 = (uint32_t)(V + halfEdgeEdges[3 * f + 2]);
+			newTris[4 * f] = uint3(face.x, ept1, ept3);
+			newTris[4 * f + 1] = uint3(face.y, ept2, ept1);
+			newTris[4 * f + 2] = uint3(face.z, ept3, ept2);
+			newTris[4 * f + 3] = uint3(ept1, ept2, ept3);
+			if (hasUVs) {
+				float2 uv1 = mesh.textureMap[3 * f];
+				float2 uv2 = mesh.textureMap[3 * f + 1];
+				float2 uv3 = mesh.textureMap[3 * f + 2];
+				float2 upt1 = 0.5f * (uv1 + uv2);
+				float2 upt2 = 0.5f * (uv2 + uv3);
+				float2 upt3 = 0.5f * (uv3 + uv1);
+				float2* uvs = &newUVs[12 * f];
+				uvs[0] = uv1;
+				uvs[1] = upt1;
+				uvs[2] = upt3;
+				uvs[3] = uv2;
+				uvs[4] = upt2;
+				uvs[5] = upt1;
+				uvs[6] = uv3;
+				uvs[7] = upt3;
+				uvs[8] = upt2;
+				uvs[9] = upt1;
+				uvs[10] = upt2;
+				uvs[11] = upt3;
+			}
+		}
+		mesh.vertexLocations.data.swap(newPoints.data);
+		mesh.vertexColors.data.swap(newColors.data);
+		mesh.triIndexes.data.swap(newTris.data);
+		mesh.textureMap.data.swap(newUVs.data);
 	}
-	void Subdivide(Mesh& mesh, SubDivisionScheme type) {
-		if (type == SubDivisionScheme::CatmullClark) {
-			SubdivideCatmullClark(mesh);
-		}
-		else if (type == SubDivisionScheme::Loop) {
-			SubdivideLoop(mesh);
+	void Subdivide(Mesh& mesh, SubDivisionScheme type, int levels) {
+		//Normals are only needed for the final mesh.
+		bool hasNormals = mesh.vertexNormals.size() > 0;
+		mesh.vertexNormals.clear();
+		for (int level = 0; level < levels; level++) {
+			if (type == SubDivisionScheme::CatmullClark) {
+				SubdivideCatmullClark(mesh);
+			}
+			else if (type == SubDivisionScheme::Loop) {
+				SubdivideLoop(mesh);
+			}
 		}
+		if (hasNormals)
+			mesh.updateVertexNormals();
+		mesh.setDirty(true);
 	}
 } /* namespace imagesci */
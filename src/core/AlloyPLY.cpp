@@ -80,6 +80,15 @@ void PLYReaderWriter::openForReading(const std::string& fileName) {
 	openForReading(fileName, &elemNames);
 	plyFile->elemNames = elemNames;
 }
+size_t PLYReaderWriter::readBytes(char* data, size_t bytes) {
+	in.read(data, bytes);
+	return (size_t) in.gcount();
+}
+void PLYReaderWriter::writeBytes(const char* data, size_t bytes) {
+	if (!out.write(data, bytes)) {
+		throw std::runtime_error("Could not write PLY element data.");
+	}
+}
 void PLYReaderWriter::openForWriting(const std::string& fileName,
 		const std::vector<std::string>& elem_names,
 		const FileFormat& file_type) {
@@ -19,4 +19,437 @@
  * THE SOFTWARE.
  */
 #include <AlloySparseSolve.h>
-
+#include <AlloyCommon.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+namespace aly {
+/*
+ * Minimum degree on the quotient graph. Eliminated pivots become elements
+ * and absorb the elements adjacent to them. Degrees use the approximate
+ * external degree bound of Amestoy, Davis and Duff, and elements that fall
+ * entirely inside the new pivot's element are absorbed aggressively.
+ * Indistinguishable variables are merged into supervariables and eliminated
+ * together. Dense-row detection is omitted; mesh matrices do not need it.
+ */
+std::vector<int> ApproximateMinimumDegreeOrdering(size_t N,
+		const size_t* rowOffsets, const uint32_t* columns) {
+	enum Status {
+		Variable = 0, Element = 1, Absorbed = 2
+	};
+	const int n = (int) N;
+	std::vector<std::vector<int>> vars(n), elems(n), elementVars(n), members(
+			n);
+	for (int i = 0; i < n; i++) {
+		for (size_t k = rowOffsets[i]; k < rowOffsets[i + 1]; k++) {
+			int j = (int) columns[k];
+			if (j != i) {
+				vars[i].push_back(j);
+				vars[j].push_back(i);
+			}
+		}
+	}
+	std::vector<int> status(n, Variable), weight(n, 1), degree(n), mark(n,
+			-1), w(n, -1), elementWeight(n, 0);
+	std::vector<int> head(n + 1, -1), next(n, -1), prev(n, -1);
+	std::vector<size_t> hash(n, 0);
+	auto insert = [&](int i) {
+		int d = degree[i];
+		next[i] = head[d];
+		prev[i] = -1;
+		if (head[d] >= 0)
+			prev[head[d]] = i;
+		head[d] = i;
+	};
+	auto remove = [&](int i) {
+		if (prev[i] >= 0)
+			next[prev[i]] = next[i];
+		else
+			head[degree[i]] = next[i];
+		if (next[i] >= 0)
+			prev[next[i]] = prev[i];
+	};
+	for (int i = 0; i < n; i++) {
+		std::sort(vars[i].begin(), vars[i].end());
+		vars[i].erase(std::unique(vars[i].begin(), vars[i].end()),
+				vars[i].end());
+		degree[i] = (int) vars[i].size();
+		insert(i);
+	}
+	std::vector<int> order;
+	order.reserve(n);
+	std::vector<int> Lp, touched;
+	std::vector<std::pair<size_t, int>> buckets;
+	int minDegree = 0;
+	int eliminated = 0;
+	int tag = 0;
+	while (eliminated < n) {
+		while (head[minDegree] < 0)
+			minDegree++;
+		int p = head[minDegree];
+		remove(p);
+		//Variables of the new element: neighbors of p and of its elements.
+		tag++;
+		mark[p] = tag;
+		Lp.clear();
+		int degreeLp = 0;
+		auto gather = [&](int i) {
+			if (status[i] == Variable && weight[i] > 0 && mark[i] != tag) {
+				mark[i] = tag;
+				Lp.push_back(i);
+				degreeLp += weight[i];
+			}
+		};
+		for (int e : elems[p]) {
+			if (status[e] != Element)
+				continue;
+			for (int i : elementVars[e])
+				gather(i);
+			status[e] = Absorbed;
+			std::vector<int>().swap(elementVars[e]);
+		}
+		for (int i : vars[p])
+			gather(i);
+		std::vector<int>().swap(vars[p]);
+		std::vector<int>().swap(elems[p]);
+		status[p] = Element;
+		elementVars[p] = Lp;
+		elementWeight[p] = degreeLp;
+		order.push_back(p);
+		order.insert(order.end(), members[p].begin(), members[p].end());
+		std::vector<int>().swap(members[p]);
+		eliminated += weight[p];
+		for (int i : Lp)
+			remove(i);
+		//w[e] = |Le \ Lp| for every element adjacent to Lp.
+		touched.clear();
+		for (int i : Lp) {
+			for (int e : elems[i]) {
+				if (status[e] != Element)
+					continue;
+				if (w[e] < 0) {
+					w[e] = elementWeight[e];
+					touched.push_back(e);
+				}
+				w[e] -= weight[i];
+			}
+		}
+		for (int i : Lp) {
+			int d = degreeLp - weight[i];
+			size_t h = 0;
+			std::vector<int>& el = elems[i];
+			size_t count = 0;
+			for (int e : el) {
+				if (status[e] != Element)
+					continue;
+				if (w[e] == 0) {
+					status[e] = Absorbed;
+					std::vector<int>().swap(elementVars[e]);
+					continue;
+				}
+				d += w[e];
+				h += e;
+				el[count++] = e;
+			}
+			el.resize(count);
+			el.push_back(p);
+			h += p;
+			std::vector<int>& vl = vars[i];
+			count = 0;
+			for (int j : vl) {
+				if (status[j] != Variable || weight[j] == 0 || mark[j] == tag)
+					continue;
+				d += weight[j];
+				h += j;
+				vl[count++] = j;
+			}
+			vl.resize(count);
+			d = std::min(d, degree[i] + degreeLp - weight[i]);
+			degree[i] = std::max(0, std::min(d, n - eliminated - weight[i]));
+			hash[i] = h;
+		}
+		for (int e : touched)
+			w[e] = -1;
+		//Merge indistinguishable variables, found by hashing their adjacency.
+		buckets.clear();
+		for (int i : Lp)
+			buckets.push_back(std::make_pair(hash[i], i));
+		std::sort(buckets.begin(), buckets.end());
+		for (size_t a = 0; a < buckets.size(); a++) {
+			int i = buckets[a].second;
+			if (weight[i] == 0)
+				continue;
+			std::sort(elems[i].begin(), elems[i].end());
+			std::sort(vars[i].begin(), vars[i].end());
+			for (size_t b = a + 1;
+					b < buckets.size() && buckets[b].first == buckets[a].first;
+					b++) {
+				int j = buckets[b].second;
+				if (weight[j] == 0 || elems[j].size() != elems[i].size()
+						|| vars[j].size() != vars[i].size())
+					continue;
+				std::sort(elems[j].begin(), elems[j].end());
+				std::sort(vars[j].begin(), vars[j].end());
+				if (elems[j] != elems[i] || vars[j] != vars[i])
+					continue;
+				degree[i] = std::max(0, degree[i] - weight[j]);
+				weight[i] += weight[j];
+				weight[j] = 0;
+				members[i].push_back(j);
+				members[i].insert(members[i].end(), members[j].begin(),
+						members[j].end());
+				std::vector<int>().swap(members[j]);
+				std::vector<int>().swap(elems[j]);
+				std::vector<int>().swap(vars[j]);
+			}
+		}
+		for (int i : Lp) {
+			if (weight[i] > 0) {
+				insert(i);
+				minDegree = std::min(minDegree, degree[i]);
+			}
+		}
+	}
+	return order;
+}
+SparseCholesky::SparseCholesky(SparseOrdering ordering) :
+		N(0), ordering(ordering), factored(false) {
+}
+void SparseCholesky::checkPattern(size_t rows, const size_t* offsets,
+		const uint32_t* columns) const {
+	if (rows != N || patternOffsets.size() != N + 1
+			|| !std::equal(patternOffsets.begin(), patternOffsets.end(),
+					offsets)
+			|| !std::equal(patternColumns.begin(), patternColumns.end(),
+					columns))
+		throw std::runtime_error(
+				"Matrix pattern does not match the analyzed pattern. Call analyze() first.");
+}
+void SparseCholesky::analyzePattern(size_t n, const size_t* offsets,
+		const uint32_t* columns) {
+	N = n;
+	factored = false;
+	size_t nnz = offsets[N];
+	patternOffsets.assign(offsets, offsets + N + 1);
+	patternColumns.assign(columns, columns + nnz);
+	if (ordering == SparseOrdering::ApproximateMinimumDegree) {
+		perm = ApproximateMinimumDegreeOrdering(N, offsets, columns);
+	} else {
+		perm.resize(N);
+		for (size_t k = 0; k < N; k++)
+			perm[k] = (int) k;
+	}
+	inversePerm.resize(N);
+	for (size_t k = 0; k < N; k++)
+		inversePerm[perm[k]] = (int) k;
+	//Lower triangle of P*A*P' by column, and its upper triangle by column (the transpose).
+	std::vector<size_t> upperOffsets(N + 1, 0);
+	inputOffsets.assign(N + 1, 0);
+	for (size_t i = 0; i < N; i++) {
+		int pi = inversePerm[i];
+		for (size_t k = offsets[i]; k < offsets[i + 1]; k++) {
+			int pj = inversePerm[columns[k]];
+			if (pi >= pj)
+				inputOffsets[pj + 1]++;
+			if (pi < pj)
+				upperOffsets[pj + 1]++;
+		}
+	}
+	for (size_t j = 0; j < N; j++) {
+		inputOffsets[j + 1] += inputOffsets[j];
+		upperOffsets[j + 1] += upperOffsets[j];
+	}
+	inputRows.resize(inputOffsets[N]);
+	inputSources.resize(inputOffsets[N]);
+	std::vector<int> upperRows(upperOffsets[N]);
+	{
+		std::vector<size_t> fill(inputOffsets.begin(), inputOffsets.end() - 1);
+		std::vector<size_t> upperFill(upperOffsets.begin(),
+				upperOffsets.end() - 1);
+		for (size_t i = 0; i < N; i++) {
+			int pi = inversePerm[i];
+			for (size_t k = offsets[i]; k < offsets[i + 1]; k++) {
+				int pj = inversePerm[columns[k]];
+				if (pi >= pj) {
+					size_t pos = fill[pj]++;
+					inputRows[pos] = pi;
+					inputSources[pos] = k;
+				} else {
+					upperRows[upperFill[pj]++] = pi;
+				}
+			}
+		}
+	}
+	//Elimination tree, Liu's algorithm with path compression.
+	parent.assign(N, -1);
+	std::vector<int> ancestor(N, -1);
+	for (size_t k = 0; k < N; k++) {
+		for (size_t q = upperOffsets[k]; q < upperOffsets[k + 1]; q++) {
+			int i = upperRows[q];
+			while (i >= 0 && i < (int) k) {
+				int nexti = ancestor[i];
+				ancestor[i] = (int) k;
+				if (nexti < 0) {
+					parent[i] = (int) k;
+					break;
+				}
+				i = nexti;
+			}
+		}
+	}
+	//Row patterns of L are the row subtrees of the elimination tree.
+	std::vector<int> flag(N, -1);
+	columnOffsets.assign(N + 1, 0);
+	rowOffsets.assign(N + 1, 0);
+	for (size_t k = 0; k < N; k++) {
+		flag[k] = (int) k;
+		for (size_t q = upperOffsets[k]; q < upperOffsets[k + 1]; q++) {
+			for (int i = upperRows[q]; flag[i] != (int) k; i = parent[i]) {
+				flag[i] = (int) k;
+				columnOffsets[i + 1]++;
+				rowOffsets[k + 1]++;
+			}
+		}
+	}
+	for (size_t j = 0; j < N; j++) {
+		columnOffsets[j + 1] += columnOffsets[j];
+		rowOffsets[j + 1] += rowOffsets[j];
+	}
+	rowIndices.resize(columnOffsets[N]);
+	rowColumns.resize(rowOffsets[N]);
+	rowPositions.resize(rowOffsets[N]);
+	{
+		std::vector<size_t> fill(columnOffsets.begin(),
+				columnOffsets.end() - 1);
+		std::fill(flag.begin(), flag.end(), -1);
+		size_t r = 0;
+		for (size_t k = 0; k < N; k++) {
+			flag[k] = (int) k;
+			for (size_t q = upperOffsets[k]; q < upperOffsets[k + 1]; q++) {
+				for (int i = upperRows[q]; flag[i] != (int) k; i = parent[i]) {
+					flag[i] = (int) k;
+					size_t pos = fill[i]++;
+					rowIndices[pos] = (int) k;
+					rowColumns[r] = i;
+					rowPositions[r] = pos;
+					r++;
+				}
+			}
+		}
+	}
+	//Level schedule: a column's height exceeds that of all its descendants.
+	std::vector<int> height(N, 0);
+	int maxHeight = -1;
+	for (size_t j = 0; j < N; j++) {
+		if (parent[j] >= 0)
+			height[parent[j]] = std::max(height[parent[j]], height[j] + 1);
+		maxHeight = std::max(maxHeight, height[j]);
+	}
+	levelOffsets.assign(maxHeight + 2, 0);
+	for (size_t j = 0; j < N; j++)
+		levelOffsets[height[j] + 1]++;
+	for (int h = 0; h <= maxHeight; h++)
+		levelOffsets[h + 1] += levelOffsets[h];
+	levelColumns.resize(N);
+	{
+		std::vector<size_t> fill(levelOffsets.begin(), levelOffsets.end() - 1);
+		for (size_t j = 0; j < N; j++)
+			levelColumns[fill[height[j]]++] = (int) j;
+	}
+	values.assign(rowIndices.size(), 0.0);
+	diagonal.assign(N, 0.0);
+}
+bool SparseCholesky::factorValues(const double* input) {
+	factored = false;
+	std::atomic<bool> singular(false);
+	const int levels = (levelOffsets.size() > 0) ? (int) levelOffsets.size() - 1 : 0;
+	//One dense accumulator per thread for the whole factorization, kept zero between columns.
+#pragma omp parallel
+	{
+		std::vector<double> x(N, 0.0);
+		for (int l = 0; l < levels; l++) {
+			const int* level = &levelColumns[levelOffsets[l]];
+			const int count = (int) (levelOffsets[l + 1] - levelOffsets[l]);
+			//The implicit barrier at the end of each level orders it before the next.
+#pragma omp for schedule(dynamic, 16)
+			for (int t = 0; t < count; t++) {
+				const int j = level[t];
+				for (size_t q = inputOffsets[j]; q < inputOffsets[j + 1]; q++) {
+					x[inputRows[q]] += input[inputSources[q]];
+				}
+				//Left-looking update from every column k with L(j,k) != 0.
+				for (size_t r = rowOffsets[j]; r < rowOffsets[j + 1]; r++) {
+					const int k = rowColumns[r];
+					const size_t pos = rowPositions[r];
+					const double ljk = values[pos];
+					const double f = ljk * diagonal[k];
+					x[j] -= ljk * f;
+					for (size_t q = pos + 1; q < columnOffsets[k + 1]; q++) {
+						x[rowIndices[q]] -= values[q] * f;
+					}
+				}
+				const double d = x[j];
+				x[j] = 0.0;
+				if (d == 0.0 || !std::isfinite(d)) {
+					singular = true;
+				}
+				diagonal[j] = d;
+				for (size_t q = columnOffsets[j]; q < columnOffsets[j + 1]; q++) {
+					int i = rowIndices[q];
+					values[q] = x[i] / d;
+					x[i] = 0.0;
+				}
+			}
+		}
+	}
+	factored = !singular;
+	return factored;
+}
+void SparseCholesky::solvePermuted(double* x, int channels) const {
+	const size_t levels = (levelOffsets.size() > 0) ? levelOffsets.size() - 1 : 0;
+	//L*y = b, rows in increasing level.
+	for (size_t l = 0; l < levels; l++) {
+		const int* level = &levelColumns[levelOffsets[l]];
+		ParallelFor(levelOffsets[l + 1] - levelOffsets[l],
+				[&](size_t begin, size_t end) {
+					for (size_t t = begin; t < end; t++) {
+						const int j = level[t];
+						double* xj = x + (size_t) j * channels;
+						for (size_t r = rowOffsets[j]; r < rowOffsets[j + 1]; r++) {
+							const double ljk = values[rowPositions[r]];
+							const double* xk = x + (size_t) rowColumns[r] * channels;
+							for (int c = 0; c < channels; c++) {
+								xj[c] -= ljk * xk[c];
+							}
+						}
+					}
+				}, 64);
+	}
+	ParallelFor(N, [&](size_t begin, size_t end) {
+		for (size_t j = begin; j < end; j++) {
+			const double inv = 1.0 / diagonal[j];
+			for (int c = 0; c < channels; c++) {
+				x[j * channels + c] *= inv;
+			}
+		}
+	});
+	//L'*x = y, columns in decreasing level.
+	for (size_t l = levels; l > 0; l--) {
+		const int* level = &levelColumns[levelOffsets[l - 1]];
+		ParallelFor(levelOffsets[l] - levelOffsets[l - 1],
+				[&](size_t begin, size_t end) {
+					for (size_t t = begin; t < end; t++) {
+						const int j = level[t];
+						double* xj = x + (size_t) j * channels;
+						for (size_t q = columnOffsets[j]; q < columnOffsets[j + 1]; q++) {
+							const double lij = values[q];
+							const double* xi = x + (size_t) rowIndices[q] * channels;
+							for (int c = 0; c < channels; c++) {
+								xj[c] -= lij * xi[c];
+							}
+						}
+					}
+				}, 64);
+	}
+}
+}
@@ -134,5 +134,104 @@ void TimerTask::task() {
 	running = false;
 	requestCancel = false;
 }
+namespace {
+thread_local WorkerPool* currentPool = nullptr;
+thread_local size_t currentWorker = 0;
+}
+WorkerPool::WorkerPool(size_t threadCount) :
+		queued(0), pending(0), nextQueue(0), shutdown(false) {
+	if (threadCount == 0) {
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threadCount; i++) {
+		queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+	}
+	for (size_t i = 0; i < threadCount; i++) {
+		threads.push_back(std::thread(&WorkerPool::run, this, i));
+	}
+}
+void WorkerPool::submit(const std::function<void()>& task) {
+	size_t index = (currentPool == this) ?
+			currentWorker : (nextQueue++ % queues.size());
+	pending++;
+	{
+		std::lock_guard<std::mutex> lockQueue(queues[index]->lock);
+		queues[index]->tasks.push_back(task);
+		queued++;
+	}
+	std::lock_guard<std::mutex> lockWait(waitLock);
+	workAvailable.notify_one();
+}
+bool WorkerPool::pop(size_t index, std::function<void()>& task) {
+	TaskQueue& queue = *queues[index];
+	std::lock_guard<std::mutex> lockQueue(queue.lock);
+	if (queue.tasks.empty())
+		return false;
+	task = std::move(queue.tasks.back());
+	queue.tasks.pop_back();
+	queued--;
+	return true;
+}
+bool WorkerPool::steal(size_t index, std::function<void()>& task) {
+	for (size_t n = 1; n < queues.size(); n++) {
+		TaskQueue& queue = *queues[(index + n) % queues.size()];
+		std::lock_guard<std::mutex> lockQueue(queue.lock);
+		if (queue.tasks.empty())
+			continue;
+		task = std::move(queue.tasks.front());
+		queue.tasks.pop_front();
+		queued--;
+		return true;
+	}
+	return false;
+}
+void WorkerPool::run(size_t index) {
+	currentPool = this;
+	currentWorker = index;
+	while (true) {
+		std::function<void()> task;
+		if (pop(index, task) || steal(index, task)) {
+			try {
+				task();
+			} catch (...) {
+				std::lock_guard<std::mutex> lockWait(waitLock);
+				if (!error)
+					error = std::current_exception();
+			}
+			if (--pending == 0) {
+				std::lock_guard<std::mutex> lockWait(waitLock);
+				workDone.notify_all();
+			}
+			continue;
+		}
+		std::unique_lock<std::mutex> lockWait(waitLock);
+		if (shutdown)
+			break;
+		if (queued > 0)
+			continue;
+		workAvailable.wait(lockWait);
+	}
+}
+void WorkerPool::wait() {
+	std::unique_lock<std::mutex> lockWait(waitLock);
+	while (pending > 0) {
+		workDone.wait(lockWait);
+	}
+	if (error) {
+		std::exception_ptr e = error;
+		error = nullptr;
+		std::rethrow_exception(e);
+	}
+}
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lockWait(waitLock);
+		shutdown = true;
+		workAvailable.notify_all();
+	}
+	for (std::thread& t : threads) {
+		if (t.joinable())
+			t.join();
+	}
+}
 }
-
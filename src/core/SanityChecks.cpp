@@ -25,6 +25,7 @@
 #include "AlloySparseSolve.h"
 #include "AlloyMath.h"
 #include "AlloyImage.h"
+#include "AlloyVolume.h"
 #include "AlloyVector.h"
 #include "AlloyFileUtil.h"
 #include "AlloyUI.h"
@@ -35,12 +36,16 @@
 #include "AlloyDenseMatrix.h"
 #include "AlloyArray.h"
 #include "AlloySpline.h"
+#include "AlloyDataFlow.h"
 #include "cereal/archives/xml.hpp"
 #include "cereal/archives/json.hpp"
 #include "cereal/archives/binary.hpp"
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <cmath>
 #include <random>
+#include <chrono>
 #ifndef ALY_WINDOWS
 #pragma GCC diagnostic ignored "-Wunused-variable"
 #pragma GCC diagnostic ignored "-Wunused-but-set-variable"
@@ -238,20 +243,303 @@ namespace aly {
 					<< distance(pivot, samples[hitPair[k].first]) << std::endl;
 			}
 		}
-		return true;
+		bool ret = true;
+		{
+			int N = 100000;
+			const int K = 8;
+			const float radius = 0.02f;
+			Vector3f samples(N);
+			for (int n = 0; n < N; n++) {
+				samples[n] = float3(RandomUniform(0.0f, 1.0f),
+					RandomUniform(0.0f, 1.0f), RandomUniform(0.0f, 1.0f));
+			}
+			auto t0 = std::chrono::steady_clock::now();
+			PointIndex3f index(samples);
+			auto t1 = std::chrono::steady_clock::now();
+			std::vector<int> indexes;
+			std::vector<float> distances;
+			index.closest(samples, K, indexes, distances);
+			auto t2 = std::chrono::steady_clock::now();
+			std::cout << "[PointIndex3f] Build "
+				<< std::chrono::duration<double>(t1 - t0).count() << " sec, kNN "
+				<< N / std::chrono::duration<double>(t2 - t1).count()
+				<< " queries/sec" << std::endl;
+			std::vector<size_t> offsets;
+			std::vector<int> radiusIndexes;
+			std::vector<float> radiusDistances;
+			index.closest(samples, radius, offsets, radiusIndexes,
+				radiusDistances);
+			int errors = 0;
+			std::vector<float> bruteForce(N);
+			for (int q = 0; q < N; q += N / 100) {
+				int inside = 0;
+				for (int n = 0; n < N; n++) {
+					bruteForce[n] = distance(samples[q], samples[n]);
+					if (bruteForce[n] <= radius)
+						inside++;
+				}
+				std::nth_element(bruteForce.begin(), bruteForce.begin() + K - 1,
+					bruteForce.end());
+				if (std::abs(distances[q * K + K - 1] - bruteForce[K - 1]) > 1E-6f)
+					errors++;
+				if (distance(samples[q], samples[indexes[q * K]]) != 0.0f)
+					errors++;
+				if ((int)(offsets[q + 1] - offsets[q]) != inside)
+					errors++;
+			}
+			std::cout << "[PointIndex3f] Mismatches against brute force: "
+				<< errors << std::endl;
+			ret &= (errors == 0);
+
+			SpatialHash3f grid(radius + 0.005f, 0.005f);
+			grid.build(samples);
+			int rebuilds = 0;
+			for (int step = 0; step < 4; step++) {
+				for (int n = 0; n < N; n++) {
+					samples[n] += float3(RandomUniform(-1E-3f, 1E-3f),
+						RandomUniform(-1E-3f, 1E-3f), RandomUniform(-1E-3f, 1E-3f));
+				}
+				if (grid.update(samples))
+					rebuilds++;
+			}
+			index.build(samples);
+			index.closest(samples, radius, offsets, radiusIndexes,
+				radiusDistances);
+			std::vector<size_t> gridOffsets;
+			std::vector<int> gridIndexes;
+			std::vector<float> gridDistances;
+			auto t3 = std::chrono::steady_clock::now();
+			grid.neighbors(radius, gridOffsets, gridIndexes, gridDistances);
+			auto t4 = std::chrono::steady_clock::now();
+			errors = 0;
+			for (int n = 0; n < N; n++) {
+				if (offsets[n + 1] - offsets[n]
+					!= gridOffsets[n + 1] - gridOffsets[n] + 1)
+					errors++;
+			}
+			std::cout << "[SpatialHash3f] Neighbors "
+				<< N / std::chrono::duration<double>(t4 - t3).count()
+				<< " queries/sec, " << rebuilds << " rebuilds in 4 steps, "
+				<< errors << " mismatches against PointIndex3f" << std::endl;
+			ret &= (errors == 0);
+		}
+		return ret;
+	}
+	bool SANITY_CHECK_MESH_ADJACENCY() {
+		bool ret = true;
+		for (std::string file : { "models/monkey.obj", "models/armadillo.ply" }) {
+			Mesh mesh;
+			mesh.load(AlloyDefaultContext()->getFullPath(file));
+			auto t0 = std::chrono::steady_clock::now();
+			MeshNeighborTable vertTable;
+			CreateVertexNeighborTable(mesh, vertTable);
+			auto t1 = std::chrono::steady_clock::now();
+			MeshHalfEdges halfEdges;
+			CreateHalfEdges(mesh, halfEdges);
+			MeshNeighborTable faceTable;
+			CreateFaceNeighborTable(halfEdges, faceTable);
+			auto t2 = std::chrono::steady_clock::now();
+			int errors = 0;
+			//Every edge of every face appears in both endpoints' neighbor lists.
+			for (uint32_t h = 0; h < (uint32_t)halfEdges.size(); h++) {
+				uint32_t u = halfEdges.getOrigin(h), v = halfEdges.getTarget(h);
+				if (!std::binary_search(vertTable.begin(u), vertTable.end(u), v)
+						|| !std::binary_search(vertTable.begin(v), vertTable.end(v), u))
+					errors++;
+				if (halfEdges.getPrev(halfEdges.getNext(h)) != h)
+					errors++;
+				if (!halfEdges.isBoundary(h)) {
+					uint32_t t = halfEdges.getTwin(h);
+					if (halfEdges.getTwin(t) != h
+							|| std::min(u, v) != std::min(halfEdges.getOrigin(t), halfEdges.getTarget(t))
+							|| std::max(u, v) != std::max(halfEdges.getOrigin(t), halfEdges.getTarget(t)))
+						errors++;
+				}
+			}
+			for (size_t v = 0; v < halfEdges.vertexEdges.size(); v++) {
+				uint32_t h = halfEdges.vertexEdges[v];
+				if (h != MeshHalfEdges::NONE && halfEdges.getOrigin(h) != v)
+					errors++;
+			}
+			//Brute-force reference tables from an edge map, independent of the sort-based builders.
+			std::vector<std::vector<uint32_t>> faceEdges;
+			for (uint3 face : mesh.triIndexes.data)
+				faceEdges.push_back({ face.x, face.y, face.z });
+			for (uint4 face : mesh.quadIndexes.data)
+				faceEdges.push_back({ face.x, face.y, face.z, face.w });
+			std::map<std::pair<uint32_t, uint32_t>, std::vector<uint32_t>> edgeFaces;
+			std::vector<std::set<uint32_t>> vertRef(mesh.vertexLocations.size());
+			auto edgeKey = [&](uint32_t f, size_t k) {
+				uint32_t u = faceEdges[f][k], v = faceEdges[f][(k + 1) % faceEdges[f].size()];
+				return std::make_pair(std::min(u, v), std::max(u, v));
+			};
+			for (uint32_t f = 0; f < (uint32_t)faceEdges.size(); f++) {
+				for (size_t k = 0; k < faceEdges[f].size(); k++) {
+					std::pair<uint32_t, uint32_t> key = edgeKey(f, k);
+					edgeFaces[key].push_back(f);
+					vertRef[key.first].insert(key.second);
+					vertRef[key.second].insert(key.first);
+				}
+			}
+			for (size_t v = 0; v < vertRef.size(); v++) {
+				if (vertRef[v].size() != vertTable.getDegree(v)
+						|| !std::equal(vertRef[v].begin(), vertRef[v].end(), vertTable.begin(v)))
+					errors++;
+			}
+			//Faces sharing each edge with exactly one other face, in the face's edge order.
+			MeshListNeighborTable faceList;
+			CreateFaceNeighborTable(mesh, faceList);
+			if (faceTable.size() != faceEdges.size() || faceList.size() != faceEdges.size())
+				errors++;
+			for (uint32_t f = 0; f < (uint32_t)std::min(faceTable.size(), faceList.size()); f++) {
+				std::vector<uint32_t> expected;
+				for (size_t k = 0; k < faceEdges[f].size(); k++) {
+					const std::vector<uint32_t>& faces = edgeFaces[edgeKey(f, k)];
+					if (faces.size() == 2 && faces[0] != faces[1])
+						expected.push_back((faces[0] == f) ? faces[1] : faces[0]);
+				}
+				if (expected.size() != faceTable.getDegree(f) || expected.size() != faceList[f].size()
+						|| !std::equal(expected.begin(), expected.end(), faceTable.begin(f))
+						|| !std::equal(expected.begin(), expected.end(), faceList[f].begin()))
+					errors++;
+			}
+			std::cout << file << ": vertex table "
+					<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+					<< " ms, half-edges and face table "
+					<< std::chrono::duration<double, std::milli>(t2 - t1).count()
+					<< " ms, " << errors << " errors" << std::endl;
+			ret &= (errors == 0);
+		}
+		return ret;
+	}
+	bool SANITY_CHECK_VERTEX_NORMALS() {
+		bool ret = true;
+		for (std::string file : { "models/monkey.obj", "models/armadillo.ply" }) {
+			Mesh mesh;
+			mesh.load(AlloyDefaultContext()->getFullPath(file));
+			//Reference area weighted normals, scattered from each face.
+			Vector3f ref(mesh.vertexLocations.size());
+			for (uint3 face : mesh.triIndexes.data) {
+				float3 norm = cross(mesh.vertexLocations[face.z] - mesh.vertexLocations[face.x],
+						mesh.vertexLocations[face.y] - mesh.vertexLocations[face.x]);
+				for (int k = 0; k < 3; k++)
+					ref[face[k]] += norm;
+			}
+			for (uint4 face : mesh.quadIndexes.data) {
+				for (int k = 0; k < 4; k++) {
+					float3 pt = mesh.vertexLocations[face[k]];
+					ref[face[k]] += cross(mesh.vertexLocations[face[(k + 3) % 4]] - pt,
+							mesh.vertexLocations[face[(k + 1) % 4]] - pt);
+				}
+			}
+			int errors = 0;
+			auto t0 = std::chrono::steady_clock::now();
+			mesh.updateVertexNormals();
+			auto t1 = std::chrono::steady_clock::now();
+			for (size_t v = 0; v < ref.size(); v++) {
+				if (distance(normalize(ref[v]), mesh.vertexNormals[v]) > 1E-5f)
+					errors++;
+			}
+			for (NormalWeighting weighting : { NormalWeighting::Uniform, NormalWeighting::Angle }) {
+				mesh.updateVertexNormals(0, 0.75f, weighting);
+				for (size_t v = 0; v < ref.size(); v++) {
+					if (lengthSqr(ref[v]) > 0.0f && (std::abs(length(mesh.vertexNormals[v]) - 1.0f) > 1E-5f
+							|| dot(mesh.vertexNormals[v], normalize(ref[v])) < 0.0f))
+						errors++;
+				}
+			}
+			//Incremental update after moving every 100th vertex must match a full update.
+			mesh.updateVertexNormals(0, 0.75f, NormalWeighting::Angle);
+			Mesh full;
+			mesh.clone(full);
+			for (size_t v = 0; v < mesh.vertexLocations.size(); v += 100) {
+				float3 offset = 0.01f * float3((float) (v % 7), 1.0f, -(float) (v % 3));
+				mesh.vertexLocations[v] += offset;
+				full.vertexLocations[v] += offset;
+				mesh.touchVertex((uint32_t) v);
+			}
+			auto t2 = std::chrono::steady_clock::now();
+			mesh.updateTouchedVertexNormals(NormalWeighting::Angle);
+			auto t3 = std::chrono::steady_clock::now();
+			full.updateVertexNormals(0, 0.75f, NormalWeighting::Angle);
+			for (size_t v = 0; v < full.vertexNormals.size(); v++) {
+				if (distance(mesh.vertexNormals[v], full.vertexNormals[v]) > 1E-6f)
+					errors++;
+			}
+			//Editing faces in place keeps their count, so the stale corner table is only caught by touchFaces().
+			if (mesh.triIndexes.size() > 1) {
+				std::swap(mesh.triIndexes[0], mesh.triIndexes[1]);
+				std::swap(full.triIndexes[0], full.triIndexes[1]);
+				mesh.touchFaces();
+				mesh.touchVertex(mesh.triIndexes[0].x);
+				mesh.updateTouchedVertexNormals(NormalWeighting::Angle);
+				full.updateVertexNormals(0, 0.75f, NormalWeighting::Angle);
+				for (size_t v = 0; v < full.vertexNormals.size(); v++) {
+					if (distance(mesh.vertexNormals[v], full.vertexNormals[v]) > 1E-6f)
+						errors++;
+				}
+			}
+			std::cout << file << ": full update "
+					<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+					<< " ms, incremental update "
+					<< std::chrono::duration<double, std::milli>(t3 - t2).count()
+					<< " ms, " << errors << " errors" << std::endl;
+			ret &= (errors == 0);
+		}
+		return ret;
+	}
+	bool SANITY_CHECK_MESH_CACHE() {
+		Mesh mesh;
+		mesh.load(AlloyDefaultContext()->getFullPath("models/armadillo.ply"));
+		mesh.vertexColors.resize(mesh.vertexLocations.size(), float4(0.5f, 0.25f, 1.0f, 1.0f));
+		auto same = [](const Mesh& a, const Mesh& b) {
+			return a.vertexLocations.data == b.vertexLocations.data
+					&& a.vertexNormals.data == b.vertexNormals.data
+					&& a.vertexColors.data == b.vertexColors.data
+					&& a.quadIndexes.data == b.quadIndexes.data
+					&& a.triIndexes.data == b.triIndexes.data
+					&& a.textureMap.data == b.textureMap.data;
+		};
+		bool ret = true;
+		WriteMeshToFile("armadillo.amesh", mesh);
+		Mesh binary;
+		auto t0 = std::chrono::steady_clock::now();
+		ReadMeshFromFile("armadillo.amesh", binary);
+		auto t1 = std::chrono::steady_clock::now();
+		ret &= same(binary, mesh);
+		MappedMesh mapped("armadillo.amesh");
+		ret &= (mapped.size(MeshBlock::TriIndexes) == mesh.triIndexes.size()
+				&& mapped.triIndexes[0] == mesh.triIndexes[0]);
+		//Second load of the PLY file comes from the sidecar and matches the parsed mesh.
+		WritePlyMeshToFile("armadillo_cache.ply", mesh, true);
+		std::remove("armadillo_cache.ply.amesh");
+		bool enabled = IsMeshCacheEnabled();
+		SetMeshCacheEnabled(true);
+		Mesh parsed, cached;
+		auto t2 = std::chrono::steady_clock::now();
+		ReadMeshFromFile("armadillo_cache.ply", parsed);
+		auto t3 = std::chrono::steady_clock::now();
+		ReadMeshFromFile("armadillo_cache.ply", cached);
+		auto t4 = std::chrono::steady_clock::now();
+		SetMeshCacheEnabled(enabled);
+		ret &= FileExists("armadillo_cache.ply.amesh") && same(parsed, cached);
+		std::cout << "Mesh cache: binary read "
+				<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+				<< " ms, PLY parse "
+				<< std::chrono::duration<double, std::milli>(t3 - t2).count()
+				<< " ms, cached PLY read "
+				<< std::chrono::duration<double, std::milli>(t4 - t3).count()
+				<< " ms" << std::endl;
+		return ret;
 	}
 	bool SANITY_CHECK_SUBDIVIDE() {
 		Mesh mesh;
 		mesh.load(AlloyDefaultContext()->getFullPath("models/monkey.obj"));
-		Subdivide(mesh, SubDivisionScheme::CatmullClark);
-		Subdivide(mesh, SubDivisionScheme::CatmullClark);
-		Subdivide(mesh, SubDivisionScheme::CatmullClark);
+		Subdivide(mesh, SubDivisionScheme::CatmullClark, 3);
 		WriteMeshToFile("monkey_catmullclark.ply", mesh);
 
 		mesh.load(AlloyDefaultContext()->getFullPath("models/monkey.obj"));
-		Subdivide(mesh, SubDivisionScheme::Loop);
-		Subdivide(mesh, SubDivisionScheme::Loop);
-		Subdivide(mesh, SubDivisionScheme::Loop);
+		Subdivide(mesh, SubDivisionScheme::Loop, 3);
 		WriteMeshToFile("monkey_loop.ply", mesh);
 
 		mesh.load(AlloyDefaultContext()->getFullPath("models/monkey.obj"));
@@ -262,9 +550,7 @@ namespace aly {
 			pt = (pt - box.position) / box.dimensions;
 			mesh.vertexColors[n] = float4(pt, 1.0f);
 		}
-		Subdivide(mesh, SubDivisionScheme::CatmullClark);
-		Subdivide(mesh, SubDivisionScheme::CatmullClark);
-		Subdivide(mesh, SubDivisionScheme::CatmullClark);
+		Subdivide(mesh, SubDivisionScheme::CatmullClark, 3);
 		WriteMeshToFile("monkey_catmullclark_color.ply", mesh);
 
 		mesh.load(AlloyDefaultContext()->getFullPath("models/monkey.obj"));
@@ -274,9 +560,7 @@ namespace aly {
 			pt = (pt - box.position) / box.dimensions;
 			mesh.vertexColors[n] = float4(pt, 1.0f);
 		}
-		Subdivide(mesh, SubDivisionScheme::Loop);
-		Subdivide(mesh, SubDivisionScheme::Loop);
-		Subdivide(mesh, SubDivisionScheme::Loop);
+		Subdivide(mesh, SubDivisionScheme::Loop, 3);
 		WriteMeshToFile("monkey_loop_color.ply", mesh);
 
 		mesh.load(AlloyDefaultContext()->getFullPath("models/tanya.ply"));
@@ -288,7 +572,91 @@ namespace aly {
 		Subdivide(mesh, SubDivisionScheme::Loop);
 		WriteMeshToFile("tanya_loop.ply", mesh);
 
-		return true;
+		bool ret = true;
+		auto same = [](const Mesh& a, const Mesh& b) {
+			return a.vertexLocations.data == b.vertexLocations.data
+					&& a.vertexNormals.data == b.vertexNormals.data
+					&& a.vertexColors.data == b.vertexColors.data
+					&& a.quadIndexes.data == b.quadIndexes.data
+					&& a.triIndexes.data == b.triIndexes.data
+					&& a.textureMap.data == b.textureMap.data;
+		};
+		//Three levels at once must match three single-level calls.
+		for (SubDivisionScheme scheme : { SubDivisionScheme::CatmullClark, SubDivisionScheme::Loop }) {
+			Mesh multi, single;
+			multi.load(AlloyDefaultContext()->getFullPath("models/monkey.obj"));
+			multi.vertexColors.resize(multi.vertexLocations.size());
+			for (int n = 0; n < (int)multi.vertexLocations.size(); n++) {
+				multi.vertexColors[n] = float4((multi.vertexLocations[n] - box.position) / box.dimensions, 1.0f);
+			}
+			multi.clone(single);
+			Subdivide(multi, scheme, 3);
+			for (int level = 0; level < 3; level++) {
+				Subdivide(single, scheme, 1);
+			}
+			ret &= same(multi, single);
+		}
+		//Loop against a reference computed from the previous level's positions only.
+		{
+			Mesh prev, next;
+			prev.load(AlloyDefaultContext()->getFullPath("models/monkey.obj"));
+			prev.convertQuadsToTriangles();
+			prev.clone(next);
+			Subdivide(next, SubDivisionScheme::Loop);
+			const Vector3f& points = prev.vertexLocations;
+			std::vector<std::set<uint32_t>> nbrs(points.size());
+			std::map<std::pair<uint32_t, uint32_t>, std::vector<uint32_t>> opposites;
+			for (uint3 face : prev.triIndexes.data) {
+				for (int k = 0; k < 3; k++) {
+					uint32_t u = face[k], v = face[(k + 1) % 3];
+					nbrs[u].insert(v);
+					nbrs[v].insert(u);
+					opposites[std::make_pair(std::min(u, v), std::max(u, v))].push_back(face[(k + 2) % 3]);
+				}
+			}
+			int errors = 0;
+			for (size_t v = 0; v < points.size(); v++) {
+				float3 expected = points[v];
+				int N = (int)nbrs[v].size();
+				if (N > 0 && N < 32) {
+					float x = 3 / 8.0f + 0.25f * std::cos(2.0f * ALY_PI / N);
+					float beta = (5 / 8.0f - x * x) / N;
+					expected = (1 - N * beta) * points[v];
+					for (uint32_t u : nbrs[v])
+						expected += beta * points[u];
+				}
+				if (distance(expected, next.vertexLocations[v]) > 1E-5f)
+					errors++;
+			}
+			//Triangle 4f+k of the result starts at corner k and continues to the point on edge k.
+			for (size_t f = 0; f < prev.triIndexes.size(); f++) {
+				uint3 face = prev.triIndexes[f];
+				for (int k = 0; k < 3; k++) {
+					uint32_t u = face[k], v = face[(k + 1) % 3];
+					const std::vector<uint32_t>& opp = opposites[std::make_pair(std::min(u, v), std::max(u, v))];
+					float3 expected = 0.5f * (points[u] + points[v]);
+					if (opp.size() == 2)
+						expected = 0.375f * (points[u] + points[v]) + 0.125f * (points[opp[0]] + points[opp[1]]);
+					if (opp.size() <= 2 && distance(expected, next.vertexLocations[next.triIndexes[4 * f + k].y]) > 1E-5f)
+						errors++;
+				}
+			}
+			ret &= (errors == 0);
+		}
+		//Vertexes not used by any face keep their position.
+		for (SubDivisionScheme scheme : { SubDivisionScheme::CatmullClark, SubDivisionScheme::Loop }) {
+			Mesh isolated;
+			isolated.load(AlloyDefaultContext()->getFullPath("models/monkey.obj"));
+			uint32_t index = (uint32_t)isolated.vertexLocations.size();
+			isolated.vertexLocations.push_back(float3(2.0f, -1.0f, 0.5f));
+			isolated.vertexNormals.push_back(float3(0.0f, 0.0f, 1.0f));
+			Subdivide(isolated, scheme, 2);
+			ret &= (isolated.vertexLocations[index] == float3(2.0f, -1.0f, 0.5f));
+			for (float3 pt : isolated.vertexLocations.data) {
+				ret &= (std::isfinite(pt.x) && std::isfinite(pt.y) && std::isfinite(pt.z));
+			}
+		}
+		return ret;
 	}
 	bool SANITY_CHECK_DENSE_MATRIX() {
 		{
@@ -401,7 +769,74 @@ namespace aly {
 			std::cout << "X3=\n" << x3 << std::endl;
 			std::cout << "r3=\n" << A * x3 - b2 << std::endl;
 		}
-
+		{
+			const int N = 2000;
+			DenseMatrix1d A(N, N);
+			Vector1d b(N);
+			srand(1123437);
+			for (int i = 0; i < A.rows; i++) {
+				b[i] = double1((rand() % 1000) / 1000.0);
+				for (int j = 0; j < A.cols; j++) {
+					A[i][j] = double1((rand() % 1000) / 1000.0);
+				}
+			}
+			DenseMatrix1d AtA, AA;
+			Vector1d Atb;
+			auto t0 = std::chrono::steady_clock::now();
+			MultiplyTranspose(AtA, A);
+			MultiplyTranspose(Atb, A, b);
+			auto t1 = std::chrono::steady_clock::now();
+			AA = A * A;
+			auto t2 = std::chrono::steady_clock::now();
+			double err = 0.0;
+			for (int n = 0; n < 16; n++) {
+				int p = rand() % N, q = rand() % N;
+				double sum = 0.0, prod = 0.0, rhs = 0.0;
+				for (int i = 0; i < N; i++) {
+					sum += A[i][p].x * A[i][q].x;
+					prod += A[p][i].x * A[i][q].x;
+					rhs += A[i][p].x * b[i].x;
+				}
+				err = std::max(err, std::abs(sum - AtA[p][q].x));
+				err = std::max(err, std::abs(prod - AA[p][q].x));
+				err = std::max(err, std::abs(rhs - Atb[p].x));
+			}
+			std::cout << N << "x" << N << " normal equations "
+					<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+					<< " ms, product "
+					<< std::chrono::duration<double, std::milli>(t2 - t1).count()
+					<< " ms, max error " << err << std::endl;
+			if (err > 1E-8)
+				return false;
+		}
+		//Archives written with the old one-vector-per-row storage must still load.
+		{
+			DenseMatrix2f M(3, 4);
+			std::vector<std::vector<float2>> legacy(3, std::vector<float2>(4));
+			for (int i = 0; i < 3; i++) {
+				for (int j = 0; j < 4; j++) {
+					M[i][j] = legacy[i][j] = float2((float) i, (float) j);
+				}
+			}
+			std::stringstream legacyStream, stream;
+			{
+				cereal::BinaryOutputArchive archiver(legacyStream);
+				archiver(M.rows, M.cols, legacy);
+			}
+			{
+				cereal::BinaryOutputArchive archiver(stream);
+				archiver(M);
+			}
+			if (legacyStream.str() != stream.str())
+				return false;
+			DenseMatrix2f loaded;
+			{
+				cereal::BinaryInputArchive archiver(legacyStream);
+				archiver(loaded);
+			}
+			if (loaded.rows != 3 || loaded.cols != 4 || loaded[2][3] != float2(2.0f, 3.0f))
+				return false;
+		}
 		return true;
 	}
 	bool SANITY_CHECK_ALGO() {
@@ -412,10 +847,17 @@ namespace aly {
 		Vector4f x(A.cols);
 		Vector1f x1(A.cols);
 
+		std::vector<SparseTriplet<float, 1>> triplets;
 		for (int i = 0; i < (int)A.rows; i++) {
 			for (int jj = -2; jj <= 2; jj++) {
-				A.set(i, i + jj, float4(0.2f));
-				A1.set(i, i + jj, float1(0.2f));
+				int j = i + jj;
+				if (j < 0 || j >= (int)A.cols)
+					continue;
+				float w = (jj == 0) ? 1.0f : -0.2f;
+				A.set(i, j, float4(w));
+				A1.set(i, j, float1(w));
+				triplets.push_back(SparseTriplet<float, 1>(j, i, 0.5f * w));
+				triplets.push_back(SparseTriplet<float, 1>(j, i, 0.5f * w));
 			}
 			b[i] = float4((rand() % 1000) / 1000.0f);
 			b1[i] = float1((rand() % 1000) / 1000.0f);
@@ -424,16 +866,154 @@ namespace aly {
 		SolveCG(b1, A1, x1);
 		SolveVecBICGStab(b, A, x);
 		SolveBICGStab(b1, A1, x1);
+		CompressedSparseMatrix4f Ac(A);
+		CompressedSparseMatrix1f A1c(A1);
+		CompressedSparseMatrix1f A1t(A1.cols, A1.rows, triplets);
+		Vector4f y, yc;
+		Vector1f y1, yc1, yt1;
+		MultiplyVec(y, A, b);
+		MultiplyVec(yc, Ac, b);
+		Multiply(y1, A1, b1);
+		Multiply(yc1, A1c, b1);
+		MultiplyTranspose(yt1, A1t, b1);
+		if (Ac.size() != A1t.size() || lengthL1(y - yc) > 1E-4f
+				|| lengthL1(y1 - yc1) > 1E-4f
+				|| lengthL1(y1 - yt1) > 1E-4f) {
+			throw std::runtime_error("Compressed sparse product does not match.");
+		}
+		Vector4f xc(A.cols);
+		Vector1f xc1(A.cols);
+		x.set(float4(0.0f));
+		x1.set(float1(0.0f));
+		SolveVecCG(b, A, x);
+		SolveVecCG(b, Ac, xc);
+		SolveCG(b1, A1, x1);
+		SolveCG(b1, A1c, xc1);
+		if (lengthL1(x - xc) > 1E-3f
+				|| lengthL1(x1 - xc1) > 1E-3f) {
+			throw std::runtime_error("Compressed sparse solve does not match.");
+		}
 		std::ofstream os("matrix.json");
 		cereal::JSONOutputArchive archiver(os);
 		archiver(A);
 
 		return true;
 	}
+	bool SANITY_CHECK_PRECONDITIONER() {
+		Mesh mesh;
+		mesh.load(AlloyDefaultContext()->getFullPath("models/armadillo.ply"));
+		MeshNeighborTable vertTable;
+		CreateVertexNeighborTable(mesh, vertTable);
+		//Implicit smoothing system (I + s*L), with L the graph Laplacian of the mesh.
+		const float smoothness = 1000.0f;
+		size_t N = mesh.vertexLocations.size();
+		std::vector<SparseTriplet<float, 1>> triplets;
+		for (size_t i = 0; i < N; i++) {
+			for (const uint32_t* v = vertTable.begin(i); v != vertTable.end(i); v++) {
+				triplets.push_back(SparseTriplet<float, 1>(i, *v, -smoothness));
+			}
+			triplets.push_back(SparseTriplet<float, 1>(i, i,
+					1.0f + smoothness * vertTable.getDegree(i)));
+		}
+		CompressedSparseMatrix1f A(N, N, triplets);
+		Vector3f b(mesh.vertexLocations);
+		std::cout << "Mesh Laplacian " << N << " unknowns, " << A.size()
+				<< " non-zeros" << std::endl;
+		int baseline = 0;
+		bool ret = true;
+		for (int type = 0; type <= (int)PreconditionerType::AlgebraicMultigrid; type++) {
+			Vector3f x(N);
+			x.set(float3(0.0f));
+			int iterations = 0;
+			double error = 0.0;
+			auto monitor = [&](int iter, double err) {
+				iterations = iter;
+				error = err;
+				return true;
+			};
+			auto t0 = std::chrono::steady_clock::now();
+			std::shared_ptr<Preconditioner<float, 3>> M =
+					MakePreconditioner<float, 3>(A, (PreconditionerType)type);
+			auto t1 = std::chrono::steady_clock::now();
+			if (M.get() == nullptr) {
+				SolveCG(b, A, x, 5000, 1E-6f, monitor);
+				baseline = iterations;
+			} else {
+				SolvePCG(b, A, x, *M, 5000, 1E-6f, monitor);
+			}
+			auto t2 = std::chrono::steady_clock::now();
+			std::cout << "PCG " << (PreconditionerType)type << ": " << iterations
+					<< " iterations, error " << error << ", setup "
+					<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+					<< " ms, solve "
+					<< std::chrono::duration<double, std::milli>(t2 - t1).count()
+					<< " ms" << std::endl;
+			ret &= (error < 1E-6);
+			if (type >= (int)PreconditionerType::IncompleteCholesky)
+				ret &= (iterations < baseline);
+		}
+		return ret;
+	}
+	bool SANITY_CHECK_SPARSE_CHOLESKY() {
+		Mesh mesh;
+		mesh.load(AlloyDefaultContext()->getFullPath("models/armadillo.ply"));
+		MeshNeighborTable vertTable;
+		CreateVertexNeighborTable(mesh, vertTable);
+		size_t N = mesh.vertexLocations.size();
+		std::vector<SparseTriplet<double, 1>> triplets;
+		Vector3d b(N);
+		for (size_t i = 0; i < N; i++) {
+			for (const uint32_t* v = vertTable.begin(i); v != vertTable.end(i); v++) {
+				triplets.push_back(SparseTriplet<double, 1>(i, *v, -1.0));
+			}
+			triplets.push_back(SparseTriplet<double, 1>(i, i,
+					(double)vertTable.getDegree(i)));
+			b[i] = double3(mesh.vertexLocations[i]);
+		}
+		CompressedSparseMatrix1d L(N, N, triplets);
+		CompressedSparseMatrix1d A = L;
+		SparseCholesky solver;
+		auto t0 = std::chrono::steady_clock::now();
+		solver.analyze(A);
+		auto t1 = std::chrono::steady_clock::now();
+		std::cout << "Sparse Cholesky " << N << " unknowns, " << A.size()
+				<< " non-zeros, " << solver.getFactorNonZeros()
+				<< " in factor, " << solver.getLevelCount()
+				<< " tree levels, analyze "
+				<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+				<< " ms" << std::endl;
+		bool ret = true;
+		//Same pattern every time, as when the smoothing weight is changed interactively.
+		for (double smoothness : { 1.0, 10.0, 1000.0 }) {
+			for (size_t k = 0; k < A.values.size(); k++) {
+				A.values[k].x = smoothness * L.values[k].x;
+			}
+			for (size_t i = 0; i < N; i++) {
+				for (size_t k = A.rowOffsets[i]; k < A.rowOffsets[i + 1]; k++) {
+					if (A.columns[k] == i)
+						A.values[k].x += 1.0;
+				}
+			}
+			t0 = std::chrono::steady_clock::now();
+			ret &= solver.refactor(A);
+			t1 = std::chrono::steady_clock::now();
+			Vector3d x = solver.solve(b);
+			auto t2 = std::chrono::steady_clock::now();
+			Vector3d r = b - A * x;
+			double error = std::sqrt(lengthSqr(r) / lengthSqr(b));
+			std::cout << "Smoothness " << smoothness << ": refactor "
+					<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+					<< " ms, solve "
+					<< std::chrono::duration<double, std::milli>(t2 - t1).count()
+					<< " ms, relative residual " << error << std::endl;
+			ret &= (error < 1E-8);
+		}
+		return ret;
+	}
 	bool SANITY_CHECK_DISTANCE_FIELD() {
 		Mesh mesh;
 		mesh.load(AlloyDefaultContext()->getFullPath("models/monkey.ply"));
-		Intersector kdTree(mesh, 6);
+		Intersector kdTree(mesh);
 		box3f bbox = mesh.getBoundingBox();
 		float3 center = bbox.position + bbox.dimensions*0.5f;
 		float maxDim = 1.1f*aly::max(bbox.dimensions);
@@ -484,7 +1064,18 @@ namespace aly {
 	bool SANITY_CHECK_KDTREE() {
 		Mesh mesh;
 		mesh.load(AlloyDefaultContext()->getFullPath("models/monkey.ply"));
-		Intersector kdTree(mesh, 6);
+		for (int q = 0; q < 3; q++) {
+			auto t0 = std::chrono::steady_clock::now();
+			Intersector tree(mesh, INTERSECTOR_MAX_DEPTH, (IntersectorQuality) q);
+			auto t1 = std::chrono::steady_clock::now();
+			std::cout << "Intersector " << (IntersectorQuality) q << ": "
+					<< tree.getNodes().size() << " nodes, build "
+					<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+					<< " ms" << std::endl;
+		}
+		auto t0 = std::chrono::steady_clock::now();
+		Intersector kdTree(mesh);
+		auto t1 = std::chrono::steady_clock::now();
 		Camera camera;
 		camera.setNearFarPlanes(0.1f, 2.0f);
 		camera.setZoom(0.75f);
@@ -514,7 +1105,50 @@ namespace aly {
 				}
 			}
 		}
+		auto t2 = std::chrono::steady_clock::now();
+		std::cout << "Intersector: " << kdTree.getNodes().size()
+				<< " nodes, build "
+				<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+				<< " ms, "
+				<< rgba.width * rgba.height
+						/ std::chrono::duration<double>(t2 - t1).count()
+				<< " rays/sec" << std::endl;
 		rgba.writeToXML("depth.xml");
+		bool ret = true;
+		std::vector<float3> origins(rgba.width * rgba.height);
+		std::vector<float3> directions(rgba.width * rgba.height);
+		for (int j = 0; j < rgba.height; j++) {
+			for (int i = 0; i < rgba.width; i++) {
+				float3 pt1 = camera.transformImageToWorld(
+					float3((float)i, (float)j, 0.0f), rgba.width,
+					rgba.height);
+				float3 pt2 = camera.transformImageToWorld(
+					float3((float)i, (float)j, 1.0f), rgba.width,
+					rgba.height);
+				origins[i + j * rgba.width] = pt1;
+				directions[i + j * rgba.width] = normalize(pt2 - pt1);
+			}
+		}
+		std::vector<IntersectorHit> hits;
+		t1 = std::chrono::steady_clock::now();
+		kdTree.intersectRays(origins, directions, hits, true);
+		t2 = std::chrono::steady_clock::now();
+		std::cout << "Intersector batch: "
+				<< rgba.width * rgba.height
+						/ std::chrono::duration<double>(t2 - t1).count()
+				<< " rays/sec" << std::endl;
+		for (int j = 0; j < rgba.height; j++) {
+			for (int i = 0; i < rgba.width; i++) {
+				const IntersectorHit& hit = hits[i + j * rgba.width];
+				float d = rgba(i, j).w;
+				ret &= (hit.isHit()) ?
+						(std::abs(hit.distance - d) < 1E-4f) : (d == 0.0f);
+			}
+		}
+		kdTree.closestPoints(mesh.vertexLocations, hits);
+		for (const IntersectorHit& hit : hits) {
+			ret &= (hit.distance < 1E-5f);
+		}
 		box3f bbox = mesh.getBoundingBox();
 #pragma omp parallel for
 		for (int i = 0; i < rgba.width; i++) {
@@ -553,7 +1187,155 @@ namespace aly {
 			}
 		}
 		rgba.writeToXML("closest_clamped.xml");
-		return true;
+		float3 center = bbox.position + 0.5f * bbox.dimensions;
+		for (float3& pt : mesh.vertexLocations.data) {
+			float3 p = pt - center;
+			float angle = 2.0f * p.y / bbox.dimensions.y;
+			pt = center
+					+ float3(std::cos(angle) * p.x - std::sin(angle) * p.z, p.y,
+							std::sin(angle) * p.x + std::cos(angle) * p.z);
+		}
+		t1 = std::chrono::steady_clock::now();
+		int rebuilt = kdTree.refit(mesh);
+		t2 = std::chrono::steady_clock::now();
+		std::cout << "Intersector refit: "
+				<< std::chrono::duration<double, std::milli>(t2 - t1).count()
+				<< " ms, rebuilt " << rebuilt << " subtrees, degradation "
+				<< kdTree.getDegradation() << std::endl;
+		Intersector rebuiltTree(mesh);
+		std::vector<IntersectorHit> rebuiltHits;
+		kdTree.intersectRays(origins, directions, hits, true);
+		rebuiltTree.intersectRays(origins, directions, rebuiltHits, true);
+		for (size_t i = 0; i < hits.size(); i++) {
+			ret &= (hits[i].isHit() == rebuiltHits[i].isHit());
+			if (hits[i].isHit() && rebuiltHits[i].isHit())
+				ret &= std::abs(hits[i].distance - rebuiltHits[i].distance)
+						< 1E-4f;
+		}
+		//Brute force references over every triangle of a tree.
+		auto bruteForceRay = [](const Intersector& tree, const float3& org, const float3& dir) {
+			float best = NO_HIT_DISTANCE;
+			for (uint32_t t = 0; t < (uint32_t)tree.getTriangleCount(); t++) {
+				KDTriangle tri = tree.getTriangle(t);
+				float3 e1 = tri.getPoint(1) - tri.getPoint(0);
+				float3 e2 = tri.getPoint(2) - tri.getPoint(0);
+				float3 p = cross(dir, e2);
+				float det = dot(e1, p);
+				if (std::abs(det) < 1E-12f)
+					continue;
+				float3 q = org - tri.getPoint(0);
+				float u = dot(q, p) / det;
+				float3 r = cross(q, e1);
+				float v = dot(dir, r) / det;
+				float d = dot(e2, r) / det;
+				if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && d >= 0.0f)
+					best = std::min(best, d);
+			}
+			return best;
+		};
+		auto bruteForceClosest = [](const Intersector& tree, const float3& pt) {
+			double best = NO_HIT_DISTANCE;
+			for (uint32_t t = 0; t < (uint32_t)tree.getTriangleCount(); t++) {
+				float3 lastPoint;
+				best = std::min(best, tree.getTriangle(t).distance(pt, lastPoint));
+			}
+			return best;
+		};
+		std::mt19937 rng(1234);
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		{
+			//Closest points away from the surface, inside and around the bounding box.
+			std::vector<float3> points;
+			for (int i = 0; i < 500; i++) {
+				points.push_back(bbox.position
+						+ bbox.dimensions * float3(1.5f * uniform(rng) - 0.25f,
+							1.5f * uniform(rng) - 0.25f, 1.5f * uniform(rng) - 0.25f));
+			}
+			rebuiltTree.closestPoints(points, hits);
+			for (size_t i = 0; i < points.size(); i++) {
+				double d = bruteForceClosest(rebuiltTree, points[i]);
+				ret &= (hits[i].isHit() && std::abs(hits[i].distance - d) < 1E-4f * std::max(1.0, d));
+				ret &= (std::abs(distance(hits[i].point, points[i]) - hits[i].distance) < 1E-4f);
+			}
+		}
+		{
+			//Height field of 2 * 127 * 127 triangles, enough to be built and refit as several subtrees.
+			const int G = 128;
+			Mesh grid;
+			for (int j = 0; j < G; j++) {
+				for (int i = 0; i < G; i++) {
+					float x = i / (float)(G - 1), y = j / (float)(G - 1);
+					grid.vertexLocations.push_back(
+							float3(x, y, 0.1f * std::sin(6.0f * x) * std::cos(5.0f * y)));
+				}
+			}
+			for (int j = 0; j < G - 1; j++) {
+				for (int i = 0; i < G - 1; i++) {
+					uint32_t v = i + j * G;
+					grid.triIndexes.push_back(uint3(v, v + 1, v + G + 1));
+					grid.triIndexes.push_back(uint3(v, v + G + 1, v + G));
+				}
+			}
+			Intersector tree(grid);
+			std::vector<float3> rayOrigins, rayDirections, points;
+			for (int i = 0; i < 2000; i++) {
+				rayOrigins.push_back(float3(0.05f + 0.9f * uniform(rng), 0.05f + 0.9f * uniform(rng), 1.0f));
+				rayDirections.push_back(normalize(float3(0.1f * (uniform(rng) - 0.5f), 0.1f * (uniform(rng) - 0.5f), -1.0f)));
+				points.push_back(float3(1.2f * uniform(rng) - 0.1f, 1.2f * uniform(rng) - 0.1f, 0.6f * uniform(rng) - 0.3f));
+			}
+			//Checks the tree against brute force and against a tree built from scratch.
+			auto compare = [&](const Intersector& refit) {
+				bool ok = true;
+				Intersector fresh(grid);
+				std::vector<IntersectorHit> refitHits, freshHits;
+				refit.intersectRays(rayOrigins, rayDirections, refitHits);
+				fresh.intersectRays(rayOrigins, rayDirections, freshHits);
+				for (size_t i = 0; i < rayOrigins.size(); i++) {
+					float d = bruteForceRay(refit, rayOrigins[i], rayDirections[i]);
+					ok &= (refitHits[i].isHit() == (d != NO_HIT_DISTANCE));
+					ok &= (freshHits[i].isHit() == refitHits[i].isHit());
+					if (refitHits[i].isHit() && d != NO_HIT_DISTANCE) {
+						ok &= std::abs(refitHits[i].distance - d) < 1E-4f;
+						ok &= std::abs(freshHits[i].distance - d) < 1E-4f;
+					}
+				}
+				refit.closestPoints(points, refitHits);
+				fresh.closestPoints(points, freshHits);
+				for (size_t i = 0; i < points.size(); i++) {
+					double d = bruteForceClosest(refit, points[i]);
+					ok &= std::abs(refitHits[i].distance - d) < 1E-4f;
+					ok &= std::abs(freshHits[i].distance - d) < 1E-4f;
+				}
+				return ok;
+			};
+			bool gridOk = compare(tree);
+			//A smooth deformation keeps the hierarchy, so only bounds are refit.
+			for (float3& pt : grid.vertexLocations.data) {
+				pt.z += 0.05f * std::sin(4.0f * pt.x + 3.0f * pt.y);
+			}
+			int rebuiltSubtrees = tree.refit(grid, 1E30f);
+			gridOk &= (rebuiltSubtrees == 0) && compare(tree);
+			//Scrambling one corner degrades the subtrees there, which are rebuilt in place.
+			std::vector<uint32_t> corner;
+			for (int j = 0; j < G / 4; j++) {
+				for (int i = 0; i < G / 4; i++) {
+					corner.push_back(i + j * G);
+				}
+			}
+			std::shuffle(corner.begin(), corner.end(), rng);
+			for (size_t i = 0; i + 1 < corner.size(); i += 2) {
+				std::swap(grid.vertexLocations[corner[i]], grid.vertexLocations[corner[i + 1]]);
+			}
+			rebuiltSubtrees = tree.refit(grid);
+			std::cout << "Intersector grid refit: rebuilt " << rebuiltSubtrees
+					<< " subtrees, degradation " << tree.getDegradation() << std::endl;
+			gridOk &= (rebuiltSubtrees > 0) && compare(tree);
+			if (!gridOk) {
+				std::cout << "Intersector does not match brute force on deformed grid." << std::endl;
+			}
+			ret &= gridOk;
+		}
+		return ret;
 	}
 	bool SANITY_CHECK_IMAGE_PROCESSING() {
 		ImageRGBAf img;
@@ -620,6 +1402,51 @@ namespace aly {
 		gX.writeToXML("gradient_x.xml");
 		gY.writeToXML("gradient_y.xml");
 
+		{
+			const int K = 11;
+			GaussianOperators<double, K, K> kernel11;
+			ImageRGBAf direct, separable;
+			auto t0 = std::chrono::high_resolution_clock::now();
+			ConvolveDirect(img, direct, kernel11.filter);
+			auto t1 = std::chrono::high_resolution_clock::now();
+			Smooth<K, K>(img, separable);
+			auto t2 = std::chrono::high_resolution_clock::now();
+			float maxError = 0.0f;
+			for (size_t n = 0; n < direct.size(); n++) {
+				maxError = std::max(maxError,
+						aly::max(aly::abs(direct[n] - separable[n])));
+			}
+			std::cout << "Smooth 11x11 direct "
+					<< std::chrono::duration<double>(t1 - t0).count()
+					<< " sec, separable "
+					<< std::chrono::duration<double>(t2 - t1).count()
+					<< " sec, max error " << maxError << std::endl;
+			//Laplacian is a sum of several separable kernels.
+			ImageRGBAf directLaplacian, separableLaplacian;
+			ConvolveDirect(img, directLaplacian, kernel11.filterLaplacian);
+			Laplacian<K, K>(img, separableLaplacian);
+			for (size_t n = 0; n < directLaplacian.size(); n++) {
+				maxError = std::max(maxError, aly::max(aly::abs(
+						directLaplacian[n] - separableLaplacian[n])));
+			}
+			std::cout << "Laplacian 11x11 max error " << maxError << std::endl;
+			if (maxError > 1E-4f) {
+				return false;
+			}
+		}
+		{
+			int2 pos(img.width / 4, img.height / 4);
+			int2 dims(img.width / 2, img.height / 2);
+			ImageRGBAf cropped, expected, tiled = img;
+			Crop(img, cropped, pos, dims);
+			Smooth<5, 5>(cropped, expected);
+			Smooth<5, 5>(tiled.view(pos, dims), tiled.view(pos, dims));
+			ImageRGBAf roi;
+			tiled.view(pos, dims).copyTo(roi);
+			if (roi.data != expected.data) {
+				throw std::runtime_error("Smoothing an image view in place does not match cropped result.");
+			}
+		}
 		return true;
 	}
 	bool SANITY_CHECK_ROBUST_SOLVE() {
@@ -638,7 +1465,7 @@ namespace aly {
 				sum += row[j] * Y[j];
 				row[j] += float1(0.1f * ((rand() % 1000) / 1000.0f - 0.5f));
 			}
-			A[i] = row;
+			A.setRow(i, row);
 			b[i] = sum;
 		}
 		std::vector<int> order(N);
@@ -664,6 +1491,61 @@ namespace aly {
 		return true;
 	}
 	bool SANITY_CHECK_DENSE_SOLVE() {
+		{
+			const int N = 1000, M = 1500, K = 200;
+			DenseMatrix1d A(N, N), Ls(M, N), B(N, K), Bs(M, K);
+			srand(1123437);
+			for (int i = 0; i < M; i++) {
+				for (int j = 0; j < N; j++) {
+					Ls[i][j] = double1((rand() % 1000) / 1000.0);
+					if (i < N)
+						A[i][j] = Ls[i][j];
+				}
+				for (int j = 0; j < K; j++) {
+					Bs[i][j] = double1((rand() % 1000) / 1000.0);
+					if (i < N)
+						B[i][j] = Bs[i][j];
+				}
+			}
+			DenseMatrix1d X, G;
+			auto t0 = std::chrono::steady_clock::now();
+			LUFactorization<double, 1> lu(A);
+			lu.solve(X, B);
+			auto t1 = std::chrono::steady_clock::now();
+			double luErr = 0.0;
+			G = A * X - B;
+			for (int i = 0; i < G.rows; i++) {
+				for (int j = 0; j < G.cols; j++) {
+					luErr = std::max(luErr, std::abs(G[i][j].x));
+				}
+			}
+			Vector1d x = SolveLU(A, B.getColumn(0));
+			Vector1d xb = X.getColumn(0);
+			for (int i = 0; i < N; i++) {
+				luErr = std::max(luErr, std::abs(x[i].x - xb[i].x));
+			}
+			auto t2 = std::chrono::steady_clock::now();
+			QRFactorization<double, 1> qr(Ls);
+			qr.solve(X, Bs);
+			auto t3 = std::chrono::steady_clock::now();
+			//Least squares residual is orthogonal to the columns of A.
+			DenseMatrix1d Rs = Ls * X - Bs;
+			MultiplyTranspose(G, Ls, Rs);
+			double qrErr = 0.0;
+			for (int i = 0; i < G.rows; i++) {
+				for (int j = 0; j < G.cols; j++) {
+					qrErr = std::max(qrErr, std::abs(G[i][j].x));
+				}
+			}
+			std::cout << "LU " << N << "x" << N << " with " << K << " right-hand sides "
+				<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+				<< " ms, error " << luErr << std::endl;
+			std::cout << "QR " << M << "x" << N << " with " << K << " right-hand sides "
+				<< std::chrono::duration<double, std::milli>(t3 - t2).count()
+				<< " ms, error " << qrErr << std::endl;
+			if (luErr > 1E-6 || qrErr > 1E-6)
+				return false;
+		}
 		ImageRGBAf src, tar;
 		ReadImageFromFile(AlloyDefaultContext()->getFullPath("images/sfmarket.png"),
 			src);
@@ -723,10 +1605,107 @@ namespace aly {
 		std::cout << "Pyramid Poisson Blend" << std::endl;
 		PoissonBlend(src, out, 32, 6);
 		WriteImageToFile("poisson_blend_pyr.png", out);
+		{
+			//Recover a known solution inside an elliptical mask on a 4K image.
+			const int W = 3840, H = 2160;
+			Image4f truth(W, H), x(W, H), b(W, H);
+			Image1ub region(W, H);
+			for (int j = 0; j < H; j++) {
+				for (int i = 0; i < W; i++) {
+					truth(i, j) = float4(std::sin(0.01f * i) * std::cos(0.02f * j),
+						0.001f * j, std::cos(0.003f * (i + j)), 1.0f);
+					float2 d((i - 0.5f * W) / (0.45f * W), (j - 0.5f * H) / (0.45f * H));
+					region(i, j).x = (lengthSqr(d) < 1.0f) ? 1 : 0;
+					x(i, j) = region(i, j).x ? float4(0.0f) : truth(i, j);
+				}
+			}
+			b.set(float4(0.0f));
+			for (int j = 1; j < H - 1; j++) {
+				for (int i = 1; i < W - 1; i++) {
+					b(i, j) = truth(i, j) - 0.25f * (truth(i - 1, j) + truth(i + 1, j)
+						+ truth(i, j - 1) + truth(i, j + 1));
+				}
+			}
+			PoissonMultigrid4f solver;
+			auto t0 = std::chrono::steady_clock::now();
+			int iters = solver.solve(x, b, region, 1E-6f, 32);
+			auto t1 = std::chrono::steady_clock::now();
+			float err = 0.0f;
+			for (size_t k = 0; k < x.size(); k++) {
+				err = std::max(err, max(abs(x.data[k] - truth.data[k])));
+			}
+			std::cout << "Multigrid " << W << "x" << H << " " << solver.getLevelCount()
+				<< " levels " << iters << " iterations "
+				<< std::chrono::duration<double, std::milli>(t1 - t0).count()
+				<< " ms, error " << err << std::endl;
+			//Round off in b is amplified by the smallest eigenvalue, which is about 1E-6 at this size.
+			if (err > 5E-2f)
+				return false;
+		}
 		std::cout << "Done!" << std::endl;
 
 		return true;
 	}
+	bool SANITY_CHECK_ALLOCATOR() {
+		std::shared_ptr<PooledBufferAllocator> pool(new PooledBufferAllocator());
+		//Restore whichever backend was active, even if a check throws, and release the test pool's cache.
+		struct RestoreAllocator {
+			std::shared_ptr<BufferAllocator> previous;
+			std::shared_ptr<PooledBufferAllocator> pool;
+			~RestoreAllocator() {
+				SetBufferAllocator(previous);
+				pool->trim();
+			}
+		} restore = { SetBufferAllocator(pool), pool };
+		Image4f src(640, 480), out;
+		for (int j = 0; j < src.height; j++) {
+			for (int i = 0; i < src.width; i++) {
+				src(i, j) = float4(i / 640.0f, j / 480.0f, 0.5f, 1.0f);
+			}
+		}
+		if (reinterpret_cast<uintptr_t>(src.ptr()) % BUFFER_ALIGNMENT != 0) {
+			throw std::runtime_error("Image storage is not aligned.");
+		}
+		for (int n = 0; n < 4; n++) {
+			out = src;
+			PoissonBlend(src, out, 8, 4);
+			std::cout << "Poisson blend pass " << n << " " << pool->getStatistics() << std::endl;
+		}
+		pool->resetStatistics();
+		SparseMatrix1f A(512, 512);
+		Vector1f b(512), x(512);
+		for (int i = 0; i < 512; i++) {
+			A.set(i, i, 2.0f);
+			if (i > 0)
+				A.set(i, i - 1, -1.0f);
+			if (i < 511)
+				A.set(i, i + 1, -1.0f);
+			b[i] = float1(1.0f);
+		}
+		for (int n = 0; n < 4; n++) {
+			x.set(float1(0.0f));
+			SolveCG(b, A, x, 16);
+		}
+		MemoryStatistics stats = pool->getStatistics();
+		std::cout << "SolveCG " << stats << std::endl;
+		if (stats.hitRate() <= 0.5)
+			return false;
+		//Allocate and free from many threads at once; the books must balance afterwards.
+		size_t liveBefore = pool->getStatistics().bytesLive;
+#pragma omp parallel for
+		for (int n = 0; n < 4096; n++) {
+			Vector1f tmp(64 + (n % 37) * 97);
+			tmp.set(float1((float) n));
+			if (tmp[0].x != (float) n) {
+#pragma omp critical
+				std::cout << "Corrupted pooled buffer " << n << std::endl;
+			}
+		}
+		stats = pool->getStatistics();
+		std::cout << "Concurrent " << stats << std::endl;
+		return (stats.bytesLive == liveBefore
+				&& stats.bytesCached <= DEFAULT_POOL_CAPACITY);
+	}
 	bool SANITY_CHECK_PYRAMID() {
 		ImageRGBAf img;
 		ReadImageFromFile(AlloyDefaultContext()->getFullPath("images/sfmarket.png"),
@@ -797,6 +1776,74 @@ namespace aly {
 		ReadMeshFromFile("icosahedron3.ply", tmpMesh);
 		return true;
 	}
+	bool SANITY_CHECK_PLY_IO() {
+		//Grid meshes whose values survive the ASCII writer's six digits, so both paths must round trip exactly.
+		auto makeGrid = [](Mesh& mesh, int W, int H, int quadStride, bool normals, bool colors, bool texture) {
+			mesh.clear();
+			for (int j = 0; j < H; j++) {
+				for (int i = 0; i < W; i++) {
+					mesh.vertexLocations.push_back(float3(i * 0.25f, j * 0.5f, ((i * j) % 5) * 0.25f));
+					if (normals)
+						mesh.vertexNormals.push_back(float3((i % 4) * 0.25f, (j % 2) * 0.5f, 1.0f));
+					if (colors)
+						mesh.vertexColors.push_back(float4((float) (i & 1), (float) (j & 1), (float) ((i + j) % 3 == 0), 1.0f));
+				}
+			}
+			for (int j = 0; j < H - 1; j++) {
+				for (int i = 0; i < W - 1; i++) {
+					uint32_t v = j * W + i;
+					if (quadStride > 0 && (j * (W - 1) + i) % quadStride == 0) {
+						mesh.quadIndexes.push_back(uint4(v, v + 1, v + W + 1, v + W));
+					}
+					else {
+						mesh.triIndexes.push_back(uint3(v, v + 1, v + W + 1));
+						mesh.triIndexes.push_back(uint3(v, v + W + 1, v + W));
+					}
+				}
+			}
+			if (texture) {
+				for (size_t n = 0; n < 3 * mesh.triIndexes.size(); n++)
+					mesh.textureMap.push_back(float2((n % 8) * 0.125f, ((n / 8) % 4) * 0.25f));
+			}
+		};
+		struct TestMesh {
+			std::string name;
+			int W, H, quadStride;
+			bool normals, colors, texture;
+		};
+		//Face counts are 2016, 280000 and 19440, none a multiple of the 1024 face run. The textured mesh spans several read chunks.
+		std::vector<TestMesh> tests = { { "ply_colored", 37, 29, 0, true, true, false },
+				{ "ply_textured", 401, 351, 0, true, false, true },
+				{ "ply_mixed", 121, 91, 5, false, true, false } };
+		bool ret = true;
+		for (const TestMesh& test : tests) {
+			Mesh mesh;
+			makeGrid(mesh, test.W, test.H, test.quadStride, test.normals, test.colors, test.texture);
+			Mesh read[2];
+			for (int binary = 0; binary < 2; binary++) {
+				std::string file = test.name + (binary ? "_binary.ply" : "_ascii.ply");
+				auto t0 = std::chrono::steady_clock::now();
+				WritePlyMeshToFile(file, mesh, binary != 0);
+				auto t1 = std::chrono::steady_clock::now();
+				ReadPlyMeshFromFile(file, read[binary]);
+				auto t2 = std::chrono::steady_clock::now();
+				const Mesh& r = read[binary];
+				bool same = r.vertexLocations.data == mesh.vertexLocations.data
+						&& r.vertexColors.data == mesh.vertexColors.data
+						&& r.quadIndexes.data == mesh.quadIndexes.data
+						&& r.triIndexes.data == mesh.triIndexes.data
+						&& r.textureMap.data == mesh.textureMap.data
+						&& (!test.normals || r.vertexNormals.data == mesh.vertexNormals.data);
+				std::cout << file << ": " << mesh.quadIndexes.size() + mesh.triIndexes.size()
+						<< " faces, write " << std::chrono::duration<double, std::milli>(t1 - t0).count()
+						<< " ms, read " << std::chrono::duration<double, std::milli>(t2 - t1).count()
+						<< " ms, " << (same ? "OK" : "MISMATCH") << std::endl;
+				ret &= same;
+			}
+			ret &= (read[0].vertexNormals.data == read[1].vertexNormals.data);
+		}
+		return ret;
+	}
 	bool SANITY_CHECK_SPARSE_SOLVE() {
 		SparseMatrix1f A(4, 3);
 		SparseMatrix1f B(3, 4);
@@ -1011,6 +2058,45 @@ namespace aly {
 		std::cout << im1.updateHashCode(0, HashMethod::SHA256) << std::endl;
 		std::cout << im1.updateHashCode(0, HashMethod::SHA384) << std::endl;
 		std::cout << im1.updateHashCode(0, HashMethod::SHA512) << std::endl;
+		std::cout << im1.updateHashCode(0, HashMethod::FAST64) << std::endl;
+		std::cout << im1.updateHashCode(0, HashMethod::FAST128) << std::endl;
+		{
+			Hasher hasher(HashMethod::FAST128);
+			const uint8_t* bytes = reinterpret_cast<const uint8_t*>(im1.ptr());
+			size_t len = im1.size() * im1.typeSize();
+			for (size_t offset = 0; offset < len; offset += 1000) {
+				hasher.update(bytes + offset, std::min((size_t) 1000, len - offset));
+			}
+			if (hasher.finish() != HashCode(im1.data, HashMethod::FAST128)) {
+				throw std::runtime_error("Streaming hash does not match single pass hash.");
+			}
+		}
+		{
+			//Published XXH64 test vectors, covering the short, tail and 32-byte stripe paths.
+			struct KnownHash {
+				const char* text;
+				uint64_t seed;
+				uint64_t hash;
+			};
+			const KnownHash known[] = { { "", 0, 0xEF46DB3751D8E999ULL },
+					{ "a", 0, 0xD24EC4F1A98C6E5BULL },
+					{ "abc", 0, 0x44BC2CF5AD770999ULL },
+					{ "hello, world", 0, 0xB33A384E6D1B1242ULL },
+					{ "Nobody inspects the spammish repetition", 0, 0xFBCEA83C8A378BF1ULL },
+					{ "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789$", 0, 0x1032D841E824F998ULL },
+					{ "xxhash", 20141025, 0xB559B98D844E0635ULL } };
+			for (const KnownHash& test : known) {
+				size_t len = std::strlen(test.text);
+				FastHash64 stream(test.seed);
+				for (size_t i = 0; i < len; i++) {
+					stream.update(test.text + i, 1);
+				}
+				if (Hash64(test.text, len, test.seed) != test.hash || stream.digest() != test.hash) {
+					throw std::runtime_error(
+							MakeString() << "XXH64 mismatch for \"" << test.text << "\".");
+				}
+			}
+		}
 
 		Integer value1(4);
 		Double value2(3.14159);
@@ -1091,6 +2177,34 @@ namespace aly {
 		aly::WriteImageToFile("sfmarket_rgba_hdr.png", srcRGBAf);
 		aly::WriteImageToFile("sfmarket_rgb2_hdr.png", srcRGBf);
 		aly::WriteImageToFile("sfmarket_r_hdr.png", srcAf);
+
+		ImageRGBAf rawRGBAf;
+		WriteImageToRawFile("sfmarket_planar.xml", srcRGBAf, RawLayout::Planar);
+		ReadImageFromRawFile("sfmarket_planar.xml", rawRGBAf);
+		if (rawRGBAf.data != srcRGBAf.data) {
+			throw std::runtime_error("Planar raw image round trip failed.");
+		}
+		WriteImageToRawFile("sfmarket_interleaved.xml", srcRGBAf, RawLayout::Interleaved);
+		MappedImage<float, 4, ImageType::FLOAT> mappedRGBAf("sfmarket_interleaved.xml");
+		if (mappedRGBAf.dimensions() != srcRGBAf.dimensions()
+				|| !std::equal(mappedRGBAf.begin(), mappedRGBAf.end(), srcRGBAf.data.begin())) {
+			throw std::runtime_error("Mapped raw image does not match source.");
+		}
+		Volume1f vol(256, 256, 256);
+		for (size_t n = 0; n < vol.size(); n++) {
+			vol[n] = float1((float) n);
+		}
+		auto t0 = std::chrono::steady_clock::now();
+		WriteImageToRawFile("volume_raw.xml", vol);
+		auto t1 = std::chrono::steady_clock::now();
+		MappedVolume<float, 1, ImageType::FLOAT> mappedVol("volume_raw.xml");
+		auto t2 = std::chrono::steady_clock::now();
+		if (mappedVol(255, 255, 255).x != vol(255, 255, 255).x) {
+			throw std::runtime_error("Mapped raw volume does not match source.");
+		}
+		std::cout << "Raw volume write " << std::chrono::duration<double, std::milli>(t1 - t0).count()
+				<< " ms, map " << std::chrono::duration<double, std::milli>(t2 - t1).count()
+				<< " ms" << std::endl;
 		return true;
 	}
 	bool SANITY_CHECK_IMAGE() {
@@ -1110,8 +2224,58 @@ namespace aly {
 			out /= float4(0.3f);
 			out += float4(1.0f);
 			out = im2 - im1;
+			out = im1 * float4(0.5f) + im2 - out;
 			float4 val2 = im1(37.1f, 32.2f) + im2(float2(21.4f, 56.2f));
 			float4 val3 = im1(37, 32) + im2(float2(21, 56));
+			{
+				//The std::function and functor overloads of Transform must agree.
+				Image4f src(3840, 2160), dst1(3840, 2160), dst2(3840, 2160);
+				Transform(src, [](int i, int j, float4& val) {
+					val = float4((float)i, (float)j, 0.0f, 1.0f);
+				});
+				std::function<void(float4&, const float4&)> f =
+					[](float4& val1, const float4& val2) {val1 = 0.5f * val2 + float4(1.0f);};
+				//Passing f directly would select the functor template, so name the std::function overload.
+				void (*transformFunction)(Image4f&, const Image4f&,
+					const std::function<void(float4&, const float4&)>&) = &Transform<float, 4, ImageType::FLOAT>;
+				auto t0 = std::chrono::high_resolution_clock::now();
+				transformFunction(dst1, src, f);
+				auto t1 = std::chrono::high_resolution_clock::now();
+				Transform(dst2, src, [](float4& val1, const float4& val2) {
+					val1 = 0.5f * val2 + float4(1.0f);
+				});
+				auto t2 = std::chrono::high_resolution_clock::now();
+				std::cout << "Transform std::function "
+					<< std::chrono::duration<double>(t1 - t0).count()
+					<< " sec, functor "
+					<< std::chrono::duration<double>(t2 - t1).count()
+					<< " sec" << std::endl;
+				if (dst1.data != dst2.data) {
+					throw std::runtime_error("Functor Transform does not match std::function Transform.");
+				}
+			}
+			{
+				//Volume views of a sub-block are updated in place, and const volumes give read-only views.
+				Volume4f vol(40, 30, 20);
+				Transform(vol.view(), [](int i, int j, int k, float4& val) {
+					val = float4((float)i, (float)j, (float)k, 1.0f);
+				});
+				const Volume4f& src = vol;
+				int3 pos(5, 4, 3), dims(20, 10, 8);
+				Volume4f block(dims.x, dims.y, dims.z);
+				Transform(block.view(), src.view(pos, dims), [](float4& val1, const float4& val2) {
+					val1 = 2.0f * val2;
+				});
+				Transform(vol.view(pos, dims), [](float4& val) {
+					val *= 2.0f;
+				});
+				Volume4f roi;
+				src.view(pos, dims).copyTo(roi);
+				if (roi.data != block.data || vol(0, 0, 0) != float4(0, 0, 0, 1)
+					|| vol(pos + dims) != float4(float3(pos + dims), 1.0f)) {
+					throw std::runtime_error("Transform of a volume view does not match.");
+				}
+			}
 			return true;
 		}
 		catch (std::exception& e) {
@@ -1195,7 +2359,30 @@ namespace aly {
 			out /= float4(0.3f);
 			out += float4(1.0f);
 			out = im2 - im1;
-
+			{
+				//Template functions take expressions wherever they take vectors.
+				Vector4f diff = im1 - im2;
+				if (lengthL1(im1 - im2) != lengthL1(diff)
+						|| dot(im1 - im2, im1) != dot(diff, im1)
+						|| dot(im1, im1 - im2) != dot(im1, diff)
+						|| max(-diff) != max(Vector4f(-diff))) {
+					throw std::runtime_error("Reduction of expression does not match.");
+				}
+				Vector4f sum;
+				Add(sum, im1 - im2, im2);
+				//Temporary operands are owned by the expression.
+				auto expr = Vector4f(im1) - im2;
+				Vector4f copy = expr;
+				if (lengthL1(sum - im1) > 1E-5f || lengthL1(copy - diff) != 0.0f) {
+					throw std::runtime_error("Expression argument does not match.");
+				}
+				//Move assignment takes the storage and leaves the source empty.
+				Vector4f moved;
+				moved = std::move(copy);
+				if (copy.size() != 0 || lengthL1(moved - diff) != 0.0f) {
+					throw std::runtime_error("Move assignment does not match.");
+				}
+			}
 			return true;
 		}
 		catch (std::exception& e) {
@@ -1203,6 +2390,70 @@ namespace aly {
 			return false;
 		}
 	}
+	bool SANITY_CHECK_DATAFLOW() {
+		using namespace aly::dataflow;
+		DataFlowPtr graph = MakeDataFlow("Data Flow", CoordPX(0, 0), CoordPX(640, 480));
+		SourcePtr source1 = MakeSourceNode("Source 1");
+		SourcePtr source2 = MakeSourceNode("Source 2");
+		ComputePtr computeA = MakeComputeNode("Compute A");
+		ComputePtr computeB = MakeComputeNode("Compute B");
+		ComputePtr computeC = MakeComputeNode("Compute C");
+		ComputePtr computeD = MakeComputeNode("Compute D");
+		DestinationPtr dest = MakeDestinationNode("Destination");
+		for (ComputePtr node : { computeA, computeB, computeC, computeD }) {
+			node->add(MakeInputPort("Input 0"));
+			node->add(MakeInputPort("Input 1"));
+			node->add(MakeOutputPort("Output 0"));
+			node->onCompute = [](Compute* compute) {
+				int sum = 0;
+				for (InputPortPtr port : compute->getInputPorts()) {
+					PacketPtr packet = port->getValue();
+					if (packet.get() != nullptr)
+						sum += packet->getValue<int>();
+				}
+				for (OutputPortPtr port : compute->getOutputPorts()) {
+					port->setValue(PacketPtr(new PacketImpl<int>(port->getName(), sum + 1)));
+				}
+			};
+			graph->add(node);
+		}
+		graph->add(source1);
+		graph->add(source2);
+		graph->add(dest);
+		//Source 1 -> A -> {C, D}, Source 2 -> B -> C -> Destination.
+		graph->add(MakeConnection(source1->getOutputPort(), computeA->getInputPort(0)));
+		graph->add(MakeConnection(source2->getOutputPort(), computeB->getInputPort(0)));
+		graph->add(MakeConnection(computeA->getOutputPort(0), computeC->getInputPort(0)));
+		graph->add(MakeConnection(computeB->getOutputPort(0), computeC->getInputPort(1)));
+		graph->add(MakeConnection(computeA->getOutputPort(0), computeD->getInputPort(0)));
+		graph->add(MakeConnection(computeC->getOutputPort(0), dest->getInputPort()));
+		Executor executor(graph);
+		executor.setValue(source1->getOutputPort(), PacketPtr(new PacketImpl<int>("Source 1", 1)));
+		executor.setValue(source2->getOutputPort(), PacketPtr(new PacketImpl<int>("Source 2", 10)));
+		executor.execute();
+		auto runs = [&](const ComputePtr& node) {
+			return executor.getTiming(node).executions;
+		};
+		auto result = [&]() {
+			PacketPtr packet = dest->getInputPort()->getValue();
+			return (packet.get() != nullptr) ? packet->getValue<int>() : -1;
+		};
+		bool ret = (result() == 14);
+		for (ComputePtr node : { computeA, computeB, computeC, computeD }) {
+			ret &= (runs(node) == 1 && !executor.isDirty(node.get()));
+		}
+		//Changing Source 2 must re-run only B and C, which are downstream of it.
+		executor.setValue(source2->getOutputPort(), PacketPtr(new PacketImpl<int>("Source 2", 20)));
+		ret &= executor.isDirty(source2.get()) && !executor.isDirty(source1.get());
+		executor.execute();
+		ret &= (result() == 24);
+		ret &= (runs(computeA) == 1 && runs(computeD) == 1);
+		ret &= (runs(computeB) == 2 && runs(computeC) == 2);
+		for (std::pair<Node*, NodeTiming> timing : executor.getTimings()) {
+			std::cout << timing.first->getName() << ": " << timing.second << std::endl;
+		}
+		return ret;
+	}
 	bool SANITY_CHECK_UI() {
 		CoordPercent rel(0.5f, 0.75f);
 		CoordDP abs(40, 30);
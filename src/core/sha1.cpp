@@ -20,6 +20,7 @@
 #include <iomanip>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 
 /* Help macros */
 #define SHA1_ROL(value, bits) (((value) << (bits)) | (((value) & 0xffffffff) >> (32 - (bits))))
@@ -54,6 +55,37 @@ void SHA1::update(std::istream &is) {
 	}
 }
 
+/*
+ * Hash raw bytes without staging them through a stream. Whole blocks are
+ * transformed straight from the input.
+ */
+void SHA1::update(const unsigned char* data, size_t len) {
+	uint32_t block[BLOCK_INTS];
+	while (len > 0) {
+		if (buffer.empty() && len >= BLOCK_BYTES) {
+			for (unsigned int i = 0; i < BLOCK_INTS; i++) {
+				block[i] = (uint32_t) data[4 * i + 3]
+						| (uint32_t) data[4 * i + 2] << 8
+						| (uint32_t) data[4 * i + 1] << 16
+						| (uint32_t) data[4 * i + 0] << 24;
+			}
+			transform(block);
+			data += BLOCK_BYTES;
+			len -= BLOCK_BYTES;
+			continue;
+		}
+		size_t n = std::min(len, (size_t) (BLOCK_BYTES - buffer.size()));
+		buffer.append(reinterpret_cast<const char*>(data), n);
+		data += n;
+		len -= n;
+		if (buffer.size() == BLOCK_BYTES) {
+			buffer_to_block(buffer, block);
+			transform(block);
+			buffer.clear();
+		}
+	}
+}
+
 /*
  * Add padding and return the message digest.
  */
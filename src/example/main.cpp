@@ -125,12 +125,20 @@ bool SANITY_CHECK() {
 	//SANITY_CHECK_KDTREE();
 	//SANITY_CHECK_PYRAMID();
 	//SANITY_CHECK_SPARSE_SOLVE();
+	//SANITY_CHECK_PRECONDITIONER();
+	//SANITY_CHECK_SPARSE_CHOLESKY();
 	//SANITY_CHECK_DENSE_SOLVE();
 	//SANITY_CHECK_DENSE_MATRIX();
 	//SANITY_CHECK_IMAGE_PROCESSING();
 	//SANITY_CHECK_IMAGE_IO();
 	//SANITY_CHECK_ROBUST_SOLVE();
 	//SANITY_CHECK_SUBDIVIDE();
+	//SANITY_CHECK_MESH_ADJACENCY();
+	//SANITY_CHECK_VERTEX_NORMALS();
+	//SANITY_CHECK_MESH_CACHE();
+	//SANITY_CHECK_ALLOCATOR();
+	//SANITY_CHECK_PLY_IO();
+	//SANITY_CHECK_DATAFLOW();
 	return ret;
 }
 int main(int argc, char *argv[]) {